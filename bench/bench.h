@@ -0,0 +1,96 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/* 阻止编译器把基准测试中的计算结果优化掉 */
+template<typename T>
+inline void do_not_optimize(T const& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct bench_result {
+    std::string name;
+    uint64_t iterations;
+    double ns_per_op;
+    double ops_per_sec;
+};
+
+/*
+ * 微基准测试运行器。每个用例先以倍增方式校准迭代次数，使单轮耗时达到target_time_，
+ * 然后重复repetitions_轮并取最快的一轮，以减少调度与频率抖动带来的噪声。
+ * 用例体接收本轮的迭代次数，由用例自己完成循环，这样可以把准备工作放在计时之外。
+ */
+class bench_runner {
+private:
+    using clock = std::chrono::steady_clock;
+    std::vector<bench_result> results_;
+    std::string filter_;
+    std::chrono::nanoseconds target_time_ {std::chrono::milliseconds(200)};
+    int repetitions_ {3};
+
+    template<typename F>
+    std::chrono::nanoseconds time_batch(F& body, uint64_t iterations) {
+        auto begin = clock::now();
+        body(iterations);
+        return clock::now() - begin;
+    }
+public:
+    explicit bench_runner(std::string filter = {}) : filter_(std::move(filter)) {}
+
+    void set_target_time(std::chrono::nanoseconds target) {
+        target_time_ = target;
+    }
+
+    /* body的签名为void(uint64_t iterations) */
+    template<typename F>
+    void run(const std::string& name, F&& body) {
+        if (!filter_.empty() && name.find(filter_) == std::string::npos) {
+            return;
+        }
+        uint64_t iterations = 1;
+        auto elapsed = time_batch(body, iterations);
+        while (elapsed < target_time_ / 10 && iterations < (uint64_t(1) << 40)) {
+            iterations *= 2;
+            elapsed = time_batch(body, iterations);
+        }
+        auto scaled = static_cast<double>(iterations) * static_cast<double>(target_time_.count()) / static_cast<double>(std::max<int64_t>(elapsed.count(), 1));
+        iterations = std::max<uint64_t>(1, static_cast<uint64_t>(scaled));
+        double best = 1e300;
+        for (int r = 0; r < repetitions_; ++r) {
+            auto spent = time_batch(body, iterations);
+            best = std::min(best, static_cast<double>(spent.count()) / static_cast<double>(iterations));
+        }
+        bench_result result { name, iterations, best, 1e9 / best };
+        std::cout << std::format("{:<48} {:>14.2f} ns/op {:>16.0f} ops/sec\n", result.name, result.ns_per_op, result.ops_per_sec) << std::flush;
+        results_.push_back(std::move(result));
+    }
+
+    [[nodiscard]] const std::vector<bench_result>& results() const {
+        return results_;
+    }
+
+    /* 以JSON格式导出结果，label通常为提交号，用于跨提交比较 */
+    bool write_json(const std::string& path, const std::string& label) const {
+        std::ofstream out(path, std::ios::out | std::ios::trunc);
+        if (!out) {
+            return false;
+        }
+        out << std::format("{{\n  \"label\": \"{}\",\n  \"results\": [\n", label);
+        for (size_t i = 0; i < results_.size(); ++i) {
+            auto& r = results_[i];
+            out << std::format("    {{\"name\": \"{}\", \"iterations\": {}, \"ns_per_op\": {:.3f}, \"ops_per_sec\": {:.1f}}}{}\n",
+                               r.name, r.iterations, r.ns_per_op, r.ops_per_sec, i + 1 == results_.size() ? "" : ",");
+        }
+        out << "  ]\n}\n";
+        return static_cast<bool>(out);
+    }
+};
@@ -0,0 +1,83 @@
+#include "loadgen.h"
+
+#include <fstream>
+#include <iostream>
+
+/* 以JSON格式导出压测结果，便于跨提交比较 */
+bool write_loadgen_json(const std::string& path, const std::string& label, const loadgen_options& options, const loadgen_result& r) {
+    std::ofstream out(path, std::ios::out | std::ios::trunc);
+    if (!out) {
+        return false;
+    }
+    out << std::format("{{\n  \"label\": \"{}\",\n  \"path\": \"{}\",\n  \"connections\": {},\n  \"threads\": {},\n"
+                       "  \"keep_alive\": {},\n  \"pipeline\": {},\n  \"rate\": {:.1f},\n  \"seconds\": {:.3f},\n",
+                       label, options.path, options.connections, options.threads,
+                       options.keep_alive ? "true" : "false", options.pipeline, options.rate, r.seconds);
+    out << std::format("  \"requests\": {},\n  \"errors\": {},\n  \"non_2xx\": {},\n  \"connects\": {},\n  \"bytes\": {},\n  \"rps\": {:.1f},\n",
+                       r.requests, r.errors, r.non_2xx, r.connects, r.bytes, r.rps());
+    out << std::format("  \"latency_ns\": {{\"mean\": {:.0f}, \"p50\": {}, \"p90\": {}, \"p99\": {}, \"p999\": {}, \"max\": {}}}\n}}\n",
+                       r.latency.mean(), r.latency.percentile(0.5), r.latency.percentile(0.9),
+                       r.latency.percentile(0.99), r.latency.percentile(0.999), r.latency.max());
+    return static_cast<bool>(out);
+}
+
+int main(int argc, char** argv) {
+    loadgen_options options;
+    std::string json_path;
+    std::string label = "unlabeled";
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--host" && i + 1 < argc) {
+            options.host = argv[++i];
+        } else if (arg == "--port" && i + 1 < argc) {
+            options.port = static_cast<uint16_t>(std::stoi(argv[++i]));
+        } else if (arg == "--path" && i + 1 < argc) {
+            options.path = argv[++i];
+        } else if (arg == "--connections" && i + 1 < argc) {
+            options.connections = std::stoul(argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            options.threads = std::stoul(argv[++i]);
+        } else if (arg == "--duration" && i + 1 < argc) {
+            options.duration = std::chrono::milliseconds(static_cast<int64_t>(std::stod(argv[++i]) * 1000));
+        } else if (arg == "--pipeline" && i + 1 < argc) {
+            options.pipeline = std::stoul(argv[++i]);
+        } else if (arg == "--rate" && i + 1 < argc) {
+            options.rate = std::stod(argv[++i]);
+        } else if (arg == "--no-keep-alive") {
+            options.keep_alive = false;
+        } else if (arg == "--json" && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (arg == "--label" && i + 1 < argc) {
+            label = argv[++i];
+        } else {
+            std::cerr << "usage: tinyhttp_loadgen [--host ipv4] [--port port] [--path path] [--connections n] [--threads n]\n"
+                         "                        [--duration seconds] [--pipeline depth] [--rate req/s] [--no-keep-alive]\n"
+                         "                        [--json path] [--label commit]" << std::endl;
+            return -1;
+        }
+    }
+    if (options.connections == 0 || options.pipeline == 0 || options.duration.count() <= 0) {
+        std::cerr << "connections, pipeline and duration must be positive" << std::endl;
+        return -1;
+    }
+    if (!options.keep_alive && options.pipeline > 1) {
+        std::cerr << "pipelining requires keep-alive" << std::endl;
+        return -1;
+    }
+    if (options.rate > 0 && options.pipeline > 1) {
+        std::cerr << "open-loop mode sends one request at a time, ignoring --pipeline" << std::endl;
+        options.pipeline = 1;
+    }
+    options.threads = std::clamp<size_t>(options.threads, 1, options.connections);
+    std::cout << std::format("{} {}:{}{} connections {} threads {} {} pipeline {} for {:.1f}s\n",
+                             options.rate > 0 ? std::format("open-loop {:.0f} req/s", options.rate) : std::string("closed-loop"),
+                             options.host, options.port, options.path, options.connections, options.threads,
+                             options.keep_alive ? "keep-alive" : "close", options.pipeline,
+                             std::chrono::duration<double>(options.duration).count()) << std::flush;
+    auto result = run_loadgen(options);
+    std::cout << format_loadgen_result(result) << std::flush;
+    if (!json_path.empty() && !write_loadgen_json(json_path, label, options, result)) {
+        std::cerr << std::format("cannot write {}", json_path) << std::endl;
+        return -1;
+    }
+}
@@ -0,0 +1,316 @@
+#pragma once
+
+#include <coroutine.h>
+#include <metrics.h>
+#include <http.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <thread>
+
+struct loadgen_options {
+    std::string host {"127.0.0.1"};
+    uint16_t port {80};
+    std::string path {"/"};
+    size_t connections {16};
+    size_t threads {1};
+    std::chrono::milliseconds duration {std::chrono::seconds(5)};
+    bool keep_alive {true};
+    size_t pipeline {1};
+    /* 开环模式下所有连接合计的目标请求速率(请求/秒)，0表示闭环模式 */
+    double rate {0};
+};
+
+/* 延迟直方图，与metrics.h共用对数线性分桶，单位为纳秒 */
+class latency_histogram {
+private:
+    std::array<uint64_t, histogram_buckets> buckets_ {};
+    uint64_t count_ {0};
+    uint64_t sum_ {0};
+    uint64_t max_ {0};
+public:
+    void record(uint64_t ns) {
+        ++buckets_[histogram_bucket_of(ns)];
+        ++count_;
+        sum_ += ns;
+        max_ = std::max(max_, ns);
+    }
+    void merge(const latency_histogram& other) {
+        for (size_t i = 0; i < histogram_buckets; ++i) {
+            buckets_[i] += other.buckets_[i];
+        }
+        count_ += other.count_;
+        sum_ += other.sum_;
+        max_ = std::max(max_, other.max_);
+    }
+    [[nodiscard]] uint64_t count() const {
+        return count_;
+    }
+    [[nodiscard]] uint64_t max() const {
+        return max_;
+    }
+    [[nodiscard]] double mean() const {
+        return count_ == 0 ? 0 : static_cast<double>(sum_) / static_cast<double>(count_);
+    }
+    /* 返回分位数所在分桶的上界(不超过观测到的最大值) */
+    [[nodiscard]] uint64_t percentile(double q) const {
+        if (count_ == 0) {
+            return 0;
+        }
+        auto rank = static_cast<uint64_t>(q * static_cast<double>(count_ - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < histogram_buckets; ++i) {
+            seen += buckets_[i];
+            if (seen >= rank) {
+                return std::min(histogram_bucket_limit(i), max_);
+            }
+        }
+        return max_;
+    }
+};
+
+struct loadgen_result {
+    uint64_t requests {0};
+    uint64_t errors {0};
+    uint64_t non_2xx {0};
+    uint64_t connects {0};
+    uint64_t bytes {0};
+    double seconds {0};
+    latency_histogram latency;
+
+    void merge(const loadgen_result& other) {
+        requests += other.requests;
+        errors += other.errors;
+        non_2xx += other.non_2xx;
+        connects += other.connects;
+        bytes += other.bytes;
+        latency.merge(other.latency);
+    }
+    [[nodiscard]] double rps() const {
+        return seconds > 0 ? static_cast<double>(requests) / seconds : 0;
+    }
+};
+
+/*
+ * 压测线程：一个io_loop驱动若干条连接，每条连接由一个协程负责。
+ * 闭环模式下每条连接一次发出pipeline个请求，全部收到响应后再发下一批；
+ * 开环模式下每条连接按固定间隔排定请求的计划发送时间，延迟从计划时间而不是实际发送时间算起，
+ * 服务端停顿导致的排队时间因此会计入延迟(coordinated omission校正)。
+ */
+class loadgen_thread {
+private:
+    using clock = io_loop::clock;
+    const loadgen_options& options_;
+    sockaddr_in addr_ {};
+    std::string batch_;
+    io_loop loop_;
+    clock::time_point start_;
+    clock::time_point deadline_;
+    size_t active_ {0};
+    loadgen_result result_;
+
+    void record(clock::time_point intended, const http_response_head& head, size_t bytes) {
+        auto now = clock::now();
+        if (now > deadline_) {
+            return;
+        }
+        ++result_.requests;
+        result_.bytes += bytes;
+        if (head.status < 200 || head.status >= 300) {
+            ++result_.non_2xx;
+        }
+        result_.latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - intended).count());
+    }
+
+    /* 从连接中读取一个完整响应，buffer中[begin, end)为尚未消费的数据；失败时返回false */
+    task<bool> read_response(int fd, std::vector<char>& buffer, size_t& begin, size_t& end, http_response_head& head, size_t& bytes) {
+        ssize_t header_length = 0;
+        //GCC 12会错误地编译成员协程中的if (!co_await ...)，先把结果存进局部变量
+        while ((header_length = parse_http_response_head({ buffer.data() + begin, end - begin }, head)) == 0) {
+            bool filled = co_await fill(fd, buffer, begin, end);
+            if (!filled) {
+                co_return false;
+            }
+        }
+        if (header_length < 0) {
+            co_return false;
+        }
+        size_t body_end = 0;
+        if (head.chunked) {
+            //服务端目前不会发送分块响应，这里只找到结束块为止，不解析分块内容
+            std::string_view view;
+            while ((view = { buffer.data() + begin, end - begin }).find("\r\n0\r\n\r\n", header_length - 2) == std::string_view::npos) {
+                bool filled = co_await fill(fd, buffer, begin, end);
+                if (!filled) {
+                    co_return false;
+                }
+            }
+            body_end = view.find("\r\n0\r\n\r\n", header_length - 2) + 7;
+        } else {
+            body_end = header_length + head.content_length;
+            while (end - begin < body_end) {
+                bool filled = co_await fill(fd, buffer, begin, end);
+                if (!filled) {
+                    co_return false;
+                }
+            }
+        }
+        bytes = body_end;
+        begin += body_end;
+        co_return true;
+    }
+
+    /* 继续接收数据，必要时先把未消费的数据搬到缓冲区开头或扩大缓冲区 */
+    task<bool> fill(int fd, std::vector<char>& buffer, size_t& begin, size_t& end) {
+        if (begin > 0) {
+            std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        if (end == buffer.size()) {
+            buffer.resize(buffer.size() * 2);
+        }
+        auto r = co_await loop_.recv_some(fd, buffer.data() + end, buffer.size() - end);
+        if (r <= 0) {
+            co_return false;
+        }
+        end += r;
+        co_return true;
+    }
+
+    void disconnect(int& fd) {
+        loop_.forget(fd);
+        close(fd);
+        fd = -1;
+    }
+
+    task<void> drive(size_t index) {
+        bool open_loop = options_.rate > 0;
+        size_t depth = open_loop ? 1 : options_.pipeline;
+        std::vector<char> buffer(16 * 1024);
+        std::vector<clock::time_point> intended(depth);
+        http_response_head head;
+        //开环模式下各连接的计划时间错开，避免同时发出请求
+        auto interval = std::chrono::duration_cast<clock::duration>(
+                std::chrono::duration<double>(static_cast<double>(options_.connections) / std::max(options_.rate, 1e-9)));
+        auto next = start_ + interval * index / options_.connections;
+        int fd = -1;
+        size_t begin = 0;
+        size_t end = 0;
+        while (clock::now() < deadline_) {
+            if (fd == -1) {
+                fd = co_await loop_.connect(reinterpret_cast<const sockaddr*>(&addr_), sizeof(addr_));
+                if (fd == -1) {
+                    ++result_.errors;
+                    co_await loop_.sleep_for(std::chrono::milliseconds(10));
+                    continue;
+                }
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                ++result_.connects;
+                begin = end = 0;
+            }
+            if (open_loop) {
+                if (next >= deadline_) {
+                    break;
+                }
+                co_await loop_.sleep_until(next);
+                intended[0] = next;
+                next += interval;
+            } else {
+                std::fill(intended.begin(), intended.end(), clock::now());
+            }
+            bool sent = co_await loop_.send_all(fd, batch_.data(), batch_.length() / options_.pipeline * depth);
+            if (!sent) {
+                ++result_.errors;
+                disconnect(fd);
+                continue;
+            }
+            bool reusable = options_.keep_alive;
+            for (size_t i = 0; i < depth; ++i) {
+                size_t bytes = 0;
+                bool received = co_await read_response(fd, buffer, begin, end, head, bytes);
+                if (!received) {
+                    if (clock::now() < deadline_) {
+                        ++result_.errors;
+                    }
+                    reusable = false;
+                    break;
+                }
+                record(intended[i], head, bytes);
+                reusable = reusable && head.keep_alive();
+            }
+            if (!reusable) {
+                disconnect(fd);
+            }
+        }
+        if (fd != -1) {
+            disconnect(fd);
+        }
+        --active_;
+    }
+public:
+    explicit loadgen_thread(const loadgen_options& options) : options_(options) {
+        addr_.sin_family = AF_INET;
+        addr_.sin_port = htons(options.port);
+        if (inet_pton(AF_INET, options.host.c_str(), &addr_.sin_addr) != 1) {
+            throw io_exception("loadgen_thread::loadgen_thread()", std::format("invalid IPv4 address {}", options.host));
+        }
+        auto request = std::format("GET {} HTTP/1.1\r\nHost: {}:{}\r\nUser-Agent: tinyhttp_loadgen\r\n{}\r\n",
+                                   options.path, options.host, options.port, options.keep_alive ? "" : "Connection: close\r\n");
+        for (size_t i = 0; i < options.pipeline; ++i) {
+            batch_ += request;
+        }
+    }
+
+    /* 运行connections条连接直到截止时间，截止后最多再等待grace让在途请求结束 */
+    loadgen_result run(size_t connections, clock::time_point start, clock::time_point deadline, clock::duration grace = std::chrono::seconds(1)) {
+        start_ = start;
+        deadline_ = deadline;
+        active_ = connections;
+        for (size_t i = 0; i < connections; ++i) {
+            loop_.spawn(drive(i));
+        }
+        while (active_ > 0 && clock::now() < deadline_ + grace) {
+            loop_.run_once(10);
+        }
+        result_.seconds = std::chrono::duration<double>(deadline_ - start_).count();
+        return result_;
+    }
+};
+
+/* 按options启动threads个压测线程，汇总各线程的结果 */
+inline loadgen_result run_loadgen(const loadgen_options& options) {
+    auto start = io_loop::clock::now();
+    auto deadline = start + options.duration;
+    std::vector<loadgen_result> results(options.threads);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < options.threads; ++t) {
+        size_t connections = options.connections / options.threads + (t < options.connections % options.threads ? 1 : 0);
+        threads.emplace_back([&options, &results, t, connections, start, deadline] {
+            loadgen_thread runner(options);
+            results[t] = runner.run(connections, start, deadline);
+        });
+    }
+    loadgen_result total;
+    for (size_t t = 0; t < options.threads; ++t) {
+        threads[t].join();
+        total.merge(results[t]);
+    }
+    total.seconds = std::chrono::duration<double>(options.duration).count();
+    return total;
+}
+
+inline std::string format_loadgen_result(const loadgen_result& r) {
+    auto us = [](uint64_t ns) {
+        return static_cast<double>(ns) / 1000.0;
+    };
+    return std::format("requests {} errors {} non-2xx {} connects {}\n"
+                       "throughput {:.1f} req/s {:.2f} MB/s\n"
+                       "latency(us) mean {:.1f} p50 {:.1f} p90 {:.1f} p99 {:.1f} p99.9 {:.1f} max {:.1f}\n",
+                       r.requests, r.errors, r.non_2xx, r.connects,
+                       r.rps(), static_cast<double>(r.bytes) / r.seconds / 1e6,
+                       r.latency.mean() / 1000.0, us(r.latency.percentile(0.5)), us(r.latency.percentile(0.9)),
+                       us(r.latency.percentile(0.99)), us(r.latency.percentile(0.999)), us(r.latency.max()));
+}
@@ -0,0 +1,373 @@
+#include <memory.h>
+#include <evchannel.h>
+#include <timer.h>
+#include <log.h>
+#include <router.h>
+#include <hpack.h>
+#include <websocket.h>
+
+#include "bench.h"
+
+/* 基准测试专用的事件 */
+class bench_event {
+private:
+    general_shared_array_buffer_t buffer_;
+public:
+    constexpr static int unique_event_id = 100;
+    explicit bench_event(general_shared_array_buffer_t buffer) : buffer_(std::move(buffer)) {}
+    [[nodiscard]] general_shared_array_buffer_t content() const {return buffer_;}
+};
+
+void bench_allocators(bench_runner& runner) {
+    runner.run("heap_allocator/allocate_64", [](uint64_t n) {
+        heap_allocator allocator;
+        for (uint64_t i = 0; i < n; ++i) {
+            do_not_optimize(allocator.allocate(64));
+            if ((i & 1023) == 1023) {
+                allocator.release();
+            }
+        }
+    });
+    runner.run("aligned_heap_allocator/allocate_64", [](uint64_t n) {
+        aligned_heap_allocator allocator(64);
+        for (uint64_t i = 0; i < n; ++i) {
+            do_not_optimize(allocator.allocate(64));
+            if ((i & 1023) == 1023) {
+                allocator.release();
+            }
+        }
+    });
+    for (size_t live : {1, 64, 1024}) {
+        runner.run(std::format("heap_allocator/reallocate/live={}", live), [live](uint64_t n) {
+            heap_allocator allocator;
+            std::vector<void*> ptrs;
+            for (size_t i = 0; i < live; ++i) {
+                ptrs.push_back(allocator.allocate(64));
+            }
+            for (uint64_t i = 0; i < n; ++i) {
+                auto& ptr = ptrs[i % live];
+                ptr = allocator.reallocate(ptr, (i & 1) ? 64 : 128);
+                do_not_optimize(ptr);
+            }
+        });
+        runner.run(std::format("aligned_heap_allocator/reallocate/live={}", live), [live](uint64_t n) {
+            aligned_heap_allocator allocator(64);
+            std::vector<void*> ptrs;
+            for (size_t i = 0; i < live; ++i) {
+                ptrs.push_back(allocator.allocate(64));
+            }
+            for (uint64_t i = 0; i < n; ++i) {
+                auto& ptr = ptrs[i % live];
+                ptr = allocator.reallocate(ptr, (i & 1) ? 64 : 128);
+                do_not_optimize(ptr);
+            }
+        });
+    }
+    runner.run("pooled_allocator/allocate_deallocate_256", [](uint64_t n) {
+        auto& pool = pooled_allocator::local();
+        for (uint64_t i = 0; i < n; ++i) {
+            auto ptr = pool.allocate(256);
+            do_not_optimize(ptr);
+            pool.deallocate(ptr, 256);
+        }
+    });
+}
+
+void bench_buffers(bench_runner& runner) {
+    runner.run("shared_array_buffer/create_destroy_1k", [](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            general_shared_array_buffer_t buffer(1024, new heap_allocator());
+            do_not_optimize(buffer.pointer());
+        }
+    });
+    runner.run("shared_array_buffer/copy_destroy", [](uint64_t n) {
+        general_shared_array_buffer_t buffer(1024, new heap_allocator());
+        for (uint64_t i = 0; i < n; ++i) {
+            general_shared_array_buffer_t copy(buffer);
+            do_not_optimize(copy.pointer());
+        }
+    });
+    runner.run("buffer_stream/append_int64", [](uint64_t n) {
+        general_array_buffer_t buffer(4096);
+        buffer_stream stream(buffer);
+        for (uint64_t i = 0; i < n; ++i) {
+            if (!stream.append(static_cast<int64_t>(i))) {
+                stream.rewind();
+                stream.clear_eof();
+            }
+        }
+        do_not_optimize(buffer.pointer());
+    });
+    runner.run("buffer_stream/get_int64", [](uint64_t n) {
+        general_array_buffer_t buffer(4096);
+        buffer_stream stream(buffer);
+        int64_t sum = 0;
+        for (uint64_t i = 0; i < n; ++i) {
+            if (stream.eof()) {
+                stream.rewind();
+                stream.clear_eof();
+            }
+            sum += stream.get<int64_t>();
+        }
+        do_not_optimize(sum);
+    });
+    runner.run("buffer_stream/append_string_view_64", [](uint64_t n) {
+        general_array_buffer_t buffer(4096);
+        buffer_stream stream(buffer);
+        std::string payload(64, 'x');
+        for (uint64_t i = 0; i < n; ++i) {
+            if (!stream.append(std::string_view(payload))) {
+                stream.rewind();
+                stream.clear_eof();
+            }
+        }
+        do_not_optimize(buffer.pointer());
+    });
+}
+
+void bench_event_channel(bench_runner& runner) {
+    for (int subscribers : {1, 8, 64}) {
+        runner.run(std::format("event_channel/post/subscribers={}", subscribers), [subscribers](uint64_t n) {
+            event_channel channel;
+            uint64_t received = 0;
+            for (int i = 0; i < subscribers; ++i) {
+                channel.subscribe<bench_event>([&received](const bench_event&) {
+                    ++received;
+                });
+            }
+            bench_event event(general_shared_array_buffer_t(64, new heap_allocator()));
+            for (uint64_t i = 0; i < n; ++i) {
+                channel.post(event);
+            }
+            do_not_optimize(received);
+        });
+    }
+}
+
+void bench_timer(bench_runner& runner) {
+    for (int tasks : {10, 1000, 100000}) {
+        runner.run(std::format("timer/advance/tasks={}", tasks), [tasks](uint64_t n) {
+            timer tm;
+            uint64_t fired = 0;
+            for (int i = 0; i < tasks; ++i) {
+                tm.add(timer::make_tv(1 + i % 20, timer::inf_times), [&fired](timer::callback_id_t, timer::tv_t) {
+                    ++fired;
+                });
+            }
+            tm.advance(0);
+            for (uint64_t i = 1; i <= n; ++i) {
+                tm.advance(static_cast<int64_t>(i));
+            }
+            do_not_optimize(fired);
+        });
+    }
+}
+
+void bench_exceptions(bench_runner& runner) {
+    runner.run("io_exception/throw_catch_eof", [](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            try {
+                throw io_exception("bench", "met EOF", no_stack_trace);
+            } catch (io_exception& e) {
+                do_not_optimize(e.what());
+            }
+        }
+    });
+    runner.run("io_exception/throw_catch_with_trace", [](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            try {
+                throw io_exception("bench", "unexpected");
+            } catch (io_exception& e) {
+                do_not_optimize(e.what());
+            }
+        }
+    });
+    runner.run("io_exception/symbolize_cached", [](uint64_t n) {
+        io_exception e("bench", "unexpected");
+        for (uint64_t i = 0; i < n; ++i) {
+            auto text = e.trace().to_string();
+            do_not_optimize(text.data());
+        }
+    });
+}
+
+//路由基准测试的路由数，模式为"/api/r0000/items/:id"，序号定宽以便从同一个字符数组中切出
+constexpr static size_t bench_route_count = 2048;
+constexpr static size_t bench_route_length = 20;
+
+constexpr static auto bench_route_text = [] {
+    std::array<char, bench_route_count * bench_route_length> text {};
+    for (size_t i = 0; i < bench_route_count; ++i) {
+        std::string_view pattern = "/api/r0000/items/:id";
+        auto out = text.data() + i * bench_route_length;
+        std::copy(pattern.begin(), pattern.end(), out);
+        for (size_t d = 0, v = i; d < 4; ++d, v /= 10) {
+            out[9 - d] = static_cast<char>('0' + v % 10);
+        }
+    }
+    return text;
+}();
+
+constexpr static auto bench_routes = [] {
+    std::array<route<uint32_t>, bench_route_count + 2> routes {};
+    for (size_t i = 0; i < bench_route_count; ++i) {
+        routes[i] = { http_method::get, std::string_view(bench_route_text.data() + i * bench_route_length, bench_route_length), static_cast<uint32_t>(i) };
+    }
+    routes[bench_route_count] = { http_method::get, "/metrics", 0 };
+    routes[bench_route_count + 1] = { http_method::get, "/static/*path", 0 };
+    return routes;
+}();
+
+constexpr static auto bench_router = compile_routes<bench_routes>();
+
+void bench_router_lookup(bench_runner& runner) {
+    std::array<std::string_view, 4> paths = { "/api/r0001/items/42", "/api/r1024/items/7", "/api/r2047/items/123456", "/api/r9999/items/1" };
+    runner.run(std::format("router/lookup/routes={}", bench_routes.size()), [&paths](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            auto match = bench_router.find(http_method::get, paths[i & 3]);
+            do_not_optimize(match.handler);
+        }
+    });
+    runner.run("router/lookup_static", [](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            auto match = bench_router.find("GET", "/metrics");
+            do_not_optimize(match.handler);
+        }
+    });
+    runner.run("router/lookup_wildcard", [](uint64_t n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            auto match = bench_router.find("GET", "/static/css/site/main.css");
+            do_not_optimize(match.handler);
+        }
+    });
+}
+
+void bench_hpack(bench_runner& runner) {
+    //curl的第一个请求：静态表索引加Huffman编码的字面量
+    std::string block;
+    hpack_encoder encoder;
+    encoder.encode(block, ":method", "GET");
+    encoder.encode(block, ":scheme", "http");
+    encoder.encode(block, ":path", "/static/css/site/main.css?v=20261017", false);
+    encoder.encode(block, ":authority", "www.example.com", false);
+    encoder.encode(block, "user-agent", "curl/7.88.1", false);
+    encoder.encode(block, "accept", "*/*", false);
+    encoder.encode(block, "accept-encoding", "gzip, deflate, br", false);
+    runner.run("hpack/decode_request", [&block](uint64_t n) {
+        hpack_decoder decoder;
+        size_t total = 0;
+        for (uint64_t i = 0; i < n; ++i) {
+            decoder.decode(block, [&total](std::string_view name, std::string_view value) {
+                total += name.length() + value.length();
+            });
+        }
+        do_not_optimize(total);
+    });
+    runner.run("hpack/encode_response", [](uint64_t n) {
+        hpack_encoder encoder;
+        std::string out;
+        for (uint64_t i = 0; i < n; ++i) {
+            out.clear();
+            encoder.encode(out, ":status", "200");
+            encoder.encode(out, "content-type", "text/css; charset=utf-8");
+            encoder.encode(out, "content-length", "114280");
+            encoder.encode(out, "last-modified", "Sat, 17 Oct 2026 00:03:18 GMT");
+            encoder.encode(out, "etag", "\"ce8014-1be68-18df2838274b5800\"");
+            do_not_optimize(out.data());
+        }
+    });
+}
+
+void bench_websocket(bench_runner& runner) {
+    for (size_t size : {125, 4096, 65536}) {
+        runner.run(std::format("websocket/unmask/bytes={}", size), [size](uint64_t n) {
+            std::string payload(size, 'x');
+            for (uint64_t i = 0; i < n; ++i) {
+                websocket_unmask(payload.data(), payload.length(), 0x5a3c9e17u);
+            }
+            do_not_optimize(payload.data());
+        });
+    }
+    //一帧带掩码的1KB二进制消息：解析帧头、就地解掩码，负载交给处理器时不复制
+    runner.run("websocket/parse_masked_1k", [](uint64_t n) {
+        std::string frame = { '\x82', '\xfe', '\x04', '\x00', '\x11', '\x22', '\x33', '\x44' };
+        frame.append(1024, 'y');
+        websocket_parser parser;
+        websocket_message message;
+        size_t total = 0;
+        for (uint64_t i = 0; i < n; ++i) {
+            total += parser.parse(frame.data(), frame.length(), message);
+        }
+        do_not_optimize(total);
+    });
+    //向1000个发送队列广播一条消息：帧只序列化一次，每个订阅者只增加一次引用计数
+    runner.run("websocket/fanout_shared_frame/subscribers=1000", [](uint64_t n) {
+        std::vector<output_queue> queues(1000);
+        std::string payload(512, 'z');
+        for (uint64_t i = 0; i < n; ++i) {
+            auto frame = make_shared_websocket_frame(websocket_opcode::text, payload);
+            auto length = frame.capacity();
+            for (auto& queue : queues) {
+                queue.append(frame, 0, length);
+            }
+            for (auto& queue : queues) {
+                queue.clear();
+            }
+        }
+    });
+}
+
+void bench_log(bench_runner& runner) {
+    runner.run("log/info_to_devnull", [](uint64_t n) {
+        event_channel channel;
+        std::ofstream sink("/dev/null");
+        channel.subscribe<event_log>([&sink](const event_log& e) {
+            auto lv = get_log_level(e.get_log_level());
+            auto tm = get_formatted_time("%Y-%m-%d %H:%M:%S", e.get_time());
+            std::string formatted = std::format("[{}][{}][{}] {}\n", lv, tm, e.get_from(), e.get_msg());
+            sink.write(formatted.c_str(), static_cast<ssize_t>(formatted.length()));
+        });
+        log_start(channel);
+        for (uint64_t i = 0; i < n; ++i) {
+            INFO("benchmark log message");
+        }
+        pevchannel = nullptr;
+    });
+}
+
+int main(int argc, char** argv) {
+    std::string filter;
+    std::string json_path;
+    std::string label = "unlabeled";
+    int time_ms = 200;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (arg == "--json" && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (arg == "--label" && i + 1 < argc) {
+            label = argv[++i];
+        } else if (arg == "--time-ms" && i + 1 < argc) {
+            time_ms = std::stoi(argv[++i]);
+        } else {
+            std::cerr << "usage: tinyhttp_bench [--filter substring] [--json path] [--label commit] [--time-ms per-benchmark]" << std::endl;
+            return -1;
+        }
+    }
+    bench_runner runner(filter);
+    runner.set_target_time(std::chrono::milliseconds(time_ms));
+    bench_allocators(runner);
+    bench_buffers(runner);
+    bench_event_channel(runner);
+    bench_timer(runner);
+    bench_exceptions(runner);
+    bench_router_lookup(runner);
+    bench_hpack(runner);
+    bench_websocket(runner);
+    bench_log(runner);
+    if (!json_path.empty() && !runner.write_json(json_path, label)) {
+        std::cerr << std::format("cannot write {}", json_path) << std::endl;
+        return -1;
+    }
+}
@@ -0,0 +1,739 @@
+#include "loadgen.h"
+
+#include <chunked.h>
+
+#include <csignal>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <spawn.h>
+#include <sstream>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/*
+ * 端到端场景测试：在回环端口上启动tinyhttp_reactor，用压测引擎驱动各个场景，
+ * 把吞吐、p99延迟和服务端进程组的常驻内存与基线文件比较，超出容差时以非0退出码结束。
+ * 任何传输错误或非2xx响应都直接判定场景失败，不论性能数字是否达标。场景之前先做不计入基线的功能检查(响应缓存能够命中、分块编码的框架正确)。
+ * 吞吐与延迟依赖机器，运行开始时先用压测引擎直接驱动进程内的替身上游做一次校准，场景的结果除以校准结果后再与基线比较；
+ * 常驻内存随worker数(即核数)变化，按进程平均后比较。
+ * reactor使用固定路径的Unix域套接字，运行期间本机不能有其他reactor实例。
+ * 反向代理场景把/upstream下的请求转发到进程内的替身上游，与直接提供同样大小的静态文件的场景对照，得出代理增加的开销。
+ */
+
+/* 与机器无关的场景指标：吞吐与p99为相对校准运行的倍数，内存为服务端每个进程的平均常驻内存 */
+struct scenario_metrics {
+    double rps {0};
+    double p99 {0};
+    double rss_kb {0};
+};
+
+struct scenario_tolerance {
+    //吞吐允许下降的比例，p99与内存允许上升的比例
+    double rps {0.25};
+    double p99 {1.0};
+    double rss {0.5};
+};
+
+/* 基线文件：以#开头的行为注释，"tolerance rps|p99|rss <比例>"设置容差，其余每行为"场景名 rps倍数 p99倍数 每进程rss_kb" */
+class scenario_baseline {
+private:
+    std::map<std::string, scenario_metrics> entries_;
+    scenario_tolerance tolerance_;
+public:
+    bool load(const std::string& path) {
+        std::ifstream in(path);
+        if (!in) {
+            return false;
+        }
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.empty() || line.front() == '#') {
+                continue;
+            }
+            std::istringstream fields(line);
+            std::string name;
+            fields >> name;
+            if (name == "tolerance") {
+                std::string which;
+                double value;
+                fields >> which >> value;
+                if (which == "rps") {
+                    tolerance_.rps = value;
+                } else if (which == "p99") {
+                    tolerance_.p99 = value;
+                } else if (which == "rss") {
+                    tolerance_.rss = value;
+                }
+                continue;
+            }
+            scenario_metrics m;
+            if (fields >> m.rps >> m.p99 >> m.rss_kb) {
+                entries_[name] = m;
+            }
+        }
+        return true;
+    }
+
+    bool save(const std::string& path) const {
+        std::ofstream out(path, std::ios::out | std::ios::trunc);
+        if (!out) {
+            return false;
+        }
+        out << "# tinyhttp_scenario baseline, regenerate with --update-baseline\n";
+        out << "# rps and p99 are multiples of the calibration run on the same machine, rss is per server process\n";
+        out << std::format("tolerance rps {:.2f}\ntolerance p99 {:.2f}\ntolerance rss {:.2f}\n", tolerance_.rps, tolerance_.p99, tolerance_.rss);
+        out << "# scenario rps p99 rss_kb\n";
+        for (auto& [name, m] : entries_) {
+            out << std::format("{} {:.3f} {:.3f} {:.0f}\n", name, m.rps, m.p99, m.rss_kb);
+        }
+        return static_cast<bool>(out);
+    }
+
+    void set(const std::string& name, const scenario_metrics& m) {
+        entries_[name] = m;
+    }
+
+    /* 与基线比较，返回所有超出容差的项，没有基线的场景不做比较 */
+    [[nodiscard]] std::vector<std::string> compare(const std::string& name, const scenario_metrics& m) const {
+        std::vector<std::string> failures;
+        auto it = entries_.find(name);
+        if (it == entries_.end()) {
+            return failures;
+        }
+        auto& base = it->second;
+        if (m.rps < base.rps * (1 - tolerance_.rps)) {
+            failures.push_back(std::format("rps {:.3f}x < baseline {:.3f}x - {:.0f}%", m.rps, base.rps, tolerance_.rps * 100));
+        }
+        if (m.p99 > base.p99 * (1 + tolerance_.p99)) {
+            failures.push_back(std::format("p99 {:.3f}x > baseline {:.3f}x + {:.0f}%", m.p99, base.p99, tolerance_.p99 * 100));
+        }
+        if (m.rss_kb > base.rss_kb * (1 + tolerance_.rss)) {
+            failures.push_back(std::format("rss {:.0f}KB/process > baseline {:.0f}KB + {:.0f}%", m.rss_kb, base.rss_kb, tolerance_.rss * 100));
+        }
+        return failures;
+    }
+};
+
+/* 读取/proc/<pid>/status中的VmRSS(KB)，进程不存在时返回0 */
+uint64_t read_rss_kb(pid_t pid) {
+    std::ifstream in(std::format("/proc/{}/status", pid));
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.starts_with("VmRSS:")) {
+            return std::stoull(line.substr(6));
+        }
+    }
+    return 0;
+}
+
+/* reactor及其所有worker子进程的常驻内存之和，processes为计入的进程数 */
+uint64_t server_rss_kb(pid_t reactor, size_t& processes) {
+    uint64_t total = read_rss_kb(reactor);
+    processes = 1;
+    for (auto& entry : std::filesystem::directory_iterator("/proc")) {
+        auto name = entry.path().filename().string();
+        if (name.empty() || name.find_first_not_of("0123456789") != std::string::npos) {
+            continue;
+        }
+        std::ifstream stat(entry.path() / "stat");
+        std::string content;
+        std::getline(stat, content);
+        //格式为"pid (comm) state ppid ..."，comm中可能含空格，从最后一个')'之后开始解析
+        auto rparen = content.rfind(')');
+        if (rparen == std::string::npos) {
+            continue;
+        }
+        std::istringstream fields(content.substr(rparen + 1));
+        char state;
+        pid_t ppid = 0;
+        fields >> state >> ppid;
+        if (ppid == reactor) {
+            total += read_rss_kb(std::stoi(name));
+            ++processes;
+        }
+    }
+    return total;
+}
+
+/* 在临时目录中运行的reactor进程，通过标准输入发送控制台命令 */
+class server_process {
+private:
+    pid_t pid_ {-1};
+    int console_fd_ {-1};
+public:
+    bool start(const std::filesystem::path& reactor, const std::filesystem::path& workdir, uint16_t port, const std::vector<std::string>& extra) {
+        int pipefd[2];
+        if (pipe2(pipefd, O_CLOEXEC) == -1) {
+            return false;
+        }
+        auto log = workdir / "reactor.out";
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, pipefd[0], STDIN_FILENO);
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+        posix_spawn_file_actions_addchdir_np(&actions, workdir.c_str());
+        auto port_string = std::to_string(port);
+        std::vector<char*> argv = { const_cast<char*>(reactor.c_str()), const_cast<char*>("--port"), port_string.data() };
+        for (auto& arg : extra) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        int r = posix_spawn(&pid_, reactor.c_str(), &actions, nullptr, argv.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+        close(pipefd[0]);
+        if (r != 0) {
+            close(pipefd[1]);
+            std::cerr << std::format("cannot spawn {}: {}", reactor.c_str(), strerror(r)) << std::endl;
+            return false;
+        }
+        console_fd_ = pipefd[1];
+        return true;
+    }
+
+    [[nodiscard]] pid_t pid() const {
+        return pid_;
+    }
+
+    void command(std::string_view line) const {
+        std::string text = std::string(line) + "\n";
+        [[maybe_unused]] auto r = write(console_fd_, text.data(), text.length());
+    }
+
+    /* 发送stop并等待进程退出，超时后强制结束 */
+    void stop() {
+        if (pid_ == -1) {
+            return;
+        }
+        command("stop");
+        for (int i = 0; i < 150; ++i) {
+            int status;
+            if (waitpid(pid_, &status, WNOHANG) == pid_) {
+                pid_ = -1;
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        if (pid_ != -1) {
+            kill(pid_, SIGKILL);
+            waitpid(pid_, nullptr, 0);
+            pid_ = -1;
+        }
+        close(console_fd_);
+        console_fd_ = -1;
+    }
+};
+
+/* 阻塞地发出一个请求并确认收到响应，用于等待服务端就绪 */
+bool probe(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    timeval timeout { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    bool ok = false;
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
+        std::string_view request = "GET / HTTP/1.1\r\nHost: probe\r\nConnection: close\r\n\r\n";
+        char buf[256];
+        ok = send(fd, request.data(), request.length(), MSG_NOSIGNAL) == static_cast<ssize_t>(request.length())
+                && recv(fd, buf, sizeof(buf), 0) > 0;
+    }
+    close(fd);
+    return ok;
+}
+
+/* 在一条连接上发出请求(最后一个请求应带Connection: close)并读到对端关闭为止，返回收到的全部数据 */
+std::string exchange(uint16_t port, std::string_view requests) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    timeval timeout { 2, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::string received;
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0
+            && send(fd, requests.data(), requests.length(), MSG_NOSIGNAL) == static_cast<ssize_t>(requests.length())) {
+        char buf[4096];
+        ssize_t n;
+        while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+            received.append(buf, n);
+        }
+    }
+    close(fd);
+    return received;
+}
+
+/* 从/metrics中读出一个计数器的值，找不到时返回-1 */
+int64_t read_counter(uint16_t port, std::string_view name) {
+    auto text = exchange(port, "GET /metrics HTTP/1.1\r\nHost: check\r\nConnection: close\r\n\r\n");
+    auto pos = text.find(std::format("\n{} ", name));
+    if (pos == std::string::npos) {
+        return -1;
+    }
+    return std::strtoll(text.c_str() + pos + name.length() + 2, nullptr, 10);
+}
+
+/* 功能检查：同一连接上连续请求两次可缓存的/status，第二次由同一个worker处理，应当命中响应缓存 */
+std::vector<std::string> check_response_cache(uint16_t port) {
+    std::vector<std::string> failures;
+    constexpr std::string_view name = "tinyhttp_response_cache_hits_total";
+    auto before = read_counter(port, name);
+    auto responses = exchange(port, "GET /status HTTP/1.1\r\nHost: check\r\n\r\nGET /status HTTP/1.1\r\nHost: check\r\nConnection: close\r\n\r\n");
+    size_t ok = 0;
+    for (auto pos = responses.find("HTTP/1.1 200 "); pos != std::string::npos; pos = responses.find("HTTP/1.1 200 ", pos + 1)) {
+        ++ok;
+    }
+    if (ok != 2) {
+        failures.push_back(std::format("expected 2 responses with status 200 from /status, got {}", ok));
+    }
+    auto after = read_counter(port, name);
+    if (before < 0 || after < 0) {
+        failures.push_back(std::format("{} missing from /metrics", name));
+    } else if (after <= before) {
+        failures.emplace_back("second request for /status did not hit the response cache");
+    }
+    return failures;
+}
+
+/*
+ * 背景连接：idle为发完一个请求后保持空闲的keep-alive连接，
+ * slow为slowloris式的慢速客户端，每隔一段时间只发送一行首部，永远不完成请求。
+ */
+class background_clients {
+private:
+    io_loop loop_;
+    sockaddr_in addr_ {};
+    std::atomic<bool> stop_ {false};
+    std::thread thread_;
+    size_t established_ {0};
+
+    task<> idle_client() {
+        int fd = co_await loop_.connect(reinterpret_cast<const sockaddr*>(&addr_), sizeof(addr_));
+        if (fd == -1) {
+            co_return;
+        }
+        std::string_view request = "GET / HTTP/1.1\r\nHost: idle\r\n\r\n";
+        char buf[1024];
+        if (co_await loop_.send_all(fd, request.data(), request.length()) && co_await loop_.recv_some(fd, buf, sizeof(buf)) > 0) {
+            ++established_;
+        }
+        while (!stop_) {
+            co_await loop_.sleep_for(std::chrono::milliseconds(100));
+        }
+        loop_.forget(fd);
+        close(fd);
+    }
+
+    task<> slow_client() {
+        int fd = co_await loop_.connect(reinterpret_cast<const sockaddr*>(&addr_), sizeof(addr_));
+        if (fd == -1) {
+            co_return;
+        }
+        ++established_;
+        std::string_view start = "GET / HTTP/1.1\r\nHost: slow\r\n";
+        std::string_view trickle = "X-Slow: 1\r\n";
+        bool alive = co_await loop_.send_all(fd, start.data(), start.length());
+        while (alive && !stop_) {
+            co_await loop_.sleep_for(std::chrono::milliseconds(200));
+            alive = co_await loop_.send_all(fd, trickle.data(), trickle.length());
+        }
+        loop_.forget(fd);
+        close(fd);
+    }
+public:
+    background_clients(uint16_t port, size_t idle, size_t slow) {
+        addr_.sin_family = AF_INET;
+        addr_.sin_port = htons(port);
+        inet_pton(AF_INET, "127.0.0.1", &addr_.sin_addr);
+        for (size_t i = 0; i < idle; ++i) {
+            loop_.spawn(idle_client());
+        }
+        for (size_t i = 0; i < slow; ++i) {
+            loop_.spawn(slow_client());
+        }
+        //等待连接建立完成后再开始计时
+        auto until = io_loop::clock::now() + std::chrono::seconds(5);
+        while (established_ < idle + slow && io_loop::clock::now() < until) {
+            loop_.run_once(10);
+        }
+        thread_ = std::thread([this] {
+            while (!stop_) {
+                loop_.run_once(10);
+            }
+            //让所有协程观察到stop_后关闭连接
+            for (int i = 0; i < 30; ++i) {
+                loop_.run_once(10);
+            }
+        });
+    }
+    background_clients(const background_clients&) = delete;
+    ~background_clients() {
+        stop_ = true;
+        thread_.join();
+    }
+
+    [[nodiscard]] size_t established() const {
+        return established_;
+    }
+};
+
+/*
+ * 替身上游：监听回环地址上的随机端口，在单独的线程里以keep-alive应答所有请求，
+ * 路径以/upstream/1mb开头时返回1MB的响应体，否则返回512字节，与small_file和large_file场景的文件大小相同。
+ */
+class stand_in_upstream {
+private:
+    io_loop loop_;
+    int listen_fd_ {-1};
+    uint16_t port_ {0};
+    std::atomic<bool> stop_ {false};
+    std::thread thread_;
+    std::string small_;
+    std::string large_;
+    std::string chunked_;
+
+    static std::string make_response(size_t length, char fill) {
+        return std::format("HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: {}\r\n\r\n", length)
+            + std::string(length, fill);
+    }
+
+    /* 分块编码的响应：块大小各不相同，带有块扩展与尾部首部，代理需要解码后重新分块 */
+    static std::string make_chunked_response() {
+        auto content = chunked_content();
+        std::string response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nTransfer-Encoding: chunked\r\n\r\n";
+        size_t offset = 0;
+        for (size_t length : { 1, 30, 4096 }) {
+            response += std::format("{:x};ext=1\r\n", length);
+            response.append(content, offset, length);
+            response += "\r\n";
+            offset += length;
+        }
+        response += std::format("{:X}\r\n", content.length() - offset);
+        response.append(content, offset);
+        response += "\r\n0\r\nX-Trailer: 1\r\n\r\n";
+        return response;
+    }
+
+    task<> serve(int fd) {
+        receive_buffer in;
+        while (!stop_) {
+            http_request request;
+            auto consumed = parse_http_request(in.data(), request);
+            if (consumed < 0) {
+                break;
+            }
+            if (consumed == 0) {
+                auto n = co_await loop_.recv_into(fd, in);
+                if (n <= 0) {
+                    break;
+                }
+                continue;
+            }
+            auto& response = request.path.starts_with("/upstream/1mb") ? large_ : request.path.starts_with("/upstream/chunked") ? chunked_ : small_;
+            bool keep_alive = request.keep_alive();
+            in.consume(consumed);
+            bool sent = co_await loop_.send_all(fd, response.data(), response.length());
+            if (!sent || !keep_alive) {
+                break;
+            }
+        }
+        loop_.forget(fd);
+        close(fd);
+    }
+
+    task<> accept_connections() {
+        while (!stop_) {
+            co_await loop_.readable(listen_fd_);
+            int fd;
+            while ((fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                loop_.spawn(serve(fd));
+            }
+        }
+    }
+public:
+    stand_in_upstream() : small_(make_response(512, 's')), large_(make_response(1024 * 1024, 'b')), chunked_(make_chunked_response()) {
+        listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        sockaddr_in addr {};
+        addr.sin_family = AF_INET;
+        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+        socklen_t length = sizeof(addr);
+        if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 || listen(listen_fd_, 1024) == -1
+                || getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &length) == -1) {
+            throw io_exception("stand_in_upstream::stand_in_upstream()", std::format("cannot listen on loopback: {}", strerror(errno)));
+        }
+        port_ = ntohs(addr.sin_port);
+        loop_.spawn(accept_connections());
+        thread_ = std::thread([this] {
+            while (!stop_) {
+                loop_.run_once(10);
+            }
+        });
+    }
+    stand_in_upstream(const stand_in_upstream&) = delete;
+    ~stand_in_upstream() {
+        stop_ = true;
+        thread_.join();
+        close(listen_fd_);
+    }
+
+    [[nodiscard]] uint16_t port() const {
+        return port_;
+    }
+
+    /* /upstream/chunked的响应体 */
+    static std::string chunked_content() {
+        std::string content(9000, '\0');
+        for (size_t i = 0; i < content.length(); ++i) {
+            content[i] = static_cast<char>('a' + i % 26);
+        }
+        return content;
+    }
+};
+
+/* 解码单个分块编码的响应体，之后不应再有多余的数据；格式非法或不完整时返回std::nullopt */
+std::optional<std::string> decode_chunked(std::string body) {
+    chunked_decoder decoder;
+    size_t produced;
+    auto consumed = decoder.decode(body.data(), body.length(), body.data(), produced);
+    if (consumed != static_cast<ssize_t>(body.length()) || !decoder.done()) {
+        return std::nullopt;
+    }
+    body.resize(produced);
+    return body;
+}
+
+/*
+ * 功能检查：分块编码的框架。经代理转发的分块响应与边生成边发送的/debug/trace，
+ * 对HTTP/1.1的客户端应当重新分块且能完整解码，对HTTP/1.0的客户端应当是去掉框架的原文。
+ */
+std::vector<std::string> check_chunked_framing(uint16_t port) {
+    std::vector<std::string> failures;
+    auto expected = stand_in_upstream::chunked_content();
+    struct probe_case {
+        std::string_view path;
+        std::string_view version;
+    };
+    for (auto [path, version] : { probe_case { "/upstream/chunked", "HTTP/1.1" }, probe_case { "/upstream/chunked", "HTTP/1.0" },
+                                  probe_case { "/debug/trace", "HTTP/1.1" }, probe_case { "/debug/trace", "HTTP/1.0" } }) {
+        auto text = ::exchange(port, std::format("GET {} {}\r\nHost: check\r\nConnection: close\r\n\r\n", path, version));
+        auto head_end = text.find("\r\n\r\n");
+        if (!text.starts_with("HTTP/1.1 200 ") || head_end == std::string::npos) {
+            failures.push_back(std::format("{} {}: no 200 response", version, path));
+            continue;
+        }
+        auto head = std::string_view(text).substr(0, head_end + 2);
+        auto body = text.substr(head_end + 4);
+        bool chunked = head.find("Transfer-Encoding: chunked\r\n") != std::string_view::npos;
+        if (chunked != (version == "HTTP/1.1")) {
+            failures.push_back(std::format("{} {}: {}expected chunked encoding", version, path, chunked ? "un" : ""));
+            continue;
+        }
+        if (chunked) {
+            auto decoded = decode_chunked(std::move(body));
+            if (!decoded) {
+                failures.push_back(std::format("{} {}: malformed chunked body", version, path));
+                continue;
+            }
+            body = std::move(*decoded);
+        }
+        bool valid = path == "/debug/trace" ? body.starts_with("{\"displayTimeUnit\"") && body.ends_with("]}\n") : body == expected;
+        if (!valid) {
+            failures.push_back(std::format("{} {}: unexpected body of {} bytes", version, path, body.length()));
+        }
+    }
+    return failures;
+}
+
+struct scenario {
+    std::string name;
+    std::string path;
+    size_t connections;
+    bool keep_alive;
+    size_t idle;
+    size_t slow;
+};
+
+loadgen_options make_options(uint16_t port, const std::string& path, size_t connections, bool keep_alive, double seconds) {
+    loadgen_options options;
+    options.port = port;
+    options.path = path;
+    options.connections = connections;
+    options.threads = std::min<size_t>(2, connections);
+    options.keep_alive = keep_alive;
+    options.duration = std::chrono::milliseconds(static_cast<int64_t>(seconds * 1000));
+    return options;
+}
+
+/* 运行中出现的传输错误与非2xx响应，场景只请求存在的资源，任何一个都说明服务端行为不正确 */
+void check_responses(const loadgen_result& result, std::vector<std::string>& failures) {
+    if (result.requests == 0) {
+        failures.emplace_back("no request completed");
+    }
+    if (result.errors > 0) {
+        failures.push_back(std::format("{} transport error(s)", result.errors));
+    }
+    if (result.non_2xx > 0) {
+        failures.push_back(std::format("{} non-2xx response(s)", result.non_2xx));
+    }
+}
+
+int main(int argc, char** argv) {
+    auto self_dir = std::filesystem::read_symlink("/proc/self/exe").parent_path();
+    std::filesystem::path reactor = self_dir / "tinyhttp_reactor";
+    std::string baseline_path = "bench/scenario_baseline.txt";
+    std::string filter;
+    uint16_t port = 18080;
+    double seconds = 3;
+    bool update = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--reactor" && i + 1 < argc) {
+            reactor = argv[++i];
+        } else if (arg == "--baseline" && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (arg == "--port" && i + 1 < argc) {
+            port = static_cast<uint16_t>(std::stoi(argv[++i]));
+        } else if (arg == "--duration" && i + 1 < argc) {
+            seconds = std::stod(argv[++i]);
+        } else if (arg == "--update-baseline") {
+            update = true;
+        } else {
+            std::cerr << "usage: tinyhttp_scenario [--reactor path] [--baseline path] [--filter substring] [--port port]\n"
+                         "                         [--duration seconds] [--update-baseline]" << std::endl;
+            return -1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    //空闲连接场景需要数千个fd
+    rlimit nofile {};
+    getrlimit(RLIMIT_NOFILE, &nofile);
+    nofile.rlim_cur = nofile.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &nofile);
+
+    scenario_baseline baseline;
+    if (!baseline.load(baseline_path) && !update) {
+        std::cerr << std::format("cannot read baseline {}, run with --update-baseline to create it", baseline_path) << std::endl;
+        return -1;
+    }
+    //服务端在临时目录中运行，文档根目录www下放置测试用的静态文件
+    auto workdir = std::filesystem::temp_directory_path() / std::format("tinyhttp_scenario_{}", getpid());
+    std::filesystem::create_directories(workdir / "logs");
+    std::filesystem::create_directories(workdir / "www");
+    std::ofstream(workdir / "www" / "small.html") << std::string(512, 's');
+    std::ofstream(workdir / "www" / "1mb.bin") << std::string(1024 * 1024, 'b');
+
+    std::vector<scenario> scenarios = {
+        { "small_file", "/small.html", 64, true, 0, 0 },
+        { "large_file", "/1mb.bin", 8, true, 0, 0 },
+        { "idle_keepalive", "/small.html", 16, true, 5000, 0 },
+        { "connection_storm", "/small.html", 32, false, 0, 0 },
+        { "slowloris_mix", "/small.html", 16, true, 0, 500 },
+        { "proxy_small", "/upstream/small", 64, true, 0, 0 },
+        { "proxy_large", "/upstream/1mb", 8, true, 0, 0 },
+    };
+    stand_in_upstream upstream;
+    //校准：与small_file相同的响应大小与连接数，但由只回放固定响应的替身上游应答
+    auto calibration = run_loadgen(make_options(upstream.port(), "/upstream/small", 64, true, seconds));
+    double calibration_p99_us = static_cast<double>(calibration.latency.percentile(0.99)) / 1000.0;
+    std::cout << std::format("{:<20} rps {:>10.0f} p99 {:>9.0f}us", "calibration", calibration.rps(), calibration_p99_us) << std::endl;
+    if (calibration.requests == 0 || calibration.errors > 0 || calibration.non_2xx > 0) {
+        std::cerr << "calibration run failed" << std::endl;
+        return -1;
+    }
+    server_process server;
+    if (!server.start(reactor, workdir, port, { "--proxy", std::format("/upstream=127.0.0.1:{}", upstream.port()) })) {
+        return -1;
+    }
+    bool ready = false;
+    for (int i = 0; i < 100 && !ready; ++i) {
+        ready = probe(port);
+        if (!ready) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+    if (!ready) {
+        std::cerr << std::format("server did not become ready, see {}", (workdir / "reactor.out").c_str()) << std::endl;
+        server.stop();
+        return -1;
+    }
+    int failed = 0;
+    //功能检查不计入基线，失败时同样以非0退出码结束
+    struct functional_check {
+        std::string_view name;
+        std::vector<std::string> (*run)(uint16_t);
+    };
+    for (auto& check : { functional_check { "response_cache_hit", check_response_cache }, functional_check { "chunked_framing", check_chunked_framing } }) {
+        if (auto failures = check.run(port); !failures.empty()) {
+            ++failed;
+            std::cout << std::format("{:<20} FAILED\n", check.name);
+            for (auto& f : failures) {
+                std::cout << "    " << f << "\n";
+            }
+        } else {
+            std::cout << std::format("{:<20} ok\n", check.name);
+        }
+    }
+    for (auto& s : scenarios) {
+        if (!filter.empty() && s.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        loadgen_result result;
+        uint64_t rss_kb;
+        size_t processes;
+        {
+            background_clients background(port, s.idle, s.slow);
+            result = run_loadgen(make_options(port, s.path, s.connections, s.keep_alive, seconds));
+            //在后台连接仍然存在时采样内存
+            rss_kb = server_rss_kb(server.pid(), processes);
+        }
+        auto p99_us = static_cast<double>(result.latency.percentile(0.99)) / 1000.0;
+        scenario_metrics m;
+        m.rps = result.rps() / calibration.rps();
+        m.p99 = calibration_p99_us > 0 ? p99_us / calibration_p99_us : 0;
+        m.rss_kb = static_cast<double>(rss_kb) / static_cast<double>(processes);
+        std::cout << std::format("{:<20} rps {:>10.0f} ({:.3f}x) p99 {:>9.0f}us ({:.3f}x) rss {:>8}KB ({:.0f}KB/process) errors {} non-2xx {}",
+                                 s.name, result.rps(), m.rps, p99_us, m.p99, rss_kb, m.rss_kb, result.errors, result.non_2xx);
+        std::vector<std::string> failures;
+        check_responses(result, failures);
+        if (!update) {
+            auto regressions = baseline.compare(s.name, m);
+            failures.insert(failures.end(), regressions.begin(), regressions.end());
+        }
+        if (update && failures.empty()) {
+            baseline.set(s.name, m);
+            std::cout << "  (recorded)\n";
+        } else if (failures.empty()) {
+            std::cout << "  ok\n";
+        } else {
+            ++failed;
+            std::cout << "  FAILED\n";
+            for (auto& f : failures) {
+                std::cout << "    " << f << "\n";
+            }
+        }
+        std::cout << std::flush;
+        //让服务端关闭上一场景遗留的连接
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    }
+    server.stop();
+    std::filesystem::remove_all(workdir);
+    //出错的运行不能成为基线
+    if (update && failed == 0 && !baseline.save(baseline_path)) {
+        std::cerr << std::format("cannot write {}", baseline_path) << std::endl;
+        return -1;
+    }
+    if (failed > 0) {
+        std::cout << std::format("{} scenario(s) failed", failed) << std::endl;
+        return 1;
+    }
+}
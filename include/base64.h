@@ -0,0 +1,81 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/* Base64(RFC 4648 4)与URL安全的变体(RFC 4648 5) */
+
+namespace base64_detail {
+    /* 字符到6位值的映射，不在字母表中的字符为-1 */
+    consteval std::array<int8_t, 256> make_decode_table(bool url) {
+        std::array<int8_t, 256> table {};
+        table.fill(-1);
+        constexpr std::string_view common = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+        for (size_t i = 0; i < common.length(); ++i) {
+            table[static_cast<uint8_t>(common[i])] = static_cast<int8_t>(i);
+        }
+        table[url ? '-' : '+'] = 62;
+        table[url ? '_' : '/'] = 63;
+        return table;
+    }
+
+    constexpr static auto decode_table = make_decode_table(false);
+    constexpr static auto url_decode_table = make_decode_table(true);
+
+    constexpr static std::string_view alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+}
+
+/* 以标准字母表编码in并追加到out，总是带有结尾的填充 */
+inline void base64_encode(std::string_view in, std::string& out) {
+    auto& alphabet = base64_detail::alphabet;
+    auto p = reinterpret_cast<const unsigned char*>(in.data());
+    size_t left = in.length();
+    out.reserve(out.length() + (left + 2) / 3 * 4);
+    while (left >= 3) {
+        uint32_t group = (static_cast<uint32_t>(p[0]) << 16) | (static_cast<uint32_t>(p[1]) << 8) | p[2];
+        out.push_back(alphabet[group >> 18]);
+        out.push_back(alphabet[(group >> 12) & 0x3f]);
+        out.push_back(alphabet[(group >> 6) & 0x3f]);
+        out.push_back(alphabet[group & 0x3f]);
+        p += 3;
+        left -= 3;
+    }
+    if (left > 0) {
+        uint32_t group = static_cast<uint32_t>(p[0]) << 16;
+        if (left == 2) {
+            group |= static_cast<uint32_t>(p[1]) << 8;
+        }
+        out.push_back(alphabet[group >> 18]);
+        out.push_back(alphabet[(group >> 12) & 0x3f]);
+        out.push_back(left == 2 ? alphabet[(group >> 6) & 0x3f] : '=');
+        out.push_back('=');
+    }
+}
+
+/* 解码in并追加到out，url为true时使用URL安全的字母表。结尾的填充可以省略，含非法字符时返回false */
+inline bool base64_decode(std::string_view in, std::string& out, bool url = false) {
+    auto& table = url ? base64_detail::url_decode_table : base64_detail::decode_table;
+    while (!in.empty() && in.back() == '=') {
+        in.remove_suffix(1);
+    }
+    if (in.length() % 4 == 1) {
+        return false;
+    }
+    uint32_t acc = 0;
+    size_t bits = 0;
+    for (unsigned char c : in) {
+        auto value = table[c];
+        if (value < 0) {
+            return false;
+        }
+        acc = (acc << 6) | static_cast<uint32_t>(value);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out.push_back(static_cast<char>(acc >> bits));
+        }
+    }
+    return true;
+}
@@ -0,0 +1,520 @@
+#pragma once
+
+#include <memory.h>
+#include <io.h>
+#include <timer.h>
+#include <http.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <climits>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+/*
+ * 基于纪元(epoch)的延迟回收，用于实现RCU风格的无锁读取。
+ * 读者进入读区时把当前全局纪元登记到自己的槽位，离开时清零；写者摘下节点后以当时的纪元将其挂入回收列表，
+ * 等到所有仍在读区中的读者登记的纪元都晚于该纪元时，再也没有读者能够看到它，此时才真正释放。
+ * 读取路径只有两次原子存储，不加锁也不修改共享的引用计数。
+ */
+class epoch_domain {
+public:
+    constexpr static size_t max_readers = 64;
+private:
+    struct alignas(64) reader_slot {
+        //0表示不在读区中
+        std::atomic<uint64_t> epoch {0};
+        std::atomic<bool> claimed {false};
+        //嵌套深度，只有持有该槽位的线程访问
+        uint32_t depth {0};
+    };
+    struct retired_node {
+        uint64_t epoch;
+        void* ptr;
+        void (*deleter)(void*);
+    };
+    //攒够这么多待回收节点后尝试回收一次
+    constexpr static size_t collect_threshold = 64;
+
+    inline static std::atomic<uint64_t> next_id_ {0};
+    //仍然存活的域，线程退出时只归还这些域中的槽位；与域的构造/析构以及线程退出互斥
+    inline static std::mutex live_mtx_;
+    inline static std::unordered_set<uint64_t> live_;
+    uint64_t id_ {next_id_.fetch_add(1, std::memory_order_relaxed)};
+    std::atomic<uint64_t> epoch_ {1};
+    std::array<reader_slot, max_readers> slots_ {};
+    std::mutex retire_mtx_;
+    std::vector<retired_node> retired_;
+
+    /* 线程认领的槽位，线程退出时归还，使槽位数限制的是同时存在的读者线程数而不是累计的线程数 */
+    struct owned_slots {
+        std::vector<std::pair<uint64_t, reader_slot*>> slots;
+        ~owned_slots() {
+            std::lock_guard lock(live_mtx_);
+            for (auto& [id, slot] : slots) {
+                if (live_.contains(id)) {
+                    slot->depth = 0;
+                    slot->epoch.store(0, std::memory_order_release);
+                    slot->claimed.store(false, std::memory_order_release);
+                }
+            }
+        }
+    };
+
+    /* 当前线程在本域中的槽位，第一次调用时认领；以域编号而不是地址识别，避免域被销毁后地址复用 */
+    reader_slot& local_slot() {
+        thread_local owned_slots local;
+        auto& owned = local.slots;
+        for (auto& [id, slot] : owned) {
+            if (id == id_) {
+                return *slot;
+            }
+        }
+        for (auto& slot : slots_) {
+            bool expected = false;
+            if (slot.claimed.compare_exchange_strong(expected, true)) {
+                owned.emplace_back(id_, &slot);
+                return slot;
+            }
+        }
+        throw memory_exception("epoch_domain::local_slot()", std::format("more than {} reader threads", max_readers));
+    }
+
+    /* 释放所有已经不可能被读者看到的节点，调用者持有retire_mtx_ */
+    void collect_locked() {
+        uint64_t oldest = UINT64_MAX;
+        for (auto& slot : slots_) {
+            auto e = slot.epoch.load(std::memory_order_seq_cst);
+            if (e != 0) {
+                oldest = std::min(oldest, e);
+            }
+        }
+        std::erase_if(retired_, [oldest](const retired_node& node) {
+            if (node.epoch < oldest) {
+                node.deleter(node.ptr);
+                return true;
+            }
+            return false;
+        });
+    }
+public:
+    epoch_domain() {
+        std::lock_guard lock(live_mtx_);
+        live_.insert(id_);
+    }
+    epoch_domain(const epoch_domain&) = delete;
+    epoch_domain& operator=(const epoch_domain&) = delete;
+    /* 销毁时不应再有读者 */
+    ~epoch_domain() {
+        {
+            std::lock_guard lock(live_mtx_);
+            live_.erase(id_);
+        }
+        for (auto& node : retired_) {
+            node.deleter(node.ptr);
+        }
+    }
+
+    /* 读区守卫，存活期间读到的节点不会被释放，可以嵌套 */
+    class guard {
+    private:
+        reader_slot& slot_;
+    public:
+        explicit guard(epoch_domain& domain) : slot_(domain.local_slot()) {
+            if (slot_.depth++ == 0) {
+                slot_.epoch.store(domain.epoch_.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+            }
+        }
+        guard(const guard&) = delete;
+        guard& operator=(const guard&) = delete;
+        ~guard() {
+            if (--slot_.depth == 0) {
+                slot_.epoch.store(0, std::memory_order_release);
+            }
+        }
+    };
+
+    /* 节点已从共享结构上摘下，等到没有读者能看到它时调用deleter释放 */
+    void retire(void* ptr, void (*deleter)(void*)) {
+        std::lock_guard lock(retire_mtx_);
+        retired_.push_back({ epoch_.fetch_add(1, std::memory_order_seq_cst), ptr, deleter });
+        if (retired_.size() >= collect_threshold) {
+            collect_locked();
+        }
+    }
+
+    void collect() {
+        std::lock_guard lock(retire_mtx_);
+        collect_locked();
+    }
+
+    [[nodiscard]] size_t pending() {
+        std::lock_guard lock(retire_mtx_);
+        return retired_.size();
+    }
+};
+
+/* 命中缓存时得到的响应，持有序列化结果的一个引用 */
+class cached_response {
+private:
+    general_shared_array_buffer_t buffer_;
+    size_t connection_offset_;
+public:
+    //缓存中的报文按keep-alive序列化，需要关闭连接时替换这一行
+    constexpr static std::string_view keep_alive_line = "Connection: keep-alive\r\n";
+    constexpr static std::string_view close_line = "Connection: close\r\n";
+
+    cached_response(general_shared_array_buffer_t buffer, size_t connection_offset)
+            : buffer_(std::move(buffer)), connection_offset_(connection_offset) {}
+
+    [[nodiscard]] size_t size() {
+        return buffer_.capacity();
+    }
+
+    /* 以零复制的方式追加到发送队列 */
+    void append_to(output_queue& out, bool keep_alive) {
+        if (keep_alive) {
+            out.append(buffer_, 0, buffer_.capacity());
+            return;
+        }
+        auto rest = connection_offset_ + keep_alive_line.length();
+        out.append(buffer_, 0, connection_offset_);
+        out.append_static(close_line);
+        out.append(buffer_, rest, buffer_.capacity() - rest);
+    }
+};
+
+/*
+ * 响应缓存。以"方法 目标"加上响应Vary首部所列请求首部的取值为键，保存按keep-alive完整序列化的响应报文，
+ * 命中时直接把共享缓冲交给writev，不再生成也不再复制响应。
+ *
+ * 散列表的每个桶是一条不可变的单链表：插入时在表头挂上新节点；删除时复制被删节点之前的部分并重新发布表头，
+ * 被替换的旧节点交给epoch_domain延迟回收。读者只在读区守卫内沿链表查找，不加锁；写者之间用互斥量串行化。
+ * 带Vary的响应额外保存一个以"方法 目标"为键的索引节点，记录需要参与建键的请求首部名。
+ *
+ * 过期时间以timer的滴答计，由attach()注册的定时任务推进；容量按字节计算，超出预算时用采样近似LRU淘汰：
+ * 每次从游标处取若干个节点，淘汰其中最久未被使用的一个，避免维护全局的LRU链表(那会让读者写共享结构)。
+ */
+class response_cache {
+public:
+    constexpr static size_t default_budget = 32 * 1024 * 1024;
+    constexpr static size_t default_buckets = 4096;
+private:
+    struct node {
+        std::string key;
+        //索引节点：需要参与建键的请求首部名，以逗号分隔
+        std::string vary;
+        std::optional<general_shared_array_buffer_t> response;
+        size_t connection_offset {0};
+        int64_t expires {0};
+        //最近一次命中的滴答数，读者以relaxed方式写入
+        std::atomic<int64_t> last_used {0};
+        size_t bytes {0};
+        node* next {nullptr};
+
+        [[nodiscard]] bool is_index() const {
+            return !response.has_value();
+        }
+    };
+    constexpr static size_t eviction_samples = 16;
+    constexpr static size_t max_vary_headers = 8;
+
+    std::unique_ptr<std::atomic<node*>[]> buckets_;
+    size_t bucket_mask_;
+    size_t budget_;
+    size_t max_entry_;
+    std::atomic<int64_t> now_ {0};
+    epoch_domain epoch_;
+    std::mutex writer_mtx_;
+    size_t bytes_ {0};
+    size_t entries_ {0};
+    size_t eviction_cursor_ {0};
+    int timer_cid_ {-1};
+    timer* timer_ {nullptr};
+
+    static void delete_node(void* ptr) {
+        delete static_cast<node*>(ptr);
+    }
+
+    std::atomic<node*>& bucket_of(std::string_view key) {
+        return buckets_[std::hash<std::string_view>()(key) & bucket_mask_];
+    }
+
+    static node* find_in(node* head, std::string_view key) {
+        for (auto n = head; n != nullptr; n = n->next) {
+            if (n->key == key) {
+                return n;
+            }
+        }
+        return nullptr;
+    }
+
+    /* 请求的主键："方法 目标" */
+    static void primary_key(const http_request& request, std::string& key) {
+        key.assign(request.method);
+        key += ' ';
+        key += request.target;
+    }
+
+    /* 在主键后追加vary所列请求首部的取值，得到完整的键 */
+    static void variant_key(const http_request& request, std::string_view vary, std::string& key) {
+        key += '\n';
+        while (!vary.empty()) {
+            auto comma = vary.find(',');
+            auto name = trim(vary.substr(0, comma));
+            key += request.header(name);
+            key += '\n';
+            vary = comma == std::string_view::npos ? std::string_view() : vary.substr(comma + 1);
+        }
+    }
+
+    /* 从桶中摘下节点n：复制n之前的节点并重新发布表头，旧节点延迟回收。调用者持有writer_mtx_ */
+    void unlink_locked(std::atomic<node*>& bucket, node* victim) {
+        node* head = bucket.load(std::memory_order_relaxed);
+        std::vector<node*> prefix;
+        for (auto n = head; n != victim; n = n->next) {
+            prefix.push_back(n);
+        }
+        node* rebuilt = victim->next;
+        for (auto it = prefix.rbegin(); it != prefix.rend(); ++it) {
+            auto old = *it;
+            auto copy = new node { old->key, old->vary, old->response, old->connection_offset, old->expires, {}, old->bytes, rebuilt };
+            copy->last_used.store(old->last_used.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            rebuilt = copy;
+        }
+        bucket.store(rebuilt, std::memory_order_seq_cst);
+        for (auto old : prefix) {
+            epoch_.retire(old, delete_node);
+        }
+        bytes_ -= victim->bytes;
+        --entries_;
+        metrics_gauge(gauge_id::response_cache_bytes, -static_cast<int64_t>(victim->bytes));
+        epoch_.retire(victim, delete_node);
+    }
+
+    /* 以key发布新节点，替换同键的旧节点。调用者持有writer_mtx_ */
+    void publish_locked(node* fresh) {
+        auto& bucket = bucket_of(fresh->key);
+        if (auto existing = find_in(bucket.load(std::memory_order_relaxed), fresh->key)) {
+            unlink_locked(bucket, existing);
+        }
+        fresh->next = bucket.load(std::memory_order_relaxed);
+        bucket.store(fresh, std::memory_order_seq_cst);
+        bytes_ += fresh->bytes;
+        ++entries_;
+        metrics_gauge(gauge_id::response_cache_bytes, static_cast<int64_t>(fresh->bytes));
+    }
+
+    /* 采样近似LRU：过期节点优先，否则淘汰样本中最久未使用的节点。调用者持有writer_mtx_ */
+    bool evict_one_locked() {
+        if (entries_ == 0) {
+            return false;
+        }
+        auto now = now_.load(std::memory_order_relaxed);
+        node* victim = nullptr;
+        size_t victim_bucket = 0;
+        size_t sampled = 0;
+        for (size_t scanned = 0; scanned <= bucket_mask_ && sampled < eviction_samples; ++scanned) {
+            auto index = eviction_cursor_++ & bucket_mask_;
+            for (auto n = buckets_[index].load(std::memory_order_relaxed); n != nullptr; n = n->next) {
+                ++sampled;
+                if (victim == nullptr || n->expires <= now ||
+                    (victim->expires > now && n->last_used.load(std::memory_order_relaxed) < victim->last_used.load(std::memory_order_relaxed))) {
+                    victim = n;
+                    victim_bucket = index;
+                }
+                if (victim->expires <= now) {
+                    break;
+                }
+            }
+        }
+        if (victim == nullptr) {
+            return false;
+        }
+        unlink_locked(buckets_[victim_bucket], victim);
+        metrics_count(counter_id::response_cache_evictions);
+        return true;
+    }
+public:
+    explicit response_cache(size_t budget = default_budget, size_t buckets = default_buckets)
+            : buckets_(new std::atomic<node*>[std::bit_ceil(buckets)]), bucket_mask_(std::bit_ceil(buckets) - 1),
+              budget_(budget), max_entry_(budget / 8) {
+        for (size_t i = 0; i <= bucket_mask_; ++i) {
+            buckets_[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+    response_cache(const response_cache&) = delete;
+    response_cache& operator=(const response_cache&) = delete;
+    ~response_cache() {
+        detach();
+        for (size_t i = 0; i <= bucket_mask_; ++i) {
+            for (auto n = buckets_[i].load(std::memory_order_relaxed); n != nullptr;) {
+                auto next = n->next;
+                delete n;
+                n = next;
+            }
+        }
+        metrics_gauge(gauge_id::response_cache_bytes, -static_cast<int64_t>(bytes_));
+    }
+
+    /* 由timer驱动时钟：每个滴答推进一次，每秒清理一次过期节点并回收延迟释放的节点 */
+    void attach(timer& tm) {
+        detach();
+        timer_ = &tm;
+        timer_cid_ = tm.add(timer::make_tv(1, timer::inf_times), [this](timer::callback_id_t, timer::tv_t) {
+            auto now = now_.fetch_add(1, std::memory_order_relaxed) + 1;
+            if (now % timer::sec == 0) {
+                expire();
+            }
+        });
+    }
+    void detach() {
+        if (timer_ != nullptr) {
+            timer_->cancel(timer_cid_);
+            timer_ = nullptr;
+        }
+    }
+
+    /* 查找与请求匹配且未过期的响应，可以在任意线程调用 */
+    std::optional<cached_response> lookup(const http_request& request) {
+        thread_local std::string key;
+        auto now = now_.load(std::memory_order_relaxed);
+        epoch_domain::guard guard(epoch_);
+        primary_key(request, key);
+        auto found = find_in(bucket_of(key).load(std::memory_order_seq_cst), key);
+        if (found != nullptr && found->is_index()) {
+            variant_key(request, found->vary, key);
+            found = find_in(bucket_of(key).load(std::memory_order_seq_cst), key);
+        }
+        if (found == nullptr || found->is_index() || found->expires <= now) {
+            metrics_count(counter_id::response_cache_misses);
+            return std::nullopt;
+        }
+        if (found->last_used.load(std::memory_order_relaxed) != now) {
+            found->last_used.store(now, std::memory_order_relaxed);
+        }
+        metrics_count(counter_id::response_cache_hits);
+        return cached_response(*found->response, found->connection_offset);
+    }
+
+    /* 序列化并保存响应，ttl_ticks为有效期(滴答)，返回可直接发送的缓存结果；响应过大或无法缓存时返回std::nullopt */
+    std::optional<cached_response> store(const http_request& request, const http_response& response, int64_t ttl_ticks) {
+        auto vary = response.header("Vary");
+        if (ttl_ticks <= 0 || vary.find('*') != std::string_view::npos) {
+            return std::nullopt;
+        }
+        //键中含有请求方法，HEAD请求的缓存项本身就不带响应体
+        auto serialized = response.serialize(true, request.method == "HEAD");
+        auto head_end = serialized.find("\r\n\r\n");
+        if (head_end == std::string::npos || serialized.length() > max_entry_) {
+            return std::nullopt;
+        }
+        auto connection_offset = head_end + 2 - cached_response::keep_alive_line.length();
+        general_shared_array_buffer_t buffer(serialized.length(), new heap_allocator());
+        memcpy(buffer.pointer(), serialized.data(), serialized.length());
+        auto now = now_.load(std::memory_order_relaxed);
+        std::string key;
+        primary_key(request, key);
+        std::lock_guard lock(writer_mtx_);
+        if (!vary.empty()) {
+            size_t names = std::count(vary.begin(), vary.end(), ',') + 1;
+            if (names > max_vary_headers) {
+                return std::nullopt;
+            }
+            auto index = new node { key, std::string(vary), std::nullopt, 0, now + ttl_ticks, {}, key.length() + vary.length() + sizeof(node), nullptr };
+            index->last_used.store(now, std::memory_order_relaxed);
+            publish_locked(index);
+            variant_key(request, vary, key);
+        }
+        auto entry = new node { std::move(key), {}, buffer, connection_offset, now + ttl_ticks, {}, 0, nullptr };
+        entry->bytes = entry->key.length() + serialized.length() + sizeof(node);
+        entry->last_used.store(now, std::memory_order_relaxed);
+        publish_locked(entry);
+        while (bytes_ > budget_ && evict_one_locked()) {}
+        return cached_response(std::move(buffer), connection_offset);
+    }
+
+    /* 删除所有过期节点 */
+    void expire() {
+        auto now = now_.load(std::memory_order_relaxed);
+        std::lock_guard lock(writer_mtx_);
+        for (size_t i = 0; i <= bucket_mask_; ++i) {
+            auto& bucket = buckets_[i];
+            node* n = bucket.load(std::memory_order_relaxed);
+            while (n != nullptr) {
+                auto next = n->next;
+                if (n->expires <= now) {
+                    unlink_locked(bucket, n);
+                }
+                n = next;
+            }
+        }
+        epoch_.collect();
+    }
+
+    [[nodiscard]] size_t bytes() {
+        std::lock_guard lock(writer_mtx_);
+        return bytes_;
+    }
+    [[nodiscard]] size_t entries() {
+        std::lock_guard lock(writer_mtx_);
+        return entries_;
+    }
+};
+
+/*
+ * 按响应的Cache-Control首部判断能否放入共享缓存，返回有效期(滴答)，不能缓存时返回0。
+ * 只缓存带有显式max-age的GET/HEAD响应，携带Authorization的请求与private/no-store/no-cache的响应一律不缓存。
+ */
+inline int64_t response_cache_ttl(const http_request& request, const http_response& response) {
+    if ((request.method != "GET" && request.method != "HEAD") || !request.header("Authorization").empty()) {
+        return 0;
+    }
+    switch (response.status()) {
+        case 200: case 203: case 204: case 300: case 301: case 404: case 410:
+            break;
+        default:
+            return 0;
+    }
+    auto cache_control = response.header("Cache-Control");
+    int64_t max_age = -1;
+    while (!cache_control.empty()) {
+        auto comma = cache_control.find(',');
+        auto directive = trim(cache_control.substr(0, comma));
+        cache_control = comma == std::string_view::npos ? std::string_view() : cache_control.substr(comma + 1);
+        if (iequals(directive, "no-store") || iequals(directive, "no-cache") || iequals(directive, "private")) {
+            return 0;
+        }
+        auto eq = directive.find('=');
+        if (eq != std::string_view::npos && (iequals(directive.substr(0, eq), "max-age") || iequals(directive.substr(0, eq), "s-maxage"))) {
+            int64_t seconds = 0;
+            for (char c : directive.substr(eq + 1)) {
+                if (c < '0' || c > '9') {
+                    return 0;
+                }
+                seconds = std::min<int64_t>(seconds * 10 + (c - '0'), INT32_MAX);
+            }
+            max_age = std::max(max_age, seconds);
+        }
+    }
+    return max_age > 0 ? max_age * timer::sec : 0;
+}
+
+/* 请求是否要求跳过缓存直接生成响应 */
+inline bool request_bypasses_cache(const http_request& request) {
+    if (!request.header("Authorization").empty()) {
+        return true;
+    }
+    auto cache_control = request.header("Cache-Control");
+    return cache_control.find("no-cache") != std::string_view::npos || cache_control.find("no-store") != std::string_view::npos ||
+           iequals(request.header("Pragma"), "no-cache");
+}
@@ -0,0 +1,311 @@
+#pragma once
+
+#include <memory.h>
+#include <io.h>
+#include <http.h>
+
+#include <cstring>
+#include <format>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+
+/*
+ * 分块传输编码(RFC 9112 7.1)。解码器是逐字节推进的状态机，可以在数据分多次到达时继续；
+ * 去掉框架后的内容就地向前移动，紧凑地排在输出位置，不需要另外的缓冲。
+ * 编码器把块头与块尾作为独立的片段放在内容片段前后，内容本身只被引用，不被复制。
+ */
+
+//块大小最多的十六进制位数，超出时视为非法，避免溢出
+constexpr static size_t max_chunk_size_digits = 15;
+
+class chunked_decoder {
+private:
+    enum class state {
+        size,
+        size_more,
+        extension,
+        size_lf,
+        data,
+        data_cr,
+        data_lf,
+        trailer_start,
+        trailer_line,
+        trailer_lf,
+        final_lf,
+        done,
+    };
+    state state_ {state::size};
+    size_t remaining_ {0};
+    size_t digits_ {0};
+    size_t trailer_bytes_ {0};
+
+    static int hex_value(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        c |= 0x20;
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        return -1;
+    }
+public:
+    /*
+     * 解码in中的[0, length)，去掉框架后的内容依次写到out(out可以与in重叠，但不能位于in之后)。
+     * 返回消耗的输入字节数，produced为写出的内容字节数；格式非法时返回-1。
+     * 完成(done()为true)后不再消耗输入，in中剩余的数据属于下一个报文。
+     */
+    ssize_t decode(const char* in, size_t length, char* out, size_t& produced) {
+        produced = 0;
+        size_t i = 0;
+        while (i < length && state_ != state::done) {
+            char c = in[i];
+            switch (state_) {
+                case state::size:
+                case state::size_more: {
+                    auto value = hex_value(c);
+                    if (value >= 0) {
+                        if (++digits_ > max_chunk_size_digits) {
+                            return -1;
+                        }
+                        remaining_ = remaining_ * 16 + value;
+                        state_ = state::size_more;
+                    } else if (state_ == state::size) {
+                        return -1;
+                    } else if (c == ';' || c == ' ' || c == '\t') {
+                        state_ = state::extension;
+                    } else if (c == '\r') {
+                        state_ = state::size_lf;
+                    } else {
+                        return -1;
+                    }
+                    ++i;
+                    break;
+                }
+                case state::extension:
+                    //块扩展没有定义任何语义，直接跳过
+                    if (c == '\r') {
+                        state_ = state::size_lf;
+                    } else if (c == '\n') {
+                        return -1;
+                    }
+                    ++i;
+                    break;
+                case state::size_lf:
+                    if (c != '\n') {
+                        return -1;
+                    }
+                    digits_ = 0;
+                    state_ = remaining_ == 0 ? state::trailer_start : state::data;
+                    ++i;
+                    break;
+                case state::data: {
+                    auto n = std::min(remaining_, length - i);
+                    if (out + produced != in + i) {
+                        memmove(out + produced, in + i, n);
+                    }
+                    produced += n;
+                    remaining_ -= n;
+                    i += n;
+                    if (remaining_ == 0) {
+                        state_ = state::data_cr;
+                    }
+                    break;
+                }
+                case state::data_cr:
+                    if (c != '\r') {
+                        return -1;
+                    }
+                    state_ = state::data_lf;
+                    ++i;
+                    break;
+                case state::data_lf:
+                    if (c != '\n') {
+                        return -1;
+                    }
+                    state_ = state::size;
+                    ++i;
+                    break;
+                case state::trailer_start:
+                    state_ = c == '\r' ? state::final_lf : state::trailer_line;
+                    ++i;
+                    ++trailer_bytes_;
+                    break;
+                case state::trailer_line:
+                    //尾部首部不合并到请求首部中，只检查大小与格式
+                    if (c == '\r') {
+                        state_ = state::trailer_lf;
+                    } else if (c == '\n') {
+                        return -1;
+                    }
+                    ++i;
+                    if (++trailer_bytes_ > max_http_header_size) {
+                        return -1;
+                    }
+                    break;
+                case state::trailer_lf:
+                    if (c != '\n') {
+                        return -1;
+                    }
+                    state_ = state::trailer_start;
+                    ++i;
+                    break;
+                case state::final_lf:
+                    if (c != '\n') {
+                        return -1;
+                    }
+                    state_ = state::done;
+                    ++i;
+                    break;
+                case state::done:
+                    break;
+            }
+        }
+        return static_cast<ssize_t>(i);
+    }
+
+    [[nodiscard]] bool done() const {
+        return state_ == state::done;
+    }
+
+    void reset() {
+        state_ = state::size;
+        remaining_ = 0;
+        digits_ = 0;
+        trailer_bytes_ = 0;
+    }
+};
+
+/*
+ * 接收缓冲中的分块请求体：解码后的内容紧接在请求头之后，
+ * 每次收到新数据时从上次停下的位置继续，已解码的部分不会被再次处理。
+ */
+class chunked_body {
+private:
+    chunked_decoder decoder_;
+    size_t raw_ {0};
+    size_t decoded_ {0};
+public:
+    /* body为请求头之后的(可写)数据。完成时返回请求体原始报文的长度，数据不完整时返回0，非法时返回-1 */
+    ssize_t feed(char* body, size_t length) {
+        if (decoder_.done()) {
+            return static_cast<ssize_t>(raw_);
+        }
+        size_t produced;
+        auto consumed = decoder_.decode(body + raw_, length - raw_, body + decoded_, produced);
+        if (consumed < 0) {
+            return -1;
+        }
+        raw_ += consumed;
+        decoded_ += produced;
+        return decoder_.done() ? static_cast<ssize_t>(raw_) : 0;
+    }
+
+    /* 已解码的内容长度，内容位于传给feed()的body开头 */
+    [[nodiscard]] size_t decoded() const {
+        return decoded_;
+    }
+
+    void reset() {
+        decoder_.reset();
+        raw_ = 0;
+        decoded_ = 0;
+    }
+};
+
+/* 块头：十六进制的长度加CRLF */
+inline std::string chunk_header(size_t length) {
+    return std::format("{:x}\r\n", length);
+}
+
+/* 把共享缓冲中的一段作为一个块加入发送队列，只增加缓冲的引用计数 */
+inline void append_chunk(output_queue& out, const general_shared_array_buffer_t& buffer, size_t offset, size_t length) {
+    if (length == 0) {
+        //长度为0的块会被当作结束块
+        return;
+    }
+    out.append(chunk_header(length));
+    out.append(buffer, offset, length);
+    out.append_static("\r\n");
+}
+
+/* 把owner持有的一段内存作为一个块加入发送队列 */
+inline void append_chunk(output_queue& out, std::shared_ptr<const void> owner, std::string_view data) {
+    if (data.empty()) {
+        return;
+    }
+    out.append(chunk_header(data.length()));
+    out.append(std::move(owner), data);
+    out.append_static("\r\n");
+}
+
+/* 把调用者保证在队列发送完之前有效的一段内存(如接收缓冲中解码后的内容)作为一个块加入发送队列 */
+inline void append_static_chunk(output_queue& out, std::string_view data) {
+    if (data.empty()) {
+        return;
+    }
+    out.append(chunk_header(data.length()));
+    out.append_static(data);
+    out.append_static("\r\n");
+}
+
+/* 结束块，之后没有尾部首部 */
+inline void append_last_chunk(output_queue& out) {
+    out.append_static("0\r\n\r\n");
+}
+
+/*
+ * 逐步生成分块编码的内容：写入的数据经buffer_stream复制进共享缓冲，flush()时把新写入的一段作为一个块加入发送队列。
+ * 缓冲写满后换用新的缓冲而不是扩容，已加入队列的片段因此始终指向有效的内存。
+ * 只能用于HTTP/1.1的客户端，响应头应带有Transfer-Encoding: chunked而不是Content-Length。
+ */
+class chunked_writer {
+public:
+    constexpr static size_t default_block_size = 16 * 1024;
+private:
+    output_queue& out_;
+    size_t block_size_;
+    std::optional<general_shared_array_buffer_t> block_;
+    //当前缓冲中已加入队列的位置与已写入的位置
+    size_t flushed_ {0};
+    size_t written_ {0};
+public:
+    explicit chunked_writer(output_queue& out, size_t block_size = default_block_size) : out_(out), block_size_(block_size) {}
+    chunked_writer(const chunked_writer&) = delete;
+    chunked_writer& operator=(const chunked_writer&) = delete;
+
+    void write(std::string_view data) {
+        while (!data.empty()) {
+            if (!block_ || written_ == block_->capacity()) {
+                flush();
+                block_.emplace(block_size_, new heap_allocator());
+                flushed_ = written_ = 0;
+            }
+            auto n = std::min(data.length(), block_->capacity() - written_);
+            buffer_stream stream(*block_);
+            stream.write(data.data(), written_, n);
+            written_ += n;
+            data.remove_prefix(n);
+        }
+    }
+
+    /* 把尚未加入队列的数据作为一个块加入队列 */
+    void flush() {
+        if (block_ && written_ > flushed_) {
+            append_chunk(out_, *block_, flushed_, written_ - flushed_);
+            flushed_ = written_;
+        }
+    }
+
+    /* 加入剩余的数据与结束块 */
+    void finish() {
+        flush();
+        append_last_chunk(out_);
+    }
+};
+
+/* 运行生成器，把它产生的响应体以分块编码加入发送队列，包括结束块 */
+inline void append_generated_body(output_queue& out, const body_generator& generator) {
+    chunked_writer writer(out);
+    generator([&writer](std::string_view data) { writer.write(data); });
+    writer.finish();
+}
@@ -0,0 +1,335 @@
+#pragma once
+
+#include <http.h>
+#include <file_cache.h>
+
+#include <array>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <zlib.h>
+#ifdef TINYHTTP_HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef TINYHTTP_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * Content-Encoding协商与压缩。gzip与deflate总是可用(zlib)，br与zstd仅在构建时找到对应的库时启用
+ * (CMake定义TINYHTTP_HAVE_BROTLI/TINYHTTP_HAVE_ZSTD)。
+ */
+
+enum class content_coding : uint8_t {
+    identity = 0,
+    gzip,
+    deflate,
+    br,
+    zstd,
+    count_
+};
+
+constexpr static size_t content_coding_count = static_cast<size_t>(content_coding::count_);
+
+constexpr static std::array<std::string_view, content_coding_count> content_coding_names = {
+    "identity",
+    "gzip",
+    "deflate",
+    "br",
+    "zstd",
+};
+
+/* 预压缩文件的后缀，deflate没有约定俗成的后缀 */
+constexpr static std::array<std::string_view, content_coding_count> content_coding_suffixes = {
+    "",
+    ".gz",
+    "",
+    ".br",
+    ".zst",
+};
+
+inline std::string_view get_content_coding_name(content_coding coding) {
+    return content_coding_names[static_cast<size_t>(coding)];
+}
+
+inline std::string_view get_content_coding_suffix(content_coding coding) {
+    return content_coding_suffixes[static_cast<size_t>(coding)];
+}
+
+/* 本次构建支持的编码 */
+constexpr bool content_coding_available(content_coding coding) {
+    switch (coding) {
+        case content_coding::identity:
+        case content_coding::gzip:
+        case content_coding::deflate:
+            return true;
+        case content_coding::br:
+#ifdef TINYHTTP_HAVE_BROTLI
+            return true;
+#else
+            return false;
+#endif
+        case content_coding::zstd:
+#ifdef TINYHTTP_HAVE_ZSTD
+            return true;
+#else
+            return false;
+#endif
+        default:
+            return false;
+    }
+}
+
+/* q值相同时的偏好顺序，压缩率高的在前 */
+constexpr static std::array<content_coding, 4> content_coding_preference = {
+    content_coding::br,
+    content_coding::zstd,
+    content_coding::gzip,
+    content_coding::deflate,
+};
+
+/* 解析q值(0~1，最多三位小数)为千分数，格式错误时返回-1 */
+inline int parse_qvalue(std::string_view q) {
+    if (q.empty() || (q[0] != '0' && q[0] != '1')) {
+        return -1;
+    }
+    int value = (q[0] - '0') * 1000;
+    if (q.length() > 1) {
+        if (q[1] != '.' || q.length() > 5) {
+            return -1;
+        }
+        int scale = 100;
+        for (size_t i = 2; i < q.length(); ++i, scale /= 10) {
+            if (q[i] < '0' || q[i] > '9') {
+                return -1;
+            }
+            value += (q[i] - '0') * scale;
+        }
+    }
+    return value > 1000 ? -1 : value;
+}
+
+/*
+ * 按Accept-Encoding选择编码(RFC 9110 12.5.3)，返回q值最高且本次构建支持的编码，q值相同时按content_coding_preference。
+ * 没有可用的编码时返回identity。
+ */
+inline content_coding negotiate_content_coding(std::string_view accept_encoding) {
+    std::array<int, content_coding_count> q {};
+    q.fill(-1);
+    int wildcard = -1;
+    while (!accept_encoding.empty()) {
+        auto comma = accept_encoding.find(',');
+        auto item = trim(accept_encoding.substr(0, comma));
+        accept_encoding = comma == std::string_view::npos ? std::string_view() : accept_encoding.substr(comma + 1);
+        auto semicolon = item.find(';');
+        auto name = trim(item.substr(0, semicolon));
+        int value = 1000;
+        if (semicolon != std::string_view::npos) {
+            auto param = trim(item.substr(semicolon + 1));
+            if (param.length() < 2 || (param[0] | 0x20) != 'q' || param[1] != '=') {
+                continue;
+            }
+            value = parse_qvalue(trim(param.substr(2)));
+            if (value < 0) {
+                continue;
+            }
+        }
+        if (name == "*") {
+            wildcard = value;
+            continue;
+        }
+        for (size_t i = 0; i < content_coding_count; ++i) {
+            if (iequals(name, content_coding_names[i]) || (i == static_cast<size_t>(content_coding::gzip) && iequals(name, "x-gzip"))) {
+                q[i] = value;
+            }
+        }
+    }
+    auto best = content_coding::identity;
+    int best_q = 0;
+    for (auto coding : content_coding_preference) {
+        auto value = q[static_cast<size_t>(coding)];
+        if (value < 0) {
+            value = wildcard;
+        }
+        if (content_coding_available(coding) && value > best_q) {
+            best = coding;
+            best_q = value;
+        }
+    }
+    return best;
+}
+
+/* 压缩data，结果不比原文小或压缩失败时返回std::nullopt。这是CPU密集型操作，应在线程池中执行 */
+inline std::optional<std::string> compress_content(content_coding coding, std::string_view data) {
+    std::string out;
+    switch (coding) {
+        case content_coding::gzip:
+        case content_coding::deflate: {
+            z_stream zs {};
+            //windowBits为31时输出gzip格式，15时输出HTTP中deflate所指的zlib格式
+            if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, coding == content_coding::gzip ? 31 : 15, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+                return std::nullopt;
+            }
+            out.resize(deflateBound(&zs, data.length()));
+            zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+            zs.avail_in = static_cast<uInt>(data.length());
+            zs.next_out = reinterpret_cast<Bytef*>(out.data());
+            zs.avail_out = static_cast<uInt>(out.length());
+            auto r = deflate(&zs, Z_FINISH);
+            auto produced = zs.total_out;
+            deflateEnd(&zs);
+            if (r != Z_STREAM_END) {
+                return std::nullopt;
+            }
+            out.resize(produced);
+            break;
+        }
+#ifdef TINYHTTP_HAVE_BROTLI
+        case content_coding::br: {
+            size_t produced = BrotliEncoderMaxCompressedSize(data.length());
+            if (produced == 0) {
+                return std::nullopt;
+            }
+            out.resize(produced);
+            //每份内容只压缩一次，较小的内容使用最高质量，大内容降低质量以免长时间占用线程
+            int quality = data.length() <= 1024 * 1024 ? BROTLI_MAX_QUALITY : 9;
+            if (!BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, data.length(),
+                                       reinterpret_cast<const uint8_t*>(data.data()), &produced, reinterpret_cast<uint8_t*>(out.data()))) {
+                return std::nullopt;
+            }
+            out.resize(produced);
+            break;
+        }
+#endif
+#ifdef TINYHTTP_HAVE_ZSTD
+        case content_coding::zstd: {
+            out.resize(ZSTD_compressBound(data.length()));
+            auto produced = ZSTD_compress(out.data(), out.length(), data.data(), data.length(), 19);
+            if (ZSTD_isError(produced)) {
+                return std::nullopt;
+            }
+            out.resize(produced);
+            break;
+        }
+#endif
+        default:
+            return std::nullopt;
+    }
+    if (out.length() >= data.length()) {
+        return std::nullopt;
+    }
+    return out;
+}
+
+/* 编码后的变体实体标签：在原标签的结束引号前加上编码名 */
+inline std::string make_variant_etag(std::string_view etag, content_coding coding) {
+    if (etag.length() < 2 || etag.back() != '"') {
+        return std::string(etag);
+    }
+    return std::format("{}-{}\"", etag.substr(0, etag.length() - 1), get_content_coding_name(coding));
+}
+
+/* 编码后的变体：预先生成的响应头(不含Connection行与结尾空行)与内容 */
+struct compressed_variant {
+    std::string head;
+    //变体自己的实体标签与304响应头
+    std::string etag;
+    std::string not_modified;
+    //运行时压缩的结果
+    std::string data;
+    //取自预压缩的同名文件(如index.html.gz)时为该文件的实体标签，此时data为空，内容经file_cache重新打开后发送；
+    //变体不持有文件本身，打开的fd与映射只受file_cache的项数与驻留预算约束
+    std::string source_etag;
+    //false表示内容不值得压缩，应发送原文
+    bool compressed {false};
+};
+
+/*
+ * 压缩变体缓存，以文件标识(ETag，由inode、大小与修改时间构成)加编码为键，
+ * 文件修改后标识随之改变，旧变体不会再被命中，随LRU淘汰；预压缩文件的标识记录在变体中，
+ * 预压缩文件被替换或删除时同键的变体立即被替换或丢弃。只在worker的事件循环中访问。
+ * 同一个键同时只有一个压缩任务在进行，其他请求在压缩完成前先发送原文。
+ */
+class compressed_cache {
+public:
+    constexpr static size_t default_budget = 32 * 1024 * 1024;
+private:
+    using entry_t = std::shared_ptr<const compressed_variant>;
+    using lru_t = std::list<std::string>;
+    struct slot {
+        entry_t variant;
+        lru_t::iterator lru;
+    };
+    size_t budget_;
+    size_t bytes_ {0};
+    std::unordered_map<std::string, slot> entries_;
+    lru_t lru_;
+    std::unordered_set<std::string> pending_;
+
+    static size_t cost(const compressed_variant& variant) {
+        return variant.head.length() + variant.not_modified.length() + variant.data.length() + variant.source_etag.length();
+    }
+public:
+    explicit compressed_cache(size_t budget = default_budget) : budget_(budget) {}
+    compressed_cache(const compressed_cache&) = delete;
+    compressed_cache& operator=(const compressed_cache&) = delete;
+
+    static std::string key_of(std::string_view etag, content_coding coding) {
+        return std::format("{}:{}", etag, get_content_coding_name(coding));
+    }
+
+    entry_t find(const std::string& key) {
+        auto it = entries_.find(key);
+        if (it == entries_.end()) {
+            return nullptr;
+        }
+        lru_.splice(lru_.begin(), lru_, it->second.lru);
+        return it->second.variant;
+    }
+
+    /* 丢弃一个变体，如预压缩文件被替换或删除后 */
+    void erase(const std::string& key) {
+        auto it = entries_.find(key);
+        if (it == entries_.end()) {
+            return;
+        }
+        bytes_ -= cost(*it->second.variant);
+        lru_.erase(it->second.lru);
+        entries_.erase(it);
+    }
+
+    /* 登记一个进行中的压缩任务，已有同键的任务时返回false */
+    bool begin(const std::string& key) {
+        return pending_.insert(key).second;
+    }
+
+    /* 结束压缩任务并保存结果，超出预算时淘汰最久未使用的变体 */
+    void finish(const std::string& key, entry_t variant) {
+        pending_.erase(key);
+        if (variant == nullptr || cost(*variant) > budget_) {
+            return;
+        }
+        erase(key);
+        bytes_ += cost(*variant);
+        lru_.push_front(key);
+        entries_[key] = { std::move(variant), lru_.begin() };
+        while (bytes_ > budget_) {
+            auto victim = entries_.find(lru_.back());
+            bytes_ -= cost(*victim->second.variant);
+            entries_.erase(victim);
+            lru_.pop_back();
+        }
+    }
+
+    [[nodiscard]] size_t bytes() const {
+        return bytes_;
+    }
+    [[nodiscard]] size_t size() const {
+        return entries_.size();
+    }
+};
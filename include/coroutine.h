@@ -0,0 +1,655 @@
+#pragma once
+
+#include <memory.h>
+#include <io.h>
+
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <vector>
+#include <climits>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+/* 所有task协程的promise公共部分：协程帧通过pooled_allocator分配，结束时通过对称转移恢复等待者。 */
+struct task_promise_base {
+    std::coroutine_handle<> continuation_ {};
+    std::exception_ptr exception_ {};
+    bool detached_ {false};
+
+    static void* operator new(size_t size) {
+        return pooled_allocator::local().allocate(size);
+    }
+    static void operator delete(void* ptr, size_t size) {
+        pooled_allocator::local().deallocate(ptr, size);
+    }
+
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        template<typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            auto& promise = handle.promise();
+            if (promise.detached_) {
+                //分离的任务没有等待者，由自己负责销毁协程帧
+                if (promise.exception_) {
+                    report(promise.exception_);
+                }
+                handle.destroy();
+                return std::noop_coroutine();
+            }
+            if (promise.continuation_) {
+                return promise.continuation_;
+            }
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() {
+        exception_ = std::current_exception();
+    }
+
+    /* 打印分离任务中未被捕获的异常 */
+    static void report(const std::exception_ptr& exception) {
+        try {
+            std::rethrow_exception(exception);
+        } catch (io_exception& e) {
+            e.print();
+        } catch (memory_exception& e) {
+            e.print();
+        } catch (std::exception& e) {
+            std::cout << std::format("uncaught exception in detached task: {}", e.what()) << std::endl;
+        } catch (...) {
+            std::cout << "uncaught unknown exception in detached task" << std::endl;
+        }
+    }
+};
+
+/* 惰性启动的协程任务，co_await时才开始执行，执行结束后返回到等待者。 */
+template<typename T = void>
+class task {
+public:
+    struct promise_type : task_promise_base {
+        std::optional<T> value_;
+        task get_return_object() {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        template<typename U>
+        void return_value(U&& value) {
+            value_.emplace(std::forward<U>(value));
+        }
+    };
+    using handle_t = std::coroutine_handle<promise_type>;
+private:
+    handle_t handle_;
+public:
+    explicit task(handle_t handle) : handle_(handle) {}
+    task(task&& t) noexcept : handle_(std::exchange(t.handle_, {})) {}
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+    ~task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle_.promise().continuation_ = awaiting;
+        return handle_;
+    }
+    T await_resume() {
+        auto& promise = handle_.promise();
+        if (promise.exception_) {
+            std::rethrow_exception(promise.exception_);
+        }
+        return std::move(*promise.value_);
+    }
+
+    /* 分离并立即开始执行任务，任务结束后自行销毁 */
+    void detach() {
+        auto handle = std::exchange(handle_, {});
+        handle.promise().detached_ = true;
+        handle.resume();
+    }
+};
+
+template<>
+class task<void> {
+public:
+    struct promise_type : task_promise_base {
+        task get_return_object() {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        void return_void() {}
+    };
+    using handle_t = std::coroutine_handle<promise_type>;
+private:
+    handle_t handle_;
+public:
+    explicit task(handle_t handle) : handle_(handle) {}
+    task(task&& t) noexcept : handle_(std::exchange(t.handle_, {})) {}
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+    ~task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle_.promise().continuation_ = awaiting;
+        return handle_;
+    }
+    void await_resume() {
+        auto& promise = handle_.promise();
+        if (promise.exception_) {
+            std::rethrow_exception(promise.exception_);
+        }
+    }
+
+    void detach() {
+        auto handle = std::exchange(handle_, {});
+        handle.promise().detached_ = true;
+        handle.resume();
+    }
+};
+
+/*
+ * 基于epoll的协程事件循环。每个fd只以边缘触发方式注册一次，等待者直接挂在以fd为下标的槽位上，
+ * 定时等待者保存在按截止时间排列的最小堆中，因此稳定运行时co_await不会产生堆分配。
+ * 约定：先尝试I/O操作，遇到EAGAIN后再co_await readable()/writable()。
+ */
+class io_loop {
+public:
+    using clock = std::chrono::steady_clock;
+private:
+    struct fd_state {
+        std::coroutine_handle<> reader;
+        std::coroutine_handle<> writer;
+        uint32_t pending;
+        bool registered;
+        stream_cipher* cipher;
+        //挂起的reader/writer所在awaiter的events，forget()时借此让其恢复后看到失败
+        uint32_t* reader_events;
+        uint32_t* writer_events;
+    };
+    struct sleeper {
+        clock::time_point deadline;
+        std::coroutine_handle<> handle;
+        bool operator>(const sleeper& other) const {
+            return deadline > other.deadline;
+        }
+    };
+    constexpr static uint32_t read_events = EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR;
+    constexpr static uint32_t write_events = EPOLLOUT | EPOLLHUP | EPOLLERR;
+
+    int epfd_;
+    std::vector<fd_state> fds_;
+    std::vector<sleeper> sleepers_;
+    std::vector<std::coroutine_handle<>> ready_;
+    std::vector<std::coroutine_handle<>> resuming_;
+    epoll_event events_[1024] {};
+
+    constexpr static size_t cipher_staging_size = 16 * 1024;
+
+    /* 需要在用户态解密/加密时返回fd上的cipher，否则返回nullptr */
+    stream_cipher* reading_cipher(int fd) {
+        auto cipher = state(fd).cipher;
+        return cipher != nullptr && cipher->decrypts_reads() ? cipher : nullptr;
+    }
+    stream_cipher* writing_cipher(int fd) {
+        auto cipher = state(fd).cipher;
+        return cipher != nullptr && cipher->encrypts_writes() ? cipher : nullptr;
+    }
+
+    /*
+     * 加密前的暂存区，相当于一个TLS记录的大小。零散的内存片段先拼接到这里再一次加密，避免每个小片段各成一个记录；
+     * 写出被阻塞时内容不必保留，恢复后从同一位置重新拼接出相同的数据。
+     */
+    static char* cipher_staging() {
+        thread_local char buffer[cipher_staging_size];
+        return buffer;
+    }
+    static size_t gather(const iovec* iov, int count) {
+        auto staging = cipher_staging();
+        size_t length = 0;
+        for (int i = 0; i < count && length < cipher_staging_size; ++i) {
+            auto n = std::min(iov[i].iov_len, cipher_staging_size - length);
+            memcpy(staging + length, iov[i].iov_base, n);
+            length += n;
+        }
+        return length;
+    }
+    /* sendfile的用户态加密版本：读出文件的一段，加密后写出，返回值与sendfile相同 */
+    ssize_t send_file_encrypted(int fd, int file_fd, off_t& offset, size_t count) {
+        auto staging = cipher_staging();
+        auto n = pread(file_fd, staging, std::min(count, cipher_staging_size), offset);
+        if (n <= 0) {
+            return n;
+        }
+        auto r = writing_cipher(fd)->write(staging, n);
+        if (r > 0) {
+            offset += r;
+        }
+        return r;
+    }
+
+    fd_state& state(int fd) {
+        if (static_cast<size_t>(fd) >= fds_.size()) {
+            fds_.resize(std::max(static_cast<size_t>(fd) + 1, fds_.size() * 2));
+        }
+        return fds_[fd];
+    }
+public:
+    io_loop() : epfd_(epoll_create1(EPOLL_CLOEXEC)) {
+        if (epfd_ == -1) {
+            throw io_exception("io_loop::io_loop()", std::format("epoll_create1() failed: {}", strerror(errno)));
+        }
+        fds_.resize(1024);
+    }
+    io_loop(const io_loop&) = delete;
+    io_loop& operator=(const io_loop&) = delete;
+    ~io_loop() {
+        close(epfd_);
+    }
+
+    /* 将fd加入epoll集合(重复调用无副作用) */
+    void watch(int fd) {
+        auto& st = state(fd);
+        if (st.registered) {
+            return;
+        }
+        epoll_event ev {};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            throw io_exception("io_loop::watch()", std::format("epoll_ctl() failed on fd {}: {}", fd, strerror(errno)));
+        }
+        st = { .registered = true, .cipher = st.cipher };
+    }
+
+    /* 之后该fd上的读写经由cipher进行(cipher的生命周期由调用者保证)，forget()时解除 */
+    void attach_cipher(int fd, stream_cipher* cipher) {
+        state(fd).cipher = cipher;
+    }
+    /* 写入fd的数据是否需要在用户态加密，此时不能用sendfile或splice直接写套接字 */
+    bool encrypts_writes(int fd) {
+        auto cipher = state(fd).cipher;
+        return cipher != nullptr && cipher->encrypts_writes();
+    }
+
+    /*
+     * 将fd移出epoll集合，关闭fd之前必须调用。
+     * 仍在该fd上等待的协程会在本轮循环末尾以EPOLLHUP|EPOLLERR恢复，随后的读写因fd已关闭而失败，不会永远挂起。
+     */
+    void forget(int fd) {
+        auto& st = state(fd);
+        if (st.registered) {
+            epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+        }
+        if (st.reader) {
+            *st.reader_events = EPOLLHUP | EPOLLERR;
+            ready_.push_back(st.reader);
+        }
+        if (st.writer) {
+            *st.writer_events = EPOLLHUP | EPOLLERR;
+            ready_.push_back(st.writer);
+        }
+        st = {};
+    }
+
+    struct fd_awaiter {
+        io_loop& loop;
+        int fd;
+        uint32_t interest;
+        uint32_t events {0};
+        bool await_ready() {
+            loop.watch(fd);
+            auto& st = loop.state(fd);
+            if (st.pending & interest) {
+                events = st.pending;
+                st.pending &= ~interest;
+                return true;
+            }
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> handle) {
+            auto& st = loop.state(fd);
+            if (interest & EPOLLIN) {
+                st.reader = handle;
+                st.reader_events = &events;
+            } else {
+                st.writer = handle;
+                st.writer_events = &events;
+            }
+        }
+        uint32_t await_resume() {
+            if (events == 0) {
+                auto& st = loop.state(fd);
+                events = st.pending;
+                st.pending &= ~interest;
+            }
+            return events;
+        }
+    };
+
+    struct sleep_awaiter {
+        io_loop& loop;
+        clock::time_point deadline;
+        bool await_ready() const {
+            return deadline <= clock::now();
+        }
+        void await_suspend(std::coroutine_handle<> handle) {
+            loop.sleepers_.push_back({ deadline, handle });
+            std::push_heap(loop.sleepers_.begin(), loop.sleepers_.end(), std::greater<>());
+        }
+        void await_resume() const {}
+    };
+
+    /* 让出执行权，在本轮循环末尾重新恢复 */
+    struct yield_awaiter {
+        io_loop& loop;
+        bool await_ready() const { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            loop.ready_.push_back(handle);
+        }
+        void await_resume() const {}
+    };
+
+    /* 等待fd可读，返回触发的epoll事件 */
+    fd_awaiter readable(int fd) {
+        return { *this, fd, read_events };
+    }
+    /* 等待fd可写，返回触发的epoll事件 */
+    fd_awaiter writable(int fd) {
+        return { *this, fd, write_events };
+    }
+    template<typename Rep, typename Period>
+    sleep_awaiter sleep_for(std::chrono::duration<Rep, Period> duration) {
+        return { *this, clock::now() + std::chrono::duration_cast<clock::duration>(duration) };
+    }
+    sleep_awaiter sleep_until(clock::time_point deadline) {
+        return { *this, deadline };
+    }
+    yield_awaiter yield() {
+        return { *this };
+    }
+    /* 在本轮循环末尾恢复一个挂起的协程 */
+    void post(std::coroutine_handle<> handle) {
+        ready_.push_back(handle);
+    }
+
+    /* 发起非阻塞连接，返回已连接的非阻塞fd，失败时返回-1 */
+    task<int> connect(const sockaddr* addr, socklen_t len) {
+        int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            co_return -1;
+        }
+        if (::connect(fd, addr, len) == 0) {
+            co_return fd;
+        }
+        if (errno != EINPROGRESS) {
+            close(fd);
+            co_return -1;
+        }
+        co_await writable(fd);
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1 || error != 0) {
+            forget(fd);
+            close(fd);
+            errno = error;
+            co_return -1;
+        }
+        co_return fd;
+    }
+
+    /* 接受一个新连接，返回非阻塞的客户端fd，监听套接字出错时返回-1 */
+    task<int> accept(int listenfd) {
+        while (true) {
+            int clifd = accept4(listenfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (clifd != -1) {
+                co_return clifd;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                co_await readable(listenfd);
+                continue;
+            }
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) {
+                if (errno == EMFILE || errno == ENFILE) {
+                    co_await sleep_for(std::chrono::milliseconds(10));
+                }
+                continue;
+            }
+            co_return -1;
+        }
+    }
+
+    /* 读取至少1个字节，返回读取的字节数，对端关闭返回0，出错返回-1 */
+    task<ssize_t> recv_some(int fd, char* buf, size_t size) {
+        while (true) {
+            auto cipher = reading_cipher(fd);
+            auto r = cipher != nullptr ? cipher->read(buf, size) : ::recv(fd, buf, size, 0);
+            if (r >= 0) {
+                co_return r;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                co_await readable(fd);
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            co_return -1;
+        }
+    }
+
+    /* 不等待地读取当前可读的数据到接收缓冲中，返回值与receive_buffer::read_from()相同 */
+    std::expected<size_t, io_error> try_recv_into(int fd, receive_buffer& buffer) {
+        auto cipher = reading_cipher(fd);
+        return cipher != nullptr ? buffer.read_from(*cipher) : buffer.read_from(fd);
+    }
+
+    /* 读取到接收缓冲中，返回读取的字节数，对端关闭返回0，连接被重置返回-1 */
+    task<ssize_t> recv_into(int fd, receive_buffer& buffer) {
+        while (true) {
+            auto r = try_recv_into(fd, buffer);
+            if (r) {
+                co_return static_cast<ssize_t>(*r);
+            }
+            if (r.error() == io_error::again) {
+                co_await readable(fd);
+                continue;
+            }
+            co_return r.error() == io_error::eof ? 0 : -1;
+        }
+    }
+
+    /* 写出全部数据，失败时返回false */
+    task<bool> send_all(int fd, const char* buf, size_t size) {
+        while (size > 0) {
+            auto cipher = writing_cipher(fd);
+            auto r = cipher != nullptr ? cipher->write(buf, size) : ::send(fd, buf, size, MSG_NOSIGNAL);
+            if (r >= 0) {
+                buf += r;
+                size -= r;
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                co_await writable(fd);
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            co_return false;
+        }
+        co_return true;
+    }
+
+    /* 用sendfile写出文件中[offset, offset + count)的内容，文件在发送途中变短或发送失败时返回false */
+    task<bool> send_file(int fd, int file_fd, off_t offset, size_t count) {
+        while (count > 0) {
+            auto r = writing_cipher(fd) != nullptr ? send_file_encrypted(fd, file_fd, offset, count) : ::sendfile(fd, file_fd, &offset, count);
+            if (r > 0) {
+                count -= r;
+                continue;
+            }
+            if (r == 0) {
+                co_return false;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                co_await writable(fd);
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            co_return false;
+        }
+        co_return true;
+    }
+
+    /* 用writev写出队列中的全部片段(文件片段用sendfile)并清空队列，失败时返回false */
+    task<bool> send_queue(int fd, output_queue& queue) {
+        auto& iov = queue.iov();
+        auto& files = queue.files();
+        size_t first = 0;
+        size_t next_file = 0;
+        while (first < iov.size() || next_file < files.size()) {
+            //先发送位于当前位置的文件片段
+            if (next_file < files.size() && files[next_file].position == first) {
+                auto& file = files[next_file++];
+                //GCC 12会错误地编译成员协程中的if (!co_await ...)，先把结果存进局部变量
+                bool sent = co_await send_file(fd, file.fd, file.offset, file.count);
+                if (!sent) {
+                    queue.clear();
+                    co_return false;
+                }
+                continue;
+            }
+            auto limit = next_file < files.size() ? files[next_file].position : iov.size();
+            auto count = static_cast<int>(std::min<size_t>(limit - first, IOV_MAX));
+            ssize_t r;
+            if (auto cipher = writing_cipher(fd)) {
+                r = cipher->write(cipher_staging(), gather(iov.data() + first, count));
+            } else {
+                msghdr msg {};
+                msg.msg_iov = iov.data() + first;
+                msg.msg_iovlen = count;
+                //后面紧跟文件片段时提示内核还有数据，让响应头与文件内容合并成满载的报文
+                r = ::sendmsg(fd, &msg, MSG_NOSIGNAL | (next_file < files.size() ? MSG_MORE : 0));
+            }
+            if (r < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    co_await writable(fd);
+                    continue;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                queue.clear();
+                co_return false;
+            }
+            //跳过已写完的片段，部分写出的片段前移起点
+            auto left = static_cast<size_t>(r);
+            while (first < iov.size() && left >= iov[first].iov_len) {
+                left -= iov[first].iov_len;
+                ++first;
+            }
+            if (left > 0) {
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + left;
+                iov[first].iov_len -= left;
+            }
+        }
+        queue.clear();
+        co_return true;
+    }
+
+    /* 分离执行一个任务 */
+    void spawn(task<void>&& t) {
+        t.detach();
+    }
+
+    /* 执行一轮事件循环，最多等待timeout_ms毫秒(若有更早到期的定时等待者则提前返回)，返回处理的epoll事件数 */
+    int run_once(int timeout_ms) {
+        if (!ready_.empty()) {
+            timeout_ms = 0;
+        } else if (!sleepers_.empty()) {
+            auto wait = std::chrono::ceil<std::chrono::milliseconds>(sleepers_.front().deadline - clock::now()).count();
+            timeout_ms = static_cast<int>(std::clamp<int64_t>(wait, 0, timeout_ms));
+        }
+        int r = epoll_wait(epfd_, events_, std::size(events_), timeout_ms);
+        if (r < 0) {
+            if (errno != EINTR) {
+                throw io_exception("io_loop::run_once()", std::format("epoll_wait() failed: {}", strerror(errno)));
+            }
+            r = 0;
+        }
+        resuming_.swap(ready_);
+        for (int i = 0; i < r; ++i) {
+            auto& st = state(events_[i].data.fd);
+            if (!st.registered) {
+                continue;
+            }
+            st.pending |= events_[i].events;
+            if ((st.pending & read_events) && st.reader) {
+                resuming_.push_back(std::exchange(st.reader, {}));
+            }
+            if ((st.pending & write_events) && st.writer) {
+                resuming_.push_back(std::exchange(st.writer, {}));
+            }
+        }
+        auto now = clock::now();
+        while (!sleepers_.empty() && sleepers_.front().deadline <= now) {
+            std::pop_heap(sleepers_.begin(), sleepers_.end(), std::greater<>());
+            resuming_.push_back(sleepers_.back().handle);
+            sleepers_.pop_back();
+        }
+        for (auto& handle : resuming_) {
+            handle.resume();
+        }
+        resuming_.clear();
+        return r;
+    }
+};
+
+/*
+ * 单个等待者的通知：wait()挂起当前协程直到notify()。等待者在本轮循环末尾恢复而不是在notify()中直接恢复，
+ * 通知者因此可以在notify()之后继续运行。没有等待者时通知被丢弃，等待者应在循环中检查自己等待的条件。
+ */
+class loop_notification {
+private:
+    io_loop& loop_;
+    std::coroutine_handle<> waiter_;
+public:
+    explicit loop_notification(io_loop& loop) : loop_(loop) {}
+    loop_notification(const loop_notification&) = delete;
+    loop_notification& operator=(const loop_notification&) = delete;
+
+    struct awaiter {
+        loop_notification& notification;
+        bool await_ready() const { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            notification.waiter_ = handle;
+        }
+        void await_resume() const {}
+    };
+
+    awaiter wait() {
+        return { *this };
+    }
+    void notify() {
+        if (waiter_) {
+            loop_.post(std::exchange(waiter_, {}));
+        }
+    }
+};
@@ -2,8 +2,11 @@
 
 #include <memory.h>
 
+#include <chrono>
 #include <functional>
 #include <map>
+#include <mutex>
+#include <sys/eventfd.h>
 
 #include "io.h"
 
@@ -24,9 +27,41 @@ private:
         evcallback_t callback_function;
         cbid_t callback_id;
     };
+    using remote_event_t = struct {
+        evid_t ueid;
+        general_shared_array_buffer_t buffer;
+    };
     std::map<evid_t, std::vector<evhandler_t>> evhandlers_;
     int cbid_count_ {0};
+    int notify_fd_ {-1};
+    std::mutex remote_mtx_;
+    std::vector<remote_event_t> remote_events_;
+    std::vector<remote_event_t> dispatching_;
+
+    void dispatch(evid_t ueid, const general_shared_array_buffer_t& buffer) {
+        metrics_count(counter_id::events_posted);
+        auto it = evhandlers_.find(ueid);
+        if (it == evhandlers_.end()) {
+            return;
+        }
+        auto begin = std::chrono::steady_clock::now();
+        for (auto& handler : it->second) {
+            handler.callback_function(general_shared_array_buffer_t(buffer));
+        }
+        metrics_count(counter_id::event_handlers_invoked, it->second.size());
+        auto spent = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin);
+        metrics_record(histogram_id::event_dispatch_ns, spent.count());
+    }
 public:
+    event_channel() = default;
+    event_channel(const event_channel&) = delete;
+    event_channel& operator=(const event_channel&) = delete;
+    ~event_channel() {
+        if (notify_fd_ != -1) {
+            close(notify_fd_);
+        }
+    }
+
     template<typename E>
     requires is_event<E>
     /* 订阅特定事件，返回event_handler对应的事件处理器句柄，一旦事件总线收到事件则立刻调用event_handler。*/
@@ -72,38 +107,126 @@ public:
     void post(E event) {
         constexpr int ueid = E::unique_event_id;
         general_shared_array_buffer_t buffer(event.content());
-        if (evhandlers_.contains(ueid)) {
-            for (auto& handler : evhandlers_[ueid]) {
-                handler.callback_function(general_shared_array_buffer_t(buffer));
+        dispatch(ueid, buffer);
+    }
+
+    /* 返回跨线程投递所使用的eventfd，事件总线所属的循环应监听该fd可读并调用dispatch_remote() */
+    int notify_fd() {
+        std::lock_guard lock(remote_mtx_);
+        if (notify_fd_ == -1) {
+            notify_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (notify_fd_ == -1) {
+                throw io_exception("event_channel::notify_fd()", std::format("eventfd() failed: {}", strerror(errno)));
             }
         }
+        return notify_fd_;
+    }
+
+    /* 从其他线程投递事件，事件会在所属线程下一次调用dispatch_remote()时分发，可以在任意线程调用 */
+    template<typename E>
+    requires is_event<E>
+    void post_remote(E event) {
+        constexpr int ueid = E::unique_event_id;
+        int fd = notify_fd();
+        bool wake;
+        {
+            std::lock_guard lock(remote_mtx_);
+            wake = remote_events_.empty();
+            remote_events_.push_back({ ueid, event.content() });
+        }
+        if (wake) {
+            uint64_t one = 1;
+            while (::write(fd, &one, sizeof(one)) == -1 && errno == EINTR) {}
+        }
+    }
+
+    /* 在所属线程内分发所有跨线程投递的事件 */
+    void dispatch_remote() {
+        if (notify_fd_ != -1) {
+            uint64_t count;
+            while (::read(notify_fd_, &count, sizeof(count)) == -1 && errno == EINTR) {}
+        }
+        {
+            std::lock_guard lock(remote_mtx_);
+            dispatching_.swap(remote_events_);
+        }
+        for (auto& event : dispatching_) {
+            dispatch(event.ueid, event.buffer);
+        }
+        dispatching_.clear();
     }
 };
 
+/* reactor与worker之间事件总线所使用的Unix域套接字路径 */
+constexpr static std::string_view reactor_unsock_path = "/tmp/tinyhttp_reactor_unsock";
+/* 对端连接reactor后发送的第一个字节，用于区分worker与热升级的新reactor */
+constexpr static char peer_worker = 'w';
+constexpr static char peer_upgrade = 'u';
+/*
+ * reactor发给worker的命令字节，command_connection随附一个客户端fd，command_connection_traced表示该连接被采样追踪，
+ * command_connection_tls(_traced)表示连接来自TLS端口，worker先完成TLS握手
+ */
+constexpr static char command_connection = 'c';
+constexpr static char command_connection_traced = 'C';
+constexpr static char command_connection_tls = 's';
+constexpr static char command_connection_tls_traced = 'S';
+constexpr static char command_drain = 'd';
+/*
+ * 热升级握手：旧reactor随upgrade_listener交出监听套接字，随后随upgrade_tls_listener交出TLS监听套接字
+ * (未启用TLS时只发送该字节，不带fd)，新reactor就绪后回复upgrade_ready
+ */
+constexpr static char upgrade_listener = 'l';
+constexpr static char upgrade_tls_listener = 't';
+constexpr static char upgrade_ready = 'r';
+
 struct event_packet_header {
     int ueid;
     size_t size;
 };
 
+/*
+ * 把事件写入跨进程的套接字，对端已关闭时返回io_error::reset，非阻塞套接字暂时写不进时返回io_error::again(什么也没有写出)。
+ * 包头一旦写出就等待写完内容，保持包的边界
+ */
 template<typename E>
 requires is_event<E>
-inline void send_packet(int fd, const E& ev) {
+inline std::expected<void, io_error> try_send_packet(int fd, const E& ev) {
     general_shared_array_buffer_t content = ev.content();
     event_packet_header hdr {
         .ueid = E::unique_event_id,
         .size = content.capacity()
     };
-    try {
-        writefd(fd, reinterpret_cast<char*>(&hdr), sizeof(hdr));
-        writefd(fd, content.pointer(), content.capacity());
-    } catch (io_exception&) {
-        throw;
+    auto r = try_writefd(fd, reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+    if (!r) {
+        return r;
     }
+    while (!(r = try_writefd(fd, content.pointer(), content.capacity())) && r.error() == io_error::again) {
+        wait_writable(fd);
+    }
+    return r;
 }
 
-inline auto recv_packet(int fd) {
+template<typename E>
+requires is_event<E>
+inline void send_packet(int fd, const E& ev) {
+    auto r = try_send_packet(fd, ev);
+    while (!r && r.error() == io_error::again) {
+        wait_writable(fd);
+        r = try_send_packet(fd, ev);
+    }
+    if (!r) {
+        throw io_exception("send_packet()", std::format("cannot send event {} through {}: {}", E::unique_event_id, fd, get_io_error_name(r.error())), no_stack_trace);
+    }
+}
+
+/* 从套接字读出一个事件，返回(事件编号, 内容)，对端关闭时返回io_error::eof */
+inline std::expected<std::tuple<int, general_shared_array_buffer_t>, io_error> try_recv_packet(int fd) {
     nonblocking_socket_stream nbs(fd);
-    general_array_buffer_t buffer = nbs.read();
+    auto received = nbs.try_read();
+    if (!received) {
+        return std::unexpected(received.error());
+    }
+    general_array_buffer_t& buffer = *received;
     try {
         buffer_stream stream(buffer);
         auto evid = stream.get_as<int>();
@@ -116,4 +239,12 @@ inline auto recv_packet(int fd) {
         e.print();
         throw memory_exception("recv_packet()", "cannot read packet array buffer");
     }
-}
\ No newline at end of file
+}
+
+inline auto recv_packet(int fd) {
+    auto r = try_recv_packet(fd);
+    if (!r) {
+        throw io_exception("recv_packet()", std::string(get_io_error_name(r.error())), no_stack_trace);
+    }
+    return std::move(*r);
+}
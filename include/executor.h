@@ -0,0 +1,331 @@
+#pragma once
+
+#include <memory.h>
+#include <evchannel.h>
+#include <coroutine.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <random>
+#include <thread>
+#include <type_traits>
+#include <variant>
+
+/*
+ * Chase-Lev工作窃取双端队列。只有所有者线程可以push()/pop()(操作底部)，其他线程通过steal()从顶部窃取。
+ * 环形数组写满时按两倍扩容，旧数组保留到队列析构时再释放，避免窃取者读到已释放的内存。
+ */
+template<typename T>
+requires std::is_trivially_copyable_v<T>
+class chase_lev_deque {
+private:
+    struct ring {
+        int64_t capacity;
+        std::unique_ptr<std::atomic<T>[]> slots;
+        explicit ring(int64_t cap) : capacity(cap), slots(new std::atomic<T>[cap]) {}
+        T get(int64_t i) const {
+            return slots[i & (capacity - 1)].load(std::memory_order_relaxed);
+        }
+        void put(int64_t i, T item) {
+            slots[i & (capacity - 1)].store(item, std::memory_order_relaxed);
+        }
+    };
+    alignas(64) std::atomic<int64_t> top_ {0};
+    alignas(64) std::atomic<int64_t> bottom_ {0};
+    alignas(64) std::atomic<ring*> ring_;
+    std::vector<std::unique_ptr<ring>> rings_;
+public:
+    explicit chase_lev_deque(int64_t capacity = 256) {
+        rings_.push_back(std::make_unique<ring>(capacity));
+        ring_.store(rings_.back().get(), std::memory_order_relaxed);
+    }
+    chase_lev_deque(const chase_lev_deque&) = delete;
+    chase_lev_deque& operator=(const chase_lev_deque&) = delete;
+
+    /* 所有者线程压入底部 */
+    void push(T item) {
+        auto b = bottom_.load(std::memory_order_relaxed);
+        auto t = top_.load(std::memory_order_acquire);
+        auto a = ring_.load(std::memory_order_relaxed);
+        if (b - t > a->capacity - 1) {
+            rings_.push_back(std::make_unique<ring>(a->capacity * 2));
+            auto grown = rings_.back().get();
+            for (auto i = t; i < b; ++i) {
+                grown->put(i, a->get(i));
+            }
+            ring_.store(grown, std::memory_order_release);
+            a = grown;
+        }
+        a->put(b, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+
+    /* 所有者线程从底部弹出 */
+    std::optional<T> pop() {
+        auto b = bottom_.load(std::memory_order_relaxed) - 1;
+        auto a = ring_.load(std::memory_order_relaxed);
+        bottom_.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto t = top_.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return std::nullopt;
+        }
+        T item = a->get(b);
+        if (t == b) {
+            //只剩最后一个元素，与窃取者竞争
+            bool won = top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            if (!won) {
+                return std::nullopt;
+            }
+        }
+        return item;
+    }
+
+    /* 任意线程从顶部窃取 */
+    std::optional<T> steal() {
+        auto t = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto b = bottom_.load(std::memory_order_acquire);
+        if (t >= b) {
+            return std::nullopt;
+        }
+        auto a = ring_.load(std::memory_order_acquire);
+        T item = a->get(t);
+        if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return std::nullopt;
+        }
+        return item;
+    }
+
+    [[nodiscard]] bool empty() const {
+        return bottom_.load(std::memory_order_relaxed) <= top_.load(std::memory_order_relaxed);
+    }
+};
+
+/* 计算任务完成事件，携带一个在所属线程上执行的回调 */
+class completion_event {
+private:
+    general_shared_array_buffer_t buffer_;
+    std::function<void()>* callback_;
+public:
+    constexpr static int unique_event_id = 3;
+    explicit completion_event(std::function<void()>* callback) : buffer_(sizeof(callback), new heap_allocator()), callback_(callback) {
+        buffer_stream stream(buffer_);
+        stream.append(reinterpret_cast<uintptr_t>(callback_));
+    }
+    explicit completion_event(general_shared_array_buffer_t buffer) : buffer_(std::move(buffer)) {
+        buffer_stream stream(buffer_);
+        callback_ = reinterpret_cast<std::function<void()>*>(stream.get_as<uintptr_t>());
+    }
+    [[nodiscard]] general_shared_array_buffer_t content() const {return buffer_;}
+    /* 执行并释放回调，每个事件只能调用一次 */
+    void complete() const {
+        (*callback_)();
+        delete callback_;
+    }
+};
+
+/*
+ * 工作窃取线程池，用于把压缩、模板渲染等CPU密集型工作移出事件循环。
+ * 每个线程拥有一个Chase-Lev队列，池内线程提交的任务压入自己的队列，外部线程提交的任务进入注入队列，
+ * 空闲线程依次尝试自己的队列、注入队列以及随机窃取其他线程的队列。
+ * 任务完成后通过事件总线的post_remote()把回调送回提交者所属的事件循环。
+ */
+class work_stealing_executor {
+private:
+    using job_t = std::function<void()>;
+    struct worker_slot {
+        chase_lev_deque<job_t*> deque;
+    };
+    std::vector<std::unique_ptr<worker_slot>> slots_;
+    std::vector<std::thread> threads_;
+    std::mutex inject_mtx_;
+    std::deque<job_t*> injected_;
+    std::mutex park_mtx_;
+    std::condition_variable park_cv_;
+    std::atomic<int> sleeping_ {0};
+    std::atomic<bool> stopping_ {false};
+    inline static thread_local work_stealing_executor* current_ {nullptr};
+    inline static thread_local size_t current_index_ {0};
+
+    job_t* find_job(size_t index, std::minstd_rand& rng) {
+        if (auto job = slots_[index]->deque.pop()) {
+            return *job;
+        }
+        {
+            std::lock_guard lock(inject_mtx_);
+            if (!injected_.empty()) {
+                auto job = injected_.front();
+                injected_.pop_front();
+                return job;
+            }
+        }
+        auto n = slots_.size();
+        auto start = rng() % n;
+        for (size_t i = 0; i < n; ++i) {
+            auto victim = (start + i) % n;
+            if (victim == index) {
+                continue;
+            }
+            if (auto job = slots_[victim]->deque.steal()) {
+                return *job;
+            }
+        }
+        return nullptr;
+    }
+
+    void run_worker(size_t index) {
+        current_ = this;
+        current_index_ = index;
+        std::minstd_rand rng(index + 1);
+        while (true) {
+            job_t* job = nullptr;
+            for (int spin = 0; spin < 64 && job == nullptr; ++spin) {
+                job = find_job(index, rng);
+                if (job == nullptr && stopping_.load(std::memory_order_acquire)) {
+                    return;
+                }
+            }
+            if (job == nullptr) {
+                //先登记为休眠再检查一次队列：提交者放入任务之后才检查sleeping_，两者至少有一方能看到对方，不会错过唤醒
+                std::unique_lock lock(park_mtx_);
+                sleeping_.fetch_add(1, std::memory_order_seq_cst);
+                job = find_job(index, rng);
+                if (job == nullptr && !stopping_.load(std::memory_order_acquire)) {
+                    park_cv_.wait(lock);
+                }
+                sleeping_.fetch_sub(1, std::memory_order_seq_cst);
+                if (job == nullptr) {
+                    continue;
+                }
+            }
+            (*job)();
+            delete job;
+        }
+    }
+
+    /* 任务入队之后调用。休眠的线程在park_mtx_下登记并等待，持有同一把锁通知保证通知不会落在登记与等待之间 */
+    void wake_one() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping_.load(std::memory_order_seq_cst) > 0) {
+            std::lock_guard lock(park_mtx_);
+            park_cv_.notify_one();
+        }
+    }
+public:
+    explicit work_stealing_executor(size_t threads = std::max(1u, std::thread::hardware_concurrency())) {
+        for (size_t i = 0; i < threads; ++i) {
+            slots_.push_back(std::make_unique<worker_slot>());
+        }
+        for (size_t i = 0; i < threads; ++i) {
+            threads_.emplace_back([this, i]() {
+                run_worker(i);
+            });
+        }
+    }
+    work_stealing_executor(const work_stealing_executor&) = delete;
+    work_stealing_executor& operator=(const work_stealing_executor&) = delete;
+    ~work_stealing_executor() {
+        {
+            std::lock_guard lock(park_mtx_);
+            stopping_.store(true, std::memory_order_release);
+        }
+        park_cv_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+        for (auto& slot : slots_) {
+            while (auto job = slot->deque.pop()) {
+                delete *job;
+            }
+        }
+        for (auto job : injected_) {
+            delete job;
+        }
+    }
+
+    /* 提交一个任务，不关心完成通知 */
+    void submit(job_t&& work) {
+        auto job = new job_t(std::move(work));
+        if (current_ == this) {
+            slots_[current_index_]->deque.push(job);
+        } else {
+            std::lock_guard lock(inject_mtx_);
+            injected_.push_back(job);
+        }
+        wake_one();
+    }
+
+    /* 提交一个任务，完成后在owner所属的线程上执行on_complete */
+    void submit(event_channel& owner, job_t&& work, job_t&& on_complete) {
+        auto callback = new job_t(std::move(on_complete));
+        submit([&owner, work = std::move(work), callback]() {
+            work();
+            owner.post_remote(completion_event(callback));
+        });
+    }
+
+    /* 在线程池中执行fn并在owner所属的事件循环中恢复协程，co_await的结果为fn的返回值 */
+    template<typename F>
+    auto offload(event_channel& owner, F&& fn) {
+        using result_t = std::invoke_result_t<F>;
+        using storage_t = std::conditional_t<std::is_void_v<result_t>, std::monostate, result_t>;
+        struct awaiter {
+            work_stealing_executor& executor;
+            event_channel& owner;
+            std::decay_t<F> fn;
+            std::optional<storage_t> result {};
+            std::exception_ptr error {};
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle) {
+                executor.submit(owner, [this]() {
+                    try {
+                        if constexpr (std::is_void_v<result_t>) {
+                            fn();
+                            result.emplace();
+                        } else {
+                            result.emplace(fn());
+                        }
+                    } catch (...) {
+                        error = std::current_exception();
+                    }
+                }, [handle]() {
+                    handle.resume();
+                });
+            }
+            result_t await_resume() {
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+                if constexpr (!std::is_void_v<result_t>) {
+                    return std::move(*result);
+                }
+            }
+        };
+        return awaiter { *this, owner, std::forward<F>(fn) };
+    }
+
+    [[nodiscard]] size_t size() const {
+        return threads_.size();
+    }
+};
+
+/* 让事件循环执行通过post_remote()送回的完成回调，每个使用offload()的循环都需要运行该任务 */
+inline task<> drain_completions(io_loop& loop, event_channel& channel) {
+    channel.subscribe<completion_event>([](completion_event e) {
+        e.complete();
+    });
+    int fd = channel.notify_fd();
+    while (true) {
+        co_await loop.readable(fd);
+        channel.dispatch_remote();
+    }
+}
@@ -0,0 +1,334 @@
+#pragma once
+
+#include <memory.h>
+#include <io.h>
+#include <http.h>
+
+#include <ctime>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* 按扩展名推断Content-Type */
+inline std::string_view get_content_type(std::string_view path) {
+    auto dot = path.rfind('.');
+    auto ext = dot == std::string_view::npos ? std::string_view() : path.substr(dot + 1);
+    if (ext == "html" || ext == "htm") return "text/html; charset=utf-8";
+    if (ext == "css") return "text/css; charset=utf-8";
+    if (ext == "js" || ext == "mjs") return "text/javascript; charset=utf-8";
+    if (ext == "json") return "application/json";
+    if (ext == "txt") return "text/plain; charset=utf-8";
+    if (ext == "xml") return "application/xml";
+    if (ext == "svg") return "image/svg+xml";
+    if (ext == "png") return "image/png";
+    if (ext == "jpg" || ext == "jpeg") return "image/jpeg";
+    if (ext == "gif") return "image/gif";
+    if (ext == "webp") return "image/webp";
+    if (ext == "ico") return "image/x-icon";
+    if (ext == "woff2") return "font/woff2";
+    if (ext == "wasm") return "application/wasm";
+    if (ext == "pdf") return "application/pdf";
+    return "application/octet-stream";
+}
+
+//小于该大小的文件压缩收益抵不过额外的首部
+constexpr static size_t min_compressible_size = 256;
+
+/* 该类型的内容是否值得压缩(文本类内容)，已压缩的图片、字体与归档文件不再压缩 */
+inline bool is_compressible_type(std::string_view content_type) {
+    return content_type.starts_with("text/") || content_type.starts_with("application/json") ||
+           content_type.starts_with("application/xml") || content_type.starts_with("image/svg+xml") ||
+           content_type.starts_with("application/wasm");
+}
+
+/* 格式化为HTTP日期(RFC 9110 IMF-fixdate) */
+inline std::string format_http_date(time_t t) {
+    tm parts {};
+    gmtime_r(&t, &parts);
+    char buf[64];
+    auto n = strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &parts);
+    return { buf, n };
+}
+
+/* 304响应头(不含Connection行与结尾空行)，只带校验信息与Vary */
+inline std::string make_not_modified_head(std::string_view etag, std::string_view last_modified, bool vary) {
+    return std::format("HTTP/1.1 304 Not Modified\r\nLast-Modified: {}\r\nETag: {}\r\n{}",
+                       last_modified, etag, vary ? "Vary: Accept-Encoding\r\n" : "");
+}
+
+/*
+ * 文档根目录中的一个文件。小文件整体映射到内存，大文件保持打开的fd供sendfile使用；
+ * 两种情况下200响应的响应头(含Content-Length/Last-Modified/ETag)都在打开时预先生成。
+ */
+class static_file {
+public:
+    std::string path;
+    int fd {-1};
+    //小文件的映射，大文件为nullptr
+    char* data {nullptr};
+    size_t size {0};
+    time_t mtime {0};
+    std::string etag;
+    std::string last_modified;
+    std::string content_type;
+    //可以协商Content-Encoding，此时响应头带有Vary: Accept-Encoding
+    bool compressible {false};
+    //不含Connection行与结尾空行的响应头
+    std::string head;
+    //同样不含Connection行的304响应头
+    std::string not_modified;
+
+    static_file() = default;
+    static_file(const static_file&) = delete;
+    static_file& operator=(const static_file&) = delete;
+    ~static_file() {
+        if (data != nullptr) {
+            munmap(data, size);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    [[nodiscard]] bool mapped() const {
+        return data != nullptr;
+    }
+    [[nodiscard]] std::string_view content() const {
+        return { data, size };
+    }
+};
+
+/*
+ * 静态文件缓存。命中的小文件只需一次writev(预先生成的响应头 + 映射的文件内容)，
+ * 大文件的命中也省去了open与stat，只剩响应头的写出与一次sendfile。
+ * 缓存项所在的目录注册在inotify中，inotify的fd加入worker的事件循环，文件被修改、替换或删除时立即失效。
+ * 映射的总字节数受resident_budget约束，超出时按LRU淘汰；项数受max_entries约束(同时限制了打开的fd数)。
+ */
+class file_cache {
+public:
+    //不超过该大小的文件映射到内存，更大的文件使用sendfile
+    constexpr static size_t small_file_limit = 256 * 1024;
+    constexpr static size_t default_resident_budget = 64 * 1024 * 1024;
+    constexpr static size_t max_entries = 4096;
+private:
+    using entry_t = std::shared_ptr<static_file>;
+    using lru_t = std::list<std::string>;
+    struct slot {
+        //nullptr表示文件不存在(负缓存)，目录中出现同名文件时随inotify事件失效
+        entry_t file;
+        lru_t::iterator lru;
+    };
+    std::string docroot_;
+    size_t resident_budget_;
+    size_t resident_ {0};
+    int notify_fd_ {-1};
+    std::unordered_map<std::string, slot> entries_;
+    lru_t lru_;
+    //inotify监视描述符 -> 目录(以'/'结尾)
+    std::unordered_map<int, std::string> watches_;
+    std::unordered_map<std::string, int> watched_dirs_;
+    std::string scratch_;
+
+    void erase(std::unordered_map<std::string, slot>::iterator it) {
+        if (it->second.file != nullptr && it->second.file->mapped()) {
+            resident_ -= it->second.file->size;
+        }
+        lru_.erase(it->second.lru);
+        entries_.erase(it);
+    }
+
+    void watch_directory(const std::string& dir) {
+        if (notify_fd_ == -1 || watched_dirs_.contains(dir)) {
+            return;
+        }
+        int wd = inotify_add_watch(notify_fd_, dir.c_str(),
+                                   IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF);
+        if (wd == -1) {
+            return;
+        }
+        watches_[wd] = dir;
+        watched_dirs_[dir] = wd;
+    }
+
+    /* 打开并登记一个文件，失败时返回nullptr */
+    entry_t load(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd == -1) {
+            return nullptr;
+        }
+        struct stat st {};
+        if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+            close(fd);
+            return nullptr;
+        }
+        auto file = std::make_shared<static_file>();
+        file->path = path;
+        file->fd = fd;
+        file->size = static_cast<size_t>(st.st_size);
+        file->mtime = st.st_mtim.tv_sec;
+        file->etag = std::format("\"{:x}-{:x}-{:x}\"", st.st_ino, st.st_size,
+                                 static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ull + st.st_mtim.tv_nsec);
+        file->last_modified = format_http_date(st.st_mtim.tv_sec);
+        file->content_type = get_content_type(path);
+        file->compressible = file->size >= min_compressible_size && is_compressible_type(file->content_type);
+        file->head = std::format("HTTP/1.1 200 OK\r\nContent-Type: {}\r\nContent-Length: {}\r\nLast-Modified: {}\r\nETag: {}\r\nAccept-Ranges: bytes\r\n{}",
+                                 file->content_type, file->size, file->last_modified, file->etag,
+                                 file->compressible ? "Vary: Accept-Encoding\r\n" : "");
+        file->not_modified = make_not_modified_head(file->etag, file->last_modified, file->compressible);
+        if (file->size > 0 && file->size <= small_file_limit && resident_budget_ > 0) {
+            void* ptr = mmap(nullptr, file->size, PROT_READ, MAP_SHARED, fd, 0);
+            if (ptr != MAP_FAILED) {
+                file->data = static_cast<char*>(ptr);
+                //映射建立后fd不再需要
+                close(fd);
+                file->fd = -1;
+            }
+        }
+        return file;
+    }
+public:
+    explicit file_cache(const std::filesystem::path& docroot, size_t resident_budget = default_resident_budget)
+            : resident_budget_(resident_budget) {
+        std::error_code ec;
+        auto canonical = std::filesystem::weakly_canonical(docroot, ec);
+        docroot_ = (ec ? docroot : canonical).string();
+        while (docroot_.length() > 1 && docroot_.back() == '/') {
+            docroot_.pop_back();
+        }
+        notify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+    file_cache(const file_cache&) = delete;
+    file_cache& operator=(const file_cache&) = delete;
+    ~file_cache() {
+        if (notify_fd_ != -1) {
+            close(notify_fd_);
+        }
+    }
+
+    [[nodiscard]] const std::string& docroot() const {
+        return docroot_;
+    }
+    /* inotify的fd，可读时调用handle_notify()；inotify不可用时为-1，此时文件不进入缓存，每次请求都重新打开 */
+    [[nodiscard]] int notify_fd() const {
+        return notify_fd_;
+    }
+    [[nodiscard]] size_t resident() const {
+        return resident_;
+    }
+    [[nodiscard]] size_t size() const {
+        return entries_.size();
+    }
+
+    /* 把URL路径映射为文档根目录下的文件路径，拒绝越出根目录的路径 */
+    bool resolve(std::string_view url_path, std::string& path) {
+        if (!decode_url_path(url_path, scratch_) || scratch_.empty() || scratch_.front() != '/' || has_dot_segment(scratch_)) {
+            return false;
+        }
+        path = docroot_;
+        path += scratch_;
+        if (path.back() == '/') {
+            path += "index.html";
+        }
+        return true;
+    }
+
+    /* 查找或打开文件系统路径对应的文件，不存在或不是普通文件时返回nullptr；不存在的结果同样被缓存 */
+    entry_t open(const std::string& path) {
+        auto it = entries_.find(path);
+        if (it != entries_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second.lru);
+            return it->second.file;
+        }
+        //先注册监视再打开文件，避免漏掉两者之间发生的修改
+        auto dir = path.substr(0, path.rfind('/') + 1);
+        watch_directory(dir);
+        auto file = load(path);
+        if (!watched_dirs_.contains(dir)) {
+            //无法监视的文件不进入缓存，否则修改后无从得知
+            return file;
+        }
+        if (file != nullptr && file->mapped()) {
+            resident_ += file->size;
+        }
+        lru_.push_front(path);
+        entries_[path] = { file, lru_.begin() };
+        while ((resident_ > resident_budget_ || entries_.size() > max_entries) && entries_.size() > 1) {
+            erase(entries_.find(lru_.back()));
+        }
+        return file;
+    }
+
+    /* 处理inotify事件，使被改动的文件失效 */
+    void handle_notify() {
+        alignas(inotify_event) char buf[4096];
+        while (true) {
+            auto n = ::read(notify_fd_, buf, sizeof(buf));
+            if (n <= 0) {
+                return;
+            }
+            for (char* p = buf; p < buf + n;) {
+                auto event = reinterpret_cast<inotify_event*>(p);
+                p += sizeof(inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    //事件丢失，无法确定哪些文件被改动
+                    clear();
+                    continue;
+                }
+                auto watch = watches_.find(event->wd);
+                if (watch == watches_.end()) {
+                    continue;
+                }
+                auto& dir = watch->second;
+                if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                    //目录本身消失：丢弃其下所有项
+                    for (auto it = entries_.begin(); it != entries_.end();) {
+                        auto next = std::next(it);
+                        if (it->first.starts_with(dir)) {
+                            erase(it);
+                        }
+                        it = next;
+                    }
+                    if (event->mask & IN_IGNORED) {
+                        watched_dirs_.erase(dir);
+                        watches_.erase(watch);
+                    }
+                    continue;
+                }
+                if (event->len > 0) {
+                    auto it = entries_.find(dir + event->name);
+                    if (it != entries_.end()) {
+                        erase(it);
+                    }
+                }
+            }
+        }
+    }
+
+    /* 丢弃所有缓存项 */
+    void clear() {
+        entries_.clear();
+        lru_.clear();
+        resident_ = 0;
+    }
+};
+
+/* 把文件的200响应追加到发送队列，head_only为true时(HEAD请求)不发送内容 */
+inline void append_static_file(output_queue& out, const std::shared_ptr<static_file>& file, bool keep_alive, bool head_only) {
+    out.append(file, file->head);
+    out.append_static(keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+    if (head_only) {
+        return;
+    }
+    if (file->mapped()) {
+        out.append(file, file->content());
+    } else {
+        out.append_file(file, file->fd, 0, file->size);
+    }
+}
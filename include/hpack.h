@@ -0,0 +1,591 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <utility>
+
+/*
+ * HPACK首部压缩(RFC 7541)。静态表与Huffman码表在编译期展开，Huffman解码按码长分组的范式码表逐个符号查找，
+ * 不需要逐位遍历的解码树。解码器与编码器各自维护一张动态表，大小受SETTINGS_HEADER_TABLE_SIZE约束。
+ */
+
+//动态表大小的默认值，同时也是本端允许对端使用的上限
+constexpr static size_t hpack_default_table_size = 4096;
+//每个表项的固定开销(RFC 7541 4.1)
+constexpr static size_t hpack_entry_overhead = 32;
+
+struct hpack_static_entry {
+    std::string_view name;
+    std::string_view value;
+};
+
+//静态表(RFC 7541附录A)，索引从1开始
+constexpr static std::array<hpack_static_entry, 61> hpack_static_table = {{
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+}};
+
+struct hpack_huffman_code {
+    uint32_t code;
+    uint8_t length;
+};
+
+//Huffman码表(RFC 7541附录B)，最后一项为EOS
+constexpr static std::array<hpack_huffman_code, 257> hpack_huffman_codes = {{
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28}, {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12}, {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8}, {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7}, {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7}, {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20}, {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23}, {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21}, {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27}, {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21}, {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27}, {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30},
+}};
+
+namespace hpack_detail {
+    constexpr static size_t eos = 256;
+    constexpr static size_t max_code_length = 30;
+    //常用字符的码长不超过9位
+    constexpr static size_t fast_bits = 9;
+
+    /*
+     * 范式Huffman码的解码表：同一码长的码字是连续的整数，且左对齐后短码总是小于长码。
+     * 把待解码的位左对齐到32位，从短到长找到第一个上界大于它的码长，即可算出符号在该码长内的序号。
+     */
+    struct huffman_decode_table {
+        //码长不超过L的全部码字左对齐后的上界(不含)
+        std::array<uint64_t, max_code_length + 1> limit {};
+        //码长为L的第一个码字
+        std::array<uint32_t, max_code_length + 1> first {};
+        //码长为L的第一个符号在symbols中的位置
+        std::array<uint16_t, max_code_length + 1> offset {};
+        //按(码长, 符号)排序的符号
+        std::array<uint16_t, 257> symbols {};
+        size_t min_length {max_code_length};
+        //以开头的fast_bits位直接查出的(符号 << 8 | 码长)，码长为0表示码字更长，需要按码长查找
+        std::array<uint16_t, 1 << fast_bits> fast {};
+    };
+
+    consteval huffman_decode_table make_huffman_decode_table() {
+        huffman_decode_table table;
+        size_t next = 0;
+        uint64_t limit = 0;
+        for (size_t length = 1; length <= max_code_length; ++length) {
+            table.offset[length] = static_cast<uint16_t>(next);
+            size_t count = 0;
+            for (size_t symbol = 0; symbol < hpack_huffman_codes.size(); ++symbol) {
+                auto& code = hpack_huffman_codes[symbol];
+                if (code.length != length) {
+                    continue;
+                }
+                if (count == 0) {
+                    table.first[length] = code.code;
+                    table.min_length = std::min(table.min_length, length);
+                } else if (code.code != table.first[length] + count) {
+                    throw "huffman table is not canonical";
+                }
+                table.symbols[next++] = static_cast<uint16_t>(symbol);
+                ++count;
+            }
+            if (count > 0) {
+                limit = static_cast<uint64_t>(table.first[length] + count) << (32 - length);
+            }
+            table.limit[length] = limit;
+        }
+        for (uint32_t prefix = 0; prefix < (1u << fast_bits); ++prefix) {
+            auto peek = static_cast<uint64_t>(prefix) << (32 - fast_bits);
+            size_t length = table.min_length;
+            while (peek >= table.limit[length]) {
+                ++length;
+            }
+            if (length <= fast_bits) {
+                auto symbol = table.symbols[table.offset[length] + ((peek >> (32 - length)) - table.first[length])];
+                table.fast[prefix] = static_cast<uint16_t>(symbol << 8 | length);
+            }
+        }
+        return table;
+    }
+
+    constexpr static huffman_decode_table huffman_table = make_huffman_decode_table();
+}
+
+inline uint32_t read_hpack_u32(const char* p) {
+    auto u = reinterpret_cast<const uint8_t*>(p);
+    return (static_cast<uint32_t>(u[0]) << 24) | (static_cast<uint32_t>(u[1]) << 16) | (static_cast<uint32_t>(u[2]) << 8) | u[3];
+}
+
+/* 把Huffman编码的data解码后追加到out，编码非法(含EOS、填充超过7位或不全为1)时返回false */
+inline bool hpack_huffman_decode(std::string_view data, std::string& out) {
+    auto& table = hpack_detail::huffman_table;
+    //待解码的位左对齐存放在acc的高位
+    uint64_t acc = 0;
+    size_t bits = 0;
+    size_t pos = 0;
+    //码字至少5位，先按上限扩容，逐个符号写入时不再检查容量
+    auto start = out.length();
+    out.resize(start + data.length() * 8 / 5);
+    auto write = out.data() + start;
+    while (true) {
+        if (bits < 32) {
+            //一次补充4个字节，只在结尾逐字节补充
+            if (data.length() - pos >= 4) {
+                acc |= static_cast<uint64_t>(read_hpack_u32(data.data() + pos)) << (32 - bits);
+                bits += 32;
+                pos += 4;
+            } else {
+                while (bits <= 56 && pos < data.length()) {
+                    acc |= static_cast<uint64_t>(static_cast<uint8_t>(data[pos++])) << (56 - bits);
+                    bits += 8;
+                }
+            }
+        }
+        if (bits == 0) {
+            out.resize(write - out.data());
+            return true;
+        }
+        //不足32位时用1补齐，结尾的填充因此总是落在比剩余位数更长的码字上
+        auto peek = static_cast<uint32_t>(acc >> 32);
+        if (bits < 32) {
+            peek |= 0xffffffffu >> bits;
+        }
+        auto entry = table.fast[peek >> (32 - hpack_detail::fast_bits)];
+        size_t length = entry & 0xff;
+        uint16_t symbol = entry >> 8;
+        if (length == 0) {
+            length = hpack_detail::fast_bits + 1;
+            while (length <= hpack_detail::max_code_length && peek >= table.limit[length]) {
+                ++length;
+            }
+            symbol = table.symbols[table.offset[length] + ((peek >> (32 - length)) - table.first[length])];
+        }
+        if (length > bits) {
+            //只剩下填充：必须少于8位且全为1
+            out.resize(write - out.data());
+            return bits < 8 && (peek >> (32 - bits)) == (0xffffffffu >> (32 - bits));
+        }
+        if (symbol == hpack_detail::eos) {
+            return false;
+        }
+        *write++ = static_cast<char>(symbol);
+        acc <<= length;
+        bits -= length;
+    }
+}
+
+/* Huffman编码后的字节数 */
+inline size_t hpack_huffman_length(std::string_view data) {
+    size_t bits = 0;
+    for (unsigned char c : data) {
+        bits += hpack_huffman_codes[c].length;
+    }
+    return (bits + 7) / 8;
+}
+
+inline void hpack_huffman_encode(std::string_view data, std::string& out) {
+    uint64_t acc = 0;
+    size_t bits = 0;
+    for (unsigned char c : data) {
+        auto& code = hpack_huffman_codes[c];
+        acc = (acc << code.length) | code.code;
+        bits += code.length;
+        while (bits >= 8) {
+            bits -= 8;
+            out.push_back(static_cast<char>(acc >> bits));
+        }
+    }
+    if (bits > 0) {
+        //用EOS的前缀(全1)填充到整字节
+        out.push_back(static_cast<char>((acc << (8 - bits)) | (0xff >> bits)));
+    }
+}
+
+/* 以prefix_bits位前缀编码整数，flags为首字节中前缀之外的高位 */
+inline void hpack_encode_integer(std::string& out, uint8_t flags, size_t prefix_bits, size_t value) {
+    size_t max_prefix = (size_t { 1 } << prefix_bits) - 1;
+    if (value < max_prefix) {
+        out.push_back(static_cast<char>(flags | value));
+        return;
+    }
+    out.push_back(static_cast<char>(flags | max_prefix));
+    value -= max_prefix;
+    while (value >= 128) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+/* 解码prefix_bits位前缀的整数，数据不完整或超出范围时返回false */
+inline bool hpack_decode_integer(std::string_view data, size_t& pos, size_t prefix_bits, size_t& value) {
+    if (pos >= data.length()) {
+        return false;
+    }
+    size_t max_prefix = (size_t { 1 } << prefix_bits) - 1;
+    value = static_cast<uint8_t>(data[pos++]) & max_prefix;
+    if (value < max_prefix) {
+        return true;
+    }
+    for (size_t shift = 0; shift <= 28; shift += 7) {
+        if (pos >= data.length()) {
+            return false;
+        }
+        auto b = static_cast<uint8_t>(data[pos++]);
+        value += static_cast<size_t>(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* 字符串字面量，Huffman编码更短时使用Huffman编码 */
+inline void hpack_encode_string(std::string& out, std::string_view value) {
+    auto huffman_length = hpack_huffman_length(value);
+    if (huffman_length < value.length()) {
+        hpack_encode_integer(out, 0x80, 7, huffman_length);
+        hpack_huffman_encode(value, out);
+    } else {
+        hpack_encode_integer(out, 0, 7, value.length());
+        out.append(value);
+    }
+}
+
+/* 动态表，最新插入的表项位于最前(索引62) */
+class hpack_dynamic_table {
+private:
+    std::deque<std::pair<std::string, std::string>> entries_;
+    size_t size_ {0};
+    size_t max_size_;
+
+    void evict(size_t limit) {
+        while (size_ > limit) {
+            auto& [name, value] = entries_.back();
+            size_ -= hpack_entry_overhead + name.length() + value.length();
+            entries_.pop_back();
+        }
+    }
+public:
+    explicit hpack_dynamic_table(size_t max_size = hpack_default_table_size) : max_size_(max_size) {}
+
+    /* 插入表项，表项大于整张表时只清空表(RFC 7541 4.4) */
+    void insert(std::string name, std::string value) {
+        auto size = hpack_entry_overhead + name.length() + value.length();
+        if (size > max_size_) {
+            evict(0);
+            return;
+        }
+        evict(max_size_ - size);
+        entries_.emplace_front(std::move(name), std::move(value));
+        size_ += size;
+    }
+
+    void resize(size_t max_size) {
+        max_size_ = max_size;
+        evict(max_size);
+    }
+
+    /* 第i个表项(从0开始)，对应HPACK索引62 + i */
+    [[nodiscard]] const std::pair<std::string, std::string>& at(size_t i) const {
+        return entries_[i];
+    }
+    [[nodiscard]] size_t count() const {
+        return entries_.size();
+    }
+    [[nodiscard]] size_t max_size() const {
+        return max_size_;
+    }
+};
+
+/* 首部块解码器，每个连接一个，按收到的顺序解码全部首部块以保持动态表与对端一致 */
+class hpack_decoder {
+private:
+    hpack_dynamic_table table_;
+    //本端通过SETTINGS_HEADER_TABLE_SIZE允许的上限，对端的大小更新不能超过它
+    size_t limit_;
+    std::string name_buffer_;
+    std::string value_buffer_;
+
+    bool lookup(size_t index, std::string_view& name, std::string_view& value) const {
+        if (index == 0) {
+            return false;
+        }
+        if (index <= hpack_static_table.size()) {
+            name = hpack_static_table[index - 1].name;
+            value = hpack_static_table[index - 1].value;
+            return true;
+        }
+        index -= hpack_static_table.size() + 1;
+        if (index >= table_.count()) {
+            return false;
+        }
+        auto& entry = table_.at(index);
+        name = entry.first;
+        value = entry.second;
+        return true;
+    }
+
+    /* 解码字符串字面量，Huffman编码的内容解码到buffer中 */
+    static bool read_string(std::string_view block, size_t& pos, std::string& buffer, std::string_view& result) {
+        if (pos >= block.length()) {
+            return false;
+        }
+        bool huffman = (static_cast<uint8_t>(block[pos]) & 0x80) != 0;
+        size_t length;
+        if (!hpack_decode_integer(block, pos, 7, length) || length > block.length() - pos) {
+            return false;
+        }
+        auto raw = block.substr(pos, length);
+        pos += length;
+        if (!huffman) {
+            result = raw;
+            return true;
+        }
+        buffer.clear();
+        if (!hpack_huffman_decode(raw, buffer)) {
+            return false;
+        }
+        result = buffer;
+        return true;
+    }
+public:
+    explicit hpack_decoder(size_t limit = hpack_default_table_size) : table_(limit), limit_(limit) {}
+
+    /*
+     * 解码一个完整的首部块，每个首部字段调用一次emit(name, value)，视图只在本次调用期间有效。
+     * 格式非法(压缩错误，应作为连接错误处理)时返回false。
+     */
+    template<typename Emit>
+    bool decode(std::string_view block, Emit&& emit) {
+        size_t pos = 0;
+        bool fields_seen = false;
+        while (pos < block.length()) {
+            auto b = static_cast<uint8_t>(block[pos]);
+            std::string_view name;
+            std::string_view value;
+            size_t index;
+            if (b & 0x80) {
+                //索引表示
+                if (!hpack_decode_integer(block, pos, 7, index) || !lookup(index, name, value)) {
+                    return false;
+                }
+                emit(name, value);
+                fields_seen = true;
+                continue;
+            }
+            if ((b & 0xe0) == 0x20) {
+                //动态表大小更新，只能出现在首部块开头
+                size_t size;
+                if (fields_seen || !hpack_decode_integer(block, pos, 5, size) || size > limit_) {
+                    return false;
+                }
+                table_.resize(size);
+                continue;
+            }
+            bool indexing = (b & 0xc0) == 0x40;
+            if (!hpack_decode_integer(block, pos, indexing ? 6 : 4, index)) {
+                return false;
+            }
+            if (index == 0) {
+                if (!read_string(block, pos, name_buffer_, name)) {
+                    return false;
+                }
+            } else {
+                std::string_view unused;
+                if (!lookup(index, name, unused)) {
+                    return false;
+                }
+                if (indexing && index > hpack_static_table.size()) {
+                    //名字引用的动态表项可能在插入时被淘汰，先复制出来
+                    name_buffer_.assign(name);
+                    name = name_buffer_;
+                }
+            }
+            if (!read_string(block, pos, value_buffer_, value)) {
+                return false;
+            }
+            if (indexing) {
+                table_.insert(std::string(name), std::string(value));
+            }
+            emit(name, value);
+            fields_seen = true;
+        }
+        return true;
+    }
+};
+
+/* 首部块编码器，响应首部优先使用静态表与动态表中的索引 */
+class hpack_encoder {
+private:
+    hpack_dynamic_table table_;
+    //尚未通知对端的动态表大小更新：期间出现过的最小值与最终值
+    bool update_pending_ {false};
+    size_t update_min_ {0};
+
+    /* 查找完全匹配的索引与名字匹配的索引，找不到时为0 */
+    void find(std::string_view name, std::string_view value, size_t& exact, size_t& name_only) const {
+        exact = 0;
+        name_only = 0;
+        for (size_t i = 0; i < hpack_static_table.size(); ++i) {
+            auto& entry = hpack_static_table[i];
+            if (entry.name != name) {
+                continue;
+            }
+            if (entry.value == value) {
+                exact = i + 1;
+                return;
+            }
+            if (name_only == 0) {
+                name_only = i + 1;
+            }
+        }
+        for (size_t i = 0; i < table_.count(); ++i) {
+            auto& entry = table_.at(i);
+            if (entry.first != name) {
+                continue;
+            }
+            if (entry.second == value) {
+                exact = hpack_static_table.size() + 1 + i;
+                return;
+            }
+            if (name_only == 0) {
+                name_only = hpack_static_table.size() + 1 + i;
+            }
+        }
+    }
+public:
+    /* 对端通过SETTINGS_HEADER_TABLE_SIZE给出的上限，本端最多使用默认大小 */
+    void set_max_size(size_t size) {
+        size = std::min(size, hpack_default_table_size);
+        if (size == table_.max_size() && !update_pending_) {
+            return;
+        }
+        update_min_ = update_pending_ ? std::min(update_min_, size) : std::min(size, table_.max_size());
+        update_pending_ = true;
+        table_.resize(size);
+    }
+
+    /* 开始一个首部块，带上尚未通知的动态表大小更新 */
+    void begin_block(std::string& out) {
+        if (!update_pending_) {
+            return;
+        }
+        if (update_min_ < table_.max_size()) {
+            hpack_encode_integer(out, 0x20, 5, update_min_);
+        }
+        hpack_encode_integer(out, 0x20, 5, table_.max_size());
+        update_pending_ = false;
+    }
+
+    /* 编码一个首部字段(名字须为小写)，indexing为false时不加入动态表，用于每次都不同的值 */
+    void encode(std::string& out, std::string_view name, std::string_view value, bool indexing = true) {
+        size_t exact;
+        size_t name_only;
+        find(name, value, exact, name_only);
+        if (exact != 0) {
+            hpack_encode_integer(out, 0x80, 7, exact);
+            return;
+        }
+        indexing = indexing && hpack_entry_overhead + name.length() + value.length() <= table_.max_size() / 2;
+        if (indexing) {
+            hpack_encode_integer(out, 0x40, 6, name_only);
+        } else {
+            hpack_encode_integer(out, 0x00, 4, name_only);
+        }
+        if (name_only == 0) {
+            hpack_encode_string(out, name);
+        }
+        hpack_encode_string(out, value);
+        if (indexing) {
+            table_.insert(std::string(name), std::string(value));
+        }
+    }
+};
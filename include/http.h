@@ -0,0 +1,456 @@
+#pragma once
+
+#include <array>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+
+constexpr static size_t max_http_headers = 64;
+constexpr static size_t max_http_header_size = 64 * 1024;
+
+struct http_header {
+    std::string_view name;
+    std::string_view value;
+};
+
+/* 大小写不敏感的字符串比较(HTTP首部名) */
+inline bool iequals(std::string_view a, std::string_view b) {
+    if (a.length() != b.length()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.length(); ++i) {
+        if ((a[i] | 0x20) != (b[i] | 0x20)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+/* 逗号分隔的首部值(例如Connection、Upgrade)中是否含有token，大小写不敏感 */
+inline bool has_token(std::string_view list, std::string_view token) {
+    while (!list.empty()) {
+        auto comma = list.find(',');
+        if (iequals(trim(list.substr(0, comma)), token)) {
+            return true;
+        }
+        list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+    }
+    return false;
+}
+
+/* 解析Content-Length的值，只接受非空的十进制数字串，溢出时返回false */
+inline bool parse_content_length(std::string_view value, size_t& length) {
+    if (value.empty()) {
+        return false;
+    }
+    length = 0;
+    for (char c : value) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        auto digit = static_cast<size_t>(c - '0');
+        if (length > (SIZE_MAX - digit) / 10) {
+            return false;
+        }
+        length = length * 10 + digit;
+    }
+    return true;
+}
+
+/* 首部名是否为合法的token(RFC 9110 5.6.2)：非空，不含空白、控制字符与分隔符。名字前后带空白的首部不能被宽松地接受，否则与上游对它的理解可能不同 */
+inline bool is_http_token(std::string_view name) {
+    if (name.empty()) {
+        return false;
+    }
+    for (char c : name) {
+        bool valid = (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || std::string_view("!#$%&'*+-.^_`|~").find(c) != std::string_view::npos;
+        if (!valid) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Transfer-Encoding的最外层(最后一个)编码，多个首部应先按顺序以逗号连接，或只传入最后一个首部 */
+inline std::string_view last_transfer_coding(std::string_view transfer_encoding) {
+    auto comma = transfer_encoding.rfind(',');
+    return trim(comma == std::string_view::npos ? transfer_encoding : transfer_encoding.substr(comma + 1));
+}
+
+/* 解码URL路径中的%XX转义，遇到非法转义或NUL时返回false */
+inline bool decode_url_path(std::string_view path, std::string& out) {
+    out.clear();
+    for (size_t i = 0; i < path.length(); ++i) {
+        char c = path[i];
+        if (c == '%') {
+            if (i + 2 >= path.length() || !isxdigit(static_cast<unsigned char>(path[i + 1])) || !isxdigit(static_cast<unsigned char>(path[i + 2]))) {
+                return false;
+            }
+            c = static_cast<char>(std::stoi(std::string(path.substr(i + 1, 2)), nullptr, 16));
+            i += 2;
+        }
+        if (c == '\0') {
+            return false;
+        }
+        out += c;
+    }
+    return true;
+}
+
+/* 解码后的路径中是否有"."或".."段，这样的路径经过规范化后可能越出它看起来所在的目录 */
+inline bool has_dot_segment(std::string_view path) {
+    size_t pos = 0;
+    while (pos <= path.length()) {
+        auto next = path.find('/', pos);
+        if (next == std::string_view::npos) {
+            next = path.length();
+        }
+        auto segment = path.substr(pos, next - pos);
+        if (segment == "." || segment == "..") {
+            return true;
+        }
+        pos = next + 1;
+    }
+    return false;
+}
+
+/* parse_http_request()的返回值：Content-Length超出调用者给出的上限，应返回413 */
+constexpr static ssize_t http_request_too_large = -2;
+
+/* HTTP/1.x请求，所有字段都是指向接收缓冲的视图，解析过程中不产生任何内存分配。 */
+class http_request {
+public:
+    std::string_view method;
+    std::string_view target;
+    std::string_view path;
+    std::string_view query;
+    std::string_view version;
+    std::string_view body;
+    std::array<http_header, max_http_headers> headers {};
+    size_t header_count {0};
+    //Transfer-Encoding: chunked，body在解码完成后才有效
+    bool chunked {false};
+
+    /* 查找首部，不存在时返回空视图 */
+    [[nodiscard]] std::string_view header(std::string_view name) const {
+        for (size_t i = 0; i < header_count; ++i) {
+            if (iequals(headers[i].name, name)) {
+                return headers[i].value;
+            }
+        }
+        return {};
+    }
+
+    [[nodiscard]] bool keep_alive() const {
+        auto connection = header("Connection");
+        if (version == "HTTP/1.0") {
+            return iequals(connection, "keep-alive");
+        }
+        return !iequals(connection, "close");
+    }
+};
+
+/*
+ * 解析一个完整的HTTP/1.x请求(包括Content-Length指定的请求体)。
+ * 返回值大于0时为该请求占用的字节数；数据不完整时返回0；请求非法时返回-1；
+ * Content-Length大于max_body_length时在请求头解析完成后立即返回http_request_too_large，不等待请求体。
+ * 分块编码的请求只解析到请求头为止，request.chunked为true，返回值为请求头占用的字节数。
+ * 会造成请求走私的请求一律视为非法：首部名不是合法的token(如冒号前带空白)、Content-Length溢出、
+ * 多个Content-Length的值不同、同时带有Transfer-Encoding与Content-Length。
+ */
+inline ssize_t parse_http_request(std::string_view data, http_request& request, size_t max_body_length = SIZE_MAX) {
+    auto header_end = data.find("\r\n\r\n");
+    if (header_end == std::string_view::npos) {
+        return data.length() > max_http_header_size ? -1 : 0;
+    }
+    auto head = data.substr(0, header_end);
+    auto line_end = head.find("\r\n");
+    auto request_line = head.substr(0, line_end);
+    auto sp1 = request_line.find(' ');
+    auto sp2 = request_line.rfind(' ');
+    if (sp1 == std::string_view::npos || sp2 == sp1) {
+        return -1;
+    }
+    request.method = request_line.substr(0, sp1);
+    request.target = request_line.substr(sp1 + 1, sp2 - sp1 - 1);
+    request.version = request_line.substr(sp2 + 1);
+    if (!request.version.starts_with("HTTP/1.") || request.target.empty()) {
+        return -1;
+    }
+    auto qpos = request.target.find('?');
+    request.path = request.target.substr(0, qpos);
+    request.query = qpos == std::string_view::npos ? std::string_view() : request.target.substr(qpos + 1);
+    request.header_count = 0;
+    size_t body_length = 0;
+    bool has_content_length = false;
+    //多个Transfer-Encoding首部等同于按顺序以逗号连接，最后一个首部的最后一个编码才是最外层的编码
+    std::string_view transfer_encoding;
+    size_t pos = line_end == std::string_view::npos ? head.length() : line_end + 2;
+    while (pos < head.length()) {
+        auto next = head.find("\r\n", pos);
+        if (next == std::string_view::npos) {
+            next = head.length();
+        }
+        auto line = head.substr(pos, next - pos);
+        auto colon = line.find(':');
+        if (colon == std::string_view::npos || request.header_count == max_http_headers) {
+            return -1;
+        }
+        auto name = line.substr(0, colon);
+        if (!is_http_token(name)) {
+            return -1;
+        }
+        auto value = trim(line.substr(colon + 1));
+        request.headers[request.header_count++] = { name, value };
+        if (iequals(name, "Content-Length")) {
+            //重复的Content-Length只有值完全相同时才接受，否则与上游对请求体边界的理解可能不同
+            size_t length;
+            if (!parse_content_length(value, length) || (has_content_length && length != body_length)) {
+                return -1;
+            }
+            body_length = length;
+            has_content_length = true;
+        } else if (iequals(name, "Transfer-Encoding")) {
+            transfer_encoding = value;
+        }
+        pos = next + 2;
+    }
+    size_t total = header_end + 4;
+    request.chunked = false;
+    if (!transfer_encoding.empty()) {
+        //chunked必须是最后一个编码，且不能同时出现Content-Length，否则无法可靠地确定请求体的边界
+        if (!iequals(last_transfer_coding(transfer_encoding), "chunked") || has_content_length) {
+            return -1;
+        }
+        //请求体由调用者在接收缓冲中就地解码(见chunked.h)
+        request.chunked = true;
+        request.body = {};
+        return static_cast<ssize_t>(total);
+    }
+    if (body_length > max_body_length) {
+        return http_request_too_large;
+    }
+    if (data.length() < total + body_length) {
+        return 0;
+    }
+    request.body = data.substr(total, body_length);
+    return static_cast<ssize_t>(total + body_length);
+}
+
+/* HTTP/1.x响应头，字段为指向接收缓冲的视图 */
+class http_response_head {
+public:
+    int status {0};
+    std::string_view version;
+    std::array<http_header, max_http_headers> headers {};
+    size_t header_count {0};
+    size_t content_length {0};
+    bool has_content_length {false};
+    bool chunked {false};
+
+    [[nodiscard]] std::string_view header(std::string_view name) const {
+        for (size_t i = 0; i < header_count; ++i) {
+            if (iequals(headers[i].name, name)) {
+                return headers[i].value;
+            }
+        }
+        return {};
+    }
+
+    [[nodiscard]] bool keep_alive() const {
+        auto connection = header("Connection");
+        if (version == "HTTP/1.0") {
+            return iequals(connection, "keep-alive");
+        }
+        return !iequals(connection, "close");
+    }
+};
+
+/*
+ * 解析HTTP/1.x响应头(不包括响应体)。
+ * 返回值大于0时为响应头占用的字节数；数据不完整时返回0；响应非法时返回-1。
+ */
+inline ssize_t parse_http_response_head(std::string_view data, http_response_head& head) {
+    auto header_end = data.find("\r\n\r\n");
+    if (header_end == std::string_view::npos) {
+        return data.length() > max_http_header_size ? -1 : 0;
+    }
+    auto block = data.substr(0, header_end);
+    auto line_end = block.find("\r\n");
+    auto status_line = block.substr(0, line_end);
+    auto sp = status_line.find(' ');
+    if (sp == std::string_view::npos || status_line.length() < sp + 4) {
+        return -1;
+    }
+    head.version = status_line.substr(0, sp);
+    if (!head.version.starts_with("HTTP/1.")) {
+        return -1;
+    }
+    head.status = 0;
+    for (size_t i = sp + 1; i < sp + 4; ++i) {
+        if (status_line[i] < '0' || status_line[i] > '9') {
+            return -1;
+        }
+        head.status = head.status * 10 + (status_line[i] - '0');
+    }
+    head.header_count = 0;
+    head.content_length = 0;
+    head.has_content_length = false;
+    head.chunked = false;
+    size_t pos = line_end == std::string_view::npos ? block.length() : line_end + 2;
+    while (pos < block.length()) {
+        auto next = block.find("\r\n", pos);
+        if (next == std::string_view::npos) {
+            next = block.length();
+        }
+        auto line = block.substr(pos, next - pos);
+        auto colon = line.find(':');
+        if (colon == std::string_view::npos || head.header_count == max_http_headers) {
+            return -1;
+        }
+        auto name = line.substr(0, colon);
+        if (!is_http_token(name)) {
+            return -1;
+        }
+        auto value = trim(line.substr(colon + 1));
+        head.headers[head.header_count++] = { name, value };
+        if (iequals(name, "Content-Length")) {
+            size_t length;
+            if (!parse_content_length(value, length) || (head.has_content_length && length != head.content_length)) {
+                return -1;
+            }
+            head.content_length = length;
+            head.has_content_length = true;
+        } else if (iequals(name, "Transfer-Encoding")) {
+            //与请求一样只看最后一个首部的最后一个编码
+            head.chunked = iequals(last_transfer_coding(value), "chunked");
+        }
+        pos = next + 2;
+    }
+    return static_cast<ssize_t>(header_end + 4);
+}
+
+inline std::string_view get_status_reason(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 412: return "Precondition Failed";
+        case 413: return "Payload Too Large";
+        case 416: return "Range Not Satisfiable";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        default: return "Unknown";
+    }
+}
+
+//逐段生成的响应体：生成器把内容依次交给writer，不需要先拼出完整的响应体
+using body_writer = std::function<void(std::string_view)>;
+using body_generator = std::function<void(const body_writer&)>;
+
+/* HTTP/1.1响应 */
+class http_response {
+private:
+    int status_;
+    std::vector<std::pair<std::string, std::string>> headers_;
+    std::string body_;
+    body_generator generator_;
+
+    void append_head(std::string& out) const {
+        out += std::format("HTTP/1.1 {} {}\r\n", status_, get_status_reason(status_));
+        for (auto& [name, value] : headers_) {
+            out += name;
+            out += ": ";
+            out += value;
+            out += "\r\n";
+        }
+    }
+public:
+    explicit http_response(int status = 200) : status_(status) {}
+
+    http_response& set_header(std::string name, std::string value) {
+        headers_.emplace_back(std::move(name), std::move(value));
+        return *this;
+    }
+    http_response& set_body(std::string body, std::string content_type = "text/plain; charset=utf-8") {
+        body_ = std::move(body);
+        return set_header("Content-Type", std::move(content_type));
+    }
+    /* 以生成器代替响应体，HTTP/1.1的客户端可以用分块编码边生成边发送(见chunked.h) */
+    http_response& set_body_generator(body_generator generator, std::string content_type) {
+        generator_ = std::move(generator);
+        return set_header("Content-Type", std::move(content_type));
+    }
+
+    [[nodiscard]] int status() const {
+        return status_;
+    }
+    [[nodiscard]] const std::string& body() const {
+        return body_;
+    }
+    [[nodiscard]] const body_generator& generator() const {
+        return generator_;
+    }
+    /* 查找已设置的首部，不存在时返回空视图 */
+    [[nodiscard]] std::string_view header(std::string_view name) const {
+        for (auto& [n, value] : headers_) {
+            if (iequals(n, name)) {
+                return value;
+            }
+        }
+        return {};
+    }
+
+    /* 序列化为完整的响应报文，head_only为true时(HEAD请求)保留Content-Length但不带响应体；有生成器时先生成完整的响应体 */
+    [[nodiscard]] std::string serialize(bool keep_alive, bool head_only = false) const {
+        std::string out;
+        append_head(out);
+        std::string generated;
+        if (generator_) {
+            generator_([&generated](std::string_view data) { generated += data; });
+        }
+        auto& body = generator_ ? generated : body_;
+        out += std::format("Content-Length: {}\r\n", body.length());
+        out += keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        if (!head_only) {
+            out += body;
+        }
+        return out;
+    }
+
+    /* 以Transfer-Encoding: chunked代替Content-Length的响应头，响应体由调用者以分块编码随后写出 */
+    [[nodiscard]] std::string serialize_chunked_head(bool keep_alive) const {
+        std::string out;
+        append_head(out);
+        out += "Transfer-Encoding: chunked\r\n";
+        out += keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        return out;
+    }
+};
@@ -0,0 +1,953 @@
+#pragma once
+
+#include <memory.h>
+#include <io.h>
+#include <http.h>
+#include <chunked.h>
+#include <hpack.h>
+#include <base64.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <format>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*
+ * HTTP/2(RFC 9113)的明文形式h2c，客户端可以直接发送连接前言(prior knowledge)，也可以从HTTP/1.1通过Upgrade切换。
+ * http2_session只处理协议状态：从接收缓冲中解析帧、维护流与两级流量控制窗口，并把待发送的帧排入output_queue，
+ * 读写套接字与生成响应由worker负责。每个流的响应仍由HTTP/1.1的流程生成到单独的output_queue中，
+ * 会话把响应头转成HEADERS帧，响应体按窗口切成DATA帧，帧的内容引用原响应的片段(包括sendfile的文件片段)而不复制。
+ */
+
+constexpr static std::string_view http2_preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+constexpr static size_t http2_frame_header_size = 9;
+//SETTINGS_MAX_FRAME_SIZE的默认值与允许的最大值
+constexpr static size_t http2_default_frame_size = 16384;
+constexpr static size_t http2_max_frame_size = 16777215;
+constexpr static int64_t http2_default_window = 65535;
+constexpr static int64_t http2_max_window = 0x7fffffff;
+//本端允许的并发流数、每个流的接收窗口与连接的接收窗口
+constexpr static size_t http2_max_concurrent_streams = 128;
+constexpr static int64_t http2_stream_window = 1024 * 1024;
+constexpr static int64_t http2_connection_window = 16 * 1024 * 1024;
+//一次write()最多排入的DATA字节数，写出后再回来检查新的输入，避免大响应独占连接
+constexpr static size_t http2_write_quantum = 256 * 1024;
+
+enum class http2_frame_type : uint8_t {
+    data = 0,
+    headers,
+    priority,
+    rst_stream,
+    settings,
+    push_promise,
+    ping,
+    goaway,
+    window_update,
+    continuation,
+};
+
+constexpr static uint8_t http2_flag_end_stream = 0x1;
+constexpr static uint8_t http2_flag_ack = 0x1;
+constexpr static uint8_t http2_flag_end_headers = 0x4;
+constexpr static uint8_t http2_flag_padded = 0x8;
+constexpr static uint8_t http2_flag_priority = 0x20;
+
+enum class http2_error : uint32_t {
+    no_error = 0,
+    protocol_error,
+    internal_error,
+    flow_control_error,
+    settings_timeout,
+    stream_closed,
+    frame_size_error,
+    refused_stream,
+    cancel,
+    compression_error,
+    connect_error,
+    enhance_your_calm,
+    inadequate_security,
+    http_1_1_required,
+};
+
+enum class http2_setting : uint16_t {
+    header_table_size = 1,
+    enable_push,
+    max_concurrent_streams,
+    initial_window_size,
+    max_frame_size,
+    max_header_list_size,
+};
+
+struct http2_frame_header {
+    uint32_t length;
+    http2_frame_type type;
+    uint8_t flags;
+    uint32_t stream_id;
+};
+
+inline uint32_t read_http2_u32(const char* p) {
+    auto u = reinterpret_cast<const uint8_t*>(p);
+    return (static_cast<uint32_t>(u[0]) << 24) | (static_cast<uint32_t>(u[1]) << 16) | (static_cast<uint32_t>(u[2]) << 8) | u[3];
+}
+
+inline void append_http2_u32(std::string& out, uint32_t value) {
+    out.push_back(static_cast<char>(value >> 24));
+    out.push_back(static_cast<char>(value >> 16));
+    out.push_back(static_cast<char>(value >> 8));
+    out.push_back(static_cast<char>(value));
+}
+
+inline http2_frame_header parse_http2_frame_header(const char* p) {
+    auto u = reinterpret_cast<const uint8_t*>(p);
+    return {
+        (static_cast<uint32_t>(u[0]) << 16) | (static_cast<uint32_t>(u[1]) << 8) | u[2],
+        static_cast<http2_frame_type>(u[3]),
+        u[4],
+        read_http2_u32(p + 5) & 0x7fffffff,
+    };
+}
+
+inline void append_http2_frame_header(std::string& out, size_t length, http2_frame_type type, uint8_t flags, uint32_t stream_id) {
+    out.push_back(static_cast<char>(length >> 16));
+    out.push_back(static_cast<char>(length >> 8));
+    out.push_back(static_cast<char>(length));
+    out.push_back(static_cast<char>(type));
+    out.push_back(static_cast<char>(flags));
+    append_http2_u32(out, stream_id);
+}
+
+/* 请求是否要求升级到h2c(RFC 7540 3.2)，分块编码的请求体无法在升级前确定，不予升级 */
+inline bool is_h2c_upgrade(const http_request& request) {
+    if (request.chunked || request.header("HTTP2-Settings").empty()) {
+        return false;
+    }
+    return has_token(request.header("Upgrade"), "h2c");
+}
+
+/* 响应体的一段：内存片段(fd为-1)或文件片段 */
+struct http2_body_piece {
+    const char* data;
+    int fd;
+    off_t offset;
+    size_t length;
+};
+
+struct http2_stream {
+    uint32_t id;
+    //解码后的首部字段，request中的视图指向这里与body
+    std::vector<std::pair<std::string, std::string>> fields;
+    std::string body;
+    http_request request;
+    //不为0时不处理请求，直接以该状态码响应(例如请求体过大)
+    int error_status {0};
+    //对端已发送END_STREAM
+    bool remote_closed {false};
+    //请求已交给worker
+    bool dispatched {false};
+    //已在发送队列中
+    bool scheduled {false};
+    int64_t send_window;
+    int64_t receive_window {http2_stream_window};
+    //已收到但还没有通过WINDOW_UPDATE归还的字节数
+    int64_t unacknowledged {0};
+    //HTTP/1.1形式的响应，DATA帧引用其中的片段
+    std::shared_ptr<output_queue> source;
+    std::vector<http2_body_piece> pieces;
+    size_t piece {0};
+    size_t piece_offset {0};
+    size_t remaining {0};
+
+    http2_stream(uint32_t id, int64_t send_window) : id(id), send_window(send_window) {}
+};
+
+class http2_session {
+private:
+    hpack_decoder decoder_;
+    hpack_encoder encoder_;
+    //worker生成响应期间持有流的引用，流被重置后也不会在它手中失效
+    std::unordered_map<uint32_t, std::shared_ptr<http2_stream>> streams_;
+    //请求已完整、等待生成响应的流
+    std::deque<uint32_t> ready_;
+    //有响应体待发送的流，按轮转顺序发送
+    std::deque<uint32_t> sendable_;
+    //待发送的控制帧与HEADERS帧，先于DATA帧写出
+    std::string control_;
+    size_t max_body_;
+    bool preface_received_ {false};
+    bool settings_received_ {false};
+    uint32_t last_stream_id_ {0};
+    //正在接收的首部块(HEADERS后跟CONTINUATION)
+    uint32_t header_stream_ {0};
+    bool header_end_stream_ {false};
+    bool continuation_expected_ {false};
+    std::string header_block_;
+    //对端的设置
+    size_t peer_max_frame_size_ {http2_default_frame_size};
+    int64_t peer_initial_window_ {http2_default_window};
+    //连接级的发送窗口与接收窗口
+    int64_t send_window_ {http2_default_window};
+    int64_t receive_window_ {http2_default_window};
+    int64_t unacknowledged_ {0};
+    bool going_away_ {false};
+    bool goaway_received_ {false};
+    bool failed_ {false};
+
+    /* 连接错误：发送GOAWAY，调用者写出后关闭连接 */
+    bool fail(http2_error error) {
+        if (!failed_) {
+            append_http2_frame_header(control_, 8, http2_frame_type::goaway, 0, 0);
+            append_http2_u32(control_, last_stream_id_);
+            append_http2_u32(control_, static_cast<uint32_t>(error));
+            failed_ = true;
+            going_away_ = true;
+        }
+        return false;
+    }
+
+    /* 流错误：发送RST_STREAM并丢弃该流 */
+    void reset_stream(uint32_t id, http2_error error) {
+        append_http2_frame_header(control_, 4, http2_frame_type::rst_stream, 0, id);
+        append_http2_u32(control_, static_cast<uint32_t>(error));
+        streams_.erase(id);
+    }
+
+    void window_update(uint32_t id, int64_t increment) {
+        append_http2_frame_header(control_, 4, http2_frame_type::window_update, 0, id);
+        append_http2_u32(control_, static_cast<uint32_t>(increment));
+    }
+
+    void schedule(http2_stream& stream) {
+        if (!stream.scheduled && stream.remaining > 0 && stream.send_window > 0) {
+            stream.scheduled = true;
+            sendable_.push_back(stream.id);
+        }
+    }
+
+    bool apply_settings(std::string_view payload) {
+        for (size_t pos = 0; pos + 6 <= payload.length(); pos += 6) {
+            auto id = static_cast<http2_setting>((static_cast<uint8_t>(payload[pos]) << 8) | static_cast<uint8_t>(payload[pos + 1]));
+            auto value = read_http2_u32(payload.data() + pos + 2);
+            switch (id) {
+                case http2_setting::header_table_size:
+                    encoder_.set_max_size(value);
+                    break;
+                case http2_setting::enable_push:
+                    //本端从不推送，只检查取值
+                    if (value > 1) {
+                        return fail(http2_error::protocol_error);
+                    }
+                    break;
+                case http2_setting::initial_window_size: {
+                    if (value > http2_max_window) {
+                        return fail(http2_error::flow_control_error);
+                    }
+                    //新的初始窗口按差值作用于所有已有的流，窗口可以因此变为负数
+                    auto delta = static_cast<int64_t>(value) - peer_initial_window_;
+                    peer_initial_window_ = value;
+                    for (auto& [_, stream] : streams_) {
+                        stream->send_window += delta;
+                        if (stream->send_window > http2_max_window) {
+                            return fail(http2_error::flow_control_error);
+                        }
+                        schedule(*stream);
+                    }
+                    break;
+                }
+                case http2_setting::max_frame_size:
+                    if (value < http2_default_frame_size || value > http2_max_frame_size) {
+                        return fail(http2_error::protocol_error);
+                    }
+                    peer_max_frame_size_ = value;
+                    break;
+                default:
+                    //SETTINGS_MAX_CONCURRENT_STREAMS只约束本端发起的流，未知的设置按规定忽略
+                    break;
+            }
+        }
+        return true;
+    }
+
+    http2_stream& create_stream(uint32_t id) {
+        auto& stream = streams_[id];
+        stream = std::make_shared<http2_stream>(id, peer_initial_window_);
+        return *stream;
+    }
+
+    /* 由首部字段与请求体生成http_request，请求格式错误时重置该流 */
+    void finish_request(http2_stream& stream) {
+        auto& request = stream.request;
+        std::string_view authority;
+        request.header_count = 0;
+        bool has_host = false;
+        bool regular_seen = false;
+        for (auto& [name, value] : stream.fields) {
+            if (name.starts_with(':')) {
+                //伪首部必须位于普通首部之前
+                if (regular_seen) {
+                    reset_stream(stream.id, http2_error::protocol_error);
+                    return;
+                }
+                if (name == ":method") {
+                    request.method = value;
+                } else if (name == ":path") {
+                    request.target = value;
+                } else if (name == ":authority") {
+                    authority = value;
+                } else if (name != ":scheme") {
+                    reset_stream(stream.id, http2_error::protocol_error);
+                    return;
+                }
+                continue;
+            }
+            regular_seen = true;
+            if (request.header_count == max_http_headers) {
+                reset_stream(stream.id, http2_error::protocol_error);
+                return;
+            }
+            has_host = has_host || name == "host";
+            request.headers[request.header_count++] = { name, value };
+        }
+        if (request.method.empty() || request.target.empty()) {
+            reset_stream(stream.id, http2_error::protocol_error);
+            return;
+        }
+        if (!has_host && !authority.empty()) {
+            if (request.header_count == max_http_headers) {
+                reset_stream(stream.id, http2_error::protocol_error);
+                return;
+            }
+            request.headers[request.header_count++] = { "host", authority };
+        }
+        //Content-Length与实际收到的DATA长度不符的请求是格式错误的(RFC 9113 8.1.1)
+        if (auto length = request.header("content-length"); !length.empty() && length != std::to_string(stream.body.length())) {
+            reset_stream(stream.id, http2_error::protocol_error);
+            return;
+        }
+        auto qpos = request.target.find('?');
+        request.path = request.target.substr(0, qpos);
+        request.query = qpos == std::string_view::npos ? std::string_view() : request.target.substr(qpos + 1);
+        request.version = "HTTP/2";
+        request.body = stream.body;
+        request.chunked = false;
+        ready_.push_back(stream.id);
+    }
+
+    /* 首部块完整后解码，对新的流检查字段并在请求完整时交给worker */
+    bool on_header_block(std::string_view block) {
+        auto id = header_stream_;
+        http2_stream* stream = nullptr;
+        bool trailers = false;
+        if (auto it = streams_.find(id); it != streams_.end()) {
+            stream = it->second.get();
+            if (stream->remote_closed) {
+                return fail(http2_error::stream_closed);
+            }
+            trailers = true;
+        } else if (id <= last_stream_id_) {
+            return fail(http2_error::stream_closed);
+        } else if (id % 2 == 0) {
+            return fail(http2_error::protocol_error);
+        } else {
+            last_stream_id_ = id;
+            if (!going_away_ && !goaway_received_ && streams_.size() < http2_max_concurrent_streams) {
+                stream = &create_stream(id);
+            } else if (!going_away_) {
+                append_http2_frame_header(control_, 4, http2_frame_type::rst_stream, 0, id);
+                append_http2_u32(control_, static_cast<uint32_t>(http2_error::refused_stream));
+            }
+        }
+        //被拒绝的流与尾部首部同样需要解码，以保持动态表与对端一致
+        bool malformed = false;
+        size_t list_size = 0;
+        bool ok = decoder_.decode(block, [&](std::string_view name, std::string_view value) {
+            if (stream == nullptr || trailers) {
+                return;
+            }
+            list_size += name.length() + value.length() + hpack_entry_overhead;
+            //首部名必须是小写，且不能出现连接级的首部
+            bool lowercase = std::none_of(name.begin(), name.end(), [](char c) { return c >= 'A' && c <= 'Z'; });
+            if (!lowercase || name == "connection" || name == "keep-alive" || name == "proxy-connection" || name == "transfer-encoding" || name == "upgrade"
+                || (name == "te" && value != "trailers") || list_size > max_http_header_size) {
+                malformed = true;
+                return;
+            }
+            stream->fields.emplace_back(name, value);
+        });
+        if (!ok) {
+            return fail(http2_error::compression_error);
+        }
+        if (stream == nullptr) {
+            return true;
+        }
+        if (trailers && !header_end_stream_) {
+            reset_stream(id, http2_error::protocol_error);
+            return true;
+        }
+        if (malformed) {
+            reset_stream(id, http2_error::protocol_error);
+            return true;
+        }
+        if (header_end_stream_) {
+            stream->remote_closed = true;
+            if (stream->error_status == 0) {
+                finish_request(*stream);
+            }
+        }
+        return true;
+    }
+
+    bool on_headers(const http2_frame_header& header, std::string_view payload) {
+        if (header.stream_id == 0) {
+            return fail(http2_error::protocol_error);
+        }
+        if (header.flags & http2_flag_padded) {
+            if (payload.empty() || static_cast<uint8_t>(payload[0]) >= payload.length()) {
+                return fail(http2_error::protocol_error);
+            }
+            auto padding = static_cast<uint8_t>(payload[0]);
+            payload = payload.substr(1, payload.length() - 1 - padding);
+        }
+        if (header.flags & http2_flag_priority) {
+            //优先级已被RFC 9113废弃，只跳过这5个字节
+            if (payload.length() < 5) {
+                return fail(http2_error::frame_size_error);
+            }
+            payload.remove_prefix(5);
+        }
+        header_stream_ = header.stream_id;
+        header_end_stream_ = (header.flags & http2_flag_end_stream) != 0;
+        if (header.flags & http2_flag_end_headers) {
+            return on_header_block(payload);
+        }
+        continuation_expected_ = true;
+        header_block_.assign(payload);
+        return true;
+    }
+
+    bool on_continuation(const http2_frame_header& header, std::string_view payload) {
+        if (!continuation_expected_ || header.stream_id != header_stream_) {
+            return fail(http2_error::protocol_error);
+        }
+        header_block_.append(payload);
+        if (header_block_.length() > max_http_header_size) {
+            return fail(http2_error::enhance_your_calm);
+        }
+        if (header.flags & http2_flag_end_headers) {
+            continuation_expected_ = false;
+            auto ok = on_header_block(header_block_);
+            header_block_.clear();
+            return ok;
+        }
+        return true;
+    }
+
+    bool on_data(const http2_frame_header& header, std::string_view payload) {
+        if (header.stream_id == 0) {
+            return fail(http2_error::protocol_error);
+        }
+        //流量控制按整个帧的长度(含填充)计算
+        int64_t length = header.length;
+        receive_window_ -= length;
+        if (receive_window_ < 0) {
+            return fail(http2_error::flow_control_error);
+        }
+        unacknowledged_ += length;
+        if (unacknowledged_ >= http2_connection_window / 2) {
+            window_update(0, unacknowledged_);
+            receive_window_ += unacknowledged_;
+            unacknowledged_ = 0;
+        }
+        if (header.flags & http2_flag_padded) {
+            if (payload.empty() || static_cast<uint8_t>(payload[0]) >= payload.length()) {
+                return fail(http2_error::protocol_error);
+            }
+            auto padding = static_cast<uint8_t>(payload[0]);
+            payload = payload.substr(1, payload.length() - 1 - padding);
+        }
+        auto it = streams_.find(header.stream_id);
+        if (it == streams_.end()) {
+            //已关闭的流(可能刚被本端重置，对端还在途的数据)只计入连接窗口，不再回应
+            return header.stream_id <= last_stream_id_ || fail(http2_error::protocol_error);
+        }
+        auto& stream = *it->second;
+        if (stream.remote_closed) {
+            reset_stream(stream.id, http2_error::stream_closed);
+            return true;
+        }
+        stream.receive_window -= length;
+        if (stream.receive_window < 0) {
+            reset_stream(stream.id, http2_error::flow_control_error);
+            return true;
+        }
+        if (stream.error_status == 0) {
+            if (stream.body.length() + payload.length() > max_body_) {
+                //与HTTP/1.1一致以413响应，不再保存之后的内容
+                stream.error_status = 413;
+                stream.body.clear();
+                stream.body.shrink_to_fit();
+                ready_.push_back(stream.id);
+            } else {
+                stream.body.append(payload);
+            }
+        }
+        if (header.flags & http2_flag_end_stream) {
+            stream.remote_closed = true;
+            if (stream.error_status == 0) {
+                finish_request(stream);
+            }
+            return true;
+        }
+        stream.unacknowledged += length;
+        if (stream.unacknowledged >= http2_stream_window / 2) {
+            window_update(stream.id, stream.unacknowledged);
+            stream.receive_window += stream.unacknowledged;
+            stream.unacknowledged = 0;
+        }
+        return true;
+    }
+
+    bool on_window_update(const http2_frame_header& header, std::string_view payload) {
+        if (payload.length() != 4) {
+            return fail(http2_error::frame_size_error);
+        }
+        int64_t increment = read_http2_u32(payload.data()) & 0x7fffffff;
+        if (header.stream_id == 0) {
+            if (increment == 0) {
+                return fail(http2_error::protocol_error);
+            }
+            send_window_ += increment;
+            if (send_window_ > http2_max_window) {
+                return fail(http2_error::flow_control_error);
+            }
+            return true;
+        }
+        auto it = streams_.find(header.stream_id);
+        if (it == streams_.end()) {
+            //已关闭的流上的WINDOW_UPDATE直接忽略
+            return header.stream_id <= last_stream_id_ || fail(http2_error::protocol_error);
+        }
+        auto& stream = *it->second;
+        if (increment == 0) {
+            reset_stream(stream.id, http2_error::protocol_error);
+            return true;
+        }
+        stream.send_window += increment;
+        if (stream.send_window > http2_max_window) {
+            reset_stream(stream.id, http2_error::flow_control_error);
+            return true;
+        }
+        schedule(stream);
+        return true;
+    }
+
+    bool on_frame(const http2_frame_header& header, std::string_view payload) {
+        //连接前言之后的第一个帧必须是SETTINGS
+        if (!settings_received_ && header.type != http2_frame_type::settings) {
+            return fail(http2_error::protocol_error);
+        }
+        //首部块的各帧之间不能插入其他帧
+        if (continuation_expected_ && header.type != http2_frame_type::continuation) {
+            return fail(http2_error::protocol_error);
+        }
+        switch (header.type) {
+            case http2_frame_type::data:
+                return on_data(header, payload);
+            case http2_frame_type::headers:
+                return on_headers(header, payload);
+            case http2_frame_type::continuation:
+                return on_continuation(header, payload);
+            case http2_frame_type::priority:
+                if (header.stream_id == 0) {
+                    return fail(http2_error::protocol_error);
+                }
+                if (payload.length() != 5) {
+                    reset_stream(header.stream_id, http2_error::frame_size_error);
+                }
+                return true;
+            case http2_frame_type::rst_stream:
+                if (header.stream_id == 0 || header.stream_id > last_stream_id_) {
+                    return fail(http2_error::protocol_error);
+                }
+                if (payload.length() != 4) {
+                    return fail(http2_error::frame_size_error);
+                }
+                streams_.erase(header.stream_id);
+                return true;
+            case http2_frame_type::settings:
+                if (header.stream_id != 0) {
+                    return fail(http2_error::protocol_error);
+                }
+                if (header.flags & http2_flag_ack) {
+                    return payload.empty() || fail(http2_error::frame_size_error);
+                }
+                if (payload.length() % 6 != 0) {
+                    return fail(http2_error::frame_size_error);
+                }
+                settings_received_ = true;
+                if (!apply_settings(payload)) {
+                    return false;
+                }
+                append_http2_frame_header(control_, 0, http2_frame_type::settings, http2_flag_ack, 0);
+                return true;
+            case http2_frame_type::ping:
+                if (header.stream_id != 0) {
+                    return fail(http2_error::protocol_error);
+                }
+                if (payload.length() != 8) {
+                    return fail(http2_error::frame_size_error);
+                }
+                if ((header.flags & http2_flag_ack) == 0) {
+                    append_http2_frame_header(control_, 8, http2_frame_type::ping, http2_flag_ack, 0);
+                    control_.append(payload);
+                }
+                return true;
+            case http2_frame_type::goaway:
+                if (header.stream_id != 0) {
+                    return fail(http2_error::protocol_error);
+                }
+                //已经开始的流继续完成，不再接受新的流
+                goaway_received_ = true;
+                return true;
+            case http2_frame_type::window_update:
+                return on_window_update(header, payload);
+            case http2_frame_type::push_promise:
+                //客户端不能推送
+                return fail(http2_error::protocol_error);
+            default:
+                //未知类型的帧按规定忽略
+                return true;
+        }
+    }
+
+    /* 流的响应发送完毕：对端尚未结束请求时(例如413)用NO_ERROR重置，让它停止发送请求体 */
+    void complete_stream(http2_stream& stream) {
+        if (!stream.remote_closed) {
+            reset_stream(stream.id, http2_error::no_error);
+            return;
+        }
+        streams_.erase(stream.id);
+    }
+
+    /* 把响应体的接下来length字节作为一个DATA帧排入队列 */
+    void append_data(output_queue& out, http2_stream& stream, size_t length) {
+        stream.remaining -= length;
+        stream.send_window -= static_cast<int64_t>(length);
+        send_window_ -= static_cast<int64_t>(length);
+        std::string frame;
+        append_http2_frame_header(frame, length, http2_frame_type::data, stream.remaining == 0 ? http2_flag_end_stream : 0, stream.id);
+        out.append(std::move(frame));
+        while (length > 0) {
+            auto& piece = stream.pieces[stream.piece];
+            auto n = std::min(length, piece.length - stream.piece_offset);
+            if (piece.fd == -1) {
+                out.append(stream.source, std::string_view(piece.data + stream.piece_offset, n));
+            } else {
+                out.append_file(stream.source, piece.fd, piece.offset + static_cast<off_t>(stream.piece_offset), n);
+            }
+            length -= n;
+            stream.piece_offset += n;
+            if (stream.piece_offset == piece.length) {
+                ++stream.piece;
+                stream.piece_offset = 0;
+            }
+        }
+    }
+
+    /* 按片段在队列中的顺序列出内存片段与文件片段 */
+    static void collect_pieces(output_queue& source, std::vector<http2_body_piece>& pieces) {
+        auto& iov = source.iov();
+        auto& files = source.files();
+        size_t f = 0;
+        for (size_t i = 0; i <= iov.size(); ++i) {
+            while (f < files.size() && files[f].position == i) {
+                pieces.push_back({ nullptr, files[f].fd, files[f].offset, files[f].count });
+                ++f;
+            }
+            if (i < iov.size()) {
+                pieces.push_back({ static_cast<const char*>(iov[i].iov_base), -1, 0, iov[i].iov_len });
+            }
+        }
+    }
+
+    /* 首部块按对端的最大帧长切成HEADERS与CONTINUATION帧 */
+    void append_header_block(uint32_t id, std::string_view block, bool end_stream) {
+        auto type = http2_frame_type::headers;
+        do {
+            auto n = std::min(block.length(), peer_max_frame_size_);
+            uint8_t flags = n == block.length() ? http2_flag_end_headers : 0;
+            if (type == http2_frame_type::headers && end_stream) {
+                flags |= http2_flag_end_stream;
+            }
+            append_http2_frame_header(control_, n, type, flags, id);
+            control_.append(block.substr(0, n));
+            block.remove_prefix(n);
+            type = http2_frame_type::continuation;
+        } while (!block.empty());
+    }
+public:
+    explicit http2_session(size_t max_body) : max_body_(max_body) {}
+    http2_session(const http2_session&) = delete;
+    http2_session& operator=(const http2_session&) = delete;
+
+    /* 排入本端的SETTINGS，并把连接的接收窗口扩大到http2_connection_window */
+    void start() {
+        append_http2_frame_header(control_, 12, http2_frame_type::settings, 0, 0);
+        for (auto [id, value] : { std::pair { http2_setting::max_concurrent_streams, http2_max_concurrent_streams },
+                                  std::pair { http2_setting::initial_window_size, static_cast<size_t>(http2_stream_window) } }) {
+            control_.push_back(static_cast<char>(static_cast<uint16_t>(id) >> 8));
+            control_.push_back(static_cast<char>(id));
+            append_http2_u32(control_, static_cast<uint32_t>(value));
+        }
+        window_update(0, http2_connection_window - http2_default_window);
+        receive_window_ = http2_connection_window;
+    }
+
+    /* 从HTTP/1.1升级：请求成为半关闭的流1，HTTP2-Settings作为对端的初始设置。返回false时不应升级 */
+    bool upgrade(const http_request& request) {
+        std::string settings;
+        if (!base64_decode(request.header("HTTP2-Settings"), settings, true) || settings.length() % 6 != 0 || !apply_settings(settings)) {
+            return false;
+        }
+        last_stream_id_ = 1;
+        auto& stream = create_stream(1);
+        stream.fields.emplace_back(":method", request.method);
+        stream.fields.emplace_back(":scheme", "http");
+        stream.fields.emplace_back(":path", request.target);
+        for (size_t i = 0; i < request.header_count; ++i) {
+            auto& [name, value] = request.headers[i];
+            if (iequals(name, "Connection") || iequals(name, "Upgrade") || iequals(name, "HTTP2-Settings") || iequals(name, "Keep-Alive")) {
+                continue;
+            }
+            std::string lower(name);
+            std::transform(lower.begin(), lower.end(), lower.begin(), [](char c) { return c >= 'A' && c <= 'Z' ? c | 0x20 : c; });
+            stream.fields.emplace_back(std::move(lower), value);
+        }
+        stream.body.assign(request.body);
+        stream.remote_closed = true;
+        finish_request(stream);
+        return true;
+    }
+
+    /* 解析data中完整的帧，返回消耗的字节数；出现连接错误时返回-1，此时GOAWAY已排入队列 */
+    ssize_t receive(std::string_view data) {
+        if (failed_) {
+            return -1;
+        }
+        size_t pos = 0;
+        if (!preface_received_) {
+            if (data.length() < http2_preface.length()) {
+                return http2_preface.starts_with(data) ? 0 : (fail(http2_error::protocol_error), -1);
+            }
+            if (!data.starts_with(http2_preface)) {
+                fail(http2_error::protocol_error);
+                return -1;
+            }
+            preface_received_ = true;
+            pos = http2_preface.length();
+        }
+        while (data.length() - pos >= http2_frame_header_size) {
+            auto header = parse_http2_frame_header(data.data() + pos);
+            //本端没有调大SETTINGS_MAX_FRAME_SIZE
+            if (header.length > http2_default_frame_size) {
+                fail(http2_error::frame_size_error);
+                return -1;
+            }
+            if (data.length() - pos - http2_frame_header_size < header.length) {
+                break;
+            }
+            auto payload = data.substr(pos + http2_frame_header_size, header.length);
+            pos += http2_frame_header_size + header.length;
+            if (!on_frame(header, payload)) {
+                return -1;
+            }
+        }
+        return static_cast<ssize_t>(pos);
+    }
+
+    /*
+     * 下一个等待响应的流，没有时返回nullptr。收到对端的SETTINGS之前不交出请求：
+     * 升级时流1的响应因此在101与本端SETTINGS之后单独写出，不会和它们一起被客户端当作升级响应之后的残余数据。
+     */
+    std::shared_ptr<http2_stream> next_request() {
+        if (!settings_received_) {
+            return nullptr;
+        }
+        while (!ready_.empty()) {
+            auto id = ready_.front();
+            ready_.pop_front();
+            auto it = streams_.find(id);
+            if (it != streams_.end() && !it->second->dispatched) {
+                it->second->dispatched = true;
+                return it->second;
+            }
+        }
+        return nullptr;
+    }
+
+    /*
+     * 提交流的响应，source为按HTTP/1.1生成的完整报文：响应头转成HEADERS帧(去掉连接级的首部)，
+     * 响应体的片段留在source中，由write()按流量控制窗口逐帧发送。生成响应期间流已被重置时丢弃响应。
+     */
+    void submit_response(http2_stream& stream, std::shared_ptr<output_queue> source) {
+        if (auto it = streams_.find(stream.id); it == streams_.end() || it->second.get() != &stream) {
+            return;
+        }
+        stream.source = std::move(source);
+        collect_pieces(*stream.source, stream.pieces);
+        //响应头总是位于开头的内存片段中
+        std::string head;
+        size_t body_piece = stream.pieces.size();
+        size_t body_offset = 0;
+        for (size_t i = 0; i < stream.pieces.size() && stream.pieces[i].fd == -1; ++i) {
+            auto searched = head.length() >= 3 ? head.length() - 3 : 0;
+            head.append(stream.pieces[i].data, stream.pieces[i].length);
+            auto end = head.find("\r\n\r\n", searched);
+            if (end != std::string::npos) {
+                body_offset = stream.pieces[i].length - (head.length() - end - 4);
+                head.resize(end + 4);
+                body_piece = i;
+                break;
+            }
+        }
+        http_response_head response;
+        if (body_piece == stream.pieces.size() || parse_http_response_head(head, response) <= 0) {
+            reset_stream(stream.id, http2_error::internal_error);
+            return;
+        }
+        stream.piece = body_piece;
+        stream.piece_offset = body_offset;
+        if (stream.piece_offset == stream.pieces[body_piece].length) {
+            ++stream.piece;
+            stream.piece_offset = 0;
+        }
+        stream.remaining = 0;
+        for (size_t i = stream.piece; i < stream.pieces.size(); ++i) {
+            stream.remaining += stream.pieces[i].length;
+        }
+        stream.remaining -= stream.piece_offset;
+        if (response.chunked && stream.remaining > 0) {
+            //HTTP/2自己划分DATA帧，分块编码的框架需要先去掉
+            std::string body;
+            body.reserve(stream.remaining);
+            for (size_t i = stream.piece; i < stream.pieces.size(); ++i) {
+                auto& piece = stream.pieces[i];
+                auto skip = i == stream.piece ? stream.piece_offset : 0;
+                if (piece.fd == -1) {
+                    body.append(piece.data + skip, piece.length - skip);
+                } else {
+                    auto start = body.length();
+                    body.resize(start + piece.length - skip);
+                    if (pread(piece.fd, body.data() + start, piece.length - skip, piece.offset + static_cast<off_t>(skip)) != static_cast<ssize_t>(piece.length - skip)) {
+                        reset_stream(stream.id, http2_error::internal_error);
+                        return;
+                    }
+                }
+            }
+            chunked_decoder decoder;
+            size_t produced;
+            if (decoder.decode(body.data(), body.length(), body.data(), produced) < 0) {
+                reset_stream(stream.id, http2_error::internal_error);
+                return;
+            }
+            body.resize(produced);
+            auto decoded = std::make_shared<output_queue>();
+            decoded->append(std::move(body));
+            stream.source = std::move(decoded);
+            stream.pieces.clear();
+            collect_pieces(*stream.source, stream.pieces);
+            stream.piece = 0;
+            stream.piece_offset = 0;
+            stream.remaining = produced;
+        }
+        std::string block;
+        encoder_.begin_block(block);
+        encoder_.encode(block, ":status", std::to_string(response.status));
+        std::string name;
+        for (size_t i = 0; i < response.header_count; ++i) {
+            auto& header = response.headers[i];
+            if (iequals(header.name, "Connection") || iequals(header.name, "Keep-Alive") || iequals(header.name, "Transfer-Encoding")
+                || iequals(header.name, "Upgrade") || iequals(header.name, "Proxy-Connection")) {
+                continue;
+            }
+            name.assign(header.name);
+            std::transform(name.begin(), name.end(), name.begin(), [](char c) { return c >= 'A' && c <= 'Z' ? c | 0x20 : c; });
+            encoder_.encode(block, name, header.value);
+        }
+        append_header_block(stream.id, block, stream.remaining == 0);
+        if (stream.remaining == 0) {
+            complete_stream(stream);
+            return;
+        }
+        schedule(stream);
+    }
+
+    /*
+     * 把待发送的帧排入out：先是控制帧与HEADERS帧，然后在有响应体的流之间轮转，
+     * 每次发送一个不超过对端最大帧长与两级窗口的DATA帧，直到用完窗口或本次的配额。
+     */
+    void write(output_queue& out) {
+        if (!control_.empty()) {
+            out.append(std::move(control_));
+            control_.clear();
+        }
+        size_t budget = http2_write_quantum;
+        while (budget > 0 && send_window_ > 0 && !sendable_.empty()) {
+            auto id = sendable_.front();
+            sendable_.pop_front();
+            auto it = streams_.find(id);
+            if (it == streams_.end()) {
+                continue;
+            }
+            auto& stream = *it->second;
+            stream.scheduled = false;
+            if (stream.send_window <= 0) {
+                //等待该流的WINDOW_UPDATE
+                continue;
+            }
+            auto n = std::min({ stream.remaining, peer_max_frame_size_, static_cast<size_t>(stream.send_window), static_cast<size_t>(send_window_), budget });
+            append_data(out, stream, n);
+            budget -= n;
+            if (stream.remaining == 0) {
+                complete_stream(stream);
+            } else {
+                schedule(stream);
+            }
+        }
+        if (!control_.empty()) {
+            out.append(std::move(control_));
+            control_.clear();
+        }
+    }
+
+    /* 还有可以立即发送的DATA帧(本次配额用完或控制帧待写出) */
+    [[nodiscard]] bool wants_write() const {
+        return !control_.empty() || (send_window_ > 0 && !sendable_.empty());
+    }
+
+    /* 开始关闭：发送GOAWAY，已经开始的流继续完成 */
+    void shutdown() {
+        if (going_away_) {
+            return;
+        }
+        going_away_ = true;
+        append_http2_frame_header(control_, 8, http2_frame_type::goaway, 0, 0);
+        append_http2_u32(control_, last_stream_id_);
+        append_http2_u32(control_, static_cast<uint32_t>(http2_error::no_error));
+    }
+
+    /* 没有进行中的流 */
+    [[nodiscard]] bool idle() const {
+        return streams_.empty();
+    }
+
+    /* 连接可以关闭：出现连接错误，或者某一方已发送GOAWAY且所有流都已完成 */
+    [[nodiscard]] bool finished() const {
+        return failed_ || ((going_away_ || goaway_received_) && streams_.empty());
+    }
+};
@@ -2,30 +2,44 @@
 
 #include <stacktrace.h>
 
+#include <deque>
 #include <string>
 #include <exception>
+#include <expected>
 #include <format>
 #include <iostream>
 #include <fstream>
 #include <filesystem>
+#include <memory>
+#include <vector>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 
 class io_exception : public std::exception {
     std::string msg;
+    stack_trace trace_;
 public:
-    io_exception(std::string&& who, std::string&& reason) : msg(std::format("met an IO exception when {} was called: {}", who, reason)) {}
+    io_exception(std::string&& who, std::string&& reason) : msg(std::format("met an IO exception when {} was called: {}", who, reason)), trace_(stack_trace::capture(1)) {}
+    io_exception(std::string&& who, std::string&& reason, no_stack_trace_t) : msg(std::format("met an IO exception when {} was called: {}", who, reason)) {}
     [[nodiscard]] const char *what() const noexcept override {
         return msg.c_str();
     }
+    /* 抛出位置的调用栈，以no_stack_trace构造时为空 */
+    [[nodiscard]] const stack_trace& trace() const {
+        return trace_;
+    }
     void print() const {
 #ifdef ENABLE_ANSI_DISPLAY
         std::cout << "\033[31m" << std::endl;
 #endif
         std::cout << msg << std::endl;
-        std::cout << "[STACKTRACE]" << std::endl;
-        std::cout << get_stack_trace() << std::endl;
+        if (!trace_.empty()) {
+            std::cout << "[STACKTRACE]" << std::endl;
+            std::cout << trace_.to_string() << std::endl;
+        }
 #ifdef ENABLE_ANSI_DISPLAY
         std::cout << "\033[39m" << std::endl;
 #endif
@@ -58,23 +72,67 @@ inline void check_path_exists(std::filesystem::path path, std::filesystem::file_
     }
 }
 
-inline void writefd(int fd, char* buf, size_t size) {
+/*
+ * 预期内的I/O情况。try_前缀的函数以std::expected返回这些情况，不展开调用栈也不格式化消息；
+ * 其余真正的错误仍然抛出io_exception。不带try_前缀的函数是对应版本的包装，遇到这些情况时抛出异常。
+ */
+enum class io_error {
+    //非阻塞fd上暂时无法继续读写
+    again,
+    //对端已关闭
+    eof,
+    //连接被对端重置或写入已关闭的连接(ECONNRESET/EPIPE)
+    reset,
+};
+
+inline std::string_view get_io_error_name(io_error error) {
+    switch (error) {
+        case io_error::again: return "would block";
+        case io_error::eof: return "met EOF";
+        case io_error::reset: return "connection reset by peer";
+        default: return "unknown";
+    }
+}
+
+/* 阻塞地等待fd可写，用于非阻塞fd上已经写出一部分、必须写完才能保持消息边界的场合 */
+inline void wait_writable(int fd) {
+    pollfd pfd { fd, POLLOUT, 0 };
+    while (poll(&pfd, 1, -1) == -1 && errno == EINTR) {}
+}
+
+/*
+ * 写出全部数据。非阻塞fd上一个字节都还没写出就遇到EAGAIN时返回io_error::again，由调用者决定稍后重试或另作处理；
+ * 已经写出一部分时等待fd可写后写完剩余部分，不会在流中留下半条消息
+ */
+inline std::expected<void, io_error> try_writefd(int fd, const char* buf, size_t size) {
     size_t left = size;
-    char* off = buf;
+    const char* off = buf;
     while (left > 0) {
         auto bytes_write = write(fd, off, left);
         if (bytes_write == -1) {
-            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (left == size) {
+                    return std::unexpected(io_error::again);
+                }
+                wait_writable(fd);
                 continue;
             }
+            if (errno == EPIPE || errno == ECONNRESET) {
+                return std::unexpected(io_error::reset);
+            }
             throw io_exception("writefd()", std::format("Write fd {} met an error {}. Bytes left: {}, Total: {}", fd, strerror(errno), left, size));
         }
         left -= bytes_write;
         off += bytes_write;
     }
+    return {};
 }
 
-inline void readfd(int fd, char* buf, size_t size) {
+/* 读满size字节(EAGAIN时重试)，对端在读满之前关闭时返回io_error::eof */
+inline std::expected<void, io_error> try_readfd(int fd, char* buf, size_t size) {
     size_t left = size;
     char* off = buf;
     while (left > 0) {
@@ -83,19 +141,437 @@ inline void readfd(int fd, char* buf, size_t size) {
             if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
                 continue;
             }
+            if (errno == ECONNRESET) {
+                return std::unexpected(io_error::reset);
+            }
             throw io_exception("readfd()", std::format("Read fd {} met an error {}. Bytes left: {}, Total: {}", fd, strerror(errno), left, size));
         }
+        if (bytes_read == 0) {
+            return std::unexpected(io_error::eof);
+        }
         left -= bytes_read;
         off += bytes_read;
     }
+    return {};
+}
+
+inline void writefd(int fd, char* buf, size_t size) {
+    auto r = try_writefd(fd, buf, size);
+    while (!r && r.error() == io_error::again) {
+        wait_writable(fd);
+        r = try_writefd(fd, buf, size);
+    }
+    if (!r) {
+        throw io_exception("writefd()", std::format("Write fd {} met an error {}. Total: {}", fd, get_io_error_name(r.error()), size), no_stack_trace);
+    }
+}
+
+inline void readfd(int fd, char* buf, size_t size) {
+    auto r = try_readfd(fd, buf, size);
+    if (!r) {
+        throw io_exception("readfd()", std::format("Read fd {} met an error {}. Total: {}", fd, get_io_error_name(r.error()), size), no_stack_trace);
+    }
+}
+
+/*
+ * 通过Unix域套接字(SCM_RIGHTS)向对端传递一个文件描述符，tag为随描述符一同发送的一个字节的附加数据。
+ * 对端已关闭时返回io_error::reset，非阻塞套接字的发送缓冲已满时返回io_error::again(描述符没有发出)
+ */
+inline std::expected<void, io_error> try_send_fd(int sock, int fd, char tag = 0) {
+    iovec iov { &tag, 1 };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] {};
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    while (sendmsg(sock, &msg, MSG_NOSIGNAL) == -1) {
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return std::unexpected(io_error::again);
+        }
+        if (errno == EPIPE || errno == ECONNRESET) {
+            return std::unexpected(io_error::reset);
+        }
+        throw io_exception("send_fd()", std::format("cannot send fd {} through {}: {}", fd, sock, strerror(errno)));
+    }
+    return {};
 }
 
+inline void send_fd(int sock, int fd, char tag = 0) {
+    auto r = try_send_fd(sock, fd, tag);
+    if (!r) {
+        throw io_exception("send_fd()", std::format("cannot send fd {} through {}: {}", fd, sock, get_io_error_name(r.error())), no_stack_trace);
+    }
+}
+
+/* try_recv_fd()收到的消息，fd为-1表示这是一个不带描述符的单字节消息(命令) */
+struct received_fd {
+    int fd;
+    char tag;
+};
+
+/* 从Unix域套接字接收一个由send_fd()传来的文件描述符。对端关闭时返回io_error::eof，非阻塞套接字上暂无数据时返回io_error::again */
+inline std::expected<received_fd, io_error> try_recv_fd(int sock) {
+    char byte = 0;
+    iovec iov { &byte, 1 };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] {};
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t r;
+    while ((r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1) {
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return std::unexpected(io_error::again);
+        }
+        if (errno == ECONNRESET) {
+            return std::unexpected(io_error::eof);
+        }
+        throw io_exception("recv_fd()", std::format("cannot receive fd through {}: {}", sock, strerror(errno)));
+    }
+    if (r == 0) {
+        return std::unexpected(io_error::eof);
+    }
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS) {
+        return received_fd { -1, byte };
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return received_fd { fd, byte };
+}
+
+constexpr static int fd_eof = -1;
+constexpr static int fd_again = -2;
+constexpr static int fd_none = -3;
+
+/*
+ * try_recv_fd()的兼容版本，tag非空时写入附加的一个字节。
+ * 对端关闭时返回fd_eof，非阻塞套接字上暂无数据时返回fd_again，收到不带描述符的单字节消息时返回fd_none。
+ */
+inline int recv_fd(int sock, char* tag = nullptr) {
+    auto r = try_recv_fd(sock);
+    if (!r) {
+        return r.error() == io_error::again ? fd_again : fd_eof;
+    }
+    if (tag != nullptr) {
+        *tag = r->tag;
+    }
+    return r->fd == -1 ? fd_none : r->fd;
+}
+
+/*
+ * 在用户态加解密的字节流，例如内核不支持kTLS时的TLS连接。io_loop对附加了stream_cipher的fd不直接读写套接字，
+ * 而是经由read()/write()，返回值约定与read(2)/write(2)相同，暂时无法继续时返回-1并把errno置为EAGAIN。
+ * 已经交给内核加解密的方向(kTLS)把对应的标志置为false，该方向仍直接使用系统调用(包括sendfile与splice)。
+ */
+class stream_cipher {
+protected:
+    bool decrypts_reads_ {true};
+    bool encrypts_writes_ {true};
+public:
+    virtual ~stream_cipher() = default;
+    virtual ssize_t read(char* buf, size_t size) = 0;
+    virtual ssize_t write(const char* buf, size_t size) = 0;
+
+    [[nodiscard]] bool decrypts_reads() const {
+        return decrypts_reads_;
+    }
+    [[nodiscard]] bool encrypts_writes() const {
+        return encrypts_writes_;
+    }
+};
+
+/*
+ * 连接上可复用的接收缓冲。数据直接读入缓冲尾部的空闲空间，未消费的数据位于[begin_, end_)。
+ * 读取时用readv同时读入尾部空间和一块线程局部的溢出区，一次系统调用就能读完内核中的数据；
+ * 只有溢出区被用到时才需要腾挪：先尝试把未消费的数据搬到缓冲开头(压缩)，放不下时才换用更大的存储。
+ * 存储分三级：常见的小请求完全放在对象内的inline_中；放不下时从receive_buffer_pool借一块固定大小的缓冲；
+ * 超过一块时才在堆上分配。全部数据被消费后归还借用的存储并回到inline_，空闲连接因此不占用额外内存。
+ */
+class receive_buffer {
+private:
+    constexpr static size_t spill_size = 64 * 1024;
+    enum class storage {
+        inline_storage,
+        pooled,
+        heap,
+    };
+    char* data_;
+    size_t capacity_;
+    size_t begin_ {0};
+    size_t end_ {0};
+    storage storage_ {storage::inline_storage};
+
+    static char* spill() {
+        thread_local char buffer[spill_size];
+        return buffer;
+    }
+
+    void drop_storage() {
+        if (storage_ == storage::pooled) {
+            receive_buffer_pool::local().give_back(data_);
+        } else if (storage_ == storage::heap) {
+            delete[] data_;
+        }
+    }
+
+    void reset() {
+        if (storage_ != storage::inline_storage) {
+            drop_storage();
+            data_ = inline_;
+            capacity_ = inline_capacity;
+            storage_ = storage::inline_storage;
+        }
+        begin_ = end_ = 0;
+    }
+
+    /* 保证尾部至少有need字节空闲，优先压缩，其次换用更大的存储 */
+    void reserve(size_t need) {
+        if (capacity_ - end_ >= need) {
+            return;
+        }
+        auto pending = end_ - begin_;
+        if (capacity_ - pending >= need) {
+            std::memmove(data_, data_ + begin_, pending);
+        } else {
+            char* data;
+            size_t capacity;
+            storage kind;
+            if (pending + need <= receive_buffer_pool::block_size) {
+                data = receive_buffer_pool::local().borrow();
+                capacity = receive_buffer_pool::block_size;
+                kind = storage::pooled;
+            } else {
+                capacity = std::max(capacity_ * 2, pending + need);
+                data = new char[capacity];
+                kind = storage::heap;
+            }
+            std::memcpy(data, data_ + begin_, pending);
+            drop_storage();
+            data_ = data;
+            capacity_ = capacity;
+            storage_ = kind;
+        }
+        begin_ = 0;
+        end_ = pending;
+    }
+public:
+    constexpr static size_t inline_capacity = 1024;
+
+    receive_buffer() : data_(inline_), capacity_(inline_capacity) {}
+    receive_buffer(const receive_buffer&) = delete;
+    receive_buffer& operator=(const receive_buffer&) = delete;
+    ~receive_buffer() {
+        drop_storage();
+    }
+
+    /* 尚未消费的数据，下一次read_from()或consume()之前保持有效 */
+    [[nodiscard]] std::string_view data() const {
+        return { data_ + begin_, end_ - begin_ };
+    }
+    /* 未消费数据的可写指针，供就地解码(例如去掉分块编码的框架)使用 */
+    char* writable_data() {
+        return data_ + begin_;
+    }
+    [[nodiscard]] size_t size() const {
+        return end_ - begin_;
+    }
+    [[nodiscard]] bool empty() const {
+        return begin_ == end_;
+    }
+    [[nodiscard]] size_t capacity() const {
+        return capacity_;
+    }
+
+    /* 标记前n字节已被消费，全部消费后归还借用的存储 */
+    void consume(size_t n) {
+        begin_ += n;
+        if (begin_ == end_) {
+            reset();
+        }
+    }
+
+    /* 从fd读取当前可读的数据，返回读取的字节数。对端关闭返回io_error::eof，暂无数据返回io_error::again */
+    std::expected<size_t, io_error> read_from(int fd) {
+        //尾部空间太小时先压缩，避免每次都只能读入几个字节
+        if (capacity_ - end_ < capacity_ / 4 && begin_ > 0) {
+            reserve(capacity_ - (end_ - begin_));
+        }
+        iovec iov[2] = {
+            { data_ + end_, capacity_ - end_ },
+            { spill(), spill_size },
+        };
+        ssize_t r;
+        while ((r = readv(fd, iov, 2)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return std::unexpected(io_error::again);
+            }
+            if (errno == ECONNRESET) {
+                return std::unexpected(io_error::reset);
+            }
+            throw io_exception("receive_buffer::read_from()", std::format("readv() failed on fd {}: {}", fd, strerror(errno)));
+        }
+        if (r == 0) {
+            return std::unexpected(io_error::eof);
+        }
+        auto n = static_cast<size_t>(r);
+        auto tail = capacity_ - end_;
+        if (n <= tail) {
+            end_ += n;
+        } else {
+            end_ = capacity_;
+            reserve(n - tail);
+            std::memcpy(data_ + end_, spill(), n - tail);
+            end_ += n - tail;
+        }
+        return n;
+    }
+
+    /* 经由cipher读取解密后的数据，返回值与read_from(int)相同，协议错误按连接被重置处理 */
+    std::expected<size_t, io_error> read_from(stream_cipher& cipher) {
+        if (capacity_ - end_ < capacity_ / 4 && begin_ > 0) {
+            reserve(capacity_ - (end_ - begin_));
+        }
+        //解密后的数据已在用户态，不需要溢出区，直接保证尾部有足够的空间
+        reserve(cipher_read_size);
+        ssize_t r;
+        while ((r = cipher.read(data_ + end_, capacity_ - end_)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return std::unexpected(io_error::again);
+            }
+            return std::unexpected(io_error::reset);
+        }
+        if (r == 0) {
+            return std::unexpected(io_error::eof);
+        }
+        end_ += static_cast<size_t>(r);
+        return static_cast<size_t>(r);
+    }
+private:
+    constexpr static size_t cipher_read_size = 4096;
+    char inline_[inline_capacity];
+};
+
+/*
+ * 待发送数据的队列，由若干片段组成，通过writev一次写出。片段可以是队列自己持有的字符串，
+ * 也可以是共享数组缓冲中的一段(只增加引用计数，不复制内容)，或者是生命周期足够长的静态数据。
+ * 队列中还可以夹带文件片段，写到该位置时改用sendfile发送。
+ */
+class output_queue {
+public:
+    /* 在第position个内存片段之前，用sendfile发送fd中[offset, offset + count)的内容 */
+    struct file_segment {
+        size_t position;
+        int fd;
+        off_t offset;
+        size_t count;
+    };
+private:
+    //deque在尾部追加时不会移动已有元素，片段指针保持有效
+    std::deque<std::string> strings_;
+    std::deque<general_shared_array_buffer_t> buffers_;
+    //持有片段所在内存(或文件)的对象，例如文件缓存中的映射
+    std::deque<std::shared_ptr<const void>> owners_;
+    std::vector<iovec> iov_;
+    std::vector<file_segment> files_;
+    size_t bytes_ {0};
+public:
+    output_queue() = default;
+    output_queue(const output_queue&) = delete;
+    output_queue& operator=(const output_queue&) = delete;
+
+    void append(std::string data) {
+        if (data.empty()) {
+            return;
+        }
+        auto& s = strings_.emplace_back(std::move(data));
+        iov_.push_back({ s.data(), s.length() });
+        bytes_ += s.length();
+    }
+    /* 追加共享缓冲中[offset, offset + length)这一段，队列清空前缓冲保持存活 */
+    void append(const general_shared_array_buffer_t& buffer, size_t offset, size_t length) {
+        if (length == 0) {
+            return;
+        }
+        auto& b = buffers_.emplace_back(buffer);
+        iov_.push_back({ b.pointer() + offset, length });
+        bytes_ += length;
+    }
+    /* 追加静态数据，调用者保证其在队列清空前有效 */
+    void append_static(std::string_view data) {
+        if (data.empty()) {
+            return;
+        }
+        iov_.push_back({ const_cast<char*>(data.data()), data.length() });
+        bytes_ += data.length();
+    }
+    /* 追加owner所持有的一段内存，队列清空前owner保持存活 */
+    void append(std::shared_ptr<const void> owner, std::string_view data) {
+        if (data.empty()) {
+            return;
+        }
+        owners_.push_back(std::move(owner));
+        append_static(data);
+    }
+    /* 追加文件的一段，发送时使用sendfile，队列清空前owner(通常持有fd)保持存活 */
+    void append_file(std::shared_ptr<const void> owner, int fd, off_t offset, size_t count) {
+        if (count == 0) {
+            return;
+        }
+        owners_.push_back(std::move(owner));
+        files_.push_back({ iov_.size(), fd, offset, count });
+        bytes_ += count;
+    }
+
+    [[nodiscard]] bool empty() const {
+        return bytes_ == 0;
+    }
+    [[nodiscard]] size_t bytes() const {
+        return bytes_;
+    }
+    std::vector<iovec>& iov() {
+        return iov_;
+    }
+    [[nodiscard]] const std::vector<file_segment>& files() const {
+        return files_;
+    }
+
+    void clear() {
+        strings_.clear();
+        buffers_.clear();
+        owners_.clear();
+        iov_.clear();
+        files_.clear();
+        bytes_ = 0;
+    }
+};
+
 class nonblocking_socket_stream {
 private:
     int fd_;
 public:
     explicit nonblocking_socket_stream(int fd) : fd_(fd) {}
-    [[nodiscard]] general_array_buffer_t read() const {
+    /* 读出当前可读的全部数据，对端关闭时返回io_error::eof */
+    [[nodiscard]] std::expected<general_array_buffer_t, io_error> try_read() const {
         general_array_buffer_t buffer(1024);
         buffer_stream stream(buffer);
         stream.set_auto_expand(true);
@@ -106,9 +582,15 @@ public:
                 if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
                     break;
                 }
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == ECONNRESET) {
+                    return std::unexpected(io_error::reset);
+                }
+                throw io_exception("nonblocking_socket_stream::read()", std::format("recv() failed: {}", strerror(errno)));
             } else if (r == 0) {
-                //遇到SOCKET EOF标记，抛出一个EOF异常
-                throw io_exception("nonblocking_socket_stream::read()", "met EOF");
+                return std::unexpected(io_error::eof);
             } else {
                 if (!stream.append(tmp, r)) {
                     throw io_exception("nonblocking_socket_stream::read()", "cannot write buffer");
@@ -117,6 +599,13 @@ public:
         }
         return buffer;
     }
+    [[nodiscard]] general_array_buffer_t read() const {
+        auto r = try_read();
+        if (!r) {
+            throw io_exception("nonblocking_socket_stream::read()", std::string(get_io_error_name(r.error())), no_stack_trace);
+        }
+        return std::move(*r);
+    }
     void write(general_array_buffer_t buffer) {
         buffer_stream stream(buffer);
         std::string_view str = stream.get_as();
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <stacktrace.h>
+#include <metrics.h>
 
+#include <algorithm>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
@@ -16,18 +18,26 @@
 
 class memory_exception : std::exception {
     std::string msg;
+    stack_trace trace_;
 public:
-    memory_exception(std::string&& who, std::string&& reason) : msg(std::format("met an memory exception when {} was called: {}", who, reason)) {}
+    memory_exception(std::string&& who, std::string&& reason) : msg(std::format("met an memory exception when {} was called: {}", who, reason)), trace_(stack_trace::capture(1)) {}
+    memory_exception(std::string&& who, std::string&& reason, no_stack_trace_t) : msg(std::format("met an memory exception when {} was called: {}", who, reason)) {}
     [[nodiscard]] const char *what() const noexcept override {
         return msg.c_str();
     }
+    /* 抛出位置的调用栈，以no_stack_trace构造时为空 */
+    [[nodiscard]] const stack_trace& trace() const {
+        return trace_;
+    }
     void print() const {
 #ifdef ENABLE_ANSI_DISPLAY
         std::cout << "\033[31m" << std::endl;
 #endif
         std::cout << msg << std::endl;
-        std::cout << "[STACKTRACE]" << std::endl;
-        std::cout << get_stack_trace() << std::endl;
+        if (!trace_.empty()) {
+            std::cout << "[STACKTRACE]" << std::endl;
+            std::cout << trace_.to_string() << std::endl;
+        }
 #ifdef ENABLE_ANSI_DISPLAY
         std::cout << "\033[39m" << std::endl;
 #endif
@@ -63,6 +73,8 @@ public:
         if (ptr == nullptr) {
             throw memory_exception("heap_allocator::allocate()", "malloc() returned nullptr");
         }
+        metrics_count(counter_id::allocations);
+        metrics_count(counter_id::allocated_bytes, size);
         ptrs_.push_back(ptr);
         return ptr;
     }
@@ -74,6 +86,7 @@ public:
                 if (recorded == nullptr) {
                     throw memory_exception("heap_allocator::reallocate()", "realloc() returned nullptr");
                 }
+                metrics_count(counter_id::reallocations);
                 return recorded;
             }
         }
@@ -98,11 +111,17 @@ private:
     struct aligned_chunk {
         void* ptr;
         size_t offset;
+        size_t size;
     };
 
     std::vector<aligned_chunk> ptrs_ {};
     std::mutex mtx_;
     int align_ {};
+
+    /* 计算base向上对齐到align_所需的偏移量 */
+    size_t offset_of(void* base) const {
+        return (align_ - reinterpret_cast<size_t>(base) % align_) % align_;
+    }
 public:
     explicit aligned_heap_allocator(int align) : align_(align) {}
     aligned_heap_allocator(const aligned_heap_allocator&) = delete;
@@ -115,9 +134,11 @@ public:
         if (ptr == nullptr) {
             throw memory_exception("aligned_heap_allocator::allocate()", "malloc() returned nullptr");
         }
-        size_t offset = reinterpret_cast<size_t>(ptr) % align_;
+        metrics_count(counter_id::allocations);
+        metrics_count(counter_id::allocated_bytes, size);
+        size_t offset = offset_of(ptr);
         ptr = reinterpret_cast<void*>(reinterpret_cast<size_t>(ptr) + offset);
-        ptrs_.push_back({ ptr, offset });
+        ptrs_.push_back({ ptr, offset, size });
         return ptr;
     }
     void* reallocate(void* ptr, size_t size) {
@@ -128,8 +149,13 @@ public:
                 if (base == nullptr) {
                     throw memory_exception("aligned_heap_allocator::reallocate()", "realloc() returned nullptr");
                 }
-                size_t offset = reinterpret_cast<size_t>(base) % align_;
-                record = {reinterpret_cast<void*>(reinterpret_cast<size_t>(base) + offset), offset};
+                metrics_count(counter_id::reallocations);
+                size_t offset = offset_of(base);
+                if (offset != record.offset) {
+                    //realloc()只保证按原偏移复制数据，对齐偏移变化时需要把数据挪到新的对齐位置
+                    memmove(reinterpret_cast<char*>(base) + offset, reinterpret_cast<char*>(base) + record.offset, std::min(record.size, size));
+                }
+                record = {reinterpret_cast<void*>(reinterpret_cast<size_t>(base) + offset), offset, size};
                 return record.ptr;
             }
         }
@@ -138,7 +164,7 @@ public:
     void release() {
         std::lock_guard lock(mtx_);
         for (auto& record: ptrs_) {
-            free(record.ptr);
+            free(reinterpret_cast<void*>(reinterpret_cast<size_t>(record.ptr) - record.offset));
         }
         ptrs_.clear();
     }
@@ -149,6 +175,145 @@ public:
     }
 };
 
+/*
+ * 线程本地的分级内存池。按granularity字节划分尺寸等级，释放的内存块挂回本线程对应等级的空闲链表中以供复用，
+ * 适用于协程帧这类频繁分配、尺寸固定的对象。超过max_pooled_size的请求直接交给malloc()/free()。
+ */
+class pooled_allocator {
+private:
+    constexpr static size_t granularity = 64;
+    constexpr static size_t max_pooled_size = 4096;
+    constexpr static size_t classes = max_pooled_size / granularity;
+    struct free_block {
+        free_block* next;
+    };
+    free_block* free_lists_[classes] {};
+
+    static size_t class_of(size_t size) {
+        return (size + granularity - 1) / granularity - 1;
+    }
+public:
+    pooled_allocator() = default;
+    pooled_allocator(const pooled_allocator&) = delete;
+    pooled_allocator& operator=(const pooled_allocator&) = delete;
+
+    /* 返回当前线程的内存池 */
+    static pooled_allocator& local() {
+        thread_local pooled_allocator allocator;
+        return allocator;
+    }
+
+    void* allocate(size_t size) {
+        if (size == 0 || size > max_pooled_size) {
+            void* ptr = malloc(size);
+            if (ptr == nullptr) {
+                throw memory_exception("pooled_allocator::allocate()", "malloc() returned nullptr");
+            }
+            return ptr;
+        }
+        metrics_count(counter_id::pool_allocations);
+        auto cls = class_of(size);
+        if (free_lists_[cls] != nullptr) {
+            auto block = free_lists_[cls];
+            free_lists_[cls] = block->next;
+            return block;
+        }
+        metrics_count(counter_id::pool_misses);
+        void* ptr = malloc((cls + 1) * granularity);
+        if (ptr == nullptr) {
+            throw memory_exception("pooled_allocator::allocate()", "malloc() returned nullptr");
+        }
+        return ptr;
+    }
+
+    /* 归还内存块，size必须与allocate()时传入的大小一致 */
+    void deallocate(void* ptr, size_t size) {
+        if (ptr == nullptr) {
+            return;
+        }
+        if (size == 0 || size > max_pooled_size) {
+            free(ptr);
+            return;
+        }
+        auto cls = class_of(size);
+        auto block = reinterpret_cast<free_block*>(ptr);
+        block->next = free_lists_[cls];
+        free_lists_[cls] = block;
+    }
+
+    ~pooled_allocator() {
+        for (auto& head : free_lists_) {
+            while (head != nullptr) {
+                auto next = head->next;
+                free(head);
+                head = next;
+            }
+        }
+    }
+};
+
+/*
+ * 固定大小接收缓冲块的池。连接只在有未处理完的数据时借用一块，数据全部消费后立即归还，
+ * 因此大量空闲keep-alive连接不会各自占用一块缓冲。池是线程本地的(同一事件循环上的连接共享)，借还不需要加锁；
+ * 空闲块最多缓存max_cached个，超出的直接释放。
+ */
+class receive_buffer_pool {
+private:
+    struct free_block {
+        free_block* next;
+    };
+    free_block* free_list_ {nullptr};
+    size_t cached_ {0};
+public:
+    constexpr static size_t block_size = 16 * 1024;
+    constexpr static size_t max_cached = 256;
+
+    receive_buffer_pool() = default;
+    receive_buffer_pool(const receive_buffer_pool&) = delete;
+    receive_buffer_pool& operator=(const receive_buffer_pool&) = delete;
+
+    /* 返回当前线程的缓冲池 */
+    static receive_buffer_pool& local() {
+        thread_local receive_buffer_pool pool;
+        return pool;
+    }
+
+    char* borrow() {
+        metrics_gauge(gauge_id::receive_buffers_borrowed, 1);
+        if (free_list_ != nullptr) {
+            auto block = free_list_;
+            free_list_ = block->next;
+            --cached_;
+            return reinterpret_cast<char*>(block);
+        }
+        void* ptr = malloc(block_size);
+        if (ptr == nullptr) {
+            throw memory_exception("receive_buffer_pool::borrow()", "malloc() returned nullptr");
+        }
+        return static_cast<char*>(ptr);
+    }
+
+    void give_back(char* ptr) {
+        metrics_gauge(gauge_id::receive_buffers_borrowed, -1);
+        if (cached_ == max_cached) {
+            free(ptr);
+            return;
+        }
+        auto block = reinterpret_cast<free_block*>(ptr);
+        block->next = free_list_;
+        free_list_ = block;
+        ++cached_;
+    }
+
+    ~receive_buffer_pool() {
+        while (free_list_ != nullptr) {
+            auto next = free_list_->next;
+            free(free_list_);
+            free_list_ = next;
+        }
+    }
+};
+
 template<typename T>
 concept is_buffer = requires (T t) {
     { t.pointer() } -> std::same_as<char*>;
@@ -466,7 +631,7 @@ public:
     }
     ~shared_array_buffer() {
         /* 复制构造过程中若抛出异常那么在这里不进行析构，避免double-free错误 */
-        if (&meta_->ptr != nullptr) {
+        if (meta_ != nullptr) {
             meta_->mutex.lock();
             --meta_->reference_count;
             if (meta_->reference_count == 0) {
@@ -477,6 +642,7 @@ public:
                 auto allocator_ptr = meta_->allocator;
                 meta_->allocator->release();
                 delete allocator_ptr;
+                return; // meta_已随分配器一同释放，不能再访问其中的互斥量
             }
             meta_->mutex.unlock();
         }
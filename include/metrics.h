@@ -0,0 +1,462 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <string>
+#include <string_view>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * 运行时指标。每个线程第一次记录时从指标区域中认领一个按缓存行对齐的分片，此后只有该线程写入自己的分片，
+ * 写入使用relaxed的load+store而不是原子读改写，不会在核之间争用缓存行，记录一次只需几纳秒。
+ * 读取时(metrics_snapshot())再把所有分片累加起来。reactor创建的区域位于memfd共享内存中，
+ * worker映射同一块区域，因此在任意进程中都能得到全部进程的汇总结果。
+ * 线程退出时归还分片，数值留在分片中由下一个认领者继续累加；分片数按进程数与每个进程的线程数确定，
+ * 仍然用尽时(或所有者进程已不存在时)见metrics_registry::claim()。
+ */
+
+enum class counter_id : size_t {
+    accepts = 0,
+    connections_handed_off,
+    requests,
+    bytes_received,
+    bytes_sent,
+    events_posted,
+    event_handlers_invoked,
+    allocations,
+    allocated_bytes,
+    reallocations,
+    pool_allocations,
+    pool_misses,
+    response_cache_hits,
+    response_cache_misses,
+    response_cache_evictions,
+    http2_streams,
+    websocket_messages,
+    proxy_requests,
+    proxy_upstream_errors,
+    proxy_ejections,
+    tls_handshakes,
+    tls_resumptions,
+    tls_kernel_offloads,
+    count_
+};
+
+enum class gauge_id : size_t {
+    workers = 0,
+    active_connections,
+    receive_buffers_borrowed,
+    response_cache_bytes,
+    count_
+};
+
+enum class histogram_id : size_t {
+    request_latency_us = 0,
+    event_dispatch_ns,
+    count_
+};
+
+constexpr static size_t counter_count = static_cast<size_t>(counter_id::count_);
+constexpr static size_t gauge_count = static_cast<size_t>(gauge_id::count_);
+constexpr static size_t histogram_count = static_cast<size_t>(histogram_id::count_);
+
+constexpr static std::array<std::string_view, counter_count> counter_names = {
+    "tinyhttp_accepts_total",
+    "tinyhttp_connections_handed_off_total",
+    "tinyhttp_requests_total",
+    "tinyhttp_bytes_received_total",
+    "tinyhttp_bytes_sent_total",
+    "tinyhttp_events_posted_total",
+    "tinyhttp_event_handlers_invoked_total",
+    "tinyhttp_allocations_total",
+    "tinyhttp_allocated_bytes_total",
+    "tinyhttp_reallocations_total",
+    "tinyhttp_pool_allocations_total",
+    "tinyhttp_pool_misses_total",
+    "tinyhttp_response_cache_hits_total",
+    "tinyhttp_response_cache_misses_total",
+    "tinyhttp_response_cache_evictions_total",
+    "tinyhttp_http2_streams_total",
+    "tinyhttp_websocket_messages_total",
+    "tinyhttp_proxy_requests_total",
+    "tinyhttp_proxy_upstream_errors_total",
+    "tinyhttp_proxy_ejections_total",
+    "tinyhttp_tls_handshakes_total",
+    "tinyhttp_tls_resumptions_total",
+    "tinyhttp_tls_kernel_offloads_total",
+};
+
+constexpr static std::array<std::string_view, gauge_count> gauge_names = {
+    "tinyhttp_workers",
+    "tinyhttp_active_connections",
+    "tinyhttp_receive_buffers_borrowed",
+    "tinyhttp_response_cache_bytes",
+};
+
+constexpr static std::array<std::string_view, histogram_count> histogram_names = {
+    "tinyhttp_request_latency_us",
+    "tinyhttp_event_dispatch_ns",
+};
+
+/*
+ * 对数线性直方图(HdrHistogram风格)的桶划分：小于16的值各占一个桶，
+ * 之后每个2的幂区间再均分为8个子桶，相对误差不超过12.5%。
+ */
+constexpr static size_t histogram_sub_bits = 3;
+constexpr static size_t histogram_linear = 16;
+constexpr static size_t histogram_buckets = histogram_linear + (64 - 4) * (1 << histogram_sub_bits);
+
+constexpr size_t histogram_bucket_of(uint64_t value) {
+    if (value < histogram_linear) {
+        return value;
+    }
+    size_t exponent = 63 - std::countl_zero(value);
+    size_t sub = (value >> (exponent - histogram_sub_bits)) & ((1 << histogram_sub_bits) - 1);
+    return histogram_linear + (exponent - 4) * (1 << histogram_sub_bits) + sub;
+}
+
+/* 返回桶的上界(包含) */
+constexpr uint64_t histogram_bucket_limit(size_t bucket) {
+    if (bucket < histogram_linear) {
+        return bucket;
+    }
+    size_t exponent = (bucket - histogram_linear) / (1 << histogram_sub_bits) + 4;
+    size_t sub = (bucket - histogram_linear) % (1 << histogram_sub_bits);
+    uint64_t base = (uint64_t(1) << exponent) | (uint64_t(sub) << (exponent - histogram_sub_bits));
+    return base + (uint64_t(1) << (exponent - histogram_sub_bits)) - 1;
+}
+
+struct alignas(64) metrics_shard {
+    //认领该分片的进程号，0表示空闲
+    std::atomic<int32_t> owner;
+    std::atomic<uint64_t> counters[counter_count];
+    std::atomic<int64_t> gauges[gauge_count];
+    std::atomic<uint64_t> histogram_sums[histogram_count];
+    std::atomic<uint64_t> histograms[histogram_count][histogram_buckets];
+};
+
+//每个进程中同时记录指标的线程数的上限估计：事件循环线程、计算线程池与控制台、日志等辅助线程，留有余量
+constexpr static size_t metrics_threads_per_process = 8;
+//未连接共享区域时进程内区域的分片数
+constexpr static size_t local_metrics_shards = 64;
+
+/* 区域的头部，之后紧跟capacity个独占分片与一个共用的溢出分片 */
+struct metrics_region {
+    alignas(64) std::atomic<uint32_t> claimed;
+    uint32_t capacity;
+};
+
+constexpr size_t metrics_region_size(size_t capacity) {
+    return sizeof(metrics_region) + (capacity + 1) * sizeof(metrics_shard);
+}
+
+/* 聚合后的指标快照 */
+struct metrics_snapshot_t {
+    std::array<uint64_t, counter_count> counters {};
+    std::array<int64_t, gauge_count> gauges {};
+    std::array<uint64_t, histogram_count> histogram_sums {};
+    std::array<std::array<uint64_t, histogram_buckets>, histogram_count> histograms {};
+
+    [[nodiscard]] uint64_t counter(counter_id id) const {
+        return counters[static_cast<size_t>(id)];
+    }
+    [[nodiscard]] int64_t gauge(gauge_id id) const {
+        return gauges[static_cast<size_t>(id)];
+    }
+    [[nodiscard]] uint64_t histogram_total(histogram_id id) const {
+        uint64_t total = 0;
+        for (auto n : histograms[static_cast<size_t>(id)]) {
+            total += n;
+        }
+        return total;
+    }
+    /* 返回分位数q(0~1)所在桶的上界 */
+    [[nodiscard]] uint64_t percentile(histogram_id id, double q) const {
+        auto& buckets = histograms[static_cast<size_t>(id)];
+        auto total = histogram_total(id);
+        if (total == 0) {
+            return 0;
+        }
+        auto rank = static_cast<uint64_t>(q * static_cast<double>(total - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < histogram_buckets; ++i) {
+            seen += buckets[i];
+            if (seen >= rank) {
+                return histogram_bucket_limit(i);
+            }
+        }
+        return histogram_bucket_limit(histogram_buckets - 1);
+    }
+
+    /* 逐项相减，用于实现不停机的"stats reset" */
+    metrics_snapshot_t operator-(const metrics_snapshot_t& base) const {
+        metrics_snapshot_t diff = *this;
+        for (size_t i = 0; i < counter_count; ++i) {
+            diff.counters[i] -= base.counters[i];
+        }
+        for (size_t h = 0; h < histogram_count; ++h) {
+            diff.histogram_sums[h] -= base.histogram_sums[h];
+            for (size_t i = 0; i < histogram_buckets; ++i) {
+                diff.histograms[h][i] -= base.histograms[h][i];
+            }
+        }
+        return diff;
+    }
+};
+
+/* 当前线程写入的分片；exclusive为false时是多个线程共用的溢出分片，必须用原子加 */
+struct metrics_writer {
+    metrics_shard* shard;
+    bool exclusive;
+};
+
+class metrics_registry {
+private:
+    struct local_region {
+        metrics_region header;
+        metrics_shard shards[local_metrics_shards + 1];
+    };
+    //未连接共享区域时使用的进程内区域，位于BSS段，只有被触及的页才会占用内存
+    inline static local_region local_region_ {};
+    metrics_region* region_ {&local_region_.header};
+    metrics_shard* shards_ {local_region_.shards};
+    int fd_ {-1};
+    std::atomic<uint64_t> generation_ {0};
+
+    /* 线程认领的分片，线程退出(或切换到共享区域)时归还，使分片数限制的是同时存在的线程数而不是累计的线程数 */
+    struct owned_shard {
+        uint64_t generation {UINT64_MAX};
+        metrics_writer writer {nullptr, false};
+
+        void release() {
+            if (writer.exclusive) {
+                writer.shard->owner.store(0, std::memory_order_release);
+            }
+            writer = { nullptr, false };
+        }
+        ~owned_shard() {
+            release();
+        }
+    };
+
+    static bool owned_by(metrics_shard& shard, int32_t expected, int32_t pid) {
+        return shard.owner.compare_exchange_strong(expected, pid, std::memory_order_acq_rel);
+    }
+
+    /*
+     * 认领一个分片：先复用已归还的分片，再取用未使用过的分片，最后接管所有者进程已经不存在的分片
+     * (例如被SIGKILL的worker，它的线程没有机会归还)，此时清零其中已失去意义的仪表值。
+     * 全部被占用时退化为共用溢出分片，它同样位于区域中并计入快照。
+     */
+    metrics_writer claim() {
+        auto pid = static_cast<int32_t>(getpid());
+        auto capacity = region_->capacity;
+        while (true) {
+            auto claimed = std::min<uint32_t>(region_->claimed.load(std::memory_order_acquire), capacity);
+            for (uint32_t i = 0; i < claimed; ++i) {
+                if (shards_[i].owner.load(std::memory_order_relaxed) == 0 && owned_by(shards_[i], 0, pid)) {
+                    return { &shards_[i], true };
+                }
+            }
+            auto index = region_->claimed.fetch_add(1, std::memory_order_acq_rel);
+            if (index >= capacity) {
+                break;
+            }
+            if (owned_by(shards_[index], 0, pid)) {
+                return { &shards_[index], true };
+            }
+            //其他线程在扫描已归还的分片时抢先认领了它，重新开始
+        }
+        for (uint32_t i = 0; i < capacity; ++i) {
+            auto owner = shards_[i].owner.load(std::memory_order_relaxed);
+            if (owner != 0 && owner != pid && kill(owner, 0) == -1 && errno == ESRCH && owned_by(shards_[i], owner, pid)) {
+                for (auto& gauge : shards_[i].gauges) {
+                    gauge.store(0, std::memory_order_relaxed);
+                }
+                return { &shards_[i], true };
+            }
+        }
+        return { &shards_[capacity], false };
+    }
+public:
+    metrics_registry() {
+        local_region_.header.capacity = local_metrics_shards;
+    }
+
+    static metrics_registry& global() {
+        static metrics_registry registry;
+        return registry;
+    }
+
+    /* 创建一块能容纳processes个进程的共享内存区域并切换到该区域(reactor端)，失败时返回false并继续使用进程内区域 */
+    bool create_shared(size_t processes) {
+        int fd = memfd_create("tinyhttp_metrics", MFD_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+        auto capacity = processes * metrics_threads_per_process;
+        if (ftruncate(fd, static_cast<off_t>(metrics_region_size(capacity))) == -1) {
+            close(fd);
+            return false;
+        }
+        void* ptr = mmap(nullptr, sizeof(metrics_region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        static_cast<metrics_region*>(ptr)->capacity = static_cast<uint32_t>(capacity);
+        munmap(ptr, sizeof(metrics_region));
+        return attach(fd);
+    }
+
+    /* 映射由reactor传来的共享区域(worker端)，分片数取自区域头部，成功后持有fd的所有权 */
+    bool attach(int fd) {
+        struct stat st {};
+        if (fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) < metrics_region_size(0)) {
+            close(fd);
+            return false;
+        }
+        void* ptr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        auto region = static_cast<metrics_region*>(ptr);
+        if (metrics_region_size(region->capacity) > static_cast<size_t>(st.st_size)) {
+            munmap(ptr, st.st_size);
+            close(fd);
+            return false;
+        }
+        fd_ = fd;
+        region_ = region;
+        shards_ = reinterpret_cast<metrics_shard*>(region + 1);
+        generation_.fetch_add(1, std::memory_order_release);
+        return true;
+    }
+
+    [[nodiscard]] int fd() const {
+        return fd_;
+    }
+
+    /* 当前线程的分片，首次调用(或区域切换后)认领一个新分片 */
+    const metrics_writer& local() {
+        thread_local owned_shard owned;
+        auto generation = generation_.load(std::memory_order_acquire);
+        if (owned.generation != generation) {
+            owned.release();
+            owned.writer = claim();
+            owned.generation = generation;
+        }
+        return owned.writer;
+    }
+
+    /* 汇总所有已认领的分片与溢出分片，不会阻塞正在记录的线程 */
+    [[nodiscard]] metrics_snapshot_t snapshot() const {
+        metrics_snapshot_t snap;
+        auto capacity = region_->capacity;
+        auto claimed = std::min<size_t>(region_->claimed.load(std::memory_order_relaxed), capacity);
+        auto add = [&snap](const metrics_shard& shard) {
+            for (size_t i = 0; i < counter_count; ++i) {
+                snap.counters[i] += shard.counters[i].load(std::memory_order_relaxed);
+            }
+            for (size_t i = 0; i < gauge_count; ++i) {
+                snap.gauges[i] += shard.gauges[i].load(std::memory_order_relaxed);
+            }
+            for (size_t h = 0; h < histogram_count; ++h) {
+                snap.histogram_sums[h] += shard.histogram_sums[h].load(std::memory_order_relaxed);
+                for (size_t i = 0; i < histogram_buckets; ++i) {
+                    snap.histograms[h][i] += shard.histograms[h][i].load(std::memory_order_relaxed);
+                }
+            }
+        };
+        for (size_t s = 0; s < claimed; ++s) {
+            add(shards_[s]);
+        }
+        add(shards_[capacity]);
+        return snap;
+    }
+};
+
+/* 独占的分片只有所有者线程写入，因此用load+store代替fetch_add，避免带锁前缀的指令；共用的溢出分片必须用fetch_add */
+template<typename T>
+inline void metrics_bump(const metrics_writer& writer, std::atomic<T>& slot, T delta) {
+    if (writer.exclusive) {
+        slot.store(slot.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    } else {
+        slot.fetch_add(delta, std::memory_order_relaxed);
+    }
+}
+
+inline void metrics_count(counter_id id, uint64_t n = 1) {
+    auto& writer = metrics_registry::global().local();
+    metrics_bump(writer, writer.shard->counters[static_cast<size_t>(id)], n);
+}
+
+inline void metrics_gauge(gauge_id id, int64_t delta) {
+    auto& writer = metrics_registry::global().local();
+    metrics_bump(writer, writer.shard->gauges[static_cast<size_t>(id)], delta);
+}
+
+inline void metrics_record(histogram_id id, uint64_t value) {
+    auto& writer = metrics_registry::global().local();
+    auto h = static_cast<size_t>(id);
+    metrics_bump(writer, writer.shard->histograms[h][histogram_bucket_of(value)], uint64_t(1));
+    metrics_bump(writer, writer.shard->histogram_sums[h], value);
+}
+
+inline metrics_snapshot_t metrics_snapshot() {
+    return metrics_registry::global().snapshot();
+}
+
+/* 以Prometheus文本格式(0.0.4)输出快照，直方图只输出非空的桶 */
+inline std::string format_prometheus(const metrics_snapshot_t& snap) {
+    std::string out;
+    for (size_t i = 0; i < counter_count; ++i) {
+        out += std::format("# TYPE {} counter\n{} {}\n", counter_names[i], counter_names[i], snap.counters[i]);
+    }
+    for (size_t i = 0; i < gauge_count; ++i) {
+        out += std::format("# TYPE {} gauge\n{} {}\n", gauge_names[i], gauge_names[i], snap.gauges[i]);
+    }
+    for (size_t h = 0; h < histogram_count; ++h) {
+        auto name = histogram_names[h];
+        out += std::format("# TYPE {} histogram\n", name);
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < histogram_buckets; ++i) {
+            if (snap.histograms[h][i] == 0) {
+                continue;
+            }
+            cumulative += snap.histograms[h][i];
+            out += std::format("{}_bucket{{le=\"{}\"}} {}\n", name, histogram_bucket_limit(i), cumulative);
+        }
+        out += std::format("{}_bucket{{le=\"+Inf\"}} {}\n", name, cumulative);
+        out += std::format("{}_sum {}\n{}_count {}\n", name, snap.histogram_sums[h], name, cumulative);
+    }
+    return out;
+}
+
+/* 供控制台"stats"命令使用的简要文本 */
+inline std::string format_stats(const metrics_snapshot_t& snap) {
+    std::string out;
+    for (size_t i = 0; i < counter_count; ++i) {
+        out += std::format("{:<40} {}\n", counter_names[i], snap.counters[i]);
+    }
+    for (size_t i = 0; i < gauge_count; ++i) {
+        out += std::format("{:<40} {}\n", gauge_names[i], snap.gauges[i]);
+    }
+    for (size_t h = 0; h < histogram_count; ++h) {
+        auto id = static_cast<histogram_id>(h);
+        auto total = snap.histogram_total(id);
+        out += std::format("{:<40} count={} mean={} p50={} p90={} p99={} p999={}\n", histogram_names[h], total,
+                           total == 0 ? 0 : snap.histogram_sums[h] / total,
+                           snap.percentile(id, 0.5), snap.percentile(id, 0.9), snap.percentile(id, 0.99), snap.percentile(id, 0.999));
+    }
+    return out;
+}
@@ -0,0 +1,821 @@
+#pragma once
+
+#include <memory.h>
+#include <io.h>
+#include <coroutine.h>
+#include <timer.h>
+#include <http.h>
+#include <chunked.h>
+#include <metrics.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <format>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/*
+ * 反向代理。路径以指定前缀开头的请求转发到一组上游之一，按轮询或最少连接数选择上游。
+ * 每个上游有一个空闲keep-alive连接池，连接在一次交换结束后归还，下一个请求直接复用。
+ * 响应头在用户态改写(去掉逐跳首部)，定长或读到关闭为止的响应体经由管道用splice在两个套接字之间搬运，不进入用户态；
+ * 分块的响应体就地解码后重新分块。上游是否可用由两方面决定：定时器驱动的主动健康检查，
+ * 以及转发时连续失败达到阈值后的被动摘除，摘除时长随摘除次数翻倍。
+ * 请求体已由HTTP解析器完整接收，与改写后的请求头一起写出。
+ */
+
+enum class balance_policy {
+    round_robin,
+    least_connections,
+};
+
+//每个上游保留的空闲连接数上限
+constexpr static size_t proxy_max_idle = 64;
+//连续失败多少次后摘除上游
+constexpr static int proxy_eject_failures = 5;
+//第一次摘除的秒数，之后每次翻倍，不超过proxy_max_eject_seconds
+constexpr static int proxy_eject_seconds = 5;
+constexpr static int proxy_max_eject_seconds = 60;
+//主动健康检查的间隔，连续失败多少次标记为不健康
+constexpr static int proxy_health_interval = 5;
+constexpr static int proxy_unhealthy_threshold = 2;
+//连接上游、等待响应头与健康检查的超时(秒)，由每秒一次的定时任务检查，实际超时可能多出一秒
+constexpr static int proxy_connect_timeout = 3;
+constexpr static int proxy_response_timeout = 30;
+//缓冲转发(HTTP/2的流)时响应体的上限，超出时返回502
+constexpr static size_t proxy_max_buffered_body = 16 * 1024 * 1024;
+//每次splice搬运的最大字节数，等于管道的默认容量
+constexpr static size_t proxy_splice_chunk = 64 * 1024;
+
+/* 逐跳首部(RFC 9110 7.6.1)，代理转发时不能原样传递 */
+inline bool is_hop_by_hop(std::string_view name) {
+    return iequals(name, "Connection") || iequals(name, "Keep-Alive") || iequals(name, "Proxy-Connection") || iequals(name, "TE")
+        || iequals(name, "Trailer") || iequals(name, "Transfer-Encoding") || iequals(name, "Upgrade");
+}
+
+struct upstream {
+    //"host:port"，请求中没有Host时作为Host
+    std::string name;
+    sockaddr_storage address {};
+    socklen_t address_length {0};
+    //空闲的keep-alive连接，后进先出，最近用过的连接最先被复用
+    std::vector<int> idle;
+    //正在进行的交换数，最少连接数均衡据此选择
+    size_t active {0};
+    //被动异常检测：连续失败次数、摘除次数与摘除结束的时刻(代理时钟的秒数)
+    int failures {0};
+    int ejections {0};
+    int64_t ejected_until {0};
+    //主动健康检查的结果
+    bool healthy {true};
+    int health_failures {0};
+    bool checking {false};
+
+    [[nodiscard]] bool available(int64_t now) const {
+        return healthy && ejected_until <= now;
+    }
+};
+
+/* 一次带超时的等待：到期时定时任务关闭fd的两个方向，等待中的协程随之以失败返回 */
+struct proxy_deadline {
+    int fd {-1};
+    int64_t at {0};
+    size_t slot {std::numeric_limits<size_t>::max()};
+    bool expired {false};
+};
+
+/* 一次请求/响应交换的状态 */
+struct proxy_exchange {
+    upstream* target {nullptr};
+    int fd {-1};
+    receive_buffer in;
+    http_response_head head;
+    size_t head_length {0};
+    //失败时应返回给客户端的状态码
+    int error_status {0};
+    proxy_deadline deadline;
+};
+
+/* 对端的IP地址(不含端口)，取不到时返回空串 */
+inline std::string peer_address(int fd) {
+    sockaddr_storage address {};
+    socklen_t length = sizeof(address);
+    if (getpeername(fd, reinterpret_cast<sockaddr*>(&address), &length) == -1) {
+        return {};
+    }
+    char text[INET6_ADDRSTRLEN] {};
+    const void* raw = nullptr;
+    if (address.ss_family == AF_INET) {
+        raw = &reinterpret_cast<sockaddr_in*>(&address)->sin_addr;
+    } else if (address.ss_family == AF_INET6) {
+        raw = &reinterpret_cast<sockaddr_in6*>(&address)->sin6_addr;
+    } else {
+        return {};
+    }
+    return inet_ntop(address.ss_family, raw, text, sizeof(text)) != nullptr ? std::string(text) : std::string();
+}
+
+enum class splice_result {
+    done,
+    upstream_failed,
+    client_failed,
+};
+
+/* 经由管道把from中的count字节(count为npos时直到对端关闭)搬到to，moved为已写给to的字节数 */
+inline task<splice_result> splice_body(io_loop& loop, int from, int to, const std::array<int, 2>& pipe, size_t count, size_t& moved) {
+    bool until_eof = count == std::string_view::npos;
+    while (until_eof || moved < count) {
+        auto want = until_eof ? proxy_splice_chunk : std::min(count - moved, proxy_splice_chunk);
+        auto n = ::splice(from, nullptr, pipe[1], nullptr, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0) {
+            co_return until_eof ? splice_result::done : splice_result::upstream_failed;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                co_await loop.readable(from);
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            co_return splice_result::upstream_failed;
+        }
+        //每次都把管道排空，下一轮从上游读入时管道总有足够的空间
+        auto left = static_cast<size_t>(n);
+        while (left > 0) {
+            auto m = ::splice(pipe[0], nullptr, to, nullptr, left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (m < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    co_await loop.writable(to);
+                    continue;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                co_return splice_result::client_failed;
+            }
+            left -= m;
+            moved += m;
+        }
+    }
+    co_return splice_result::done;
+}
+
+class reverse_proxy {
+private:
+    std::string prefix_;
+    std::vector<upstream> upstreams_;
+    balance_policy policy_ {balance_policy::least_connections};
+    std::string health_path_ {"/"};
+    size_t cursor_ {0};
+    //代理时钟，每秒加一
+    int64_t now_ {0};
+    io_loop* loop_ {nullptr};
+    //空闲的管道，splice出错时管道中可能残留数据，这样的管道直接关闭
+    std::vector<std::array<int, 2>> pipes_;
+    std::vector<proxy_deadline*> deadlines_;
+
+    void arm(proxy_deadline& deadline, int fd, int seconds) {
+        deadline.fd = fd;
+        deadline.at = now_ + seconds;
+        deadline.expired = false;
+        deadline.slot = deadlines_.size();
+        deadlines_.push_back(&deadline);
+    }
+    void disarm(proxy_deadline& deadline) {
+        auto slot = deadline.slot;
+        if (slot >= deadlines_.size() || deadlines_[slot] != &deadline) {
+            return;
+        }
+        deadlines_[slot] = deadlines_.back();
+        deadlines_[slot]->slot = slot;
+        deadlines_.pop_back();
+        deadline.slot = std::numeric_limits<size_t>::max();
+    }
+
+    void discard(int fd) {
+        loop_->forget(fd);
+        close(fd);
+    }
+
+    /* 取出一个仍然可用的空闲连接：对端已关闭或发来了不该有的数据的连接直接丢弃 */
+    int take_idle(upstream& target) {
+        while (!target.idle.empty()) {
+            int fd = target.idle.back();
+            target.idle.pop_back();
+            char c;
+            if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return fd;
+            }
+            discard(fd);
+        }
+        return -1;
+    }
+
+    void close_idle(upstream& target) {
+        for (int fd : target.idle) {
+            discard(fd);
+        }
+        target.idle.clear();
+    }
+
+    /* 按均衡策略选择一个可用的上游，exclude为刚刚失败的上游；没有可用的上游时返回nullptr */
+    upstream* pick(const upstream* exclude) {
+        upstream* best = nullptr;
+        auto count = upstreams_.size();
+        for (size_t i = 0; i < count; ++i) {
+            auto& candidate = upstreams_[(cursor_ + i) % count];
+            if (&candidate == exclude || !candidate.available(now_)) {
+                continue;
+            }
+            if (policy_ == balance_policy::round_robin) {
+                best = &candidate;
+                break;
+            }
+            //最少连接数相同时取轮询顺序上的第一个，避免总是压在同一个上游上
+            if (best == nullptr || candidate.active < best->active) {
+                best = &candidate;
+            }
+        }
+        if (best != nullptr) {
+            cursor_ = (static_cast<size_t>(best - upstreams_.data()) + 1) % count;
+        }
+        return best;
+    }
+
+    /* 被动异常检测：连续失败达到阈值时摘除上游，并关闭它的空闲连接 */
+    void record_failure(upstream& target) {
+        metrics_count(counter_id::proxy_upstream_errors);
+        if (++target.failures < proxy_eject_failures || target.ejected_until > now_) {
+            return;
+        }
+        auto seconds = std::min(proxy_eject_seconds << std::min(target.ejections, 8), proxy_max_eject_seconds);
+        target.ejected_until = now_ + seconds;
+        ++target.ejections;
+        target.failures = 0;
+        close_idle(target);
+        metrics_count(counter_id::proxy_ejections);
+    }
+    void record_success(upstream& target) {
+        target.failures = 0;
+        target.ejections = 0;
+    }
+
+    /* 连接结束交换：完整读完响应且双方都同意保持连接时归还连接池，否则关闭 */
+    void release(proxy_exchange& ex, bool reusable) {
+        --ex.target->active;
+        if (reusable && ex.in.empty() && ex.target->idle.size() < proxy_max_idle && ex.target->available(now_)) {
+            ex.target->idle.push_back(ex.fd);
+        } else {
+            discard(ex.fd);
+        }
+        ex.fd = -1;
+    }
+
+    std::array<int, 2> take_pipe() {
+        if (!pipes_.empty()) {
+            auto pipe = pipes_.back();
+            pipes_.pop_back();
+            return pipe;
+        }
+        std::array<int, 2> pipe {-1, -1};
+        if (pipe2(pipe.data(), O_NONBLOCK | O_CLOEXEC) == -1) {
+            throw io_exception("reverse_proxy::take_pipe()", std::format("pipe2() failed: {}", strerror(errno)));
+        }
+        return pipe;
+    }
+    void give_back_pipe(const std::array<int, 2>& pipe, bool clean) {
+        if (clean) {
+            pipes_.push_back(pipe);
+        } else {
+            close(pipe[0]);
+            close(pipe[1]);
+        }
+    }
+
+    /* 发起到上游的非阻塞连接，超过proxy_connect_timeout秒未完成时视为失败 */
+    task<int> connect(const upstream& target, proxy_deadline& deadline) {
+        auto addr = reinterpret_cast<const sockaddr*>(&target.address);
+        int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            co_return -1;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (::connect(fd, addr, target.address_length) == 0) {
+            co_return fd;
+        }
+        if (errno != EINPROGRESS) {
+            close(fd);
+            co_return -1;
+        }
+        arm(deadline, fd, proxy_connect_timeout);
+        co_await loop_->writable(fd);
+        disarm(deadline);
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        if (deadline.expired || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1 || error != 0) {
+            discard(fd);
+            co_return -1;
+        }
+        co_return fd;
+    }
+
+    /* 改写后的请求头：去掉逐跳首部与Connection中列出的首部，追加X-Forwarded-For，请求体长度按解码后的内容重新给出 */
+    std::string upstream_request_head(const http_request& request, const upstream& target, std::string_view client_address) const {
+        std::string head;
+        head.reserve(512);
+        head.append(request.method).append(" ").append(request.target).append(" HTTP/1.1\r\n");
+        auto connection = request.header("Connection");
+        std::string_view forwarded_for;
+        bool has_host = false;
+        bool has_length = false;
+        for (size_t i = 0; i < request.header_count; ++i) {
+            auto& header = request.headers[i];
+            if (is_hop_by_hop(header.name) || has_token(connection, header.name) || iequals(header.name, "Expect")) {
+                continue;
+            }
+            if (iequals(header.name, "Content-Length")) {
+                has_length = true;
+                continue;
+            }
+            if (iequals(header.name, "X-Forwarded-For")) {
+                forwarded_for = header.value;
+                continue;
+            }
+            has_host = has_host || iequals(header.name, "Host");
+            head.append(header.name).append(": ").append(header.value).append("\r\n");
+        }
+        if (!has_host) {
+            head.append("Host: ").append(target.name).append("\r\n");
+        }
+        if (!client_address.empty()) {
+            head.append("X-Forwarded-For: ");
+            if (!forwarded_for.empty()) {
+                head.append(forwarded_for).append(", ");
+            }
+            head.append(client_address).append("\r\n");
+        }
+        if (has_length || request.chunked || !request.body.empty()) {
+            head.append(std::format("Content-Length: {}\r\n", request.body.length()));
+        }
+        head.append("\r\n");
+        return head;
+    }
+
+    /*
+     * 给客户端的响应头(不含Connection与结束的空行)：状态行保留上游的原因短语，去掉逐跳首部；
+     * drop_length为true时也去掉Content-Length，由调用者重新给出长度或改用分块编码。
+     */
+    static std::string client_response_head(const proxy_exchange& ex, bool drop_length) {
+        auto data = ex.in.data();
+        auto status_line = data.substr(0, data.find("\r\n"));
+        std::string head = "HTTP/1.1";
+        head.append(status_line.substr(status_line.find(' '))).append("\r\n");
+        auto connection = ex.head.header("Connection");
+        for (size_t i = 0; i < ex.head.header_count; ++i) {
+            auto& header = ex.head.headers[i];
+            if (is_hop_by_hop(header.name) || has_token(connection, header.name) || (drop_length && iequals(header.name, "Content-Length"))) {
+                continue;
+            }
+            head.append(header.name).append(": ").append(header.value).append("\r\n");
+        }
+        return head;
+    }
+
+    /* 响应头之后是否没有响应体(RFC 9112 6.3) */
+    static bool bodyless(const http_request& request, int status) {
+        return request.method == "HEAD" || status / 100 == 1 || status == 204 || status == 304;
+    }
+
+    /*
+     * 选择上游、发出请求并读到响应头(跳过1xx中间响应)。成功时ex.fd为上游连接，响应头在ex.in开头。
+     * 连接失败时换一个上游重试；复用的空闲连接在收到任何响应之前失败时换新连接重试，
+     * 其他情况只有幂等的请求才重试。失败时ex.error_status为应返回给客户端的状态码。
+     */
+    task<bool> begin(const http_request& request, std::string_view client_address, proxy_exchange& ex) {
+        bool idempotent = request.method == "GET" || request.method == "HEAD" || request.method == "PUT"
+            || request.method == "DELETE" || request.method == "OPTIONS";
+        upstream* failed = nullptr;
+        ex.error_status = 503;
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            auto target = pick(failed);
+            if (target == nullptr) {
+                co_return false;
+            }
+            ex.error_status = 502;
+            int fd = take_idle(*target);
+            bool reused = fd != -1;
+            if (fd == -1) {
+                fd = co_await connect(*target, ex.deadline);
+                if (fd == -1) {
+                    record_failure(*target);
+                    failed = target;
+                    continue;
+                }
+            }
+            ++target->active;
+            ex.target = target;
+            ex.fd = fd;
+            output_queue out;
+            out.append(upstream_request_head(request, *target, client_address));
+            out.append_static(request.body);
+            arm(ex.deadline, fd, proxy_response_timeout);
+            bool sent = co_await loop_->send_queue(fd, out);
+            ssize_t parsed = 0;
+            while (sent) {
+                parsed = parse_http_response_head(ex.in.data(), ex.head);
+                if (parsed > 0 && ex.head.status / 100 == 1 && ex.head.status != 101) {
+                    ex.in.consume(parsed);
+                    continue;
+                }
+                if (parsed != 0) {
+                    break;
+                }
+                auto n = co_await loop_->recv_into(fd, ex.in);
+                if (n <= 0) {
+                    break;
+                }
+            }
+            disarm(ex.deadline);
+            if (parsed > 0 && ex.head.status != 101) {
+                ex.head_length = static_cast<size_t>(parsed);
+                co_return true;
+            }
+            bool received = !ex.in.empty();
+            --target->active;
+            discard(fd);
+            ex.fd = -1;
+            ex.in.consume(ex.in.size());
+            if (ex.deadline.expired) {
+                record_failure(*target);
+                ex.error_status = 504;
+                co_return false;
+            }
+            if (reused && !received) {
+                //空闲连接恰好被上游关闭，不算作上游的失败，换一个新连接
+                --attempt;
+                continue;
+            }
+            record_failure(*target);
+            if (received || !idempotent) {
+                co_return false;
+            }
+            failed = target;
+        }
+        co_return false;
+    }
+
+    /* 上游的网关类错误状态也计入被动异常检测 */
+    void record_status(upstream& target, int status) {
+        if (status == 502 || status == 503 || status == 504) {
+            record_failure(target);
+        } else {
+            record_success(target);
+        }
+    }
+
+    /* 对一个上游做一次健康检查：发出GET请求，响应状态在[200, 500)内视为健康 */
+    task<> check(upstream& target) {
+        target.checking = true;
+        proxy_deadline deadline;
+        int fd = co_await connect(target, deadline);
+        bool ok = false;
+        if (fd != -1) {
+            output_queue out;
+            out.append(std::format("GET {} HTTP/1.1\r\nHost: {}\r\nUser-Agent: tinyhttp-health-check\r\nConnection: close\r\n\r\n", health_path_, target.name));
+            arm(deadline, fd, proxy_connect_timeout);
+            bool sent = co_await loop_->send_queue(fd, out);
+            if (sent) {
+                receive_buffer in;
+                http_response_head head;
+                ssize_t parsed;
+                while ((parsed = parse_http_response_head(in.data(), head)) == 0) {
+                    auto n = co_await loop_->recv_into(fd, in);
+                    if (n <= 0) {
+                        break;
+                    }
+                }
+                ok = parsed > 0 && head.status >= 200 && head.status < 500;
+            }
+            disarm(deadline);
+            discard(fd);
+        }
+        target.checking = false;
+        if (ok) {
+            target.health_failures = 0;
+            target.healthy = true;
+        } else if (++target.health_failures >= proxy_unhealthy_threshold && target.healthy) {
+            target.healthy = false;
+            close_idle(target);
+        }
+    }
+
+    /* 每秒一次：推进代理时钟，关闭超时的等待，按间隔发起健康检查 */
+    void tick() {
+        ++now_;
+        for (auto deadline : deadlines_) {
+            if (!deadline->expired && deadline->at <= now_) {
+                deadline->expired = true;
+                shutdown(deadline->fd, SHUT_RDWR);
+            }
+        }
+        if (health_path_.empty() || now_ % proxy_health_interval != 0) {
+            return;
+        }
+        for (auto& target : upstreams_) {
+            if (!target.checking) {
+                loop_->spawn(check(target));
+            }
+        }
+    }
+
+    /* 完整地写出队列，counted为队列开头已经计入指标的字节数，其余写出的字节计入指标 */
+    task<bool> flush(int client, output_queue& out, size_t& counted) {
+        metrics_count(counter_id::bytes_sent, out.bytes() - counted);
+        counted = 0;
+        bool sent = co_await loop_->send_queue(client, out);
+        co_return sent;
+    }
+public:
+    reverse_proxy() = default;
+    reverse_proxy(const reverse_proxy&) = delete;
+    reverse_proxy& operator=(const reverse_proxy&) = delete;
+    ~reverse_proxy() {
+        for (auto& target : upstreams_) {
+            for (int fd : target.idle) {
+                close(fd);
+            }
+        }
+        for (auto& pipe : pipes_) {
+            close(pipe[0]);
+            close(pipe[1]);
+        }
+    }
+
+    /*
+     * 按"前缀=host:port[,host:port...]"配置代理，例如"/api=127.0.0.1:9001,127.0.0.1:9002"。
+     * balance为round-robin或least-connections(默认)，health_path为健康检查的路径，为空时不做主动检查。
+     * 格式错误或地址无法解析时返回false。
+     */
+    bool configure(std::string_view spec, std::string_view balance, std::string_view health_path) {
+        auto equal = spec.find('=');
+        if (equal == std::string_view::npos || equal == 0 || spec.front() != '/') {
+            return false;
+        }
+        prefix_ = spec.substr(0, equal);
+        if (balance == "round-robin") {
+            policy_ = balance_policy::round_robin;
+        } else if (balance.empty() || balance == "least-connections") {
+            policy_ = balance_policy::least_connections;
+        } else {
+            return false;
+        }
+        health_path_ = health_path;
+        auto list = spec.substr(equal + 1);
+        while (!list.empty()) {
+            auto comma = list.find(',');
+            auto item = trim(list.substr(0, comma));
+            list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+            auto colon = item.rfind(':');
+            if (colon == std::string_view::npos || colon == 0) {
+                return false;
+            }
+            std::string host(item.substr(0, colon));
+            if (host.front() == '[' && host.back() == ']') {
+                host = host.substr(1, host.length() - 2);
+            }
+            std::string port(item.substr(colon + 1));
+            addrinfo hints {};
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo* result = nullptr;
+            if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0 || result == nullptr) {
+                return false;
+            }
+            auto& target = upstreams_.emplace_back();
+            target.name = item;
+            memcpy(&target.address, result->ai_addr, result->ai_addrlen);
+            target.address_length = result->ai_addrlen;
+            freeaddrinfo(result);
+        }
+        return !upstreams_.empty();
+    }
+
+    /* 注册每秒一次的定时任务，代理的所有协程都运行在loop上 */
+    void attach(timer& tm, io_loop& loop) {
+        loop_ = &loop;
+        tm.add(timer::make_tv(timer::sec, timer::inf_times), [this](timer::callback_id_t, timer::tv_t) {
+            tick();
+        });
+    }
+
+    [[nodiscard]] bool enabled() const {
+        return loop_ != nullptr && !upstreams_.empty();
+    }
+
+    /*
+     * 路径是否落在代理的前缀之下(按路径段匹配，"/api"不匹配"/apix")。请求目标原样转发，
+     * 带有"."或".."段(包括%2e之类的转义形式)的路径在上游规范化后可能落到前缀之外，不予匹配。
+     */
+    [[nodiscard]] bool matches(std::string_view path) const {
+        if (!enabled() || !path.starts_with(prefix_)) {
+            return false;
+        }
+        if (path.length() != prefix_.length() && prefix_.back() != '/' && path[prefix_.length()] != '/') {
+            return false;
+        }
+        std::string decoded;
+        return decode_url_path(path, decoded) && !has_dot_segment(decoded);
+    }
+
+    /*
+     * 转发一个HTTP/1.1请求并把响应直接写给client，写出的字节自行计入指标。
+     * out中积攒的(管线化的、已计入指标的)响应先于转发的响应写出，返回时out为空。
+     * 响应体只能读到连接关闭为止，或客户端无法接收分块编码时，keep_alive被置为false。
+     * 客户端连接已不可用(写失败，或响应体中途中断)时返回false。
+     */
+    task<bool> forward(int client, const http_request& request, bool& keep_alive, output_queue& out) {
+        metrics_count(counter_id::proxy_requests);
+        proxy_exchange ex;
+        auto client_address = peer_address(client);
+        size_t counted = out.bytes();
+        bool begun = co_await begin(request, client_address, ex);
+        if (!begun) {
+            out.append(http_response(ex.error_status).serialize(keep_alive));
+            bool sent = co_await flush(client, out, counted);
+            co_return sent;
+        }
+        auto& head = ex.head;
+        bool no_body = bodyless(request, head.status);
+        bool chunked = !no_body && head.chunked;
+        bool until_close = !no_body && !chunked && !head.has_content_length;
+        //HTTP/1.0的客户端不认识分块编码，解码后的内容直接写出，以关闭连接结束
+        bool rechunk = chunked && request.version != "HTTP/1.0";
+        if (until_close || (chunked && !rechunk)) {
+            keep_alive = false;
+        }
+        auto response_head = client_response_head(ex, chunked);
+        if (rechunk) {
+            response_head.append("Transfer-Encoding: chunked\r\n");
+        }
+        response_head.append(keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+        out.append(std::move(response_head));
+        bool reusable = head.keep_alive() && !until_close;
+        auto status = head.status;
+        auto content_length = head.content_length;
+        ex.in.consume(ex.head_length);
+        bool upstream_ok = true;
+        bool client_ok = true;
+        if (no_body) {
+            client_ok = co_await flush(client, out, counted);
+        } else if (chunked) {
+            chunked_decoder decoder;
+            while (client_ok) {
+                if (!ex.in.empty()) {
+                    size_t produced;
+                    auto data = ex.in.writable_data();
+                    auto consumed = decoder.decode(data, ex.in.size(), data, produced);
+                    if (consumed < 0) {
+                        upstream_ok = false;
+                        break;
+                    }
+                    //解码后的内容在写出完成之后才从ex.in中消费
+                    if (rechunk) {
+                        append_static_chunk(out, { data, produced });
+                    } else {
+                        out.append_static({ data, produced });
+                    }
+                    if (decoder.done() && rechunk) {
+                        append_last_chunk(out);
+                    }
+                    client_ok = co_await flush(client, out, counted);
+                    ex.in.consume(consumed);
+                    if (decoder.done()) {
+                        break;
+                    }
+                }
+                auto n = co_await loop_->recv_into(ex.fd, ex.in);
+                if (n <= 0) {
+                    upstream_ok = false;
+                    break;
+                }
+            }
+        } else {
+            //已经随响应头读到的那部分响应体直接写出，剩下的用splice搬运
+            auto buffered = until_close ? ex.in.size() : std::min(ex.in.size(), content_length);
+            out.append_static(ex.in.data().substr(0, buffered));
+            client_ok = co_await flush(client, out, counted);
+            ex.in.consume(buffered);
+            auto remaining = until_close ? std::string_view::npos : content_length - buffered;
+            if (client_ok && remaining > 0 && loop_->encrypts_writes(client)) {
+                //用户态加密的TLS连接不能splice，响应体经接收缓冲转发
+                size_t moved = 0;
+                while (client_ok && (until_close || moved < remaining)) {
+                    auto n = co_await loop_->recv_into(ex.fd, ex.in);
+                    if (n <= 0) {
+                        upstream_ok = until_close && n == 0;
+                        break;
+                    }
+                    auto take = until_close ? ex.in.size() : std::min(ex.in.size(), remaining - moved);
+                    out.append_static(ex.in.data().substr(0, take));
+                    client_ok = co_await flush(client, out, counted);
+                    ex.in.consume(take);
+                    moved += take;
+                }
+            } else if (client_ok && remaining > 0) {
+                int one = 1;
+                setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                auto pipe = take_pipe();
+                size_t moved = 0;
+                auto result = co_await splice_body(*loop_, ex.fd, client, pipe, remaining, moved);
+                metrics_count(counter_id::bytes_sent, moved);
+                give_back_pipe(pipe, result != splice_result::client_failed);
+                upstream_ok = result != splice_result::upstream_failed;
+                client_ok = result != splice_result::client_failed;
+            }
+        }
+        if (upstream_ok) {
+            record_status(*ex.target, status);
+        } else {
+            record_failure(*ex.target);
+        }
+        release(ex, reusable && upstream_ok && client_ok);
+        out.clear();
+        co_return client_ok && upstream_ok;
+    }
+
+    /*
+     * 转发一个请求并把完整的响应(长度由Content-Length给出)追加到out，用于不能直接写套接字的场合(HTTP/2的流)。
+     * 响应体超过proxy_max_buffered_body时返回502。
+     */
+    task<> fetch(const http_request& request, bool keep_alive, output_queue& out) {
+        metrics_count(counter_id::proxy_requests);
+        proxy_exchange ex;
+        bool begun = co_await begin(request, {}, ex);
+        if (!begun) {
+            out.append(http_response(ex.error_status).serialize(keep_alive));
+            co_return;
+        }
+        auto& head = ex.head;
+        bool no_body = bodyless(request, head.status);
+        bool chunked = !no_body && head.chunked;
+        bool until_close = !no_body && !chunked && !head.has_content_length;
+        auto response_head = client_response_head(ex, !no_body);
+        bool reusable = head.keep_alive() && !until_close;
+        auto status = head.status;
+        auto content_length = head.content_length;
+        ex.in.consume(ex.head_length);
+        bool upstream_ok = true;
+        size_t body_length = 0;
+        if (!no_body) {
+            chunked_body body;
+            while (true) {
+                if (chunked) {
+                    auto raw = body.feed(ex.in.writable_data(), ex.in.size());
+                    if (raw != 0) {
+                        upstream_ok = raw > 0;
+                        body_length = body.decoded();
+                        break;
+                    }
+                } else if (!until_close && ex.in.size() >= content_length) {
+                    body_length = content_length;
+                    break;
+                }
+                if (ex.in.size() > proxy_max_buffered_body) {
+                    upstream_ok = false;
+                    break;
+                }
+                auto n = co_await loop_->recv_into(ex.fd, ex.in);
+                if (n <= 0) {
+                    upstream_ok = until_close && n == 0;
+                    body_length = ex.in.size();
+                    break;
+                }
+            }
+        }
+        if (upstream_ok) {
+            record_status(*ex.target, status);
+            if (!no_body) {
+                response_head.append(std::format("Content-Length: {}\r\n", body_length));
+            }
+            response_head.append(keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+            out.append(std::move(response_head));
+            out.append(std::string(ex.in.data().substr(0, body_length)));
+        } else {
+            record_failure(*ex.target);
+            out.append(http_response(502).serialize(keep_alive));
+        }
+        //分块编码的响应体已就地解码，原始报文的其余部分不再可用，连接不能复用
+        ex.in.consume(chunked ? ex.in.size() : std::min(body_length, ex.in.size()));
+        release(ex, reusable && upstream_ok && !chunked);
+    }
+};
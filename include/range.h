@@ -0,0 +1,282 @@
+#pragma once
+
+#include <http.h>
+#include <io.h>
+#include <file_cache.h>
+
+#include <array>
+#include <charconv>
+#include <ctime>
+#include <format>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+
+/*
+ * 条件请求(RFC 9110 13)与范围请求(RFC 9110 14)。校验只使用文件打开时缓存的ETag与修改时间，
+ * 206响应的内容是映射区的切片或sendfile的偏移，续传与重新验证都不会读取文件或在用户态复制文件内容。
+ */
+
+/* 解析HTTP日期，接受IMF-fixdate以及过时的RFC 850与asctime格式，格式错误时返回-1 */
+inline time_t parse_http_date(std::string_view value) {
+    constexpr static std::array<const char*, 3> formats = {
+        "%a, %d %b %Y %H:%M:%S GMT",
+        "%A, %d-%b-%y %H:%M:%S GMT",
+        "%a %b %e %H:%M:%S %Y",
+    };
+    char buf[64];
+    if (value.length() >= sizeof(buf)) {
+        return -1;
+    }
+    memcpy(buf, value.data(), value.length());
+    buf[value.length()] = '\0';
+    for (auto format : formats) {
+        tm parts {};
+        auto end = strptime(buf, format, &parts);
+        if (end != nullptr && *end == '\0') {
+            return timegm(&parts);
+        }
+    }
+    return -1;
+}
+
+/* 实体标签比较，weak为true时使用弱比较(忽略W/前缀)，否则两者都必须是强标签 */
+inline bool etag_equals(std::string_view a, std::string_view b, bool weak) {
+    bool a_weak = a.starts_with("W/");
+    bool b_weak = b.starts_with("W/");
+    if (!weak && (a_weak || b_weak)) {
+        return false;
+    }
+    if (a_weak) {
+        a.remove_prefix(2);
+    }
+    if (b_weak) {
+        b.remove_prefix(2);
+    }
+    return a == b;
+}
+
+/* If-Match/If-None-Match的值("*"或以逗号分隔的实体标签)中是否有与etag匹配的项 */
+inline bool etag_list_matches(std::string_view list, std::string_view etag, bool weak) {
+    if (trim(list) == "*") {
+        return true;
+    }
+    while (!list.empty()) {
+        auto comma = list.find(',');
+        auto item = trim(list.substr(0, comma));
+        list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+        if (!item.empty() && etag_equals(item, etag, weak)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+enum class precondition {
+    //按正常流程响应
+    proceed,
+    //304 Not Modified
+    not_modified,
+    //412 Precondition Failed
+    failed,
+};
+
+/* 按RFC 9110 13.2.2的顺序求值GET/HEAD请求的条件首部 */
+inline precondition evaluate_preconditions(const http_request& request, std::string_view etag, time_t mtime) {
+    if (auto if_match = request.header("If-Match"); !if_match.empty()) {
+        if (!etag_list_matches(if_match, etag, false)) {
+            return precondition::failed;
+        }
+    } else if (auto since = request.header("If-Unmodified-Since"); !since.empty()) {
+        auto date = parse_http_date(since);
+        if (date != -1 && mtime > date) {
+            return precondition::failed;
+        }
+    }
+    if (auto if_none_match = request.header("If-None-Match"); !if_none_match.empty()) {
+        return etag_list_matches(if_none_match, etag, true) ? precondition::not_modified : precondition::proceed;
+    }
+    if (auto since = request.header("If-Modified-Since"); !since.empty()) {
+        auto date = parse_http_date(since);
+        if (date != -1 && mtime <= date) {
+            return precondition::not_modified;
+        }
+    }
+    return precondition::proceed;
+}
+
+/* If-Range是否允许按Range响应：实体标签须强匹配，日期须与Last-Modified完全一致 */
+inline bool if_range_matches(std::string_view if_range, std::string_view etag, time_t mtime) {
+    if_range = trim(if_range);
+    if (if_range.empty()) {
+        return true;
+    }
+    if (if_range.front() == '"' || if_range.starts_with("W/")) {
+        return etag_equals(if_range, etag, false);
+    }
+    return parse_http_date(if_range) == mtime;
+}
+
+struct byte_range {
+    size_t first;
+    size_t length;
+};
+
+//一次请求最多的范围数，超出时忽略Range首部返回完整内容
+constexpr static size_t max_byte_ranges = 16;
+
+struct byte_ranges {
+    std::array<byte_range, max_byte_ranges> items;
+    size_t count {0};
+};
+
+enum class range_status {
+    //没有Range首部、格式错误或不值得按范围响应：返回完整内容
+    ignore,
+    //206 Partial Content
+    satisfiable,
+    //416 Range Not Satisfiable
+    unsatisfiable,
+};
+
+/* 解析Range首部(bytes=a-b, a-, -n，以逗号分隔)，把其中可满足的范围按原顺序写入ranges */
+inline range_status parse_byte_ranges(std::string_view header, size_t size, byte_ranges& ranges) {
+    ranges.count = 0;
+    header = trim(header);
+    if (header.length() < 6 || !iequals(header.substr(0, 6), "bytes=")) {
+        return range_status::ignore;
+    }
+    header.remove_prefix(6);
+    auto to_size = [](std::string_view s, size_t& value) {
+        auto [end, ec] = std::from_chars(s.data(), s.data() + s.length(), value);
+        return !s.empty() && ec == std::errc() && end == s.data() + s.length();
+    };
+    size_t total = 0;
+    bool any = false;
+    while (!header.empty()) {
+        auto comma = header.find(',');
+        auto spec = trim(header.substr(0, comma));
+        header = comma == std::string_view::npos ? std::string_view() : header.substr(comma + 1);
+        if (spec.empty()) {
+            continue;
+        }
+        auto dash = spec.find('-');
+        if (dash == std::string_view::npos) {
+            return range_status::ignore;
+        }
+        auto first_part = spec.substr(0, dash);
+        auto last_part = spec.substr(dash + 1);
+        size_t first;
+        size_t last;
+        if (first_part.empty()) {
+            //后缀范围：最后n个字节
+            size_t suffix;
+            if (!to_size(last_part, suffix)) {
+                return range_status::ignore;
+            }
+            any = true;
+            if (suffix == 0 || size == 0) {
+                continue;
+            }
+            first = suffix >= size ? 0 : size - suffix;
+            last = size - 1;
+        } else {
+            if (!to_size(first_part, first)) {
+                return range_status::ignore;
+            }
+            if (last_part.empty()) {
+                last = size == 0 ? 0 : size - 1;
+            } else if (!to_size(last_part, last) || last < first) {
+                return range_status::ignore;
+            }
+            any = true;
+            if (first >= size) {
+                continue;
+            }
+            last = std::min(last, size - 1);
+        }
+        if (ranges.count == max_byte_ranges) {
+            return range_status::ignore;
+        }
+        ranges.items[ranges.count++] = { first, last - first + 1 };
+        total += last - first + 1;
+    }
+    if (!any) {
+        return range_status::ignore;
+    }
+    if (ranges.count == 0) {
+        return range_status::unsatisfiable;
+    }
+    //大量重叠的范围会让响应远大于文件本身，这种请求直接返回完整内容
+    if (total > size) {
+        return range_status::ignore;
+    }
+    return range_status::satisfiable;
+}
+
+/* 多段响应的分隔符，每个进程生成一次 */
+inline const std::string& multipart_boundary() {
+    static const std::string boundary = [] {
+        std::random_device rd;
+        return std::format("tinyhttp-{:08x}{:08x}", rd(), rd());
+    }();
+    return boundary;
+}
+
+/* 追加文件的一段内容：映射的文件引用映射区的切片，否则交给sendfile */
+inline void append_file_slice(output_queue& out, const std::shared_ptr<static_file>& file, size_t first, size_t length) {
+    if (file->mapped()) {
+        out.append(file, file->content().substr(first, length));
+    } else {
+        out.append_file(file, file->fd, static_cast<off_t>(first), length);
+    }
+}
+
+/* 304响应，响应头只有缓存的校验信息 */
+inline void append_not_modified(output_queue& out, const std::shared_ptr<const void>& owner, std::string_view head, bool keep_alive) {
+    out.append(owner, head);
+    out.append_static(keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+}
+
+/* 416响应，Content-Range给出完整长度 */
+inline void append_range_not_satisfiable(output_queue& out, const static_file& file, bool keep_alive) {
+    out.append(std::format("HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */{}\r\nContent-Length: 0\r\n"
+                           "Last-Modified: {}\r\nETag: {}\r\nConnection: {}\r\n\r\n",
+                           file.size, file.last_modified, file.etag, keep_alive ? "keep-alive" : "close"));
+}
+
+/* 206响应：单个范围直接发送该段，多个范围组成multipart/byteranges，各段内容都引用文件本身 */
+inline void append_file_ranges(output_queue& out, const std::shared_ptr<static_file>& file, const byte_ranges& ranges, bool keep_alive) {
+    auto vary = file->compressible ? "Vary: Accept-Encoding\r\n" : "";
+    auto connection = keep_alive ? "keep-alive" : "close";
+    if (ranges.count == 1) {
+        auto& range = ranges.items[0];
+        out.append(std::format("HTTP/1.1 206 Partial Content\r\nContent-Type: {}\r\nContent-Length: {}\r\nContent-Range: bytes {}-{}/{}\r\n"
+                               "Last-Modified: {}\r\nETag: {}\r\nAccept-Ranges: bytes\r\n{}Connection: {}\r\n\r\n",
+                               file->content_type, range.length, range.first, range.first + range.length - 1, file->size,
+                               file->last_modified, file->etag, vary, connection));
+        append_file_slice(out, file, range.first, range.length);
+        return;
+    }
+    auto& boundary = multipart_boundary();
+    //先生成各段的分隔行与段首部以算出Content-Length
+    std::array<std::string, max_byte_ranges> part_heads;
+    size_t length = 0;
+    for (size_t i = 0; i < ranges.count; ++i) {
+        auto& range = ranges.items[i];
+        part_heads[i] = std::format("\r\n--{}\r\nContent-Type: {}\r\nContent-Range: bytes {}-{}/{}\r\n\r\n",
+                                    boundary, file->content_type, range.first, range.first + range.length - 1, file->size);
+        length += part_heads[i].length() + range.length;
+    }
+    auto tail = std::format("\r\n--{}--\r\n", boundary);
+    length += tail.length();
+    out.append(std::format("HTTP/1.1 206 Partial Content\r\nContent-Type: multipart/byteranges; boundary={}\r\nContent-Length: {}\r\n"
+                           "Last-Modified: {}\r\nETag: {}\r\nAccept-Ranges: bytes\r\n{}Connection: {}\r\n\r\n",
+                           boundary, length, file->last_modified, file->etag, vary, connection));
+    for (size_t i = 0; i < ranges.count; ++i) {
+        out.append(std::move(part_heads[i]));
+        append_file_slice(out, file, ranges.items[i].first, ranges.items[i].length);
+    }
+    out.append(std::move(tail));
+}
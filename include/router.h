@@ -0,0 +1,527 @@
+#pragma once
+
+#include <http.h>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <charconv>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+/*
+ * 编译期路由。路由表以constexpr的方法+路径模式声明，在编译期构建成按路径段组织的trie，
+ * 节点保存在定长数组中，普通边以(父节点, 段)为键放在编译期生成的开放寻址散列表里，查找不分配内存。
+ * 路径模式由'/'分隔的段组成：普通段逐字匹配，":name"匹配任意非空的一段，"*name"只能是最后一段，匹配剩余的全部路径。
+ * 同一位置上普通段优先于参数段，参数段优先于通配段，匹配失败时回溯。
+ */
+
+enum class http_method : uint8_t {
+    get = 0,
+    head,
+    post,
+    put,
+    delete_,
+    patch,
+    options,
+    count_
+};
+
+constexpr static size_t http_method_count = static_cast<size_t>(http_method::count_);
+
+constexpr static std::array<std::string_view, http_method_count> http_method_names = {
+    "GET",
+    "HEAD",
+    "POST",
+    "PUT",
+    "DELETE",
+    "PATCH",
+    "OPTIONS",
+};
+
+/* 解析请求方法(区分大小写)，不支持的方法返回std::nullopt */
+constexpr std::optional<http_method> parse_http_method(std::string_view method) {
+    for (size_t i = 0; i < http_method_count; ++i) {
+        if (http_method_names[i] == method) {
+            return static_cast<http_method>(i);
+        }
+    }
+    return std::nullopt;
+}
+
+//一条路由最多的参数个数(含通配段)
+constexpr static size_t max_route_params = 8;
+
+/* 一条路由的声明，Handler通常是函数指针 */
+template<typename Handler>
+struct route {
+    http_method method;
+    std::string_view pattern;
+    Handler handler;
+};
+
+/* 匹配得到的路径参数，值是指向请求路径的视图 */
+class route_params {
+private:
+    const std::string_view* names_ {nullptr};
+    //只有前count_项有效，其余不初始化，每次查找都要构造一个route_params，清零反而是主要开销
+    const char* data_[max_route_params];
+    size_t length_[max_route_params];
+    size_t count_ {0};
+public:
+    constexpr route_params() = default;
+
+    constexpr void bind(const std::string_view* names) {
+        names_ = names;
+    }
+    constexpr void push(std::string_view value) {
+        data_[count_] = value.data();
+        length_[count_] = value.length();
+        ++count_;
+    }
+    constexpr void pop() {
+        --count_;
+    }
+    constexpr void clear() {
+        names_ = nullptr;
+        count_ = 0;
+    }
+
+    [[nodiscard]] constexpr size_t size() const {
+        return count_;
+    }
+    [[nodiscard]] constexpr std::string_view operator[](size_t i) const {
+        return { data_[i], length_[i] };
+    }
+    /* 按名称取参数，不存在时返回空视图 */
+    [[nodiscard]] constexpr std::string_view get(std::string_view name) const {
+        for (size_t i = 0; i < count_; ++i) {
+            if (names_[i] == name) {
+                return (*this)[i];
+            }
+        }
+        return {};
+    }
+    /* 按名称取参数并转换为整数，不存在或格式错误时返回std::nullopt */
+    template<typename T>
+    requires std::is_integral_v<T>
+    [[nodiscard]] std::optional<T> get_as(std::string_view name) const {
+        auto value = get(name);
+        T result;
+        auto [end, ec] = std::from_chars(value.data(), value.data() + value.length(), result);
+        if (value.empty() || ec != std::errc() || end != value.data() + value.length()) {
+            return std::nullopt;
+        }
+        return result;
+    }
+};
+
+template<typename Handler>
+struct route_match {
+    //nullptr表示没有匹配的路由
+    const Handler* handler {nullptr};
+    route_params params;
+    //路径匹配但方法不匹配时，该路径支持的方法(按http_method的位)，用于405响应的Allow首部
+    uint32_t allowed {0};
+};
+
+/* 按allowed中的位生成Allow首部的值 */
+inline std::string format_allowed_methods(uint32_t allowed) {
+    std::string out;
+    for (size_t i = 0; i < http_method_count; ++i) {
+        if (allowed & (1u << i)) {
+            if (!out.empty()) {
+                out += ", ";
+            }
+            out += http_method_names[i];
+        }
+    }
+    return out;
+}
+
+/* trie的节点，构建时子节点的普通边连续存放在边数组的[first_edge, first_edge + edge_count)中 */
+struct route_trie_node {
+    uint32_t first_edge {0};
+    uint32_t edge_count {0};
+    int32_t param {-1};
+    int32_t wildcard {-1};
+    //各方法对应的路由下标，-1表示没有
+    std::array<int32_t, http_method_count> routes {};
+};
+
+/* 普通边，以(父节点, 段)为键存放在散列表中；child为0表示空槽(根节点不会是子节点) */
+struct route_trie_edge {
+    std::string_view text;
+    uint32_t parent {0};
+    uint32_t child {0};
+};
+
+/* 边的散列：以父节点为种子，对段逐字节做FNV-1a，查找时可以在寻找下一个'/'的同时算出 */
+constexpr uint32_t route_hash_seed(uint32_t parent) {
+    return 2166136261u ^ (parent * 0x9e3779b1u);
+}
+constexpr uint32_t route_hash_step(uint32_t hash, char c) {
+    return (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+}
+constexpr uint32_t route_hash(uint32_t parent, std::string_view text) {
+    auto hash = route_hash_seed(parent);
+    for (char c : text) {
+        hash = route_hash_step(hash, c);
+    }
+    return hash;
+}
+
+namespace router_detail {
+
+/* 构建时段的排序：先比较长度再比较内容 */
+constexpr bool literal_before(std::string_view a, std::string_view b) {
+    if (a.length() != b.length()) {
+        return a.length() < b.length();
+    }
+    for (size_t i = 0; i < a.length(); ++i) {
+        if (a[i] != b[i]) {
+            return a[i] < b[i];
+        }
+    }
+    return false;
+}
+
+/* 路由在当前位置的状态，排序时依次排列：在此结束、普通段、参数段、通配段 */
+enum class step_kind : uint8_t {
+    end = 0,
+    literal,
+    param,
+    wildcard,
+};
+
+/* 模式中从pos开始的一段，next为下一段的起点，没有下一段时为npos */
+constexpr std::string_view segment_at(std::string_view pattern, size_t pos, size_t& next) {
+    auto slash = pattern.find('/', pos);
+    next = slash == std::string_view::npos ? std::string_view::npos : slash + 1;
+    return pattern.substr(pos, slash == std::string_view::npos ? std::string_view::npos : slash - pos);
+}
+
+constexpr step_kind kind_of(std::string_view segment) {
+    if (!segment.empty() && segment.front() == ':') {
+        return step_kind::param;
+    }
+    if (!segment.empty() && segment.front() == '*') {
+        return step_kind::wildcard;
+    }
+    return step_kind::literal;
+}
+
+/* 检查模式的格式并返回段数；常量求值中的throw使编译失败，错误信息中会带上这里的字符串 */
+constexpr size_t validate_pattern(std::string_view pattern) {
+    if (pattern.empty() || pattern.front() != '/') {
+        throw "route pattern must start with '/'";
+    }
+    size_t segments = 0;
+    size_t params = 0;
+    for (size_t pos = 1; pos != std::string_view::npos;) {
+        size_t next;
+        auto segment = segment_at(pattern, pos, next);
+        auto kind = kind_of(segment);
+        if (kind != step_kind::literal) {
+            if (segment.length() == 1) {
+                throw "route parameter must be named";
+            }
+            if (kind == step_kind::wildcard && next != std::string_view::npos) {
+                throw "wildcard must be the last segment of a route";
+            }
+            ++params;
+        }
+        ++segments;
+        pos = next;
+    }
+    if (params > max_route_params) {
+        throw "too many route parameters";
+    }
+    return segments;
+}
+
+/* 节点数的上限：每一段至多产生一个节点 */
+template<typename Handler, size_t N>
+constexpr size_t max_trie_nodes(const std::array<route<Handler>, N>& routes) {
+    size_t nodes = 1;
+    for (auto& r : routes) {
+        nodes += validate_pattern(r.pattern);
+    }
+    return nodes;
+}
+
+/*
+ * 构建过程中的trie，数组按上限分配，构建完成后由compile_routes()复制到大小恰好的compiled_router中。
+ * 递归地处理每个节点：该节点下的路由按下一段排序后分组，相同的段共用一个子节点。
+ * 一个节点的普通边先全部分配再递归，保证它们在边数组中连续且有序。
+ */
+template<typename Handler, size_t N, size_t MaxNodes>
+struct staged_trie {
+    //这里使用普通数组，常量求值中std::array的每次下标访问都要计入一次函数调用
+    route_trie_node nodes[MaxNodes] {};
+    route_trie_edge edges[MaxNodes] {};
+    size_t node_count {0};
+    size_t edge_count {0};
+
+    const route<Handler>* routes;
+    uint32_t order[N] {};
+    uint32_t scratch[N] {};
+    //各路由下一段的起点(npos表示已结束)、当前段与其种类
+    size_t cursor[N] {};
+    std::string_view current[N] {};
+    step_kind kind[N] {};
+
+    constexpr explicit staged_trie(const std::array<route<Handler>, N>& r) : routes(r.data()) {
+        for (size_t i = 0; i < N; ++i) {
+            order[i] = static_cast<uint32_t>(i);
+            cursor[i] = 1;
+        }
+        new_node();
+        build(0, 0, N);
+    }
+
+    constexpr uint32_t new_node() {
+        nodes[node_count].routes.fill(-1);
+        return static_cast<uint32_t>(node_count++);
+    }
+
+    constexpr bool before(uint32_t a, uint32_t b) const {
+        if (kind[a] != kind[b]) {
+            return kind[a] < kind[b];
+        }
+        return kind[a] == step_kind::literal && literal_before(current[a], current[b]);
+    }
+
+    constexpr bool same_step(uint32_t a, uint32_t b) const {
+        return kind[a] == kind[b] && (kind[a] != step_kind::literal || current[a] == current[b]);
+    }
+
+    /* 自底向上的归并排序，比较次数为O(n log n)，且在常量求值中比std::sort便宜得多 */
+    constexpr void sort(size_t lo, size_t hi) {
+        for (size_t width = 1; width < hi - lo; width *= 2) {
+            for (size_t left = lo; left < hi; left += 2 * width) {
+                size_t mid = std::min(left + width, hi);
+                size_t right = std::min(left + 2 * width, hi);
+                size_t i = left, j = mid, k = left;
+                while (i < mid && j < right) {
+                    scratch[k++] = before(order[j], order[i]) ? order[j++] : order[i++];
+                }
+                while (i < mid) {
+                    scratch[k++] = order[i++];
+                }
+                while (j < right) {
+                    scratch[k++] = order[j++];
+                }
+            }
+            for (size_t i = lo; i < hi; ++i) {
+                order[i] = scratch[i];
+            }
+        }
+    }
+
+    /* order[lo, hi)中的路由都已匹配到node，取出各自的下一段并向下构建 */
+    constexpr void build(uint32_t node, size_t lo, size_t hi) {
+        for (size_t i = lo; i < hi; ++i) {
+            auto r = order[i];
+            if (cursor[r] == std::string_view::npos) {
+                kind[r] = step_kind::end;
+                continue;
+            }
+            size_t next;
+            current[r] = segment_at(routes[r].pattern, cursor[r], next);
+            kind[r] = kind_of(current[r]);
+            cursor[r] = next;
+        }
+        sort(lo, hi);
+        //先为所有普通段分配连续的边
+        size_t literal_groups = 0;
+        for (size_t i = lo; i < hi; ++i) {
+            if (kind[order[i]] == step_kind::literal && (i == lo || !same_step(order[i - 1], order[i]))) {
+                ++literal_groups;
+            }
+        }
+        nodes[node].first_edge = static_cast<uint32_t>(edge_count);
+        nodes[node].edge_count = static_cast<uint32_t>(literal_groups);
+        edge_count += literal_groups;
+        size_t edge = nodes[node].first_edge;
+        for (size_t i = lo; i < hi;) {
+            auto r = order[i];
+            size_t j = i + 1;
+            while (j < hi && same_step(order[j - 1], order[j])) {
+                ++j;
+            }
+            switch (kind[r]) {
+                case step_kind::end:
+                    for (size_t k = i; k < j; ++k) {
+                        auto& slot = nodes[node].routes[static_cast<size_t>(routes[order[k]].method)];
+                        if (slot != -1) {
+                            throw "duplicate route";
+                        }
+                        slot = static_cast<int32_t>(order[k]);
+                    }
+                    break;
+                case step_kind::literal: {
+                    auto child = new_node();
+                    edges[edge++] = { current[r], node, child };
+                    build(child, i, j);
+                    break;
+                }
+                case step_kind::param: {
+                    auto child = new_node();
+                    nodes[node].param = static_cast<int32_t>(child);
+                    build(child, i, j);
+                    break;
+                }
+                case step_kind::wildcard: {
+                    auto child = new_node();
+                    nodes[node].wildcard = static_cast<int32_t>(child);
+                    build(child, i, j);
+                    break;
+                }
+            }
+            i = j;
+        }
+    }
+};
+
+}
+
+/* 编译好的路由表，由compile_routes()生成。TableSize是边散列表的大小(2的幂) */
+template<typename Handler, size_t RouteCount, size_t NodeCount, size_t TableSize>
+class compiled_router {
+public:
+    struct entry {
+        Handler handler {};
+        std::array<std::string_view, max_route_params> names {};
+    };
+
+    std::array<entry, RouteCount> entries {};
+    std::array<route_trie_node, NodeCount> nodes {};
+    std::array<route_trie_edge, TableSize> table {};
+private:
+    /* 在节点上结束匹配，方法不匹配时记录该路径支持的方法并继续回溯 */
+    constexpr bool finish(const route_trie_node& n, http_method method, route_match<Handler>& match) const {
+        //不支持的方法(count_)不匹配任何路由，只收集Allow
+        auto index = method == http_method::count_ ? -1 : n.routes[static_cast<size_t>(method)];
+        if (index == -1 && method == http_method::head) {
+            index = n.routes[static_cast<size_t>(http_method::get)];
+        }
+        if (index != -1) {
+            match.handler = &entries[index].handler;
+            match.params.bind(entries[index].names.data());
+            return true;
+        }
+        for (size_t i = 0; i < http_method_count; ++i) {
+            if (n.routes[i] != -1) {
+                match.allowed |= 1u << i;
+            }
+        }
+        if (match.allowed & (1u << static_cast<size_t>(http_method::get))) {
+            match.allowed |= 1u << static_cast<size_t>(http_method::head);
+        }
+        return false;
+    }
+
+    /* rest为去掉开头'/'后尚未匹配的路径 */
+    constexpr bool match_node(uint32_t index, std::string_view rest, http_method method, route_match<Handler>& match) const {
+        auto& n = nodes[index];
+        //一次扫描同时找到段的结尾并算出边的散列
+        auto hash = route_hash_seed(index);
+        size_t length = 0;
+        while (length < rest.length() && rest[length] != '/') {
+            hash = route_hash_step(hash, rest[length]);
+            ++length;
+        }
+        auto text = rest.substr(0, length);
+        bool last = length == rest.length();
+        auto remaining = last ? std::string_view() : rest.substr(length + 1);
+        if (n.edge_count > 0) {
+            for (auto slot = hash & (TableSize - 1); table[slot].child != 0; slot = (slot + 1) & (TableSize - 1)) {
+                auto& e = table[slot];
+                if (e.parent == index && e.text == text) {
+                    if (last ? finish(nodes[e.child], method, match) : match_node(e.child, remaining, method, match)) {
+                        return true;
+                    }
+                    break;
+                }
+            }
+        }
+        if (n.param != -1 && !text.empty()) {
+            match.params.push(text);
+            auto child = static_cast<uint32_t>(n.param);
+            if (last ? finish(nodes[child], method, match) : match_node(child, remaining, method, match)) {
+                return true;
+            }
+            match.params.pop();
+        }
+        if (n.wildcard != -1) {
+            match.params.push(rest);
+            if (finish(nodes[n.wildcard], method, match)) {
+                return true;
+            }
+            match.params.pop();
+        }
+        return false;
+    }
+public:
+    /* 查找路由。没有匹配时handler为nullptr，若路径存在但方法不匹配，allowed不为0 */
+    [[nodiscard]] constexpr route_match<Handler> find(http_method method, std::string_view path) const {
+        route_match<Handler> match;
+        if (path.empty() || path.front() != '/') {
+            return match;
+        }
+        if (!match_node(0, path.substr(1), method, match)) {
+            match.params.clear();
+        }
+        return match;
+    }
+
+    [[nodiscard]] route_match<Handler> find(std::string_view method, std::string_view path) const {
+        return find(parse_http_method(method).value_or(http_method::count_), path);
+    }
+};
+
+/*
+ * 在编译期把路由表编译为compiled_router，Routes是constexpr的std::array<route<Handler>, N>，例如：
+ *     constexpr static auto routes = std::to_array<route<handler_t>>({ { http_method::get, "/users/:id", get_user } });
+ *     constexpr static auto router = compile_routes<routes>();
+ * 模式非法、同一方法的路由重复或参数过多时编译失败。GCC对常量求值有操作数上限，
+ * 上千条路由的表需要较多的编译时间，超过约两千条时可能需要调大-fconstexpr-ops-limit。
+ */
+template<const auto& Routes>
+consteval auto compile_routes() {
+    using handler_t = std::remove_cvref_t<decltype(Routes[0].handler)>;
+    constexpr size_t route_count = std::tuple_size_v<std::remove_cvref_t<decltype(Routes)>>;
+    constexpr size_t max_nodes = router_detail::max_trie_nodes(Routes);
+    constexpr router_detail::staged_trie<handler_t, route_count, max_nodes> staged(Routes);
+    //装载因子不超过一半，未命中时的探测链也很短
+    constexpr size_t table_size = std::bit_ceil(std::max<size_t>(staged.edge_count * 2, 1));
+    compiled_router<handler_t, route_count, staged.node_count, table_size> router;
+    for (size_t i = 0; i < staged.node_count; ++i) {
+        router.nodes[i] = staged.nodes[i];
+    }
+    for (size_t i = 0; i < staged.edge_count; ++i) {
+        auto& e = staged.edges[i];
+        auto slot = route_hash(e.parent, e.text) & (table_size - 1);
+        while (router.table[slot].child != 0) {
+            slot = (slot + 1) & (table_size - 1);
+        }
+        router.table[slot] = e;
+    }
+    for (size_t i = 0; i < route_count; ++i) {
+        router.entries[i].handler = Routes[i].handler;
+        size_t param = 0;
+        for (size_t pos = 1; pos != std::string_view::npos;) {
+            size_t next;
+            auto segment = router_detail::segment_at(Routes[i].pattern, pos, next);
+            if (router_detail::kind_of(segment) != router_detail::step_kind::literal) {
+                router.entries[i].names[param++] = segment.substr(1);
+            }
+            pos = next;
+        }
+    }
+    return router;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+/* SHA-1(RFC 3174)，只用于WebSocket握手中Sec-WebSocket-Accept的计算，不应用于任何安全相关的场合 */
+
+using sha1_digest = std::array<uint8_t, 20>;
+
+namespace sha1_detail {
+    inline uint32_t load_be32(const unsigned char* p) {
+        return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+               (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+    }
+
+    /* 压缩一个64字节的分组 */
+    inline void compress(uint32_t (&state)[5], const unsigned char* block) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = load_be32(block + i * 4);
+        }
+        for (int i = 16; i < 80; ++i) {
+            w[i] = std::rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+        for (int i = 0; i < 80; ++i) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            uint32_t t = std::rotl(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = std::rotl(b, 30);
+            b = a;
+            a = t;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+}
+
+inline sha1_digest sha1(std::string_view data) {
+    uint32_t state[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+    auto p = reinterpret_cast<const unsigned char*>(data.data());
+    size_t left = data.length();
+    while (left >= 64) {
+        sha1_detail::compress(state, p);
+        p += 64;
+        left -= 64;
+    }
+    //末尾补0x80、若干0与64位的消息位长，可能跨越两个分组
+    unsigned char tail[128] {};
+    memcpy(tail, p, left);
+    tail[left] = 0x80;
+    size_t tail_length = left < 56 ? 64 : 128;
+    uint64_t bits = static_cast<uint64_t>(data.length()) * 8;
+    for (int i = 0; i < 8; ++i) {
+        tail[tail_length - 1 - i] = static_cast<unsigned char>(bits >> (i * 8));
+    }
+    for (size_t offset = 0; offset < tail_length; offset += 64) {
+        sha1_detail::compress(state, tail + offset);
+    }
+    sha1_digest digest;
+    for (int i = 0; i < 5; ++i) {
+        digest[i * 4] = static_cast<uint8_t>(state[i] >> 24);
+        digest[i * 4 + 1] = static_cast<uint8_t>(state[i] >> 16);
+        digest[i * 4 + 2] = static_cast<uint8_t>(state[i] >> 8);
+        digest[i * 4 + 3] = static_cast<uint8_t>(state[i]);
+    }
+    return digest;
+}
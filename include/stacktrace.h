@@ -1,23 +1,85 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <format>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <cxxabi.h>
+#include <dlfcn.h>
 #include <execinfo.h>
-#include <sstream>
 
 constexpr static int max_backtraces = 128;
-/* 返回当前线程的堆栈追踪字符串 */
-static std::string get_stack_trace() {
-    void* addrs[max_backtraces];
-    int frames = backtrace(addrs, max_backtraces);
-    char** sym = backtrace_symbols(addrs, frames);
-    if (sym != nullptr) {
-        std::stringstream ss;
-        //避免输出本函数的追踪信息
-        for (int i = 1; i < frames; ++i) {
-            ss << sym[i] << std::endl;
+//异常只保存最内层的若干帧，足以定位抛出位置
+constexpr static int max_captured_frames = 32;
+
+/* 把一个返回地址解析为"模块(符号+偏移) [地址]"的形式，结果按地址缓存，同一地址只解析一次 */
+inline std::string symbolize_frame(void* addr) {
+    static std::mutex lock;
+    static std::unordered_map<void*, std::string> cache;
+    std::lock_guard guard(lock);
+    auto it = cache.find(addr);
+    if (it != cache.end()) {
+        return it->second;
+    }
+    std::string line;
+    Dl_info info {};
+    if (dladdr(addr, &info) != 0 && info.dli_fname != nullptr) {
+        std::string symbol;
+        if (info.dli_sname != nullptr) {
+            int status = 0;
+            char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+            symbol = status == 0 && demangled != nullptr ? demangled : info.dli_sname;
+            free(demangled);
+            symbol += std::format("+{:#x}", reinterpret_cast<uintptr_t>(addr) - reinterpret_cast<uintptr_t>(info.dli_saddr));
+        }
+        line = std::format("{}({}) [{}]", info.dli_fname, symbol, addr);
+    } else {
+        line = std::format("?? [{}]", addr);
+    }
+    return cache.emplace(addr, std::move(line)).first->second;
+}
+
+/*
+ * 抛出时记录的原始返回地址。capture()只做一次栈回溯，不分配内存也不解析符号，
+ * 符号解析推迟到真正需要打印时(to_string())，并且按地址缓存。
+ */
+class stack_trace {
+private:
+    std::array<void*, max_captured_frames> frames_ {};
+    int count_ {0};
+public:
+    /* 记录调用者的调用栈，skip为需要跳过的最内层帧数(不含本函数) */
+    static stack_trace capture(int skip = 0) {
+        void* addrs[max_captured_frames + 8];
+        int frames = backtrace(addrs, max_captured_frames + 8);
+        stack_trace trace;
+        for (int i = skip + 1; i < frames && trace.count_ < max_captured_frames; ++i) {
+            trace.frames_[trace.count_++] = addrs[i];
         }
-        free(sym);
-        return ss.str();
+        return trace;
     }
-    return {};
+
+    [[nodiscard]] bool empty() const {
+        return count_ == 0;
+    }
+
+    [[nodiscard]] std::string to_string() const {
+        std::string out;
+        for (int i = 0; i < count_; ++i) {
+            out += symbolize_frame(frames_[i]);
+            out += '\n';
+        }
+        return out;
+    }
+};
+
+/* 预期内的情况(如对端关闭连接)构造异常时传入，不记录调用栈 */
+struct no_stack_trace_t {};
+constexpr static no_stack_trace_t no_stack_trace {};
+
+/* 返回当前线程的堆栈追踪字符串 */
+inline std::string get_stack_trace() {
+    return stack_trace::capture(1).to_string();
 }
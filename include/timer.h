@@ -2,16 +2,18 @@
 
 #include <evchannel.h>
 
+#include <atomic>
 #include <functional>
 #include <thread>
 #include <unordered_map>
+#include <sys/mman.h>
 
 class tick_event {
 private:
     general_shared_array_buffer_t buffer_;
     int64_t ticks_;
 public:
-    constexpr static int unique_event_id = 1;
+    constexpr static int unique_event_id = 2;
     explicit tick_event(int64_t ticks) : buffer_(8, new heap_allocator()), ticks_(ticks) {
         buffer_stream stream(buffer_);
         stream.append(ticks);
@@ -20,12 +22,78 @@ public:
         buffer_stream stream(buffer_);
         ticks_ = stream.get_as<int64_t>();
     }
-    general_shared_array_buffer_t content() {return buffer_;}
+    [[nodiscard]] general_shared_array_buffer_t content() const {return buffer_;}
     [[nodiscard]] int64_t get_ticks() const {
         return ticks_;
     }
 };
 
+/*
+ * 共享内存滴答计数板。reactor创建一块memfd并在每轮循环中仅写入一次单调递增的滴答计数，
+ * worker连接时通过SCM_RIGHTS拿到该memfd并以只读方式映射，之后读取滴答数既不需要系统调用也不需要分配内存，
+ * 广播的开销与worker数量无关。
+ */
+class tick_board {
+private:
+    struct alignas(64) board {
+        std::atomic<int64_t> ticks;
+    };
+    int fd_ {-1};
+    board* board_ {nullptr};
+public:
+    /* 创建一块新的计数板(reactor端)，失败时抛出io_exception */
+    tick_board() {
+        fd_ = memfd_create("tinyhttp_tick_board", MFD_CLOEXEC);
+        if (fd_ == -1) {
+            throw io_exception("tick_board::tick_board()", std::format("memfd_create() failed: {}", strerror(errno)));
+        }
+        if (ftruncate(fd_, sizeof(board)) == -1) {
+            close(fd_);
+            throw io_exception("tick_board::tick_board()", std::format("ftruncate() failed: {}", strerror(errno)));
+        }
+        void* ptr = mmap(nullptr, sizeof(board), PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (ptr == MAP_FAILED) {
+            close(fd_);
+            throw io_exception("tick_board::tick_board()", std::format("mmap() failed: {}", strerror(errno)));
+        }
+        board_ = new (ptr) board { 0 };
+    }
+    /* 映射由reactor传来的计数板(worker端)，映射后持有fd的所有权 */
+    explicit tick_board(int fd) : fd_(fd) {
+        void* ptr = mmap(nullptr, sizeof(board), PROT_READ, MAP_SHARED, fd_, 0);
+        if (ptr == MAP_FAILED) {
+            close(fd_);
+            throw io_exception("tick_board::tick_board(int)", std::format("mmap() failed: {}", strerror(errno)));
+        }
+        board_ = reinterpret_cast<board*>(ptr);
+    }
+    tick_board(tick_board&& other) noexcept : fd_(other.fd_), board_(other.board_) {
+        other.fd_ = -1;
+        other.board_ = nullptr;
+    }
+    tick_board(const tick_board&) = delete;
+    tick_board& operator=(const tick_board&) = delete;
+    ~tick_board() {
+        if (board_ != nullptr) {
+            munmap(board_, sizeof(board));
+        }
+        if (fd_ != -1) {
+            close(fd_);
+        }
+    }
+
+    /* 发布新的滴答计数，只应由reactor调用 */
+    void publish(int64_t ticks) {
+        board_->ticks.store(ticks, std::memory_order_release);
+    }
+    [[nodiscard]] int64_t load() const {
+        return board_->ticks.load(std::memory_order_acquire);
+    }
+    [[nodiscard]] int fd() const {
+        return fd_;
+    }
+};
+
 /* 计时器工具，提供了20Hz(50ms/pertick)精度的定时任务调度， */
 class timer {
 public:
@@ -57,6 +125,23 @@ private:
     int cid_count_ {0};
     std::mutex mtx_;
     bool flag_ {false};
+    int64_t last_ticks_ {-1};
+
+    void tick_once() {
+        for (auto it = tasks_.begin(); it != tasks_.end();) {
+            auto cid = it->first;
+            auto& [tv, cb] = it->second;
+            if (--tv.countdown == 0) {
+                cb(cid, tv);
+                if (++tv.spend == tv.total) {
+                    it = tasks_.erase(it);
+                    continue;
+                }
+                tv.countdown = tv.gap;
+            }
+            ++it;
+        }
+    }
 
 public:
     int add(tv_t tv, callback_t&& cb) {
@@ -82,23 +167,27 @@ public:
         return {-1, -1, -1, -1};
     }
 
+    /* 订阅进程内的tick_event，每收到一次事件推进一个滴答 */
     void run(event_channel &channel) {
         channel.subscribe<tick_event>([this](const tick_event&) {
             std::lock_guard lock(mtx_);
-            for (auto &task: tasks_) {
-                auto cid = task.first;
-                auto& [tv, cb] = task.second;
-                if (--tv.countdown == 0) {
-                    cb(cid, tv);
-                    if (++tv.spend == tv.total) {
-                        tasks_.erase(cid);
-                        continue;
-                    }
-                    tv.countdown = tv.gap;
-                }
-            }
+            tick_once();
         });
     }
+
+    /* 追赶到给定的滴答计数(通常读取自tick_board)，补齐自上次调用以来错过的所有滴答 */
+    void advance(int64_t ticks) {
+        std::lock_guard lock(mtx_);
+        if (last_ticks_ < 0) {
+            last_ticks_ = ticks;
+            return;
+        }
+        while (last_ticks_ < ticks) {
+            ++last_ticks_;
+            tick_once();
+        }
+    }
+
     void stop() {
         flag_ = false;
     }
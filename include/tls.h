@@ -0,0 +1,408 @@
+#pragma once
+
+#include <memory.h>
+#include <io.h>
+#include <coroutine.h>
+#include <metrics.h>
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+
+/*
+ * TLS终结。TLS端口上的连接由reactor照常交给worker，worker在自己的事件循环里以非阻塞方式完成握手，
+ * 之后若内核支持kTLS，加密交给内核：写出仍然是普通的sendmsg/sendfile/splice，静态文件不经过用户态；
+ * 否则连接上附加一个tls_stream，io_loop的读写经由OpenSSL在用户态加解密。
+ * 读方向总是经由SSL_read：启用了kTLS接收时数据已由内核解密，OpenSSL只负责处理告警等非应用数据的记录。
+ *
+ * 会话恢复在所有worker之间共享：reactor创建一块memfd共享内存，其中放着会话票据的密钥与一个会话缓存，
+ * worker连接时映射同一块区域。票据密钥在reactor启动时随机生成，热升级后由新的reactor重新生成，旧票据随之失效。
+ */
+
+//共享会话缓存的槽位数与每个槽位能存放的序列化会话的最大长度，直接映射，冲突时覆盖旧会话
+constexpr static size_t tls_cache_slots = 4096;
+constexpr static size_t tls_cache_entry_size = 1024;
+//会话(包括票据)的有效期(秒)
+constexpr static long tls_session_lifetime = 3600;
+//TLS 1.3完整握手后发给客户端的票据数
+constexpr static size_t tls_tickets_per_handshake = 1;
+
+struct tls_session_slot {
+    //槽位锁，只尝试一次，拿不到时放弃本次存取：缓存只是加速手段，这样也不会因为某个进程崩溃而永远锁住槽位
+    std::atomic<uint32_t> lock;
+    uint32_t id_length;
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    int64_t expires;
+    uint32_t length;
+    unsigned char data[tls_cache_entry_size];
+};
+
+struct tls_shared_region {
+    //会话票据的密钥：名称、AES-256-CBC的加密密钥与HMAC-SHA256的密钥(RFC 5077推荐的格式)
+    unsigned char ticket_name[16];
+    unsigned char ticket_cipher_key[32];
+    unsigned char ticket_mac_key[32];
+    tls_session_slot slots[tls_cache_slots];
+};
+
+/* 位于共享内存中的票据密钥与会话缓存，reactor端create_shared()，worker端attach() */
+class tls_session_cache {
+private:
+    tls_shared_region* region_ {nullptr};
+    int fd_ {-1};
+
+    tls_session_slot& slot_of(const unsigned char* id, size_t length) {
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < length; ++i) {
+            hash = (hash ^ id[i]) * 1099511628211ull;
+        }
+        return region_->slots[hash % tls_cache_slots];
+    }
+    static bool try_lock(tls_session_slot& slot) {
+        uint32_t expected = 0;
+        return slot.lock.compare_exchange_strong(expected, 1, std::memory_order_acquire);
+    }
+    static void unlock(tls_session_slot& slot) {
+        slot.lock.store(0, std::memory_order_release);
+    }
+public:
+    tls_session_cache() = default;
+    tls_session_cache(const tls_session_cache&) = delete;
+    tls_session_cache& operator=(const tls_session_cache&) = delete;
+    ~tls_session_cache() {
+        if (region_ != nullptr) {
+            munmap(region_, sizeof(tls_shared_region));
+        }
+        if (fd_ != -1) {
+            close(fd_);
+        }
+    }
+
+    /* 创建共享区域并生成票据密钥(reactor端)，失败时返回false */
+    bool create_shared() {
+        int fd = memfd_create("tinyhttp_tls_sessions", MFD_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+        if (ftruncate(fd, sizeof(tls_shared_region)) == -1 || !attach(fd)) {
+            close(fd);
+            return false;
+        }
+        unsigned char keys[sizeof(region_->ticket_name) + sizeof(region_->ticket_cipher_key) + sizeof(region_->ticket_mac_key)];
+        if (getrandom(keys, sizeof(keys), 0) != sizeof(keys)) {
+            return false;
+        }
+        memcpy(region_->ticket_name, keys, sizeof(region_->ticket_name));
+        memcpy(region_->ticket_cipher_key, keys + sizeof(region_->ticket_name), sizeof(region_->ticket_cipher_key));
+        memcpy(region_->ticket_mac_key, keys + sizeof(region_->ticket_name) + sizeof(region_->ticket_cipher_key), sizeof(region_->ticket_mac_key));
+        return true;
+    }
+
+    /* 映射由reactor传来的共享区域(worker端)，成功后持有fd的所有权 */
+    bool attach(int fd) {
+        void* ptr = mmap(nullptr, sizeof(tls_shared_region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            return false;
+        }
+        fd_ = fd;
+        region_ = static_cast<tls_shared_region*>(ptr);
+        return true;
+    }
+
+    [[nodiscard]] int fd() const {
+        return fd_;
+    }
+    [[nodiscard]] const tls_shared_region& keys() const {
+        return *region_;
+    }
+
+    /* 保存一个会话，序列化后超过槽位大小的会话不缓存 */
+    void store(SSL_SESSION* session) {
+        unsigned int id_length;
+        auto id = SSL_SESSION_get_id(session, &id_length);
+        auto length = i2d_SSL_SESSION(session, nullptr);
+        if (id_length == 0 || length <= 0 || static_cast<size_t>(length) > tls_cache_entry_size) {
+            return;
+        }
+        auto& slot = slot_of(id, id_length);
+        if (!try_lock(slot)) {
+            return;
+        }
+        auto p = slot.data;
+        i2d_SSL_SESSION(session, &p);
+        slot.length = static_cast<uint32_t>(length);
+        slot.id_length = id_length;
+        memcpy(slot.id, id, id_length);
+        slot.expires = static_cast<int64_t>(SSL_SESSION_get_time(session)) + SSL_SESSION_get_timeout(session);
+        unlock(slot);
+    }
+
+    /* 按会话ID查找，命中时返回反序列化出的新会话(调用者持有引用)，否则返回nullptr */
+    SSL_SESSION* lookup(const unsigned char* id, size_t id_length) {
+        if (id_length == 0 || id_length > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+            return nullptr;
+        }
+        auto& slot = slot_of(id, id_length);
+        if (!try_lock(slot)) {
+            return nullptr;
+        }
+        SSL_SESSION* session = nullptr;
+        if (slot.length > 0 && slot.id_length == id_length && memcmp(slot.id, id, id_length) == 0 && slot.expires > time(nullptr)) {
+            const unsigned char* p = slot.data;
+            session = d2i_SSL_SESSION(nullptr, &p, slot.length);
+        }
+        unlock(slot);
+        return session;
+    }
+
+    void remove(SSL_SESSION* session) {
+        unsigned int id_length;
+        auto id = SSL_SESSION_get_id(session, &id_length);
+        auto& slot = slot_of(id, id_length);
+        if (!try_lock(slot)) {
+            return;
+        }
+        if (slot.id_length == id_length && memcmp(slot.id, id, id_length) == 0) {
+            slot.length = 0;
+        }
+        unlock(slot);
+    }
+};
+
+/* OpenSSL错误队列中最早的一条错误，同时清空错误队列 */
+inline std::string tls_error_string() {
+    char text[256] = "unknown error";
+    if (auto code = ERR_get_error(); code != 0) {
+        ERR_error_string_n(code, text, sizeof(text));
+    }
+    ERR_clear_error();
+    return text;
+}
+
+enum class tls_step {
+    done,
+    want_read,
+    want_write,
+    failed,
+};
+
+/* 一个TLS连接，握手完成后附加到io_loop上(io_loop::attach_cipher) */
+class tls_stream : public stream_cipher {
+private:
+    SSL* ssl_;
+public:
+    tls_stream(SSL_CTX* ctx, int fd) : ssl_(SSL_new(ctx)) {
+        if (ssl_ == nullptr || SSL_set_fd(ssl_, fd) != 1) {
+            SSL_free(ssl_);
+            throw io_exception("tls_stream::tls_stream()", std::format("cannot create TLS connection: {}", tls_error_string()));
+        }
+    }
+    tls_stream(const tls_stream&) = delete;
+    tls_stream& operator=(const tls_stream&) = delete;
+    ~tls_stream() override {
+        SSL_free(ssl_);
+    }
+
+    /* 推进一步握手。完成时检查OpenSSL是否已把发送方向交给了内核 */
+    tls_step accept() {
+        auto r = SSL_accept(ssl_);
+        if (r == 1) {
+            encrypts_writes_ = BIO_get_ktls_send(SSL_get_wbio(ssl_)) == 0;
+            return tls_step::done;
+        }
+        switch (SSL_get_error(ssl_, r)) {
+            case SSL_ERROR_WANT_READ:
+                return tls_step::want_read;
+            case SSL_ERROR_WANT_WRITE:
+                return tls_step::want_write;
+            default:
+                ERR_clear_error();
+                return tls_step::failed;
+        }
+    }
+
+    ssize_t read(char* buf, size_t size) override {
+        auto r = SSL_read(ssl_, buf, static_cast<int>(std::min<size_t>(size, INT_MAX)));
+        if (r > 0) {
+            return r;
+        }
+        switch (SSL_get_error(ssl_, r)) {
+            case SSL_ERROR_ZERO_RETURN:
+                return 0;
+            case SSL_ERROR_WANT_READ:
+            case SSL_ERROR_WANT_WRITE:
+                errno = EAGAIN;
+                return -1;
+            default:
+                ERR_clear_error();
+                errno = ECONNRESET;
+                return -1;
+        }
+    }
+
+    ssize_t write(const char* buf, size_t size) override {
+        auto r = SSL_write(ssl_, buf, static_cast<int>(std::min<size_t>(size, INT_MAX)));
+        if (r > 0) {
+            return r;
+        }
+        switch (SSL_get_error(ssl_, r)) {
+            case SSL_ERROR_WANT_READ:
+            case SSL_ERROR_WANT_WRITE:
+                errno = EAGAIN;
+                return -1;
+            default:
+                ERR_clear_error();
+                errno = EPIPE;
+                return -1;
+        }
+    }
+
+    /* 尽力发出close_notify，不等待对端的回应 */
+    void shutdown() {
+        if (SSL_is_init_finished(ssl_) && SSL_shutdown(ssl_) < 0) {
+            ERR_clear_error();
+        }
+    }
+
+    [[nodiscard]] bool resumed() const {
+        return SSL_session_reused(ssl_) == 1;
+    }
+};
+
+/* 非阻塞地完成服务端握手，失败(包括对端关闭)时返回false */
+inline task<bool> tls_accept(io_loop& loop, int fd, tls_stream& stream) {
+    while (true) {
+        switch (stream.accept()) {
+            case tls_step::done:
+                co_return true;
+            case tls_step::want_read:
+                co_await loop.readable(fd);
+                break;
+            case tls_step::want_write:
+                co_await loop.writable(fd);
+                break;
+            case tls_step::failed:
+                co_return false;
+        }
+    }
+}
+
+/* 服务端的SSL_CTX：证书、协议与密码套件的选择、ALPN，以及把会话恢复接到共享的tls_session_cache上 */
+class tls_context {
+private:
+    SSL_CTX* ctx_ {nullptr};
+
+    static tls_session_cache& cache_of(SSL_CTX* ctx) {
+        return *static_cast<tls_session_cache*>(SSL_CTX_get_app_data(ctx));
+    }
+
+    static int on_new_session(SSL* ssl, SSL_SESSION* session) {
+        cache_of(SSL_get_SSL_CTX(ssl)).store(session);
+        //返回0表示没有保留对会话的引用
+        return 0;
+    }
+    static SSL_SESSION* on_get_session(SSL* ssl, const unsigned char* id, int length, int* copy) {
+        //反序列化出的会话已带有一个引用，直接交给OpenSSL
+        *copy = 0;
+        return cache_of(SSL_get_SSL_CTX(ssl)).lookup(id, static_cast<size_t>(length));
+    }
+    static void on_remove_session(SSL_CTX* ctx, SSL_SESSION* session) {
+        cache_of(ctx).remove(session);
+    }
+
+    /* 用共享的密钥加密/解密会话票据，所有worker签发的票据可以互相恢复 */
+    static int on_ticket_key(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* mac, int encrypt) {
+        auto& keys = cache_of(SSL_get_SSL_CTX(ssl)).keys();
+        if (encrypt) {
+            if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) {
+                return -1;
+            }
+            memcpy(name, keys.ticket_name, sizeof(keys.ticket_name));
+            if (EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, keys.ticket_cipher_key, iv) != 1) {
+                return -1;
+            }
+        } else {
+            if (memcmp(name, keys.ticket_name, sizeof(keys.ticket_name)) != 0) {
+                //不认识的票据(例如热升级之前签发的)，退回完整握手
+                return 0;
+            }
+            if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, keys.ticket_cipher_key, iv) != 1) {
+                return -1;
+            }
+        }
+        OSSL_PARAM params[] = {
+            OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, const_cast<unsigned char*>(keys.ticket_mac_key), sizeof(keys.ticket_mac_key)),
+            OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char*>("SHA256"), 0),
+            OSSL_PARAM_construct_end(),
+        };
+        return EVP_MAC_CTX_set_params(mac, params) == 1 ? 1 : -1;
+    }
+
+    /* 客户端同时支持时优先选择h2，之后按HTTP/1.1处理 */
+    static int on_alpn(SSL*, const unsigned char** out, unsigned char* out_length, const unsigned char* in, unsigned int in_length, void*) {
+        constexpr static unsigned char protocols[] = "\x02h2\x08http/1.1";
+        unsigned char* selected;
+        if (SSL_select_next_proto(&selected, out_length, protocols, sizeof(protocols) - 1, in, in_length) != OPENSSL_NPN_NEGOTIATED) {
+            return SSL_TLSEXT_ERR_NOACK;
+        }
+        *out = selected;
+        return SSL_TLSEXT_ERR_OK;
+    }
+public:
+    tls_context() = default;
+    tls_context(const tls_context&) = delete;
+    tls_context& operator=(const tls_context&) = delete;
+    ~tls_context() {
+        SSL_CTX_free(ctx_);
+    }
+
+    /* 加载证书链与私钥(PEM)，会话恢复使用cache。失败时抛出io_exception */
+    void load(const std::string& certificate, const std::string& key, tls_session_cache& cache) {
+        ctx_ = SSL_CTX_new(TLS_server_method());
+        if (ctx_ == nullptr) {
+            throw io_exception("tls_context::load()", std::format("SSL_CTX_new() failed: {}", tls_error_string()));
+        }
+        SSL_CTX_set_min_proto_version(ctx_, TLS1_2_VERSION);
+        //TLS 1.2只保留内核kTLS能够处理的AEAD套件(TLS 1.3的默认套件都能处理)
+        SSL_CTX_set_cipher_list(ctx_, "ECDHE+AESGCM:ECDHE+CHACHA20");
+        SSL_CTX_set_options(ctx_, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE
+            | SSL_OP_NO_COMPRESSION | SSL_OP_IGNORE_UNEXPECTED_EOF);
+        //部分写出后以同样的内容重试即可，内容不必位于同一地址；空闲连接不保留读写缓冲
+        SSL_CTX_set_mode(ctx_, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+        if (SSL_CTX_use_certificate_chain_file(ctx_, certificate.c_str()) != 1) {
+            throw io_exception("tls_context::load()", std::format("cannot load certificate {}: {}", certificate, tls_error_string()));
+        }
+        if (SSL_CTX_use_PrivateKey_file(ctx_, key.c_str(), SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx_) != 1) {
+            throw io_exception("tls_context::load()", std::format("cannot load private key {}: {}", key, tls_error_string()));
+        }
+        SSL_CTX_set_app_data(ctx_, &cache);
+        constexpr static unsigned char session_context[] = "tinyhttp";
+        SSL_CTX_set_session_id_context(ctx_, session_context, sizeof(session_context) - 1);
+        SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+        SSL_CTX_sess_set_new_cb(ctx_, on_new_session);
+        SSL_CTX_sess_set_get_cb(ctx_, on_get_session);
+        SSL_CTX_sess_set_remove_cb(ctx_, on_remove_session);
+        SSL_CTX_set_timeout(ctx_, tls_session_lifetime);
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx_, on_ticket_key);
+        SSL_CTX_set_num_tickets(ctx_, tls_tickets_per_handshake);
+        SSL_CTX_set_alpn_select_cb(ctx_, on_alpn, nullptr);
+    }
+
+    [[nodiscard]] bool enabled() const {
+        return ctx_ != nullptr;
+    }
+
+    std::unique_ptr<tls_stream> open(int fd) {
+        return std::make_unique<tls_stream>(ctx_, fd);
+    }
+};
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <format>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * 请求追踪。每个线程第一次记录时从追踪区域中认领一个环形缓冲区，此后只有该线程写入，满了就覆盖最旧的记录。
+ * 与指标区域一样，reactor创建的追踪区域位于memfd共享内存中，worker映射同一块区域，
+ * 因此reactor可以随时把所有进程的记录导出为Chrome trace事件格式的JSON(chrome://tracing或Perfetto)。
+ * 采样以连接为单位：reactor接受连接时按1/N决定是否追踪，并通过交接命令字节告知worker。
+ * 时间戳使用CLOCK_MONOTONIC(vDSO，不陷入内核)，它在进程之间是一致的，不需要像rdtsc那样校准。
+ */
+
+enum class span_id : uint32_t {
+    accept = 0,
+    handoff,
+    receive,
+    parse,
+    handle,
+    write,
+    count_
+};
+
+constexpr static size_t span_count = static_cast<size_t>(span_id::count_);
+
+constexpr static std::array<std::string_view, span_count> span_names = {
+    "accept",
+    "handoff",
+    "receive",
+    "parse",
+    "handle",
+    "write",
+};
+
+constexpr static size_t trace_ring_size = 4096;
+constexpr static size_t max_trace_rings = 128;
+//span字段的最高位表示瞬时事件
+constexpr static uint32_t trace_instant_flag = 0x80000000u;
+
+/* 一条记录。seq为0表示正在写入，读取端在复制前后各读一次seq，不一致则丢弃 */
+struct trace_event {
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> start_ns;
+    std::atomic<uint64_t> duration_ns;
+    std::atomic<uint32_t> span;
+    std::atomic<int32_t> arg;
+};
+
+struct alignas(64) trace_ring {
+    std::atomic<uint64_t> head;
+    std::atomic<uint32_t> pid;
+    std::atomic<uint32_t> tid;
+    trace_event events[trace_ring_size];
+};
+
+struct trace_region {
+    alignas(64) std::atomic<uint32_t> claimed;
+    //每sample_every个连接追踪一个，0表示关闭
+    std::atomic<uint32_t> sample_every;
+    trace_ring rings[max_trace_rings];
+};
+
+inline uint64_t trace_now_ns() {
+    timespec ts {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+class trace_registry {
+private:
+    //未连接共享区域时使用的进程内区域，位于BSS段，只有被触及的页才会占用内存
+    inline static trace_region local_region_ {};
+    trace_region* region_ {&local_region_};
+    int fd_ {-1};
+    std::atomic<uint64_t> generation_ {0};
+
+    struct cached_ring {
+        uint64_t generation;
+        trace_ring* ring;
+    };
+
+    trace_ring* claim() {
+        auto index = region_->claimed.fetch_add(1, std::memory_order_relaxed);
+        if (index >= max_trace_rings) {
+            //环形缓冲区用尽时该线程不再记录
+            return nullptr;
+        }
+        auto ring = &region_->rings[index];
+        ring->pid.store(getpid(), std::memory_order_relaxed);
+        ring->tid.store(gettid(), std::memory_order_relaxed);
+        return ring;
+    }
+public:
+    static trace_registry& global() {
+        static trace_registry registry;
+        return registry;
+    }
+
+    /* 创建一块共享内存区域并切换到该区域(reactor端)，失败时返回false并继续使用进程内区域 */
+    bool create_shared() {
+        int fd = memfd_create("tinyhttp_trace", MFD_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+        if (ftruncate(fd, sizeof(trace_region)) == -1) {
+            close(fd);
+            return false;
+        }
+        return attach(fd);
+    }
+
+    /* 映射由reactor传来的共享区域(worker端)，成功后持有fd的所有权 */
+    bool attach(int fd) {
+        void* ptr = mmap(nullptr, sizeof(trace_region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        fd_ = fd;
+        region_ = reinterpret_cast<trace_region*>(ptr);
+        generation_.fetch_add(1, std::memory_order_release);
+        return true;
+    }
+
+    [[nodiscard]] int fd() const {
+        return fd_;
+    }
+
+    void set_sample_every(uint32_t n) {
+        region_->sample_every.store(n, std::memory_order_relaxed);
+    }
+    [[nodiscard]] uint32_t sample_every() const {
+        return region_->sample_every.load(std::memory_order_relaxed);
+    }
+
+    /* 按采样率决定是否追踪一个新连接 */
+    bool should_sample() {
+        auto every = sample_every();
+        if (every == 0) {
+            return false;
+        }
+        thread_local uint32_t counter = 0;
+        return ++counter % every == 0;
+    }
+
+    /* 当前线程的环形缓冲区，可能为nullptr */
+    trace_ring* local() {
+        thread_local cached_ring cache {UINT64_MAX, nullptr};
+        auto generation = generation_.load(std::memory_order_acquire);
+        if (cache.generation != generation) {
+            cache = { generation, claim() };
+        }
+        return cache.ring;
+    }
+
+    void record(uint32_t span, uint64_t start_ns, uint64_t duration_ns, int32_t arg) {
+        auto ring = local();
+        if (ring == nullptr) {
+            return;
+        }
+        auto index = ring->head.load(std::memory_order_relaxed);
+        auto& e = ring->events[index % trace_ring_size];
+        e.seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        e.start_ns.store(start_ns, std::memory_order_relaxed);
+        e.duration_ns.store(duration_ns, std::memory_order_relaxed);
+        e.span.store(span, std::memory_order_relaxed);
+        e.arg.store(arg, std::memory_order_relaxed);
+        e.seq.store(index + 1, std::memory_order_release);
+        ring->head.store(index + 1, std::memory_order_relaxed);
+    }
+
+    /* 导出所有环形缓冲区中的记录，格式为Chrome trace事件JSON，逐条交给write，不会阻塞正在记录的线程 */
+    template <class Writer>
+    void write_chrome_trace(Writer&& write) const {
+        write("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+        std::string event;
+        bool first = true;
+        auto claimed = std::min<size_t>(region_->claimed.load(std::memory_order_relaxed), max_trace_rings);
+        for (size_t r = 0; r < claimed; ++r) {
+            auto& ring = region_->rings[r];
+            auto pid = ring.pid.load(std::memory_order_relaxed);
+            auto tid = ring.tid.load(std::memory_order_relaxed);
+            auto head = ring.head.load(std::memory_order_relaxed);
+            auto begin = head > trace_ring_size ? head - trace_ring_size : 0;
+            for (auto i = begin; i < head; ++i) {
+                auto& e = ring.events[i % trace_ring_size];
+                auto seq = e.seq.load(std::memory_order_acquire);
+                auto start = e.start_ns.load(std::memory_order_relaxed);
+                auto duration = e.duration_ns.load(std::memory_order_relaxed);
+                auto span = e.span.load(std::memory_order_relaxed);
+                auto arg = e.arg.load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (seq != i + 1 || e.seq.load(std::memory_order_relaxed) != seq) {
+                    continue;
+                }
+                auto id = span & ~trace_instant_flag;
+                if (id >= span_count) {
+                    continue;
+                }
+                event = first ? "\n" : ",\n";
+                first = false;
+                if (span & trace_instant_flag) {
+                    event += std::format("{{\"name\":\"{}\",\"cat\":\"http\",\"ph\":\"i\",\"s\":\"t\",\"ts\":{}.{:03},\"pid\":{},\"tid\":{},\"args\":{{\"fd\":{}}}}}",
+                                         span_names[id], start / 1000, start % 1000, pid, tid, arg);
+                } else {
+                    event += std::format("{{\"name\":\"{}\",\"cat\":\"http\",\"ph\":\"X\",\"ts\":{}.{:03},\"dur\":{}.{:03},\"pid\":{},\"tid\":{},\"args\":{{\"fd\":{}}}}}",
+                                         span_names[id], start / 1000, start % 1000, duration / 1000, duration % 1000, pid, tid, arg);
+                }
+                write(std::string_view(event));
+            }
+        }
+        write("\n]}\n");
+    }
+
+    [[nodiscard]] std::string format_chrome_trace() const {
+        std::string out;
+        write_chrome_trace([&out](std::string_view data) { out += data; });
+        return out;
+    }
+};
+
+/* 作用域内的一段追踪，enabled为false时什么也不做；在协程中使用时可以跨越co_await */
+class trace_span {
+private:
+    uint64_t start_ns_;
+    span_id span_;
+    int32_t arg_;
+    bool enabled_;
+public:
+    trace_span(span_id span, bool enabled, int32_t arg = 0)
+            : start_ns_(enabled ? trace_now_ns() : 0), span_(span), arg_(arg), enabled_(enabled) {}
+    trace_span(const trace_span&) = delete;
+    trace_span& operator=(const trace_span&) = delete;
+    ~trace_span() {
+        if (enabled_) {
+            trace_registry::global().record(static_cast<uint32_t>(span_), start_ns_, trace_now_ns() - start_ns_, arg_);
+        }
+    }
+};
+
+/* 记录一个瞬时事件 */
+inline void trace_instant(span_id span, bool enabled, int32_t arg = 0) {
+    if (enabled) {
+        trace_registry::global().record(static_cast<uint32_t>(span) | trace_instant_flag, trace_now_ns(), 0, arg);
+    }
+}
@@ -0,0 +1,572 @@
+#pragma once
+
+#include <memory.h>
+#include <io.h>
+#include <coroutine.h>
+#include <timer.h>
+#include <http.h>
+#include <base64.h>
+#include <sha1.h>
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/socket.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+ * WebSocket(RFC 6455)。客户端发来的帧在接收缓冲中就地解掩码，不分片的消息直接以指向接收缓冲的视图交给处理器，
+ * 只有分片的消息才复制进重组缓冲。发出的帧不带掩码；广播时帧只序列化一次，放进共享缓冲，
+ * 每个订阅者的发送队列只引用它(增加引用计数)，不论订阅者有多少都不再复制。
+ * 不协商任何扩展与子协议。
+ */
+
+constexpr static std::string_view websocket_guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+//一条消息(分片重组后)的上限，超出时以1009关闭
+constexpr static size_t websocket_max_message = 1024 * 1024;
+//单个连接积压的待发送数据上限，超出说明对端读得太慢，直接断开而不是无限地为它积压广播
+constexpr static size_t websocket_max_pending = 8 * 1024 * 1024;
+//连接连续多少秒没有收到任何帧时发送ping，之后再过多少秒仍没有收到任何帧则断开
+constexpr static int websocket_ping_after = 30;
+constexpr static int websocket_pong_timeout = 10;
+
+enum class websocket_opcode : uint8_t {
+    continuation = 0x0,
+    text = 0x1,
+    binary = 0x2,
+    close = 0x8,
+    ping = 0x9,
+    pong = 0xa,
+};
+
+//关闭帧中的状态码(RFC 6455 7.4.1)
+enum class websocket_status : uint16_t {
+    normal = 1000,
+    going_away = 1001,
+    protocol_error = 1002,
+    invalid_payload = 1007,
+    too_big = 1009,
+};
+
+/* 请求是否要求升级到WebSocket，握手字段是否齐全由websocket_handshake()检查 */
+inline bool is_websocket_upgrade(const http_request& request) {
+    return request.method == "GET" && has_token(request.header("Upgrade"), "websocket");
+}
+
+/* 校验握手字段(RFC 6455 4.2.1)并生成101响应，版本不是13或Sec-WebSocket-Key不是16字节的base64时返回false */
+inline bool websocket_handshake(const http_request& request, std::string& response) {
+    if (!has_token(request.header("Connection"), "upgrade") || trim(request.header("Sec-WebSocket-Version")) != "13") {
+        return false;
+    }
+    auto key = trim(request.header("Sec-WebSocket-Key"));
+    std::string nonce;
+    if (key.length() != 24 || !base64_decode(key, nonce) || nonce.length() != 16) {
+        return false;
+    }
+    std::string input;
+    input.reserve(key.length() + websocket_guid.length());
+    input.append(key).append(websocket_guid);
+    auto digest = sha1(input);
+    response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
+    base64_encode({ reinterpret_cast<const char*>(digest.data()), digest.size() }, response);
+    response += "\r\n\r\n";
+    return true;
+}
+
+/*
+ * 以4字节掩码就地异或data(RFC 6455 5.3)。mask按线路上的字节顺序存放，
+ * 依次用AVX2(编译时启用时)、SSE2与64位字处理，每一步的长度都是4的倍数，掩码的相位保持不变。
+ */
+inline void websocket_unmask(char* data, size_t length, uint32_t mask) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    auto mask256 = _mm256_set1_epi32(static_cast<int>(mask));
+    for (; i + 32 <= length; i += 32) {
+        auto p = reinterpret_cast<__m256i*>(data + i);
+        _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), mask256));
+    }
+#endif
+#if defined(__SSE2__)
+    auto mask128 = _mm_set1_epi32(static_cast<int>(mask));
+    for (; i + 16 <= length; i += 16) {
+        auto p = reinterpret_cast<__m128i*>(data + i);
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), mask128));
+    }
+#endif
+    uint64_t mask64 = (static_cast<uint64_t>(mask) << 32) | mask;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        word ^= mask64;
+        memcpy(data + i, &word, 8);
+    }
+    auto key = reinterpret_cast<const unsigned char*>(&mask);
+    for (; i < length; ++i) {
+        data[i] = static_cast<char>(data[i] ^ key[i & 3]);
+    }
+}
+
+/* 检查文本是否是合法的UTF-8(RFC 3629)，拒绝过长编码、代理区与超出U+10FFFF的码点 */
+inline bool valid_utf8(std::string_view text) {
+    auto p = reinterpret_cast<const unsigned char*>(text.data());
+    auto end = p + text.length();
+    while (p < end) {
+        //ASCII的快速路径：每次检查8个字节
+        if (end - p >= 8) {
+            uint64_t word;
+            memcpy(&word, p, 8);
+            if ((word & 0x8080808080808080ull) == 0) {
+                p += 8;
+                continue;
+            }
+        }
+        unsigned char c = *p;
+        if (c < 0x80) {
+            ++p;
+            continue;
+        }
+        size_t extra;
+        uint32_t cp;
+        uint32_t min;
+        if ((c & 0xe0) == 0xc0) {
+            extra = 1;
+            cp = c & 0x1f;
+            min = 0x80;
+        } else if ((c & 0xf0) == 0xe0) {
+            extra = 2;
+            cp = c & 0x0f;
+            min = 0x800;
+        } else if ((c & 0xf8) == 0xf0) {
+            extra = 3;
+            cp = c & 0x07;
+            min = 0x10000;
+        } else {
+            return false;
+        }
+        if (static_cast<size_t>(end - p) <= extra) {
+            return false;
+        }
+        for (size_t i = 1; i <= extra; ++i) {
+            if ((p[i] & 0xc0) != 0x80) {
+                return false;
+            }
+            cp = (cp << 6) | (p[i] & 0x3f);
+        }
+        if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+            return false;
+        }
+        p += extra + 1;
+    }
+    return true;
+}
+
+/* 关闭帧中的状态码能否由对端发送(RFC 6455 7.4)，1005、1006与1015只用于本地表示，不能出现在帧中 */
+inline bool valid_close_status(uint16_t status) {
+    return (status >= 1000 && status <= 1003) || (status >= 1007 && status <= 1014) || (status >= 3000 && status <= 4999);
+}
+
+struct websocket_frame_header {
+    bool fin;
+    websocket_opcode opcode;
+    bool masked;
+    //按线路上的字节顺序存放，可以直接交给websocket_unmask()
+    uint32_t mask;
+    uint64_t length;
+};
+
+/* 解析帧头，返回帧头占用的字节数；数据不完整时返回0，保留位不为0或64位长度的最高位不为0时返回-1 */
+inline ssize_t parse_websocket_frame_header(std::string_view data, websocket_frame_header& header) {
+    if (data.length() < 2) {
+        return 0;
+    }
+    auto b = reinterpret_cast<const unsigned char*>(data.data());
+    //没有协商扩展，RSV1-3必须为0
+    if (b[0] & 0x70) {
+        return -1;
+    }
+    header.fin = b[0] & 0x80;
+    header.opcode = static_cast<websocket_opcode>(b[0] & 0x0f);
+    header.masked = b[1] & 0x80;
+    uint64_t length = b[1] & 0x7f;
+    size_t pos = 2;
+    if (length == 126) {
+        if (data.length() < 4) {
+            return 0;
+        }
+        length = (static_cast<uint64_t>(b[2]) << 8) | b[3];
+        pos = 4;
+    } else if (length == 127) {
+        if (data.length() < 10) {
+            return 0;
+        }
+        length = 0;
+        for (size_t i = 2; i < 10; ++i) {
+            length = (length << 8) | b[i];
+        }
+        if (length >> 63) {
+            return -1;
+        }
+        pos = 10;
+    }
+    header.mask = 0;
+    if (header.masked) {
+        if (data.length() < pos + 4) {
+            return 0;
+        }
+        memcpy(&header.mask, b + pos, 4);
+        pos += 4;
+    }
+    header.length = length;
+    return static_cast<ssize_t>(pos);
+}
+
+/* 不带掩码的帧头长度 */
+inline size_t websocket_frame_header_length(uint64_t length) {
+    return length < 126 ? 2 : length <= 0xffff ? 4 : 10;
+}
+
+/* 写出服务端发出的(不带掩码的)帧头，返回写出的字节数，out至少要有10字节 */
+inline size_t write_websocket_frame_header(char* out, websocket_opcode opcode, uint64_t length, bool fin = true) {
+    out[0] = static_cast<char>((fin ? 0x80 : 0) | static_cast<uint8_t>(opcode));
+    if (length < 126) {
+        out[1] = static_cast<char>(length);
+        return 2;
+    }
+    if (length <= 0xffff) {
+        out[1] = 126;
+        out[2] = static_cast<char>(length >> 8);
+        out[3] = static_cast<char>(length);
+        return 4;
+    }
+    out[1] = 127;
+    for (size_t i = 0; i < 8; ++i) {
+        out[2 + i] = static_cast<char>(length >> (56 - i * 8));
+    }
+    return 10;
+}
+
+/* 生成一个完整的帧 */
+inline std::string make_websocket_frame(websocket_opcode opcode, std::string_view payload) {
+    std::string frame(websocket_frame_header_length(payload.length()) + payload.length(), '\0');
+    auto head = write_websocket_frame_header(frame.data(), opcode, payload.length());
+    memcpy(frame.data() + head, payload.data(), payload.length());
+    return frame;
+}
+
+/* 把一个完整的帧序列化进共享缓冲(缓冲的容量即帧长)，供任意多个发送队列引用 */
+inline general_shared_array_buffer_t make_shared_websocket_frame(websocket_opcode opcode, std::string_view payload) {
+    general_shared_array_buffer_t frame(websocket_frame_header_length(payload.length()) + payload.length(), new heap_allocator());
+    auto head = write_websocket_frame_header(frame.pointer(), opcode, payload.length());
+    memcpy(frame.pointer() + head, payload.data(), payload.length());
+    return frame;
+}
+
+//空的ping帧，所有连接的保活共用这两个字节
+constexpr static std::string_view websocket_ping_frame { "\x89\x00", 2 };
+
+struct websocket_message {
+    websocket_opcode opcode {websocket_opcode::continuation};
+    //不分片的消息指向接收缓冲中已解掩码的负载，分片的消息指向重组缓冲，下一次parse()之前有效
+    std::string_view payload;
+    //数据帧只有消息的最后一帧才为true，控制帧总是true
+    bool complete {false};
+};
+
+/* 客户端帧的解析器，负责控制帧的校验、分片消息的重组与文本消息的UTF-8校验 */
+class websocket_parser {
+private:
+    size_t max_message_;
+    std::string fragments_;
+    websocket_opcode fragment_opcode_ {websocket_opcode::continuation};
+    bool fragmented_ {false};
+    websocket_status error_ {websocket_status::normal};
+
+    ssize_t fail(websocket_status status) {
+        error_ = status;
+        return -1;
+    }
+public:
+    explicit websocket_parser(size_t max_message = websocket_max_message) : max_message_(max_message) {}
+
+    /*
+     * 解析data中的一帧并就地解掩码，返回该帧占用的字节数；数据不完整时返回0；
+     * 违反协议时返回-1，error()给出应在关闭帧中使用的状态码。帧过大时只看帧头就会失败，不会等待整个负载到达。
+     */
+    ssize_t parse(char* data, size_t size, websocket_message& message) {
+        message = {};
+        websocket_frame_header header {};
+        auto head = parse_websocket_frame_header({ data, size }, header);
+        if (head <= 0) {
+            return head < 0 ? fail(websocket_status::protocol_error) : 0;
+        }
+        //客户端发来的帧必须带掩码(RFC 6455 5.1)
+        if (!header.masked) {
+            return fail(websocket_status::protocol_error);
+        }
+        auto opcode = header.opcode;
+        bool control = static_cast<uint8_t>(opcode) & 0x8;
+        if (control) {
+            if (opcode != websocket_opcode::close && opcode != websocket_opcode::ping && opcode != websocket_opcode::pong) {
+                return fail(websocket_status::protocol_error);
+            }
+            //控制帧不能分片，负载不超过125字节，可以夹在分片消息的各帧之间
+            if (!header.fin || header.length > 125) {
+                return fail(websocket_status::protocol_error);
+            }
+        } else {
+            if (opcode != websocket_opcode::continuation && opcode != websocket_opcode::text && opcode != websocket_opcode::binary) {
+                return fail(websocket_status::protocol_error);
+            }
+            //延续帧只能出现在分片消息中，分片消息结束之前不能开始新的消息
+            if ((opcode == websocket_opcode::continuation) != fragmented_) {
+                return fail(websocket_status::protocol_error);
+            }
+            if (header.length > max_message_ - fragments_.length()) {
+                return fail(websocket_status::too_big);
+            }
+        }
+        auto length = static_cast<size_t>(header.length);
+        if (size - head < length) {
+            return 0;
+        }
+        auto payload = data + head;
+        websocket_unmask(payload, length, header.mask);
+        auto consumed = static_cast<ssize_t>(head + length);
+        if (control) {
+            if (opcode == websocket_opcode::close && length > 0) {
+                if (length == 1) {
+                    return fail(websocket_status::protocol_error);
+                }
+                auto status = static_cast<uint16_t>((static_cast<uint8_t>(payload[0]) << 8) | static_cast<uint8_t>(payload[1]));
+                if (!valid_close_status(status)) {
+                    return fail(websocket_status::protocol_error);
+                }
+                if (!valid_utf8({ payload + 2, length - 2 })) {
+                    return fail(websocket_status::invalid_payload);
+                }
+            }
+            message = { opcode, { payload, length }, true };
+            return consumed;
+        }
+        if (!fragmented_ && header.fin) {
+            message = { opcode, { payload, length }, true };
+        } else {
+            if (!fragmented_) {
+                fragmented_ = true;
+                fragment_opcode_ = opcode;
+                fragments_.clear();
+            }
+            fragments_.append(payload, length);
+            if (!header.fin) {
+                return consumed;
+            }
+            fragmented_ = false;
+            message = { fragment_opcode_, fragments_, true };
+        }
+        if (message.opcode == websocket_opcode::text && !valid_utf8(message.payload)) {
+            return fail(websocket_status::invalid_payload);
+        }
+        return consumed;
+    }
+
+    /* 是否不在分片消息的中间 */
+    [[nodiscard]] bool idle() const {
+        return !fragmented_;
+    }
+    [[nodiscard]] websocket_status error() const {
+        return error_;
+    }
+};
+
+/*
+ * 一个WebSocket连接的发送端。帧追加进发送队列后由按需启动的写协程写出，写协程等待可写期间追加的帧会被它一并写出，
+ * 因此广播与保活可以在任意时刻发送，不必等待该连接自己的读协程。
+ * 连接的所有者在销毁它之前必须等待flushing()变为false。
+ */
+class websocket_connection {
+    friend class websocket_hub;
+private:
+    io_loop& loop_;
+    int fd_;
+    output_queue out_;
+    bool flushing_ {false};
+    //已发出关闭帧或连接已断开，之后不再发送任何帧
+    bool closed_ {false};
+    bool aborted_ {false};
+    bool subscribed_ {false};
+    //在websocket_hub中的位置
+    size_t slot_ {std::numeric_limits<size_t>::max()};
+    //连续没有收到任何帧的秒数，由websocket_hub累加
+    int silent_ {0};
+    //写协程结束时通知等待它的协程
+    loop_notification flushed_;
+
+    task<> flush() {
+        //GCC 12会错误地编译成员协程中的if (!co_await ...)，先把结果存进局部变量
+        bool sent = co_await loop_.send_queue(fd_, out_);
+        if (!sent) {
+            abort();
+        }
+        flushing_ = false;
+        flushed_.notify();
+    }
+
+    void kick() {
+        if (out_.bytes() > websocket_max_pending) {
+            abort();
+            return;
+        }
+        if (!flushing_) {
+            flushing_ = true;
+            loop_.spawn(flush());
+        }
+    }
+public:
+    websocket_connection(io_loop& loop, int fd) : loop_(loop), fd_(fd), flushed_(loop) {}
+    websocket_connection(const websocket_connection&) = delete;
+    websocket_connection& operator=(const websocket_connection&) = delete;
+
+    /* 发送一个帧，负载会被复制 */
+    void send(websocket_opcode opcode, std::string_view payload) {
+        if (closed_) {
+            return;
+        }
+        out_.append(make_websocket_frame(opcode, payload));
+        kick();
+    }
+    /* 发送共享缓冲中已序列化好的帧，只增加缓冲的引用计数 */
+    void send(const general_shared_array_buffer_t& frame, size_t length) {
+        if (closed_) {
+            return;
+        }
+        out_.append(frame, 0, length);
+        kick();
+    }
+    /* 原样发送静态数据(例如共用的ping帧) */
+    void send_static(std::string_view data) {
+        if (closed_) {
+            return;
+        }
+        out_.append_static(data);
+        kick();
+    }
+    /* 原样发送握手响应等非帧数据 */
+    void send_raw(std::string data) {
+        if (closed_) {
+            return;
+        }
+        out_.append(std::move(data));
+        kick();
+    }
+    /* 发送带状态码的关闭帧，之后不再发送 */
+    void close(websocket_status status) {
+        auto code = static_cast<uint16_t>(status);
+        char payload[2] = { static_cast<char>(code >> 8), static_cast<char>(code) };
+        close(std::string_view(payload, 2));
+    }
+    /* 发送以payload为负载的关闭帧(回应对端的关闭帧时原样带回其状态码)，之后不再发送 */
+    void close(std::string_view payload) {
+        send(websocket_opcode::close, payload);
+        closed_ = true;
+    }
+    /* 立即断开两个方向，等待中的读协程与写协程都会被唤醒并以失败返回 */
+    void abort() {
+        closed_ = true;
+        if (!aborted_) {
+            aborted_ = true;
+            shutdown(fd_, SHUT_RDWR);
+        }
+    }
+    /* 收到了对端的帧，重新开始保活计时 */
+    void touch() {
+        silent_ = 0;
+    }
+
+    [[nodiscard]] int fd() const {
+        return fd_;
+    }
+    [[nodiscard]] bool flushing() const {
+        return flushing_;
+    }
+    /* 等待正在运行的写协程结束，没有写协程时也会挂起，调用者应先检查flushing() */
+    loop_notification::awaiter flushed() {
+        return flushed_.wait();
+    }
+    [[nodiscard]] bool closed() const {
+        return closed_;
+    }
+};
+
+/* 一个worker进程内的全部WebSocket连接，负责保活与向订阅者广播 */
+class websocket_hub {
+private:
+    std::vector<websocket_connection*> connections_;
+    size_t subscribers_ {0};
+public:
+    websocket_hub() = default;
+    websocket_hub(const websocket_hub&) = delete;
+    websocket_hub& operator=(const websocket_hub&) = delete;
+
+    /* 登记连接，subscribe为true时连接接收broadcast()发出的消息 */
+    void add(websocket_connection& connection, bool subscribe) {
+        connection.slot_ = connections_.size();
+        connection.subscribed_ = subscribe;
+        connections_.push_back(&connection);
+        subscribers_ += subscribe;
+    }
+    /* 注销连接，与末尾的连接交换位置 */
+    void remove(websocket_connection& connection) {
+        auto slot = connection.slot_;
+        if (slot >= connections_.size() || connections_[slot] != &connection) {
+            return;
+        }
+        connections_[slot] = connections_.back();
+        connections_[slot]->slot_ = slot;
+        connections_.pop_back();
+        subscribers_ -= connection.subscribed_;
+        connection.slot_ = std::numeric_limits<size_t>::max();
+    }
+
+    /* 向所有订阅者广播一条消息：帧只序列化一次，各个发送队列引用同一块共享缓冲。返回发送到的连接数 */
+    size_t broadcast(websocket_opcode opcode, std::string_view payload) {
+        if (subscribers_ == 0) {
+            return 0;
+        }
+        auto frame = make_shared_websocket_frame(opcode, payload);
+        auto length = frame.capacity();
+        size_t sent = 0;
+        for (auto connection : connections_) {
+            if (connection->subscribed_ && !connection->closed_) {
+                connection->send(frame, length);
+                ++sent;
+            }
+        }
+        return sent;
+    }
+
+    /* 每秒检查一次所有连接：静默达到websocket_ping_after秒的发送ping，此后仍没有任何回应的断开 */
+    void attach(timer& tm) {
+        tm.add(timer::make_tv(timer::sec, timer::inf_times), [this](timer::callback_id_t, timer::tv_t) {
+            for (auto connection : connections_) {
+                auto silent = ++connection->silent_;
+                if (silent == websocket_ping_after) {
+                    connection->send_static(websocket_ping_frame);
+                } else if (silent >= websocket_ping_after + websocket_pong_timeout) {
+                    connection->abort();
+                }
+            }
+        });
+    }
+
+    [[nodiscard]] size_t size() const {
+        return connections_.size();
+    }
+    [[nodiscard]] size_t subscribers() const {
+        return subscribers_;
+    }
+};
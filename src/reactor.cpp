@@ -2,14 +2,22 @@
 #include <evchannel.h>
 #include <log.h>
 #include <timer.h>
+#include <coroutine.h>
+#include <http.h>
+#include <trace.h>
+#include <tls.h>
 
+#include <atomic>
+#include <csignal>
+#include <spawn.h>
+#include <sys/eventfd.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <sys/un.h>
 #include <sys/fcntl.h>
 
-constexpr static uint16_t listen_port = 80;
+constexpr static uint16_t default_listen_port = 80;
 
 int setnoblocking(int fd) {
     int old = fcntl(fd, F_GETFL);
@@ -17,109 +25,496 @@ int setnoblocking(int fd) {
     return old;
 }
 
+constexpr static auto upgrade_drain_timeout = std::chrono::seconds(30);
+//交出监听套接字后等待新reactor就绪的时限，超时则放弃交接，本进程继续服务
+constexpr static auto upgrade_ready_timeout = std::chrono::seconds(10);
+constexpr static auto shutdown_drain_timeout = std::chrono::seconds(10);
+
 int sockfd;
-bool flag = false;
-int64_t ticks = 0;
+//TLS端口的监听套接字，未启用TLS时为-1；启用时所有worker共享tls_sessions中的票据密钥与会话缓存
+int tls_sockfd = -1;
+tls_session_cache tls_sessions;
+std::atomic<bool> flag {false};
+bool draining = false;
+//控制台线程与信号处理函数通过该eventfd请求reactor线程开始关闭
+int shutdown_fd = -1;
+std::chrono::steady_clock::time_point drain_deadline;
+//热升级时与旧reactor之间的连接，新进程就绪后关闭
+int upgrade_fd = -1;
+//正在向新reactor交出监听套接字，期间不接受其他热升级请求
+bool handing_over = false;
 
 void on_abort() {
     close(sockfd);
 }
 
-int main() {
-    event_channel evchannel;
-    log_init(evchannel);
-    unlink("/tmp/tinyhttp_reactor_unsock");
-    //创建Unix域套接字供事件总线使用
+/* 在reactor_unsock_path上重新创建非阻塞的Unix域监听套接字(替换路径上原有的套接字)，失败时返回-1 */
+int listen_unix_socket() {
+    unlink(reactor_unsock_path.data());
     int unsockfd = socket(AF_UNIX, SOCK_STREAM, 0);
-    constexpr std::string_view unsockaddrpath = "/tmp/tinyhttp_reactor_unsock";
     sockaddr_un unsockaddr {};
     unsockaddr.sun_family = AF_UNIX;
-    memcpy(unsockaddr.sun_path, unsockaddrpath.data(), unsockaddrpath.length());
-    if (bind(unsockfd, reinterpret_cast<sockaddr*>(&unsockaddr), sizeof(sockaddr_un)) == -1) {
-        FATAL(std::format("error when bind unix domain socket: {}", strerror(errno)));
+    memcpy(unsockaddr.sun_path, reactor_unsock_path.data(), reactor_unsock_path.length());
+    if (bind(unsockfd, reinterpret_cast<sockaddr*>(&unsockaddr), sizeof(sockaddr_un)) == -1 || listen(unsockfd, SOMAXCONN) == -1) {
+        close(unsockfd);
+        return -1;
+    }
+    setnoblocking(unsockfd);
+    return unsockfd;
+}
+
+/* 请求关闭，可以在任意线程或信号处理函数中调用 */
+void request_shutdown() {
+    uint64_t one = 1;
+    [[maybe_unused]] auto r = write(shutdown_fd, &one, sizeof(one));
+}
+
+/* 在reactor可执行文件所在目录下启动count个worker进程，worker启动后会自行连接reactor的Unix域套接字 */
+void spawn_workers(unsigned count) {
+    auto path = std::filesystem::read_symlink("/proc/self/exe").parent_path() / "tinyhttp_worker";
+    for (unsigned i = 0; i < count; ++i) {
+        pid_t pid;
+        char* argv[] = { const_cast<char*>(path.c_str()), nullptr };
+        int r = posix_spawn(&pid, path.c_str(), nullptr, nullptr, argv, environ);
+        if (r != 0) {
+            ERROR(std::format("cannot spawn worker {}: {}", path.c_str(), strerror(r)));
+            return;
+        }
+    }
+}
+
+/* 开始排空：停止接受新连接并通知所有worker处理完进行中的请求后退出，reactor在所有worker断开后退出 */
+void begin_drain(io_loop& loop, std::vector<int>& workers_fd, std::chrono::seconds deadline) {
+    if (draining) {
+        return;
+    }
+    draining = true;
+    drain_deadline = std::chrono::steady_clock::now() + deadline;
+    //监听套接字可能已经交给了新进程，这里只能关闭自己持有的fd，不能shutdown()
+    loop.forget(sockfd);
+    close(sockfd);
+    if (tls_sockfd != -1) {
+        loop.forget(tls_sockfd);
+        close(tls_sockfd);
+    }
+    for (auto wfd : workers_fd) {
+        char command = command_drain;
+        if (send(wfd, &command, 1, MSG_NOSIGNAL) == -1) {
+            WARN(std::format("cannot send drain command to worker on fd {}: {}", wfd, strerror(errno)));
+        }
+    }
+    INFO(std::format("draining {} workers", workers_fd.size()));
+}
+
+/* 处理一个worker连接：交出滴答计数板，此后仅监视其是否断开 */
+task<> serve_worker(io_loop& loop, int wfd, tick_board& board, std::vector<int>& workers_fd) {
+    if (!try_send_fd(wfd, board.fd()) || !try_send_fd(wfd, metrics_registry::global().fd()) || !try_send_fd(wfd, trace_registry::global().fd())
+            || (tls_sockfd != -1 && !try_send_fd(wfd, tls_sessions.fd()))) {
+        WARN(std::format("worker on fd {} disconnected during handshake", wfd));
+        loop.forget(wfd);
+        close(wfd);
+        co_return;
+    }
+    workers_fd.push_back(wfd);
+    metrics_gauge(gauge_id::workers, 1);
+    INFO(std::format("worker connected on fd {}", wfd));
+    //新进程在第一个worker就绪后通知旧进程开始排空，保证交接期间始终有进程在处理连接
+    if (upgrade_fd != -1) {
+        char ready = upgrade_ready;
+        auto sent = send(upgrade_fd, &ready, 1, MSG_NOSIGNAL);
+        close(upgrade_fd);
+        upgrade_fd = -1;
+        //旧进程已经放弃交接(例如等待超时)并继续服务，本进程退出，避免两个版本同时运行
+        if (sent != 1) {
+            ERROR("the running reactor abandoned the upgrade, shutting down");
+            request_shutdown();
+        }
+    }
+    char discard[256];
+    while (true) {
+        auto n = co_await loop.recv_some(wfd, discard, sizeof(discard));
+        if (n <= 0) {
+            break;
+        }
+    }
+    std::erase(workers_fd, wfd);
+    metrics_gauge(gauge_id::workers, -1);
+    loop.forget(wfd);
+    close(wfd);
+    INFO(std::format("worker on fd {} disconnected", wfd));
+}
+
+/* 新reactor在时限内没有就绪时关闭交接连接，唤醒等待中的hand_over() */
+task<> expire_hand_over(io_loop& loop, int pfd, std::shared_ptr<bool> pending) {
+    co_await loop.sleep_for(upgrade_ready_timeout);
+    if (*pending) {
+        shutdown(pfd, SHUT_RDWR);
+    }
+}
+
+/*
+ * 处理新版本reactor的热升级请求：交出监听套接字，只有收到upgrade_ready后才开始排空。
+ * 新进程断开、回复了其他内容或超时都说明它无法接替，此时放弃交接，本进程继续接受连接
+ */
+task<> accept_peers(io_loop& loop, int unsockfd, tick_board& board, std::vector<int>& workers_fd);
+
+task<> hand_over(io_loop& loop, int pfd, tick_board& board, std::vector<int>& workers_fd) {
+    INFO("handing listening socket over to the upgraded reactor");
+    bool sent = try_send_fd(pfd, sockfd, upgrade_listener).has_value();
+    if (sent) {
+        char tag = upgrade_tls_listener;
+        sent = tls_sockfd != -1 ? try_send_fd(pfd, tls_sockfd, tag).has_value() : try_writefd(pfd, &tag, 1).has_value();
+    }
+    if (!sent) {
+        WARN("upgraded reactor disconnected before receiving the listening socket");
+        loop.forget(pfd);
+        close(pfd);
+        co_return;
+    }
+    handing_over = true;
+    auto pending = std::make_shared<bool>(true);
+    loop.spawn(expire_hand_over(loop, pfd, pending));
+    char ready = 0;
+    auto n = co_await loop.recv_some(pfd, &ready, 1);
+    *pending = false;
+    handing_over = false;
+    loop.forget(pfd);
+    close(pfd);
+    if (n != 1 || ready != upgrade_ready) {
+        ERROR("upgraded reactor did not become ready, upgrade aborted");
+        //新进程启动时已经替换了Unix域套接字的路径，重新绑定，之后的热升级才能连接到本进程
+        if (int unsockfd = listen_unix_socket(); unsockfd != -1) {
+            loop.spawn(accept_peers(loop, unsockfd, board, workers_fd));
+        } else {
+            ERROR(std::format("cannot rebind unix domain socket: {}", strerror(errno)));
+        }
+        co_return;
+    }
+    begin_drain(loop, workers_fd, upgrade_drain_timeout);
+}
+
+/* 根据对端发来的第一个字节区分worker与热升级请求 */
+task<> serve_peer(io_loop& loop, int pfd, tick_board& board, std::vector<int>& workers_fd) {
+    char role = 0;
+    auto n = co_await loop.recv_some(pfd, &role, 1);
+    if (n == 1 && role == peer_worker) {
+        co_await serve_worker(loop, pfd, board, workers_fd);
+    } else if (n == 1 && role == peer_upgrade && !draining && !handing_over) {
+        co_await hand_over(loop, pfd, board, workers_fd);
+    } else {
+        loop.forget(pfd);
+        close(pfd);
+    }
+}
+
+/* 接受Unix域套接字上的连接 */
+task<> accept_peers(io_loop& loop, int unsockfd, tick_board& board, std::vector<int>& workers_fd) {
+    while (!flag) {
+        int pfd = co_await loop.accept(unsockfd);
+        if (pfd == -1) {
+            FATAL(std::format("error when accept unix domain socket: {}", strerror(errno)));
+            break;
+        }
+        loop.spawn(serve_peer(loop, pfd, board, workers_fd));
+    }
+}
+
+/*
+ * 从next开始轮询地把客户端连接交给一个worker。某个worker的套接字缓冲已满(它暂时没有读取)或已经断开时换下一个，
+ * 所有worker都交不出去时返回io_error::again(至少有一个只是暂时已满)或io_error::reset
+ */
+std::expected<void, io_error> hand_off(std::vector<int>& workers_fd, size_t& next, int clifd, char command) {
+    auto error = io_error::reset;
+    for (size_t attempt = 0; attempt < workers_fd.size(); ++attempt) {
+        int wfd = workers_fd[next++ % workers_fd.size()];
+        //其他错误仍以异常报告，但不能中断接受循环
+        try {
+            auto r = try_send_fd(wfd, clifd, command);
+            if (r) {
+                return r;
+            }
+            if (r.error() == io_error::again) {
+                error = io_error::again;
+            }
+        } catch (io_exception& e) {
+            e.print();
+        }
+    }
+    return std::unexpected(error);
+}
+
+/*
+ * 接受listenfd上的客户端连接，并以轮询方式将连接交给worker处理。没有可用worker时暂不接受，让连接留在accept队列中。
+ * secure表示listenfd是TLS端口，worker收到连接后先完成握手
+ */
+task<> accept_clients(io_loop& loop, std::vector<int>& workers_fd, int listenfd, bool secure) {
+    size_t next = 0;
+    while (!flag && !draining) {
+        if (workers_fd.empty()) {
+            co_await loop.sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+        int clifd = co_await loop.accept(listenfd);
+        if (draining) {
+            if (clifd != -1) {
+                close(clifd);
+            }
+            break;
+        }
+        if (clifd == -1) {
+            FATAL(std::format("error from reactor socket: {}", strerror(errno)));
+            break;
+        }
+        metrics_count(counter_id::accepts);
+        bool traced = trace_registry::global().should_sample();
+        trace_instant(span_id::accept, traced, clifd);
+        {
+            trace_span span(span_id::handoff, traced, clifd);
+            auto command = secure ? (traced ? command_connection_tls_traced : command_connection_tls)
+                                  : (traced ? command_connection_traced : command_connection);
+            //所有worker都暂时读不过来时稍后重试，不在这里忙等，以免拖住reactor上的其他工作；worker全部退出时关闭该连接
+            while (!draining && !workers_fd.empty()) {
+                auto r = hand_off(workers_fd, next, clifd, command);
+                if (r) {
+                    metrics_count(counter_id::connections_handed_off);
+                    break;
+                }
+                if (r.error() != io_error::again) {
+                    break;
+                }
+                co_await loop.sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        close(clifd);
+    }
+}
+
+void on_shutdown_signal(int) {
+    request_shutdown();
+}
+
+/* 等待关闭请求，收到后开始排空：停止接受连接，通知worker关闭空闲连接并在截止时间内完成进行中的请求 */
+task<> await_shutdown(io_loop& loop, std::vector<int>& workers_fd) {
+    uint64_t count;
+    while (read(shutdown_fd, &count, sizeof(count)) == -1) {
+        co_await loop.readable(shutdown_fd);
+    }
+    INFO("shutdown requested");
+    begin_drain(loop, workers_fd, shutdown_drain_timeout);
+}
+
+/* 连接正在运行的旧reactor，请求其交出监听套接字；旧reactor启用了TLS时tls_listener为其TLS监听套接字，否则为-1 */
+int request_listener(int& tls_listener) {
+    upgrade_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, reactor_unsock_path.data(), reactor_unsock_path.length());
+    if (connect(upgrade_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(sockaddr_un)) == -1) {
+        FATAL(std::format("cannot connect to the running reactor: {}", strerror(errno)));
         exit(-1);
     }
-    if (listen(unsockfd, SOMAXCONN) == -1) {
-        FATAL(std::format("error when listen unix domain socket: {}", strerror(errno)));
+    char role = peer_upgrade;
+    std::expected<received_fd, io_error> received = std::unexpected(io_error::eof);
+    if (try_writefd(upgrade_fd, &role, 1)) {
+        received = try_recv_fd(upgrade_fd);
+    }
+    if (!received || received->fd == -1 || received->tag != upgrade_listener) {
+        FATAL("the running reactor refused to hand over its listening socket");
         exit(-1);
     }
-    sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    int opt = 1;
-    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    sockaddr_in soaddr {};
-    soaddr.sin_family = AF_INET;
-    inet_aton("127.0.0.1", &soaddr.sin_addr);
-    soaddr.sin_port = htons(listen_port);
-    if (bind(sockfd, reinterpret_cast<sockaddr*>(&soaddr), sizeof(soaddr)) == -1) {
-        FATAL(std::format("error when bind socket: {}", strerror(errno)));
+    auto tls_received = try_recv_fd(upgrade_fd);
+    if (!tls_received || tls_received->tag != upgrade_tls_listener) {
+        FATAL("the running reactor did not finish handing over its listening sockets");
         exit(-1);
     }
-    if (listen(sockfd, SOMAXCONN) == -1) {
-        FATAL(std::format("error when listen socket: {}", strerror(errno)));
+    tls_listener = tls_received->fd;
+    return received->fd;
+}
+
+int main(int argc, char** argv) {
+    //以--upgrade启动时从正在运行的旧reactor接管监听套接字，旧reactor随后排空并退出
+    bool upgrade = false;
+    uint16_t listen_port = default_listen_port;
+    //--tls-port启用TLS，证书与私钥经环境变量传给worker；私钥省略时从证书文件中读取
+    uint16_t tls_port = 0;
+    std::string certificate;
+    std::string key;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--upgrade") {
+            upgrade = true;
+        } else if (arg == "--port" && i + 1 < argc) {
+            listen_port = static_cast<uint16_t>(std::stoi(argv[++i]));
+        } else if (arg == "--tls-port" && i + 1 < argc) {
+            tls_port = static_cast<uint16_t>(std::stoi(argv[++i]));
+        } else if (arg == "--cert" && i + 1 < argc) {
+            certificate = argv[++i];
+        } else if (arg == "--key" && i + 1 < argc) {
+            key = argv[++i];
+        } else if (arg == "--proxy" && i + 1 < argc) {
+            //反向代理的配置经环境变量传给worker，worker由posix_spawn启动时继承环境
+            setenv("TINYHTTP_PROXY", argv[++i], 1);
+        } else if (arg == "--balance" && i + 1 < argc) {
+            setenv("TINYHTTP_PROXY_BALANCE", argv[++i], 1);
+        } else if (arg == "--health-check" && i + 1 < argc) {
+            setenv("TINYHTTP_PROXY_HEALTH", argv[++i], 1);
+        } else {
+            std::cerr << "usage: tinyhttp_reactor [--port port] [--upgrade] [--tls-port port --cert file [--key file]]"
+                " [--proxy /prefix=host:port[,host:port...]] [--balance round-robin|least-connections] [--health-check path]" << std::endl;
+            exit(-1);
+        }
+    }
+    if (tls_port != 0 && certificate.empty()) {
+        std::cerr << "--tls-port requires --cert" << std::endl;
+        exit(-1);
+    }
+    if (tls_port != 0) {
+        setenv("TINYHTTP_TLS_CERT", certificate.c_str(), 1);
+        setenv("TINYHTTP_TLS_KEY", key.empty() ? certificate.c_str() : key.c_str(), 1);
+    } else {
+        //worker据此决定是否等待会话缓存的memfd，不能从外部环境中继承
+        unsetenv("TINYHTTP_TLS_CERT");
+        unsetenv("TINYHTTP_TLS_KEY");
+    }
+    //每个核一个worker
+    const unsigned worker_count = std::max(1u, std::thread::hardware_concurrency());
+    //指标区域放在共享内存中，worker连接时映射同一块区域；分片按worker加上reactor自身的进程数分配
+    if (!metrics_registry::global().create_shared(worker_count + 1)) {
+        std::cerr << std::format("cannot create shared metrics region: {}", strerror(errno)) << std::endl;
         exit(-1);
     }
+    if (!trace_registry::global().create_shared()) {
+        std::cerr << std::format("cannot create shared trace region: {}", strerror(errno)) << std::endl;
+        exit(-1);
+    }
+    event_channel evchannel;
+    log_init(evchannel);
+    if (upgrade) {
+        sockfd = request_listener(tls_sockfd);
+        sockaddr_in inherited {};
+        socklen_t inherited_len = sizeof(inherited);
+        if (getsockname(sockfd, reinterpret_cast<sockaddr*>(&inherited), &inherited_len) == 0) {
+            listen_port = ntohs(inherited.sin_port);
+        }
+        INFO("received listening socket from the running reactor");
+        //新版本不再启用TLS时关闭接管的TLS端口；仍启用时沿用旧reactor的端口
+        if (tls_sockfd != -1 && tls_port == 0) {
+            close(tls_sockfd);
+            tls_sockfd = -1;
+        } else if (tls_sockfd != -1 && getsockname(tls_sockfd, reinterpret_cast<sockaddr*>(&inherited), &inherited_len) == 0) {
+            tls_port = ntohs(inherited.sin_port);
+        }
+    }
+    //创建Unix域套接字供事件总线使用
+    int unsockfd = listen_unix_socket();
+    if (unsockfd == -1) {
+        FATAL(std::format("error when listen unix domain socket: {}", strerror(errno)));
+        exit(-1);
+    }
+    if (!upgrade) {
+        sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        int opt = 1;
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        sockaddr_in soaddr {};
+        soaddr.sin_family = AF_INET;
+        inet_aton("127.0.0.1", &soaddr.sin_addr);
+        soaddr.sin_port = htons(listen_port);
+        if (bind(sockfd, reinterpret_cast<sockaddr*>(&soaddr), sizeof(soaddr)) == -1) {
+            FATAL(std::format("error when bind socket: {}", strerror(errno)));
+            exit(-1);
+        }
+        if (listen(sockfd, SOMAXCONN) == -1) {
+            FATAL(std::format("error when listen socket: {}", strerror(errno)));
+            exit(-1);
+        }
+    }
     INFO(std::format("server started at port {}", listen_port));
-    int epfd = epoll_create(1024);
-    epoll_event unsockev{};
-    unsockev.events = EPOLLIN | EPOLLET;
-    unsockev.data.fd = unsockfd;
-    epoll_event sockev{};
-    sockev.events = EPOLLIN | EPOLLET;
-    sockev.data.fd = sockfd;
-    setnoblocking(unsockfd);
+    if (tls_port != 0) {
+        if (!tls_sessions.create_shared()) {
+            FATAL(std::format("cannot create shared tls session cache: {}", strerror(errno)));
+            exit(-1);
+        }
+        //热升级时TLS监听套接字与普通监听套接字一样从旧reactor接管，accept队列中的连接不会丢失
+        if (tls_sockfd == -1) {
+            tls_sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            int opt = 1;
+            setsockopt(tls_sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+            sockaddr_in soaddr {};
+            soaddr.sin_family = AF_INET;
+            inet_aton("127.0.0.1", &soaddr.sin_addr);
+            soaddr.sin_port = htons(tls_port);
+            if (bind(tls_sockfd, reinterpret_cast<sockaddr*>(&soaddr), sizeof(soaddr)) == -1 || listen(tls_sockfd, SOMAXCONN) == -1) {
+                FATAL(std::format("error when listen on tls port {}: {}", tls_port, strerror(errno)));
+                exit(-1);
+            }
+        }
+        setnoblocking(tls_sockfd);
+        INFO(std::format("tls enabled at port {}", tls_port));
+    }
     setnoblocking(sockfd);
-    epoll_ctl(epfd, EPOLL_CTL_ADD, unsockfd, &unsockev);
-    epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &sockev);
-    epoll_event events[1024];
+    shutdown_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGTERM, on_shutdown_signal);
+    signal(SIGINT, on_shutdown_signal);
+    io_loop loop;
     std::thread console([&]() {
         std::string command;
-        while (true) {
-            std::cin >> command;
+        //"stats reset"只重置控制台看到的基线，/metrics上的计数器保持单调递增
+        metrics_snapshot_t baseline {};
+        while (std::getline(std::cin, command)) {
+            command = std::string(trim(command));
             if (command == "stop") {
-                flag = true;
-                std::this_thread::sleep_for(std::chrono::seconds(2));
-                close(sockfd);
+                request_shutdown();
                 break;
+            } else if (command == "stats") {
+                std::cout << format_stats(metrics_snapshot() - baseline) << std::flush;
+            } else if (command == "stats reset") {
+                baseline = metrics_snapshot();
+                std::cout << "stats reset" << std::endl;
+            } else if (command.starts_with("trace dump ")) {
+                auto path = command.substr(11);
+                std::ofstream out(path, std::ios::out | std::ios::trunc);
+                out << trace_registry::global().format_chrome_trace();
+                std::cout << (out ? std::format("trace written to {}", path) : std::format("cannot write {}", path)) << std::endl;
+            } else if (command == "trace off") {
+                trace_registry::global().set_sample_every(0);
+                std::cout << "tracing disabled" << std::endl;
+            } else if (command.starts_with("trace ")) {
+                //"trace N"表示每N个连接追踪一个
+                auto every = std::strtoul(command.c_str() + 6, nullptr, 10);
+                trace_registry::global().set_sample_every(static_cast<uint32_t>(every));
+                std::cout << std::format("tracing 1 of every {} connections", every) << std::endl;
+            } else if (!command.empty()) {
+                std::cout << std::format("unknown command: {}", command) << std::endl;
             }
         }
     });
     console.detach();
     std::vector<int> workers_fd;
+    //滴答计数通过共享内存广播给所有worker，每轮循环只写入一次
+    tick_board board;
+    loop.spawn(accept_peers(loop, unsockfd, board, workers_fd));
+    loop.spawn(accept_clients(loop, workers_fd, sockfd, false));
+    if (tls_sockfd != -1) {
+        loop.spawn(accept_clients(loop, workers_fd, tls_sockfd, true));
+    }
+    loop.spawn(await_shutdown(loop, workers_fd));
+    spawn_workers(worker_count);
+    const auto start_time = std::chrono::steady_clock::now();
     while (!flag) {
-        int r = epoll_wait(epfd, events, 1024, 50);
-        if (r < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
-            FATAL(std::format("error when epoll_wait(): {}", strerror(errno)));
+        try {
+            loop.run_once(1000 / timer::sec);
+        } catch (io_exception& e) {
+            FATAL(e.what());
             break;
         }
-        //发送一次TickEvent
-        for (auto& fd : workers_fd) {
-            try {
-                send_packet(fd, tick_event(ticks));
-            } catch (io_exception& e) {
-                e.print();
-                auto c = std::remove_if(workers_fd.begin(), workers_fd.end(), [&](const int f) {
-                    return f == fd;
-                });
-                workers_fd.erase(c);
-                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
-            }
-        }
-        for (int i = 0; i < r; ++i) {
-            int fd = events[i].data.fd;
-            if (fd == sockfd) {
-                if (events[i].events & EPOLLERR) {
-                    FATAL(std::format("error from reactor socket: {}", strerror(errno)));
-                    break;
-                }
-                sockaddr addr{};
-                socklen_t len;
-                int clifd = accept(sockfd, &addr, &len);
-            } else if (fd == unsockfd) {
-
-            }
+        auto now = std::chrono::steady_clock::now();
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - start_time);
+        board.publish(elapsed.count() / (1000 / timer::sec));
+        if (draining && (workers_fd.empty() || now > drain_deadline)) {
+            INFO(workers_fd.empty() ? "all workers drained" : "drain deadline exceeded");
+            flag = true;
         }
     }
     log_close();
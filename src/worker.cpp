@@ -1,5 +1,877 @@
+#include <memory.h>
+#include <evchannel.h>
+#include <timer.h>
+#include <coroutine.h>
+#include <executor.h>
+#include <http.h>
+#include <cache.h>
+#include <file_cache.h>
+#include <compress.h>
+#include <range.h>
+#include <chunked.h>
+#include <router.h>
+#include <http2.h>
+#include <websocket.h>
+#include <proxy.h>
+#include <tls.h>
+#include <trace.h>
 
+#include <csignal>
+#include <unordered_set>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/fcntl.h>
+#include <sys/stat.h>
 
-int main() {
+//每个worker进程内用于CPU密集型工作的线程数，worker进程本身已按核数启动，这里保持较小的值
+constexpr static size_t compute_threads = 2;
+//单个请求(含请求体)的上限，超出时返回413并关闭连接
+constexpr static size_t max_request_size = 16 * 1024 * 1024;
+//静态文件的文档根目录，相对于工作目录
+constexpr static std::string_view docroot = "www";
+//运行时压缩的文件大小上限，更大的文件只使用预压缩版本
+constexpr static size_t max_compress_size = 8 * 1024 * 1024;
+
+bool running = true;
+//收到reactor的排空命令后不再复用keep-alive连接，所有连接关闭后退出
+bool draining = false;
+size_t connections = 0;
+//正在等待下一个请求的空闲keep-alive连接
+std::unordered_set<int> idle_connections;
+
+/* worker进程内各个处理器共享的运行环境 */
+struct worker_context {
+    io_loop& loop;
+    event_channel& channel;
+    work_stealing_executor& executor;
+    timer& tm;
+    response_cache& cache;
+    file_cache& files;
+    compressed_cache& variants;
+    websocket_hub& sockets;
+    reverse_proxy& proxy;
+    tls_context& tls;
+};
+
+/* 路由的处理器，CPU密集型的处理应通过ctx.executor.offload(ctx.channel, ...)移出事件循环 */
+using route_handler = task<http_response> (*)(worker_context&, const http_request&, const route_params&);
+
+task<http_response> handle_metrics(worker_context&, const http_request&, const route_params&) {
+    http_response response(200);
+    response.set_body(format_prometheus(metrics_snapshot()), "text/plain; version=0.0.4; charset=utf-8");
+    co_return response;
+}
+
+task<http_response> handle_trace(worker_context&, const http_request&, const route_params&) {
+    http_response response(200);
+    //记录最多有几十万条，HTTP/1.1的客户端收到的响应边生成边以分块编码写出
+    response.set_body_generator([](const body_writer& write) { trace_registry::global().write_chrome_trace(write); }, "application/json");
+    co_return response;
+}
 
+/* 服务状态摘要。汇总所有分片的指标并不便宜，允许响应缓存保存1秒，频繁的轮询在每个worker中每秒只生成一次 */
+task<http_response> handle_status(worker_context&, const http_request&, const route_params&) {
+    auto snap = metrics_snapshot();
+    http_response response(200);
+    response.set_header("Cache-Control", "public, max-age=1");
+    response.set_body(std::format("{{\"workers\": {}, \"active_connections\": {}, \"requests\": {}, \"p99_latency_us\": {}}}\n",
+                                  snap.gauge(gauge_id::workers), snap.gauge(gauge_id::active_connections), snap.counter(counter_id::requests),
+                                  snap.percentile(histogram_id::request_latency_us, 0.99)), "application/json");
+    co_return response;
+}
+
+constexpr static auto worker_routes = std::to_array<route<route_handler>>({
+    { http_method::get, "/metrics", handle_metrics },
+    { http_method::get, "/status", handle_status },
+    { http_method::get, "/debug/trace", handle_trace },
+});
+
+constexpr static auto worker_router = compile_routes<worker_routes>();
+
+/* WebSocket端点，连接升级后每收到一条完整的数据消息调用一次on_message，消息的负载只在调用期间有效 */
+struct websocket_endpoint {
+    //为true时连接加入ctx.sockets的广播组
+    bool subscribe;
+    void (*on_message)(worker_context&, websocket_connection&, const websocket_message&);
+};
+
+void websocket_echo(worker_context&, websocket_connection& connection, const websocket_message& message) {
+    connection.send(message.opcode, message.payload);
+}
+
+/* 把消息转发给本worker进程内所有订阅了广播的连接(包括发送者自己) */
+void websocket_broadcast(worker_context& ctx, websocket_connection&, const websocket_message& message) {
+    ctx.sockets.broadcast(message.opcode, message.payload);
+}
+
+constexpr static websocket_endpoint echo_endpoint { false, websocket_echo };
+constexpr static websocket_endpoint broadcast_endpoint { true, websocket_broadcast };
+
+constexpr static auto websocket_routes = std::to_array<route<const websocket_endpoint*>>({
+    { http_method::get, "/ws/echo", &echo_endpoint },
+    { http_method::get, "/ws/broadcast", &broadcast_endpoint },
+});
+
+constexpr static auto websocket_router = compile_routes<websocket_routes>();
+
+/* 按路由表分派请求，路径存在但方法不符时返回405，否则返回404 */
+task<http_response> handle_request(worker_context& ctx, const http_request& request) {
+    auto match = worker_router.find(request.method, request.path);
+    if (match.handler != nullptr) {
+        co_return co_await (*match.handler)(ctx, request, match.params);
+    }
+    if (match.allowed != 0) {
+        http_response response(405);
+        response.set_header("Allow", format_allowed_methods(match.allowed));
+        co_return response;
+    }
+    http_response response(404);
+    response.set_body(std::format("{} not found\n", request.path));
+    co_return response;
+}
+
+/* 写出积攒的响应并清空，失败时返回false */
+task<bool> flush_responses(io_loop& loop, int fd, output_queue& out, bool traced) {
+    trace_span span(span_id::write, traced, fd);
+    co_return co_await loop.send_queue(fd, out);
+}
+
+/* 解析请求，分块编码的请求体在接收缓冲中就地解码。追踪时只记录得出结果(完整或非法)的那一次解析 */
+ssize_t parse_request(receive_buffer& inbuf, http_request& request, chunked_body& body, bool traced, int fd) {
+    auto start = traced ? trace_now_ns() : 0;
+    auto consumed = parse_http_request(inbuf.data(), request, max_request_size);
+    if (consumed > 0 && request.chunked) {
+        auto data = inbuf.writable_data() + consumed;
+        auto raw = body.feed(data, inbuf.size() - consumed);
+        if (raw > 0) {
+            request.body = { data, body.decoded() };
+            consumed += raw;
+        } else {
+            consumed = raw;
+        }
+    }
+    if (traced && consumed != 0) {
+        trace_registry::global().record(static_cast<uint32_t>(span_id::parse), start, trace_now_ns() - start, fd);
+    }
+    return consumed;
+}
+
+/* 生成编码后变体的实体标签、200响应头与304响应头 */
+void make_variant_heads(compressed_variant& variant, const static_file& file, content_coding coding, size_t length) {
+    variant.etag = make_variant_etag(file.etag, coding);
+    variant.head = std::format("HTTP/1.1 200 OK\r\nContent-Type: {}\r\nContent-Encoding: {}\r\nContent-Length: {}\r\nLast-Modified: {}\r\nETag: {}\r\nVary: Accept-Encoding\r\n",
+                               file.content_type, get_content_coding_name(coding), length, file.last_modified, variant.etag);
+    variant.not_modified = make_not_modified_head(variant.etag, file.last_modified, true);
+}
+
+/*
+ * 取得文件以coding编码后的变体：优先使用预压缩的同名文件(如.gz/.br)，否则在线程池中压缩一次并缓存结果。
+ * 使用预压缩文件时该文件经file_cache打开后存入sibling，由调用者发送。
+ * 同一内容正在被压缩或不适合压缩时返回nullptr，调用者应发送原文。
+ */
+task<std::shared_ptr<const compressed_variant>> get_compressed_variant(worker_context& ctx, const std::shared_ptr<static_file>& file, const std::string& path,
+                                                                       content_coding coding, std::shared_ptr<static_file>& sibling) {
+    auto key = compressed_cache::key_of(file->etag, coding);
+    auto suffix = get_content_coding_suffix(coding);
+    if (!suffix.empty()) {
+        sibling = ctx.files.open(path + std::string(suffix));
+    }
+    auto cached = ctx.variants.find(key);
+    if (sibling != nullptr) {
+        //预压缩文件被替换后标识改变，旧的响应头随之作废
+        if (cached != nullptr && cached->source_etag == sibling->etag) {
+            co_return cached;
+        }
+        auto variant = std::make_shared<compressed_variant>();
+        make_variant_heads(*variant, *file, coding, sibling->size);
+        variant->source_etag = sibling->etag;
+        variant->compressed = true;
+        ctx.variants.finish(key, variant);
+        co_return variant;
+    }
+    if (cached != nullptr && cached->source_etag.empty()) {
+        co_return cached;
+    }
+    if (cached != nullptr) {
+        //预压缩文件已被删除，改为在线重新压缩
+        ctx.variants.erase(key);
+    }
+    if (file->size > max_compress_size || !ctx.variants.begin(key)) {
+        co_return nullptr;
+    }
+    //等待期间调用者持有file，线程池中的任务只需要裸指针
+    const static_file* source = file.get();
+    std::optional<std::string> compressed;
+    try {
+        compressed = co_await ctx.executor.offload(ctx.channel, [source, coding]() -> std::optional<std::string> {
+            if (source->mapped()) {
+                return compress_content(coding, source->content());
+            }
+            //未映射的大文件在线程池中读入
+            std::string content(source->size, '\0');
+            size_t done = 0;
+            while (done < content.length()) {
+                auto r = pread(source->fd, content.data() + done, content.length() - done, static_cast<off_t>(done));
+                if (r <= 0) {
+                    if (r == -1 && errno == EINTR) {
+                        continue;
+                    }
+                    return std::nullopt;
+                }
+                done += r;
+            }
+            return compress_content(coding, content);
+        });
+    } catch (std::exception& e) {
+        std::cerr << std::format("cannot compress {}: {}", path, e.what()) << std::endl;
+    }
+    auto variant = std::make_shared<compressed_variant>();
+    if (compressed) {
+        make_variant_heads(*variant, *file, coding, compressed->length());
+        variant->data = std::move(*compressed);
+        variant->compressed = true;
+    }
+    //不值得压缩的结果同样缓存，避免反复尝试
+    ctx.variants.finish(key, variant);
+    co_return variant;
+}
+
+/* 以文档根目录中的文件响应GET/HEAD请求，找不到文件时返回false */
+task<bool> serve_static(worker_context& ctx, const http_request& request, bool keep_alive, output_queue& out) {
+    if (request.method != "GET" && request.method != "HEAD") {
+        co_return false;
+    }
+    std::string path;
+    if (!ctx.files.resolve(request.path, path)) {
+        co_return false;
+    }
+    bool head_only = request.method == "HEAD";
+    auto file = ctx.files.open(path);
+    if (file != nullptr) {
+        //Range只对GET有意义；范围请求总是针对原文，压缩后内容的字节偏移对客户端没有意义
+        auto range = head_only ? std::string_view() : request.header("Range");
+        auto coding = file->compressible && range.empty() ? negotiate_content_coding(request.header("Accept-Encoding")) : content_coding::identity;
+        if (coding != content_coding::identity) {
+            std::shared_ptr<static_file> sibling;
+            auto variant = co_await get_compressed_variant(ctx, file, path, coding, sibling);
+            if (variant != nullptr && variant->compressed) {
+                switch (evaluate_preconditions(request, variant->etag, file->mtime)) {
+                    case precondition::not_modified:
+                        append_not_modified(out, variant, variant->not_modified, keep_alive);
+                        co_return true;
+                    case precondition::failed:
+                        out.append(http_response(412).serialize(keep_alive));
+                        co_return true;
+                    default:
+                        break;
+                }
+                out.append(variant, variant->head);
+                out.append_static(keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+                if (head_only) {
+                    co_return true;
+                }
+                if (sibling == nullptr) {
+                    out.append(variant, variant->data);
+                } else if (sibling->mapped()) {
+                    out.append(sibling, sibling->content());
+                } else {
+                    out.append_file(sibling, sibling->fd, 0, sibling->size);
+                }
+                co_return true;
+            }
+        }
+        switch (evaluate_preconditions(request, file->etag, file->mtime)) {
+            case precondition::not_modified:
+                append_not_modified(out, file, file->not_modified, keep_alive);
+                co_return true;
+            case precondition::failed:
+                out.append(http_response(412).serialize(keep_alive));
+                co_return true;
+            default:
+                break;
+        }
+        if (!range.empty() && if_range_matches(request.header("If-Range"), file->etag, file->mtime)) {
+            byte_ranges ranges;
+            switch (parse_byte_ranges(range, file->size, ranges)) {
+                case range_status::satisfiable:
+                    append_file_ranges(out, file, ranges, keep_alive);
+                    co_return true;
+                case range_status::unsatisfiable:
+                    append_range_not_satisfiable(out, *file, keep_alive);
+                    co_return true;
+                default:
+                    break;
+            }
+        }
+        append_static_file(out, file, keep_alive, head_only);
+        co_return true;
+    }
+    //目录缺少结尾的'/'时重定向，使页面中的相对链接指向正确的位置
+    struct stat st {};
+    if (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        http_response response(301);
+        auto location = std::string(request.path) + "/";
+        if (!request.query.empty()) {
+            location += "?";
+            location += request.query;
+        }
+        response.set_header("Location", std::move(location));
+        out.append(response.serialize(keep_alive));
+        co_return true;
+    }
+    co_return false;
+}
+
+/* 生成请求的响应并追加到发送队列：可缓存的请求先查响应缓存，命中时直接引用缓存中的报文 */
+task<> respond(worker_context& ctx, const http_request& request, bool keep_alive, output_queue& out) {
+    if (ctx.proxy.matches(request.path)) {
+        co_await ctx.proxy.fetch(request, keep_alive, out);
+        co_return;
+    }
+    bool bypass = request_bypasses_cache(request);
+    if (!bypass) {
+        if (auto cached = ctx.cache.lookup(request)) {
+            cached->append_to(out, keep_alive);
+            co_return;
+        }
+    }
+    if (co_await serve_static(ctx, request, keep_alive, out)) {
+        co_return;
+    }
+    auto response = co_await handle_request(ctx, request);
+    if (auto ttl = response_cache_ttl(request, response); ttl > 0) {
+        if (auto stored = ctx.cache.store(request, response, ttl)) {
+            stored->append_to(out, keep_alive);
+            co_return;
+        }
+    }
+    if (response.generator() && request.version != "HTTP/1.0") {
+        out.append(response.serialize_chunked_head(keep_alive));
+        if (request.method != "HEAD") {
+            append_generated_body(out, response.generator());
+        }
+        co_return;
+    }
+    out.append(response.serialize(keep_alive, request.method == "HEAD"));
+}
+
+/* 一条HTTP/2连接上读协程、写协程与各个流的响应协程共享的状态 */
+struct http2_connection {
+    int fd;
+    bool traced;
+    http2_session session {max_request_size};
+    output_queue out;
+    //写协程正在运行
+    bool flushing {false};
+    //正在生成响应的流数
+    size_t responding {0};
+    //读协程尚未结束
+    bool reading {true};
+    bool failed {false};
+    //读协程结束后在此等待进行中的流与写协程
+    loop_notification settled;
+};
+
+/* 读协程已经结束时，在最后一个流的响应与写协程都完成后唤醒它 */
+void settle_http2(http2_connection& connection) {
+    if (!connection.reading && connection.responding == 0 && !connection.flushing) {
+        connection.settled.notify();
+    }
+}
+
+/* 把会话中待发送的帧写出，直到没有可以立即发送的数据。会话可以关闭时关闭读方向，唤醒等待输入的读协程 */
+task<> flush_http2(worker_context& ctx, http2_connection& connection) {
+    //先让出一次，同一轮事件中完成的响应合并写出
+    co_await ctx.loop.yield();
+    auto& out = connection.out;
+    while (!connection.failed) {
+        connection.session.write(out);
+        if (out.empty()) {
+            break;
+        }
+        metrics_count(counter_id::bytes_sent, out.bytes());
+        bool sent = co_await flush_responses(ctx.loop, connection.fd, out, connection.traced);
+        if (!sent) {
+            connection.failed = true;
+            shutdown(connection.fd, SHUT_RDWR);
+        }
+    }
+    connection.flushing = false;
+    if (connection.reading && connection.session.finished()) {
+        shutdown(connection.fd, SHUT_RD);
+    }
+    settle_http2(connection);
+}
+
+void kick_http2(worker_context& ctx, http2_connection& connection) {
+    if (!connection.flushing && !connection.failed) {
+        connection.flushing = true;
+        ctx.loop.spawn(flush_http2(ctx, connection));
+    }
+}
+
+void dispatch_http2(worker_context& ctx, http2_connection& connection);
+
+/* 生成一个流的响应，完成后交给会话并唤醒写协程 */
+task<> respond_http2(worker_context& ctx, http2_connection& connection, std::shared_ptr<http2_stream> stream) {
+    auto begin = std::chrono::steady_clock::now();
+    auto source = std::make_shared<output_queue>();
+    {
+        trace_span span(span_id::handle, connection.traced, connection.fd);
+        co_await respond(ctx, stream->request, true, *source);
+    }
+    connection.session.submit_response(*stream, std::move(source));
+    metrics_count(counter_id::requests);
+    metrics_count(counter_id::http2_streams);
+    auto spent = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin);
+    metrics_record(histogram_id::request_latency_us, spent.count());
+    --connection.responding;
+    dispatch_http2(ctx, connection);
+    kick_http2(ctx, connection);
+    settle_http2(connection);
+}
+
+/*
+ * 为已完整的请求启动响应协程。同时生成响应的流数不超过http2_max_concurrent_streams，
+ * 对端在响应生成期间重置流再开启新流时也不会无限制地增加，其余的请求等到有响应完成时再启动。
+ */
+void dispatch_http2(worker_context& ctx, http2_connection& connection) {
+    while (connection.responding < http2_max_concurrent_streams) {
+        auto stream = connection.session.next_request();
+        if (stream == nullptr) {
+            return;
+        }
+        if (stream->error_status != 0) {
+            auto source = std::make_shared<output_queue>();
+            source->append(http_response(stream->error_status).serialize(false));
+            connection.session.submit_response(*stream, std::move(source));
+            metrics_count(counter_id::requests);
+            metrics_count(counter_id::http2_streams);
+            continue;
+        }
+        ++connection.responding;
+        ctx.loop.spawn(respond_http2(ctx, connection, std::move(stream)));
+    }
+}
+
+/*
+ * 以HTTP/2处理连接上剩余的数据。upgrade不为空时连接由该HTTP/1.1请求升级而来，请求作为流1响应，
+ * 它在inbuf中占用的upgrade_length字节在复制进会话之后才消费。
+ * 每个流的响应在单独的协程中生成，慢的处理函数或上游不会阻塞其他流，也不会妨碍读协程继续处理
+ * WINDOW_UPDATE、PING与RST_STREAM；写协程按需启动，写出时按流量控制窗口在流之间交错。
+ */
+task<> serve_http2(worker_context& ctx, int fd, receive_buffer& inbuf, bool traced, const http_request* upgrade, size_t upgrade_length) {
+    auto& loop = ctx.loop;
+    http2_connection connection { .fd = fd, .traced = traced, .settled = loop_notification(loop) };
+    auto& session = connection.session;
+    if (upgrade != nullptr) {
+        if (!session.upgrade(*upgrade)) {
+            connection.out.append(http_response(400).serialize(false));
+            co_await flush_responses(loop, fd, connection.out, traced);
+            co_return;
+        }
+        inbuf.consume(upgrade_length);
+        connection.out.append_static("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+    }
+    session.start();
+    while (!connection.failed) {
+        auto consumed = session.receive(inbuf.data());
+        if (consumed > 0) {
+            inbuf.consume(consumed);
+        }
+        dispatch_http2(ctx, connection);
+        if (draining) {
+            session.shutdown();
+        }
+        kick_http2(ctx, connection);
+        if (consumed < 0 || session.finished()) {
+            break;
+        }
+        if (session.idle()) {
+            idle_connections.insert(fd);
+        }
+        auto n = co_await loop.recv_into(fd, inbuf);
+        idle_connections.erase(fd);
+        if (n <= 0) {
+            if (draining) {
+                //排空时读方向已被关闭，仍然告知对端不要再发起新的流
+                session.shutdown();
+                kick_http2(ctx, connection);
+            }
+            break;
+        }
+        metrics_count(counter_id::bytes_received, n);
+    }
+    connection.reading = false;
+    //等待进行中的流生成响应，写协程写完已经可以发送的数据
+    while (connection.responding > 0 || connection.flushing) {
+        co_await connection.settled.wait();
+    }
+}
+
+/*
+ * 以WebSocket处理升级后的连接。握手请求在inbuf中占用的request_length字节在生成响应之后才消费。
+ * 帧在接收缓冲中就地解掩码后交给端点处理，所有发送都经过connection的发送队列，由它按需启动写协程。
+ */
+task<> serve_websocket(worker_context& ctx, int fd, receive_buffer& inbuf, const http_request& request, size_t request_length, const websocket_endpoint& endpoint) {
+    auto& loop = ctx.loop;
+    std::string handshake;
+    if (!websocket_handshake(request, handshake)) {
+        http_response response(400);
+        response.set_header("Sec-WebSocket-Version", "13");
+        output_queue out;
+        out.append(response.serialize(false));
+        co_await loop.send_queue(fd, out);
+        co_return;
+    }
+    inbuf.consume(request_length);
+    websocket_connection connection(loop, fd);
+    websocket_parser parser;
+    ctx.sockets.add(connection, endpoint.subscribe);
+    connection.send_raw(std::move(handshake));
+    while (!connection.closed()) {
+        websocket_message message;
+        auto consumed = parser.parse(inbuf.writable_data(), inbuf.size(), message);
+        if (consumed < 0) {
+            connection.close(parser.error());
+            break;
+        }
+        if (consumed > 0) {
+            connection.touch();
+            if (message.complete) {
+                switch (message.opcode) {
+                    case websocket_opcode::ping:
+                        connection.send(websocket_opcode::pong, message.payload);
+                        break;
+                    case websocket_opcode::pong:
+                        break;
+                    case websocket_opcode::close:
+                        //原样带回对端的状态码，不带回原因
+                        connection.close(message.payload.substr(0, 2));
+                        break;
+                    default:
+                        metrics_count(counter_id::websocket_messages);
+                        endpoint.on_message(ctx, connection, message);
+                        break;
+                }
+            }
+            inbuf.consume(consumed);
+            continue;
+        }
+        if (draining) {
+            connection.close(websocket_status::going_away);
+            break;
+        }
+        if (inbuf.empty() && parser.idle()) {
+            idle_connections.insert(fd);
+        }
+        auto n = co_await loop.recv_into(fd, inbuf);
+        idle_connections.erase(fd);
+        if (n <= 0) {
+            //排空时读方向被关闭，仍然告知对端服务端即将离开
+            if (draining) {
+                connection.close(websocket_status::going_away);
+            }
+            break;
+        }
+        metrics_count(counter_id::bytes_received, n);
+    }
+    ctx.sockets.remove(connection);
+    if (connection.flushing()) {
+        //给关闭帧等尚未写完的数据一秒，对端一直不读时强行断开，唤醒写协程
+        auto deadline = ctx.tm.add(timer::make_tv(timer::sec, 1), [&connection](timer::callback_id_t, timer::tv_t) {
+            connection.abort();
+        });
+        while (connection.flushing()) {
+            co_await connection.flushed();
+        }
+        ctx.tm.cancel(deadline);
+    }
+}
+
+/*
+ * 处理一个客户端连接上的全部请求(支持keep-alive与管线化)，traced表示reactor选中追踪该连接，
+ * secure表示连接来自TLS端口，先完成握手，之后的读写经由io_loop上附加的tls_stream
+ */
+task<> serve_connection(worker_context& ctx, int fd, bool traced, bool secure) {
+    auto& loop = ctx.loop;
+    receive_buffer inbuf;
+    //管线化的请求在缓冲中还有后续请求时先不发送，攒到一起写出，避免小包之间互相等待ACK
+    output_queue out;
+    bool keep_alive = true;
+    bool failed = false;
+    ++connections;
+    metrics_gauge(gauge_id::active_connections, 1);
+    std::unique_ptr<tls_stream> tls;
+    if (secure) {
+        tls = ctx.tls.open(fd);
+        //握手期间与空闲连接一样，排空时直接关闭
+        idle_connections.insert(fd);
+        bool secured = co_await tls_accept(loop, fd, *tls);
+        idle_connections.erase(fd);
+        failed = !secured;
+        if (secured) {
+            loop.attach_cipher(fd, tls.get());
+            metrics_count(counter_id::tls_handshakes);
+            metrics_count(counter_id::tls_resumptions, tls->resumed() ? 1 : 0);
+            metrics_count(counter_id::tls_kernel_offloads, tls->encrypts_writes() ? 0 : 1);
+        }
+    }
+    while (keep_alive && !failed) {
+        http_request request;
+        chunked_body body;
+        ssize_t consumed;
+        bool closed = false;
+        while (!closed && (consumed = parse_request(inbuf, request, body, traced, fd)) == 0) {
+            if (inbuf.size() > max_request_size) {
+                break;
+            }
+            if (!out.empty() && !co_await flush_responses(loop, fd, out, traced)) {
+                closed = true;
+                break;
+            }
+            if (inbuf.empty()) {
+                if (draining) {
+                    closed = true;
+                    break;
+                }
+                idle_connections.insert(fd);
+            }
+            auto n = co_await loop.recv_into(fd, inbuf);
+            idle_connections.erase(fd);
+            if (n <= 0) {
+                closed = true;
+                break;
+            }
+            metrics_count(counter_id::bytes_received, n);
+        }
+        if (closed) {
+            break;
+        }
+        //HTTP/2的连接前言(HTTP/1.1解析会把它当作非法请求)或h2c升级请求：连接上之后的数据都按HTTP/2处理
+        bool prior_knowledge = consumed < 0 && inbuf.data().starts_with(http2_preface.substr(0, 18));
+        if (prior_knowledge || (consumed > 0 && !draining && !secure && is_h2c_upgrade(request))) {
+            if (out.empty() || co_await flush_responses(loop, fd, out, traced)) {
+                co_await serve_http2(ctx, fd, inbuf, traced, prior_knowledge ? nullptr : &request, prior_knowledge ? 0 : consumed);
+            }
+            break;
+        }
+        if (consumed > 0 && !draining && is_websocket_upgrade(request)) {
+            auto match = websocket_router.find(http_method::get, request.path);
+            if (match.handler != nullptr) {
+                if (out.empty() || co_await flush_responses(loop, fd, out, traced)) {
+                    co_await serve_websocket(ctx, fd, inbuf, request, consumed, **match.handler);
+                }
+                break;
+            }
+        }
+        auto begin = std::chrono::steady_clock::now();
+        auto appended = out.bytes();
+        if (consumed < 0) {
+            keep_alive = false;
+            out.append(http_response(consumed == http_request_too_large ? 413 : 400).serialize(false));
+        } else if (consumed == 0) {
+            keep_alive = false;
+            out.append(http_response(413).serialize(false));
+        } else if (ctx.proxy.matches(request.path)) {
+            //转发的响应由代理直接写给客户端(连同之前积攒的响应)，写出的字节由代理计入指标
+            keep_alive = request.keep_alive() && !draining;
+            trace_span span(span_id::handle, traced, fd);
+            bool forwarded = co_await ctx.proxy.forward(fd, request, keep_alive, out);
+            keep_alive = keep_alive && forwarded;
+            inbuf.consume(consumed);
+            appended = out.bytes();
+        } else {
+            keep_alive = request.keep_alive() && !draining;
+            trace_span span(span_id::handle, traced, fd);
+            co_await respond(ctx, request, keep_alive, out);
+            inbuf.consume(consumed);
+        }
+        metrics_count(counter_id::requests);
+        metrics_count(counter_id::bytes_sent, out.bytes() - appended);
+        if (!keep_alive || inbuf.empty()) {
+            failed = !co_await flush_responses(loop, fd, out, traced);
+        }
+        auto spent = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin);
+        metrics_record(histogram_id::request_latency_us, spent.count());
+    }
+    if (tls) {
+        tls->shutdown();
+    }
+    loop.forget(fd);
+    close(fd);
+    --connections;
+    metrics_gauge(gauge_id::active_connections, -1);
+}
+
+/* 开始排空：唤醒并关闭所有空闲连接，进行中的请求完成后其连接也会随之关闭 */
+void begin_drain() {
+    draining = true;
+    for (int fd : idle_connections) {
+        shutdown(fd, SHUT_RD);
+    }
+}
+
+/* 等待inotify事件，使文件缓存中被改动的文件失效 */
+task<> watch_files(worker_context& ctx) {
+    auto fd = ctx.files.notify_fd();
+    while (running) {
+        co_await ctx.loop.readable(fd);
+        ctx.files.handle_notify();
+    }
+}
+
+/* 接收reactor交过来的客户端连接 */
+task<> receive_connections(worker_context& ctx, int unsockfd) {
+    auto& loop = ctx.loop;
+    while (running) {
+        co_await loop.readable(unsockfd);
+        while (true) {
+            auto received_ns = trace_now_ns();
+            std::expected<received_fd, io_error> received;
+            try {
+                received = try_recv_fd(unsockfd);
+            } catch (io_exception& e) {
+                e.print();
+                received = std::unexpected(io_error::eof);
+            }
+            if (!received) {
+                if (received.error() == io_error::again) {
+                    break;
+                }
+                //reactor已退出
+                running = false;
+                co_return;
+            }
+            auto [clifd, tag] = *received;
+            if (clifd == -1) {
+                if (tag == command_drain) {
+                    begin_drain();
+                }
+                continue;
+            }
+            bool traced = tag == command_connection_traced || tag == command_connection_tls_traced;
+            bool secure = tag == command_connection_tls || tag == command_connection_tls_traced;
+            if (secure && !ctx.tls.enabled()) {
+                close(clifd);
+                continue;
+            }
+            if (traced) {
+                trace_registry::global().record(static_cast<uint32_t>(span_id::receive), received_ns, trace_now_ns() - received_ns, clifd);
+            }
+            loop.spawn(serve_connection(ctx, clifd, traced, secure));
+        }
+    }
+}
+
+/* 阻塞地接收reactor在握手阶段发来的一个memfd，失败时返回-1 */
+int receive_handshake_fd(int unsockfd, std::string_view what) {
+    std::expected<received_fd, io_error> received;
+    try {
+        received = try_recv_fd(unsockfd);
+    } catch (io_exception& e) {
+        e.print();
+        return -1;
+    }
+    if (!received || received->fd == -1) {
+        std::cerr << std::format("reactor closed the connection before sending {}", what) << std::endl;
+        return -1;
+    }
+    return received->fd;
+}
+
+int main() {
+    signal(SIGPIPE, SIG_IGN);
+    //关闭由reactor通过排空命令统一协调，忽略发往整个进程组的终止信号
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    //连接reactor的Unix域套接字
+    int unsockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un unsockaddr {};
+    unsockaddr.sun_family = AF_UNIX;
+    memcpy(unsockaddr.sun_path, reactor_unsock_path.data(), reactor_unsock_path.length());
+    if (connect(unsockfd, reinterpret_cast<sockaddr*>(&unsockaddr), sizeof(sockaddr_un)) == -1) {
+        std::cerr << std::format("error when connect reactor: {}", strerror(errno)) << std::endl;
+        return -1;
+    }
+    char role = peer_worker;
+    if (!try_writefd(unsockfd, &role, 1)) {
+        std::cerr << "reactor closed the connection" << std::endl;
+        return -1;
+    }
+    //reactor会首先发来滴答计数板的memfd
+    int board_fd = receive_handshake_fd(unsockfd, "tick board");
+    if (board_fd == -1) {
+        return -1;
+    }
+    tick_board board(board_fd);
+    //随后是共享指标区域的memfd，最后是共享追踪区域的memfd
+    int metrics_fd = receive_handshake_fd(unsockfd, "metrics region");
+    if (metrics_fd == -1 || !metrics_registry::global().attach(metrics_fd)) {
+        std::cerr << "cannot attach shared metrics region" << std::endl;
+        return -1;
+    }
+    int trace_fd = receive_handshake_fd(unsockfd, "trace region");
+    if (trace_fd == -1 || !trace_registry::global().attach(trace_fd)) {
+        std::cerr << "cannot attach shared trace region" << std::endl;
+        return -1;
+    }
+    //启用TLS时还有共享会话缓存的memfd
+    tls_session_cache sessions;
+    tls_context tls;
+    if (auto certificate = getenv("TINYHTTP_TLS_CERT"); certificate != nullptr && *certificate != '\0') {
+        int sessions_fd = receive_handshake_fd(unsockfd, "tls session cache");
+        if (sessions_fd == -1 || !sessions.attach(sessions_fd)) {
+            std::cerr << "cannot attach shared tls session cache" << std::endl;
+            return -1;
+        }
+        auto key = getenv("TINYHTTP_TLS_KEY");
+        try {
+            tls.load(certificate, key != nullptr ? key : certificate, sessions);
+        } catch (io_exception& e) {
+            e.print();
+            return -1;
+        }
+    }
+    timer tm;
+    fcntl(unsockfd, F_SETFL, fcntl(unsockfd, F_GETFL) | O_NONBLOCK);
+    io_loop loop;
+    event_channel channel;
+    work_stealing_executor executor(compute_threads);
+    response_cache cache;
+    cache.attach(tm);
+    file_cache files(docroot);
+    compressed_cache variants;
+    websocket_hub sockets;
+    sockets.attach(tm);
+    reverse_proxy proxy;
+    if (auto spec = getenv("TINYHTTP_PROXY"); spec != nullptr && *spec != '\0') {
+        auto balance = getenv("TINYHTTP_PROXY_BALANCE");
+        auto health = getenv("TINYHTTP_PROXY_HEALTH");
+        if (!proxy.configure(spec, balance != nullptr ? balance : "", health != nullptr ? health : "/")) {
+            std::cerr << "invalid proxy configuration: " << spec << std::endl;
+            return -1;
+        }
+        proxy.attach(tm, loop);
+    }
+    worker_context ctx { loop, channel, executor, tm, cache, files, variants, sockets, proxy, tls };
+    if (files.notify_fd() != -1) {
+        loop.spawn(watch_files(ctx));
+    }
+    loop.spawn(drain_completions(loop, channel));
+    loop.spawn(receive_connections(ctx, unsockfd));
+    while (running) {
+        try {
+            loop.run_once(1000 / timer::sec);
+        } catch (io_exception& e) {
+            e.print();
+            break;
+        }
+        //读取共享内存中的滴答计数，补齐错过的滴答
+        tm.advance(board.load());
+        if (draining && connections == 0) {
+            running = false;
+        }
+    }
+    close(unsockfd);
 }